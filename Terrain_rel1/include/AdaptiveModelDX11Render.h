@@ -16,10 +16,11 @@
 #include "BlockBasedAdaptiveModel.h"
 #include "d3dx11effect.h"
 #include "HierarchyArray.h"
+#include "NormalMapPyramid.h"
 
 
 // This class renders the adaptive model using DX11 API
-class CAdaptiveModelDX11Render : public CBlockBasedAdaptiveModel
+class CAdaptiveModelDX11Render : public CBlockBasedAdaptiveModel, public INormalMapGenerator
 {
 public:
     enum TEXTURING_MODE
@@ -95,15 +96,28 @@ public:
     // Enables or disables height map morphing in a pixel shader
     void EnableNormalMapMorph(bool bEnableMorph);
 
-    // Renders small terrain map
+    // Opens the file of the normal maps baked for the static terrain. Patches upload the baked
+    // normal maps and generate only the normal maps missing in the file
+    HRESULT OpenNormalMapPyramid(LPCTSTR strFilePath);
+    // Bakes the normal maps of all patches, which may be created, into the file and opens it
+    HRESULT ConstructNormalMapPyramid(LPCTSTR strFilePath);
+
+    // INormalMapGenerator
+    virtual size_t GetNormalMapDataSize(const SQuadTreeNodeLocation &Pos);
+    virtual HRESULT GenerateNormalMap(const SQuadTreeNodeLocation &Pos, BYTE *pNormalMapData);
+
+    // Renders small terrain map using level 1 patches of all quad trees
 	void RenderTerrainMap(const D3DXVECTOR4 &ScreenPos,
-		     		      SPatchRenderingInfo pLevel1Patches[4]);
+		     		      const std::vector<SPatchRenderingInfo> &Level1Patches);
 
 private:
     // Creates a terrain patch
     virtual std::auto_ptr<CTerrainPatch> CreatePatch(class CPatchElevationData *pPatchElevData,
                                                      class CRQTTriangulation *pAdaptiveTriangulation)const;
 
+    // Discards the baked normal maps of the patches affected by the region
+    virtual void OnRegionUpdated(int iStartCol, int iEndCol, int iStartRow, int iEndRow);
+
     // Render all patches in the model
     int RenderPatches(const D3DXMATRIX &WorldViewProjMatr,
                       float fScreenSpaceTreshold,
@@ -210,4 +224,9 @@ private:
     CAdaptiveModelDX11Render& operator = (const CAdaptiveModelDX11Render&);
 
     std::auto_ptr<CDX11PatchesCommon> m_pPatchCommon;
+
+    // Returns parameters of the normal maps baked for the current terrain and rendering parameters.
+    // Fails if the DEM hash is not available
+    HRESULT GetNormalMapPyramidDesc(CNormalMapPyramid::SDesc &Desc)const;
+    std::auto_ptr<CNormalMapPyramid> m_pNormalMapPyramid;
 };
@@ -0,0 +1,66 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+// Interface of the object receiving the results of the asynchronous reads
+__interface IAsyncReadHandler
+{
+    // Called by CAsyncFileReader::ProcessCompletedReads() on the thread calling it
+    void OnReadCompleted(UINT64 RequestKey, HRESULT hr);
+};
+
+// Reads the file with overlapped I/O. Completed reads are queued to the I/O completion
+// port and dequeued by ProcessCompletedReads(), so the threads issuing the reads never
+// wait for the disk and many reads can be in flight simultaneously
+class CAsyncFileReader
+{
+public:
+    CAsyncFileReader();
+    // Cancels the pending reads and waits for their completion
+    ~CAsyncFileReader();
+
+    // Opens the file for overlapped reads
+    HRESULT Open(LPCTSTR strFilePath);
+    void Close();
+
+    // Starts reading dwSize bytes at the Offset to the buffer, which must remain valid
+    // until the read is completed. Fails if MAX_PENDING_READS reads are in flight
+    HRESULT BeginRead(UINT64 Offset, void *pBuffer, DWORD dwSize, UINT64 RequestKey);
+
+    // Passes the completed reads to the handler without waiting for the pending ones.
+    // Returns the number of processed reads
+    UINT ProcessCompletedReads(IAsyncReadHandler *pHandler);
+
+    UINT GetNumPendingReads()const{return (UINT)m_lNumPendingReads;}
+
+    enum {MAX_PENDING_READS = 64};
+
+private:
+    struct SReadRequest
+    {
+        OVERLAPPED Overlapped; // Must be the first member
+        UINT64 RequestKey;
+        DWORD dwSize;
+    };
+
+    // Waits for all pending reads and releases their requests
+    void WaitForPendingReads();
+
+    HANDLE m_hFile;
+    HANDLE m_hCompletionPort;
+    volatile LONG m_lNumPendingReads;
+
+    CAsyncFileReader(const CAsyncFileReader&);
+    const CAsyncFileReader& operator = (const CAsyncFileReader&);
+};
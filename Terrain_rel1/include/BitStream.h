@@ -20,7 +20,9 @@
     typedef unsigned char       BYTE;
 #endif
 
-// Class implements simple bit stream
+// Class implements simple bit stream. Bits are stored from the least significant
+// bit of each byte. Reader and writer buffer the bits in 64-bit word, so that the
+// byte sequence is only accessed once per several bytes
 class CBitStream
 {
 public:
@@ -40,6 +42,11 @@ public:
     // Puts one bit to the stream
     inline void WriteBit(int bit);
 
+    // Gets iNumBits <= 32 bits from the stream. The first bit read is the least significant bit of the value
+    inline UINT ReadBits(int iNumBits);
+    // Puts iNumBits <= 32 lowest bits of the value to the stream starting from the least significant one
+    inline void WriteBits(UINT uiValue, int iNumBits);
+
     int GetTotalBits()const{return total_bits;}
     int GetMaxBits()const{return MaxBits;}
     int GetBitStreamSizeInBits()const{return (m_AccessMode == BIT_STREAM_ACCESS_MODE_WRITING) ? GetTotalBits() : GetMaxBits();}
@@ -53,11 +60,19 @@ public:
     void LoadFromFile(FILE *pInputFile);
 
 private:
+    // Moves whole bytes of the sequence to the read buffer, so that it contains at least 57 bits
+    // or all remaining bits of the stream
+    void RefillReadBuffer();
+    // Moves 32 lowest bits of the write buffer to the sequence
+    void FlushWriteBuffer();
+
     std::vector<BYTE> m_BitSequence;
-    std::vector<BYTE>::const_iterator m_CurrentByteIter;
+    size_t m_NextByte;
 
-    BYTE m_CurrentByte;
-    int m_iBitsLeftInCurrByte;
+    // Buffered bits starting from the least significant one. When reading, the bits above
+    // m_iNumBufferedBits may contain the following bits of the sequence
+    UINT64 m_BitBuffer;
+    int m_iNumBufferedBits;
     
     int total_bits;
     int MaxBits;
@@ -74,16 +89,13 @@ inline int CBitStream::ReadBit()
 {
     assert(m_AccessMode == BIT_STREAM_ACCESS_MODE_READING);
 
-    if (m_iBitsLeftInCurrByte==0)  
-    {
-        // Read the current byte if no bits are left in buffer
-        m_CurrentByte = *(m_CurrentByteIter++);
-        m_iBitsLeftInCurrByte = 8;
-    }
-
-    int bit = m_CurrentByte&1; // Return the next bit from the bottom of the byte
-    m_CurrentByte >>= 1;
-    m_iBitsLeftInCurrByte--;
+    if( m_iNumBufferedBits == 0 )
+        RefillReadBuffer();
+    assert( m_iNumBufferedBits > 0 );
+
+    int bit = (int)(m_BitBuffer & 1); // Return the next bit from the bottom of the buffer
+    m_BitBuffer >>= 1;
+    m_iNumBufferedBits--;
     
     total_bits--;
 
@@ -94,16 +106,44 @@ inline void CBitStream::WriteBit(int bit)
 {
     assert(m_AccessMode == BIT_STREAM_ACCESS_MODE_WRITING);
 
-    m_CurrentByte >>= 1; // Put bit In top of buffer
-    if (bit)
-        m_CurrentByte |= 0x80;
-    m_iBitsLeftInCurrByte--;    // Decrease number of bits to output to buffer
+    // Put bit on top of the buffered bits
+    m_BitBuffer |= (UINT64)(bit ? 1 : 0) << m_iNumBufferedBits;
+    m_iNumBufferedBits++;
     
-    if (m_iBitsLeftInCurrByte==0)  // Output current byte if it is now full
-    {
-        m_BitSequence.push_back( m_CurrentByte );
-        m_iBitsLeftInCurrByte = 8;
-    }
+    if( m_iNumBufferedBits == 32 )
+        FlushWriteBuffer();
 
     total_bits++;
 }
+
+inline UINT CBitStream::ReadBits(int iNumBits)
+{
+    assert(m_AccessMode == BIT_STREAM_ACCESS_MODE_READING);
+    assert( iNumBits >= 0 && iNumBits <= 32 );
+
+    if( m_iNumBufferedBits < iNumBits )
+        RefillReadBuffer();
+    assert( m_iNumBufferedBits >= iNumBits );
+
+    UINT uiValue = (UINT)( m_BitBuffer & (((UINT64)1 << iNumBits) - 1) );
+    m_BitBuffer >>= iNumBits;
+    m_iNumBufferedBits -= iNumBits;
+
+    total_bits -= iNumBits;
+
+    return uiValue;
+}
+
+inline void CBitStream::WriteBits(UINT uiValue, int iNumBits)
+{
+    assert(m_AccessMode == BIT_STREAM_ACCESS_MODE_WRITING);
+    assert( iNumBits >= 0 && iNumBits <= 32 );
+
+    m_BitBuffer |= ( (UINT64)uiValue & (((UINT64)1 << iNumBits) - 1) ) << m_iNumBufferedBits;
+    m_iNumBufferedBits += iNumBits;
+
+    if( m_iNumBufferedBits >= 32 )
+        FlushWriteBuffer();
+
+    total_bits += iNumBits;
+}
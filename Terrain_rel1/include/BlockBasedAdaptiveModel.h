@@ -54,7 +54,7 @@ struct SPatchQuadTreeNodeData
     float m_fGuaranteedPatchErrorBound;// == ElevDataErrorBound + TriangulationErrorBound
     float m_fDistanceToCamera;
     float m_fPatchScrSpaceError;
-    bool m_bUpdateRequired; // For future use
+    bool m_bUpdateRequired; // Patch must be recreated from the updated elevation data
 
     SPatchBoundingBox BoundBox;
 
@@ -239,15 +239,30 @@ public:
     // Enables or disables asynchronous task execution
     void EnableAsyncExecution(bool bAsyncExecution){m_Params.m_bAsyncExecution = bAsyncExecution;}
 
+    // Replaces height map samples in the region (see CElevationDataSource::UpdateRegion()) and
+    // rebuilds the triangulations of the affected patches. Resident patches covering the region
+    // are recreated during the next UpdateModel() call
+    HRESULT UpdateRegion(const UINT16 *pSamples,
+                         size_t SamplesPitch,
+                         int iStartCol, int iEndCol,
+                         int iStartRow, int iEndRow);
+
 protected:
     // Creates a new terrain patch
     virtual std::auto_ptr<CTerrainPatch> CreatePatch(class CPatchElevationData *pPatchElevData,
                                                      class CRQTTriangulation *pAdaptiveTriangulation)const = 0;
 
+    // Called by UpdateRegion() after the height map samples of the region are replaced, before
+    // the patches are marked for recreation. Async tasks are completed
+    virtual void OnRegionUpdated(int iStartCol, int iEndCol, int iStartRow, int iEndRow){}
+
     // Calculates bounding box for the specified patch
     void CalculatePatchBoundingBox(const SQuadTreeNodeLocation &pos, CElevationDataSource *pElev,
                                    SPatchBoundingBox &PatchBoundingBox)const;
 
+    // Calculates sum of the elevation data and triangulation error bounds for the specified patch
+    float CalculateGuaranteedPatchErrorBound(const SQuadTreeNodeLocation &pos)const;
+
     // Extract view frustum planes from the world-view-projection matrix
     void ExtractViewFrustumPlanesFromMatrix(const D3DXMATRIX &Matrix, SViewFrustum &ViewFrustum);
     
@@ -280,7 +295,9 @@ protected:
                                     // If patch size is 128x128, then its quad tree 
                                     // consists of 8 levels
     
-    CPatchQuadTreeNode m_PatchQuadTreeRoot; // Root of the quad tree
+    // Roots of the grid of the quad trees covering the terrain, stored row by row
+    std::vector<CPatchQuadTreeNode*> m_PatchQuadTreeRoots;
+    int m_iNumRootNodesHorz, m_iNumRootNodesVert;
     SRenderingParams m_Params; // Rendering params
 
     CElevationDataSource *m_pDataSource; // Pointer to elevation data source
@@ -308,29 +325,64 @@ private:
     // Recursively traverses the tree and updates it
     void RecursiveDetermineOptimalPatches(CPatchQuadTreeNode &PatchNode);
 
+    // Triangulation statistics for each level of the hierarchy
+    struct SLevelAdaptiveTriangulationStat
+    {
+        LONGLONG m_llTotalTriangles;
+        size_t TotalCompressedDataSize;
+        SLevelAdaptiveTriangulationStat() : m_llTotalTriangles(0), TotalCompressedDataSize(0) {}
+    };
+    typedef std::vector< SLevelAdaptiveTriangulationStat > TriangulationStatType;
+
+    // Data of the task set building the triangulations of the subtrees in parallel
+    struct STriangBuildTaskSetData;
+    static void BuildSubtreeTriangulationsTask(VOID* pvInfo, INT iContext, UINT uTaskId, UINT uTaskCount);
+
+    // Returns true if the triangulations of the node children are built. Descendants of the
+    // patches without finer data are never created by the model
+    bool AreChildTriangulationsBuilt(const SQuadTreeNodeLocation &pos)const
+    {
+        return pos.level < m_iNumLevelsInPatchHierarchy-1 && (pos.level == 0 || m_pDataSource->HasFinerData(pos));
+    }
+
     // Recursively traverses the whole hierarchy and builds adaptive 
-    // triangulation for each node
+    // triangulation for each node. Triangulations of the subtrees, which are already
+    // built by the task set, are taken from its data
     void RecursiveBuildPatchTriangulations(const SQuadTreeNodeLocation &pos,
                                            float fTriangulationError,
                                            CPatchElevationData *pElevData,
-                                           std::auto_ptr<class CRQTTriangulation> &pAdaptiveTriangulation);
+                                           std::auto_ptr<class CRQTTriangulation> &pAdaptiveTriangulation,
+                                           TriangulationStatType &Stat,
+                                           STriangBuildTaskSetData *pBuiltSubtrees);
     
     // Recursively traverses the tree and waits while each async taks (if any)
     // is completed
     void RecursiveWaitForAsyncTaks(CPatchQuadTreeNode &PatchNode);
+
+    // Creates root nodes of the quad trees covering the data source height map
+    void CreateQuadTreeRoots();
+    // Destroys all quad trees. Async tasks must be completed
+    void DestroyQuadTreeRoots();
+
+    // Region of the height map updated by UpdateRegion()
+    struct SUpdatedRegion
+    {
+        int iStartCol, iEndCol;
+        int iStartRow, iEndRow;
+    };
+
+    // Recursively traverses the nodes affected by the updated region, updates their bounding
+    // boxes and error bounds and marks their patches for recreation
+    void RecursiveMarkUpdatedPatches(CPatchQuadTreeNode &PatchNode, const SUpdatedRegion &Region);
+
+    // Recursively recreates patches marked by RecursiveMarkUpdatedPatches()
+    void RecursiveRecreateUpdatedPatches(CPatchQuadTreeNode &PatchNode);
     
     // Adds async task for scheduling
     bool AddTask(ITask *pTask);
 
     // Adds current patch to the list of active patches in current model
     void AddPatchToOptimalPatchesList(CPatchQuadTreeNode *pPatchQTNode);
-    
-    // Triangulation statistics for each level of the hierarchy
-    struct SLevelAdaptiveTriangulationStat
-    {
-        LONGLONG m_llTotalTriangles;
-        size_t TotalCompressedDataSize;
-        SLevelAdaptiveTriangulationStat() : m_llTotalTriangles(0), TotalCompressedDataSize(0) {}
-    };
-    std::vector< SLevelAdaptiveTriangulationStat > m_AdaptiveTriangulationStat;
+
+    TriangulationStatType m_AdaptiveTriangulationStat;
 };
@@ -0,0 +1,81 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <vector>
+#include "TilePyramidHeightMap.h"
+#include "BitStream.h"
+
+// Height map compressed with the hierarchical quantized-refinement codec, which is
+// decoded on the GPU by fx/ElevDataDecompressor.fx. Level k of the tile pyramid is
+// quantized with precision 2^k * ReconstrPrecision. Each sample of the coarser level is
+// refined to the finer level with the label 0, 1 or 2; the remaining samples are
+// predicted by interpolating the refined samples and corrected with the quantized
+// residual. Labels and residuals are entropy coded separately for each tile, so a tile
+// is decoded from its parent tile only. Decoded tiles are kept in the tile cache
+class CCompressedHeightMap : public CTilePyramidHeightMap
+{
+public:
+    CCompressedHeightMap();
+    ~CCompressedHeightMap();
+
+    // Loads the compressed file to memory
+    HRESULT Open(LPCTSTR strFilePath, size_t TileCacheBudget);
+    void Close();
+
+    // Maximal difference between the finest level samples and the source height map
+    float GetReconstructionPrecision()const{return m_uiQuantStep * 0.5f;}
+    virtual float GetMaxReconstructionError(int iStep)const;
+
+    // Total size of the encoded tiles
+    size_t GetCompressedSize()const;
+
+    // ITileLoader
+    virtual HRESULT LoadTile(UINT64 TileKey, std::vector<UINT16> &TileData);
+
+    // Compresses the height map so that the finest level samples differ from the
+    // source by at most fReconstrPrecision
+    static HRESULT CreateCompressedFile(LPCTSTR strFilePath,
+                                        const CHeightMapStore &SrcHeightMap,
+                                        float fReconstrPrecision,
+                                        int iTileSize = DEFAULT_TILE_SIZE);
+
+    // Returns the quantization step of the finest level. The precision is rounded down to
+    // the multiple of 0.5 so that the reconstructed elevations are integer
+    static UINT GetQuantizationStep(float fReconstrPrecision);
+
+    enum {DEFAULT_TILE_SIZE = 64};
+
+private:
+    struct SCompressedFileHeader
+    {
+        UINT32 uiSignature;
+        UINT32 uiVersion;
+        UINT32 uiNumCols, uiNumRows;
+        UINT32 uiTileSizeLog2;
+        UINT32 uiNumLevels;
+        UINT32 uiQuantStep; // Quantization step of the finest level, i.e. 2*ReconstrPrecision
+    };
+    enum
+    {
+        COMPRESSED_FILE_SIGNATURE = 0x43434854, // 'THCC'
+        COMPRESSED_FILE_VERSION = 1
+    };
+
+    UINT m_uiQuantStep;
+    // Encoded tiles of all levels in the file order: from the coarsest level to
+    // the finest one. Tiles of each level are stored in row-major order
+    std::vector<CBitStream> m_EncodedTiles;
+    std::vector<size_t> m_LevelStartTile;
+};
@@ -16,14 +16,27 @@
 #define MAX_PATH_LENGTH 1024
 
 extern TCHAR g_strRawDEMDataFile[];
+extern TCHAR g_strTiledHeightMapFile[];
+extern TCHAR g_strTilePyramidFile[];
+extern TCHAR g_strCompressedHeightMapFile[];
+extern TCHAR g_strHierarchyCacheFile[];
 extern TCHAR g_strEncodedRQTTriangFile[];
+extern TCHAR g_strNormalMapPyramidFile[];
 
 extern TCHAR g_strCameraTrackPath[];
 extern int g_iNumColumns;
 extern int g_iNumRows;
 extern int g_iPatchSize;
+extern int g_iTileCacheBudgetMB;
+extern int g_iPatchDataCacheBudgetMB;
 extern float g_fElevationSamplingInterval;
+extern float g_fReconstrPrecision;
 extern bool g_bForceRecreateTriang;
+extern bool g_bBenchmarkElevDataKernels;
+extern bool g_bVerifyProceduralHeightMap;
+extern bool g_bMortonHeightMapLayout;
+extern bool g_bBlockCompressedHeightMap;
+extern bool g_bDecimatedLODPyramid;
 extern struct SRenderingParams g_TerrainRenderParams;
 extern struct CAdaptiveModelDX11Render::SRenderParams g_DX11PatchRenderParams;
 
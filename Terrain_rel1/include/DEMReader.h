@@ -0,0 +1,129 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+// The reader does not depend on the Windows headers so that the preprocessing
+// tools can be built on any platform
+#include <cstdio>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Function executing one decoding task
+typedef void (*DEM_TASK_FUNC)(void *pTaskData, unsigned int uiTask);
+
+// Function executing tasks [0, uiNumTasks) in parallel. It must return when all tasks are complete
+typedef void (*DEM_PARALLEL_FOR_FUNC)(DEM_TASK_FUNC pTaskFunc, void *pTaskData, unsigned int uiNumTasks, void *pUserData);
+
+// Reader of 16-bit grayscale digital elevation models. Supported formats are
+// TIFF/BigTIFF (strips or tiles, uncompressed, LZW or Deflate, with optional
+// horizontal differencing), PNG and headerless little-endian RAW.
+// Independent TIFF strips and tiles are decoded in parallel through the parallel for function
+class CDEMReader
+{
+public:
+    enum FORMAT
+    {
+        FORMAT_UNKNOWN = 0,
+        FORMAT_TIFF,
+        FORMAT_PNG,
+        FORMAT_RAW
+    };
+
+    CDEMReader();
+    ~CDEMReader();
+
+    // Sets the function used to run decoding tasks. Tasks are executed sequentially if it is not set
+    void SetParallelFor(DEM_PARALLEL_FOR_FUNC pParallelFor, void *pUserData);
+
+    // Opens the file and reads the image header. The format is detected by the file signature.
+    // Files with unknown signature are read as RAW data if their size matches the specified dimensions
+    bool Open(const wchar_t *strFilePath, unsigned int uiRawWidth = 0, unsigned int uiRawHeight = 0);
+    void Close();
+
+    FORMAT GetFormat()const{return m_Format;}
+    unsigned int GetWidth()const{return m_uiWidth;}
+    unsigned int GetHeight()const{return m_uiHeight;}
+
+    // Decodes the whole image. DstPitch is the destination row pitch in samples
+    bool Read(unsigned short *pDst, size_t DstPitch);
+
+    // Description of the last error
+    const char* GetErrorMessage()const{return m_strError.c_str();}
+
+    // Decompresses zlib stream. Returns the number of decoded bytes or -1 if the stream is
+    // corrupted or does not fit into the destination buffer
+    static ptrdiff_t Inflate(const unsigned char *pSrc, size_t SrcSize, unsigned char *pDst, size_t DstSize);
+    // Decompresses TIFF LZW stream. Returns the number of decoded bytes or -1 on error
+    static ptrdiff_t DecodeLZW(const unsigned char *pSrc, size_t SrcSize, unsigned char *pDst, size_t DstSize);
+
+private:
+    enum TIFF_COMPRESSION
+    {
+        TIFF_COMPRESSION_NONE = 1,
+        TIFF_COMPRESSION_LZW = 5,
+        TIFF_COMPRESSION_ADOBE_DEFLATE = 8,
+        TIFF_COMPRESSION_DEFLATE = 32946
+    };
+
+    // Strip or tile of the TIFF image
+    struct SChunk
+    {
+        unsigned long long FileOffset;
+        size_t Size;
+        size_t BufferOffset; // Offset of the compressed data in the batch buffer
+        unsigned int uiX, uiY; // Position in the image
+        unsigned int uiWidth, uiHeight; // Dimensions of the decoded chunk
+    };
+
+    struct SDecodeTaskData;
+    static void DecodeChunkTask(void *pTaskData, unsigned int uiTask);
+
+    bool OpenTIFF();
+    bool OpenPNG();
+    bool ReadTIFF(unsigned short *pDst, size_t DstPitch);
+    bool ReadPNG(unsigned short *pDst, size_t DstPitch);
+    bool ReadRAW(unsigned short *pDst, size_t DstPitch);
+
+    bool ReadTIFFTag(const unsigned char *pEntry, std::vector<unsigned long long> &Values);
+
+    bool Seek(unsigned long long Offset);
+    bool ReadBytes(void *pDst, size_t Size);
+    unsigned int GetUInt16(const unsigned char *p)const;
+    unsigned int GetUInt32(const unsigned char *p)const;
+    unsigned long long GetUInt64(const unsigned char *p)const;
+
+    bool SetError(const char *strError);
+
+    FILE *m_pFile;
+    FORMAT m_Format;
+    unsigned int m_uiWidth, m_uiHeight;
+    std::string m_strError;
+
+    DEM_PARALLEL_FOR_FUNC m_pParallelFor;
+    void *m_pParallelForUserData;
+
+    // TIFF parameters
+    bool m_bBigEndian;
+    bool m_bBigTIFF;
+    unsigned int m_uiCompression;
+    unsigned int m_uiPredictor;
+    std::vector<SChunk> m_Chunks;
+
+    // Concatenated PNG IDAT chunks
+    std::vector<unsigned char> m_PNGData;
+
+    CDEMReader(const CDEMReader&);
+    const CDEMReader& operator = (const CDEMReader&);
+};
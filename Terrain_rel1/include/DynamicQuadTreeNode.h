@@ -16,6 +16,9 @@
 #include <memory>
 
 // Structure describing quad tree node location
+// Terrain may be covered by a grid of quad trees (forest). Root nodes are then
+// located at level 0 with horzOrder and vertOrder giving the position in the grid,
+// and nodes of the level l have global positions up to (NumRoots << l) - 1
 struct SQuadTreeNodeLocation
 {
     // Position in a tree
@@ -28,8 +31,8 @@ struct SQuadTreeNodeLocation
 		, vertOrder(v)
 		, level(l)
 	{
-		assert(h < (1 << l));
-		assert(v < (1 << l));
+		assert(h >= 0);
+		assert(v >= 0);
 	}
 	SQuadTreeNodeLocation()
 		: horzOrder(0)
@@ -68,13 +71,17 @@ protected:
 };
 
 // Iterator for recursively traversing the quad tree starting from the root up to the specified level
+// Forest of nRootsHorz x nRootsVert trees is traversed level by level
 class HierarchyIterator : public HierarchyIteratorBase
 {
 public:
-	HierarchyIterator(int nLevels)
+	HierarchyIterator(int nLevels, int nRootsHorz = 1, int nRootsVert = 1)
 		: m_nLevels(nLevels)
+		, m_nRootsHorz(nRootsHorz)
+		, m_nRootsVert(nRootsVert)
 	{
-		m_currentLevelSize = 1;
+		m_currentLevelSize = nRootsHorz;
+		m_currentLevelHeight = nRootsVert;
 	}
 	bool IsValid() const { return m_current.level < m_nLevels; }
 	void Next()
@@ -82,26 +89,33 @@ public:
 		if( ++m_current.horzOrder == m_currentLevelSize )
 		{
 			m_current.horzOrder = 0;
-			if( ++m_current.vertOrder == m_currentLevelSize )
+			if( ++m_current.vertOrder == m_currentLevelHeight )
 			{
 				m_current.vertOrder = 0;
-				m_currentLevelSize = 1 << ++m_current.level;
+				++m_current.level;
+				m_currentLevelSize = m_nRootsHorz << m_current.level;
+				m_currentLevelHeight = m_nRootsVert << m_current.level;
 			}
 		}
 	}
 
 private:
 	int m_nLevels;
+	int m_nRootsHorz, m_nRootsVert;
+	int m_currentLevelHeight;
 };
 
 // Iterator for recursively traversing the quad tree starting from the specified level up to the root
 class HierarchyReverseIterator : public HierarchyIteratorBase
 {
 public:
-	HierarchyReverseIterator(int nLevels)
+	HierarchyReverseIterator(int nLevels, int nRootsHorz = 1, int nRootsVert = 1)
+		: m_nRootsHorz(nRootsHorz)
+		, m_nRootsVert(nRootsVert)
 	{
 		m_current.level = nLevels - 1;
-		m_currentLevelSize = 1 << m_current.level;
+		m_currentLevelSize = nRootsHorz << m_current.level;
+		m_currentLevelHeight = nRootsVert << m_current.level;
 	}
 	bool IsValid() const { return m_current.level >= 0; }
 	void Next()
@@ -109,13 +123,19 @@ public:
 		if( ++m_current.horzOrder == m_currentLevelSize )
 		{
 			m_current.horzOrder = 0;
-			if( ++m_current.vertOrder == m_currentLevelSize )
+			if( ++m_current.vertOrder == m_currentLevelHeight )
 			{
 				m_current.vertOrder = 0;
-				m_currentLevelSize = 1 << --m_current.level;
+				--m_current.level;
+				m_currentLevelSize = m_nRootsHorz << max(m_current.level, 0);
+				m_currentLevelHeight = m_nRootsVert << max(m_current.level, 0);
 			}
 		}
 	}
+
+private:
+	int m_nRootsHorz, m_nRootsVert;
+	int m_currentLevelHeight;
 };
 
 // Template class for the node of a dynamic quad tree
@@ -128,6 +148,14 @@ public:
     {
     }
 
+    // Creates the root of the quad tree located in the specified cell of the forest
+    explicit CDynamicQuadTreeNode(const SQuadTreeNodeLocation &RootPos) : 
+        m_pAncestor(NULL),
+        m_pos(RootPos)
+    {
+        assert( RootPos.level == 0 );
+    }
+
     NodeDataType &GetData(){return m_Data;}
     const NodeDataType &GetData()const{return m_Data;}
 
@@ -0,0 +1,63 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <vector>
+
+// Pyramid of the residuals of the square blocks of the patch samples. Residual of the sample is the
+// difference between its elevation and the bilinear interpolation of the block corner samples, and
+// only the minimal and the maximal residuals of the block are stored.
+// Block i of the level covers samples [i*S, (i+1)*S], where S = FINEST_BLOCK_SIZE << iLevel,
+// so the blocks of the adjacent levels are nested and share the boundary samples.
+// The pyramid is used to bound the world space error of the triangle without visiting
+// the samples covered by it
+class CElevMinMaxPyramid
+{
+public:
+    // (iPatchSize+1) x (iPatchSize+1) samples of the patch are processed. The data must
+    // stay valid while the pyramid is used
+    CElevMinMaxPyramid(const UINT16 *pElevData, size_t ElevDataPitch, int iPatchSize);
+
+    // Compares the maximal vertical distance from the samples covered by the triangle to the
+    // triangle plane with the threshold. The distance is bounded using the blocks overlapping
+    // the triangle. Returns false if the bound is not conclusive and the covered samples must
+    // be tested; otherwise bThresholdExceeded is set.
+    // The decision is conservative with respect to the rounding of the exact triangle error
+    // calculation, so it is always the same as the decision made from the exact error
+    bool CompareTriangleErrorWithThreshold(const int piVertCols[3],
+                                           const int piVertRows[3],
+                                           float fErrorThreshold,
+                                           bool &bThresholdExceeded)const;
+
+private:
+    enum {FINEST_BLOCK_SIZE = 4};
+    // Bounding box of the triangle is covered by about this number of blocks in each dimension
+    enum {BLOCKS_PER_TRIANGLE = 8};
+
+    // Bilinear interpolation of the corner samples of the block [iStartCol,iEndCol]x[iStartRow,iEndRow]
+    double InterpolateCorners(int iStartCol, int iStartRow, int iEndCol, int iEndRow, int iCol, int iRow)const;
+
+    struct SLevel
+    {
+        int iBlockSize;
+        int iNumBlocks; // in each dimension
+        std::vector<float> MinResiduals, MaxResiduals;
+    };
+    std::vector<SLevel> m_Levels;
+    const UINT16 *m_pElevData;
+    size_t m_ElevDataPitch;
+    int m_iPatchSize;
+    // Upper bound of the rounding errors of the residuals and the exact triangle error calculation
+    double m_dRoundingMargin;
+};
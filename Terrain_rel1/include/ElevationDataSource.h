@@ -14,10 +14,16 @@
 #pragma once
 
 #include <vector>
+#include <memory>
+#include <string>
 #include "HierarchyArray.h"
 #include "DynamicQuadTreeNode.h"
+#include "HeightMapStore.h"
+#include "HeightMapKernels.h"
 
-// Class that stores height map data for the particular quad tree node
+// Class that references height map data for the particular quad tree node. The data
+// is kept in the patch data cache of the data source and is pinned there until the
+// object is destroyed
 class CPatchElevationData
 {
 public:
@@ -55,13 +61,21 @@ public:
     // Returns this patch approximation error bound
     UINT16 GetApproximationErrorBound()const;
 
+    // Returns maximal difference between the patch samples and the source height map
+    float GetMaxReconstructionError()const{return m_fMaxReconstructionError;}
+
 private:
     friend class CElevationDataSource;
     SQuadTreeNodeLocation m_pos; // Position in the quad tree
-    std::vector<UINT16> m_HeightMap; // The height map itself
-    std::vector<UINT16> m_HighResHeightMap; // The higher resolution height map used to generate normal map
+    const UINT16 *m_pHeightMap; // The height map itself
+    const UINT16 *m_pHighResHeightMap; // The higher resolution height map used to generate normal map
     size_t m_Pitch;
     size_t m_HighResDataPitch;
+    size_t m_HeightMapSize; // Number of samples in the height maps
+    size_t m_HighResHeightMapSize;
+    // Cache entry containing the height map followed by the higher resolution height map
+    CTileCache *m_pDataCache;
+    UINT64 m_DataKey;
     int m_iLeftBndrExt; // Height map boundary extension widths
     int m_iBottomBndrExt;
     int m_iRightBndrExt;
@@ -69,26 +83,94 @@ private:
     int m_iHighResDataLODBias;
     int m_iPatchSize;
     UINT16 m_ErrorBound;
+    float m_fMaxReconstructionError;
     
     CPatchElevationData();
 };
 
+// Parameters defining how the elevation data source stores the height map
+struct SElevDataSourceParams
+{
+    // Memory-mapped tiled height map file. Created from the raw data file if necessary
+    LPCTSTR strTiledHeightMapFile;
+    // Tile pyramid file streamed through the tile cache. Created from the raw data
+    // file (or the tiled height map file if specified) if necessary
+    LPCTSTR strTilePyramidFile;
+    // Byte budget of the tile cache
+    size_t TileCacheBudget;
+    // Dimensions of the headerless RAW data file
+    UINT uiRawDEMWidth, uiRawDEMHeight;
+    // Sidecar file caching the min/max elevation and error bound hierarchies. The file
+    // is rebuilt if the content of the raw data file or the patch size changes
+    LPCTSTR strHierarchyCacheFile;
+    // Store the resident height map in the Z-order tiled layout
+    bool bMortonHeightMapLayout;
+    // Keep the resident height map losslessly compressed in memory
+    bool bBlockCompressedHeightMap;
+    // Keep decimated copy of the height map for every quad tree level in memory
+    bool bDecimatedLODPyramid;
+    // Height map file compressed with the lossy hierarchical codec. Created from the raw
+    // data file if necessary. Takes precedence over the tile pyramid file
+    LPCTSTR strCompressedHeightMapFile;
+    // Maximal difference between the compressed and the source elevations
+    float fReconstrPrecision;
+    // Byte budget of the cache of the patch height maps returned by GetElevData()
+    size_t PatchDataCacheBudget;
+
+    SElevDataSourceParams() : 
+        strTiledHeightMapFile(NULL),
+        strTilePyramidFile(NULL),
+        TileCacheBudget(256 << 20),
+        uiRawDEMWidth(0),
+        uiRawDEMHeight(0),
+        strHierarchyCacheFile(NULL),
+        bMortonHeightMapLayout(false),
+        bBlockCompressedHeightMap(false),
+        bDecimatedLODPyramid(false),
+        strCompressedHeightMapFile(NULL),
+        fReconstrPrecision(1.f),
+        PatchDataCacheBudget(64 << 20)
+    {}
+};
+
 // Class implementing elevation data source
-class CElevationDataSource
+class CElevationDataSource : public ITileLoader
 {
 public:
-    // Creates data source from the specified raw data file
+    // Creates data source from the specified raw data file, DEM mosaic index file (see CMosaicHeightMap),
+    // sparse height map description file (see CSparseHeightMap) or procedural height map description
+    // file (see CProceduralHeightMap)
     CElevationDataSource(LPCTSTR strSrcDemFile,
-                         int iPatchSize);
+                         int iPatchSize,
+                         const SElevDataSourceParams &Params = SElevDataSourceParams());
     virtual ~CElevationDataSource(void);
 
     // Creates object storing height map for the specified patch
     CPatchElevationData* GetElevData(const struct SQuadTreeNodeLocation &Pos)const;
+    // Returns LOD bias of the higher resolution height map of the patches of the level
+    int GetHighResDataLODBias(int iLevel)const{return max(0, min(m_iHighResDataLODBias, (m_iNumLevels-1) - iLevel));}
+
+    // Starts asynchronous reads of the source data of the patch height maps, if the height map is
+    // streamed from the disk. Returns true if GetElevData() will not wait for the storage
+    bool PrefetchElevData(const SQuadTreeNodeLocation &Pos)const;
+    // Moves the data of the completed asynchronous reads into the height map store
+    // Must be called periodically, e.g. once per frame
+    void ProcessAsyncReads(){m_pHeightMap->ProcessAsyncReads();}
 
     // Returns minimal and maximal heights of the patch
     void GetPatchMinMaxElevation(const SQuadTreeNodeLocation &pos,
                                  UINT16 &MinElevation, 
                                  UINT16 &MaxElevation)const;
+
+    // The forest of quad trees covers the height map virtually padded to N*2^n+1 x M*2^n+1 by clamping
+    // the sample coordinates. Returns true if the patch lies wholly in the padded area. Min/max elevations
+    // and error bounds are not calculated for such patches, and triangulations are not built
+    bool IsPatchInPaddedArea(const SQuadTreeNodeLocation &pos)const
+    {
+        int iPatchSpan = m_iPatchSize << (m_iNumLevels-1 - pos.level);
+        return (int)pos.horzOrder * iPatchSpan >= (int)m_iNumCols-1 ||
+               (int)pos.vertOrder * iPatchSpan >= (int)m_iNumRows-1;
+    }
     
     // Returns minimal height of the whole terrain
     UINT16 GetGlobalMinElevation()const;
@@ -99,13 +181,48 @@ public:
     // Returns patch height map world space error bound
     UINT16 GetPatchElevDataErrorBound(const SQuadTreeNodeLocation &pos)const;
 
+    // Returns maximal difference between the patch samples of the level and the source
+    // height map. Only lossy height map stores return non-zero error
+    float GetMaxReconstructionError(int iLevel)const{return m_pHeightMap->GetMaxReconstructionError(1 << (m_iNumLevels-1 - iLevel));}
+
+    // Returns true if the descendants of the patch contain samples, which are not present in the patch.
+    // There is no finer data below the finest level and, for sparse height maps (see CSparseHeightMap),
+    // in the regions where the source samples are not denser than the patch samples. Error bounds of
+    // the patches without finer data are zero, and such patches need not be refined
+    bool HasFinerData(const SQuadTreeNodeLocation &pos)const;
+
+    // Returns bilinearly interpolated elevations at the positions given in height map samples (x is the
+    // column, y is the row). Coordinates are clamped to the height map extent. If iStepLog2 > 0, every
+    // 2^iStepLog2-th sample of the height map is interpolated. Queries are processed in batches without
+    // memory allocation; the method is thread safe
+    void QueryHeights(const D3DXVECTOR2 *pPositions, float *pHeights, size_t NumQueries, int iStepLog2 = 0)const;
+    // Returns normals of the bilinearly interpolated surface at the positions. Normals are given in the
+    // height map space: x is along the columns, y is along the rows and z is up. fSampleSpacing is the
+    // distance between two height map samples, fElevationScale is the scale of the elevations
+    void QueryNormals(const D3DXVECTOR2 *pPositions, D3DXVECTOR3 *pNormals, size_t NumQueries,
+                      float fSampleSpacing, float fElevationScale, int iStepLog2 = 0)const;
+
     int GetNumLevelsInHierarchy()const;
 
+    // The height map is covered by the grid of the quad trees. Root node of the tree in the
+    // column i and the row j of the grid is located at (i, j, 0). The number of levels is
+    // chosen for the shorter side of the height map, so that the trees of the rectangular
+    // height map do not cover large padded area
+    int GetNumRootNodesHorz()const{return m_iNumRootNodesHorz;}
+    int GetNumRootNodesVert()const{return m_iNumRootNodesVert;}
+
     int GetPatchSize()const;
+
+    // Returns the hash of the source DEM, which identifies the files derived from it, such as
+    // the hierarchy cache. The hash covers the content of the DEM file and the paths, sizes and
+    // modification times of the files it refers to. The hash is calculated on the first call.
+    // Fails if the DEM is not available
+    HRESULT GetDEMHash(UINT64 &DEMHash)const;
     
     // Sets required boundary extension widths. If requested extension will be
     // larger than what has been set by this method, then additional memory
     // will be required to store the requested height map
+    // Changing the extensions or the LOD bias invalidates cached patch data
     void SetRequiredElevDataBoundaryExtensions(int iRequiredLeftBoundaryExt,
                                                int iRequiredBottomBoundaryExt,
                                                int iRequiredRightBoundaryExt,
@@ -114,6 +231,49 @@ public:
     // calculate the normal map
     void SetHighResDataLODBias(int iHighResDataLODBias);
 
+    // Replaces samples (iCol, iRow), iStartCol <= iCol < iEndCol, iStartRow <= iRow < iEndRow,
+    // of the height map and updates min/max elevations, error bounds and cached height maps
+    // of the affected patches only. Patch data objects created before the call keep the
+    // previous samples. The method must not be called while other threads request the data
+    HRESULT UpdateRegion(const UINT16 *pSamples,
+                         size_t SamplesPitch,
+                         int iStartCol, int iEndCol,
+                         int iStartRow, int iEndRow);
+
+    // Returns the range [iStart, iEnd) of the patches of the level, whose data returned
+    // by GetElevData(), min/max elevations or error bounds depend on the samples of the region
+    void GetPatchesAffectedByRegion(int iLevel,
+                                    int iStartCol, int iEndCol,
+                                    int iStartRow, int iEndRow,
+                                    int &iStartHorz, int &iEndHorz,
+                                    int &iStartVert, int &iEndVert)const
+    {
+        GetPatchesInRegion(iLevel, iStartCol, iEndCol, iStartRow, iEndRow, 
+                           m_iRequiredLeftBoundaryExt, m_iRequiredBottomBoundaryExt, max(m_iRequiredRightBoundaryExt, 1), max(m_iRequiredTopBoundaryExt, 1),
+                           iStartHorz, iEndHorz, iStartVert, iEndVert);
+    }
+
+    // Measures the throughput of the min/max elevation calculation and writes it to the file
+    void BenchmarkMinMaxElevations(LPCTSTR strStatFile);
+    // Measures patch fetch throughput from the row-major, the Z-order and the block-compressed height map
+    // for each level and appends the results to the file
+    void BenchmarkHeightMapLayouts(LPCTSTR strStatFile);
+
+    // Verifies the data source created from the procedural height map against its generator:
+    // the samples and the min/max elevations of the corner patches of every level and the
+    // height queries spread over the terrain. Sample indices of the far patches of large terrains
+    // do not fit 32 bits, so the check covers the addressing of the store used for the height map,
+    // e.g. of the tile pyramid. Mismatches are reported to the user
+    HRESULT VerifyProceduralHeightMap()const;
+
+    // Returns statistics of the tile cache if the height map is streamed
+    bool GetTileCacheStatistics(CTileCache::SStatistics &Stat)const{return m_pHeightMap->GetTileCacheStatistics(Stat);}
+    // Returns statistics of the patch data cache
+    void GetPatchDataCacheStatistics(CTileCache::SStatistics &Stat)const{m_pPatchDataCache->GetStatistics(Stat);}
+
+    // ITileLoader. Fills the height maps of the patch identified by the key
+    virtual HRESULT LoadTile(UINT64 PatchKey, std::vector<UINT16> &PatchData);
+
     enum
     { 
         LB_DATA_EXTENSION_WIDTH = 1, // Left and bottom height map extensions of the stored data
@@ -123,11 +283,56 @@ public:
 private:
     CElevationDataSource();
 
+    // Decodes the raw data file or opens the mosaic or the sparse height map described by the file
+    static CHeightMapStore* LoadHeightMap(LPCTSTR strSrcDemFile, const SElevDataSourceParams &Params);
+
+    // Creates the height map store as specified by the parameters
+    static CHeightMapStore* CreateHeightMapStore(LPCTSTR strSrcDemFile, const SElevDataSourceParams &Params);
+
     // Calculates min/max elevations for all patches in the tree
-    void CalculateMinMaxElevations();
+    void CalculateMinMaxElevations(SIMD_LEVEL SIMDLevel = GetSupportedSIMDLevel(), bool bParallel = true);
+    void CalculateFinestLevelMinMaxElevations(int iPatchRow, SIMD_LEVEL SIMDLevel);
+    void CalculateFinestLevelMinMaxElevation(const SQuadTreeNodeLocation &Pos, std::vector<UINT16> &PatchHeightMap, SIMD_LEVEL SIMDLevel);
+    void CalculateMinMaxElevationFromChildren(const SQuadTreeNodeLocation &Pos);
+    struct SMinMaxTaskSetData;
+    static void CalculateMinMaxElevationsTask(VOID* pvInfo, INT iContext, UINT uTaskId, UINT uTaskCount);
 
     // Calculates world space approximation error bounds for all patches in the tree
     void CalculatePatchErrorBounds();
+    void CalculatePatchErrorBounds(int iLevel, int iPatchRow);
+    void CalculatePatchErrorBound(const SQuadTreeNodeLocation &Pos, std::vector<UINT16> &ParentHeightMap, std::vector<UINT16> &ChildrenHeightMap);
+    struct SErrorBoundsTaskSetData;
+    static void CalculatePatchErrorBoundsTask(VOID* pvInfo, INT iContext, UINT uTaskId, UINT uTaskCount);
+#ifdef _DEBUG
+    void CalculatePatchErrorBoundsReference(HierarchyArray<UINT16> &ErrorBounds)const;
+#endif
+
+    // Loads min/max elevations and error bounds from the hierarchy cache file. Fails if
+    // the file was created for different DEM or patch size
+    HRESULT LoadHierarchyCache(LPCTSTR strFilePath, UINT64 DEMHash, const SElevDataSourceParams &Params);
+    HRESULT SaveHierarchyCache(LPCTSTR strFilePath, UINT64 DEMHash, const SElevDataSourceParams &Params)const;
+
+    // The header is followed by min/max elevation pairs of all levels and then by the
+    // error bounds of all levels. Levels are stored from the coarsest to the finest
+    struct SHierarchyCacheHeader
+    {
+        UINT32 uiSignature;
+        UINT32 uiVersion;
+        UINT64 DEMHash;
+        UINT32 uiPatchSize;
+        UINT32 uiNumLevels;
+        UINT32 uiNumRootNodesHorz, uiNumRootNodesVert;
+        UINT32 uiNumCols, uiNumRows;
+        UINT32 uiRawDEMWidth, uiRawDEMHeight;
+        float fMaxReconstructionError; // Precision of the lossy compressed height map
+    };
+    enum
+    {
+        HIERARCHY_CACHE_SIGNATURE = 0x48435645, // 'EVCH'
+        HIERARCHY_CACHE_VERSION = 3
+    };
+    // Number of elements in all levels of the hierarchy of all trees in the forest
+    size_t GetNumHierarchyElements(int iNumLevels)const{return ((size_t(1) << (2*iNumLevels)) - 1) / 3 * m_iNumRootNodesHorz * m_iNumRootNodesVert;}
 
     // Copies height map to the specified memory location
     // using quad tree node location as input
@@ -148,6 +353,44 @@ private:
                             int iStartRow, int iEndRow, 
                             int iStep)const;
 
+    // Starts asynchronous reads of the data filled by FillPatchHeightMap() with the same arguments
+    // Returns true if the data is resident
+    bool PrefetchPatchHeightMap(const SQuadTreeNodeLocation &pos,
+                                int iLeftExt,
+                                int iBottomExt,
+                                int iRightExt,
+                                int iTopExt,
+                                int iLODBias)const;
+
+    // Sample quads and interpolation weights of a batch of height queries, kept on the stack
+    enum {QUERY_BATCH_SIZE = 64};
+    struct SQueryBatch
+    {
+        int Cols[QUERY_BATCH_SIZE], Rows[QUERY_BATCH_SIZE];
+        float FracX[QUERY_BATCH_SIZE], FracY[QUERY_BATCH_SIZE];
+        UINT16 Quads[4*QUERY_BATCH_SIZE];
+    };
+    // Gathers the sample quads surrounding the query positions
+    void GatherQueryBatch(const D3DXVECTOR2 *pPositions, int iNumQueries, int iStepLog2, SQueryBatch &Batch)const;
+
+    // Patch data cache key. The cache is cleared when the patch data layout changes, and
+    // the data of the patches alive at that moment are detached from it, so the key only
+    // identifies the node
+    UINT64 GetPatchDataKey(const SQuadTreeNodeLocation &Pos)const
+    {
+        return ((UINT64)Pos.level << 56) | ((UINT64)Pos.vertOrder << 28) | (UINT64)Pos.horzOrder;
+    }
+    void InvalidatePatchDataCache();
+
+    // Returns the range of the patches of the level, whose samples with the specified
+    // extensions overlap the region
+    void GetPatchesInRegion(int iLevel,
+                            int iStartCol, int iEndCol,
+                            int iStartRow, int iEndRow,
+                            int iLeftExt, int iBottomExt, int iRightExt, int iTopExt,
+                            int &iStartHorz, int &iEndHorz,
+                            int &iStartVert, int &iEndVert)const;
+
     // Hierarchy array storing minimal and maximal heights for quad tree nodes
     HierarchyArray< std::pair<UINT16, UINT16> > m_MinMaxElevation;
     // Hierarchy array storing world space approximation error bounds for quad tree nodes
@@ -155,9 +398,10 @@ private:
 
     int m_iNumLevels;
     int m_iPatchSize;
+    int m_iNumRootNodesHorz, m_iNumRootNodesVert;
 
     // The whole terrain height map
-    std::vector<UINT16> m_TheHeightMap;
+    std::auto_ptr<CHeightMapStore> m_pHeightMap;
     unsigned int m_iNumCols, m_iNumRows;
 
     int m_iRequiredLeftBoundaryExt;
@@ -165,4 +409,11 @@ private:
     int m_iRequiredRightBoundaryExt;
     int m_iRequiredTopBoundaryExt;
     int m_iHighResDataLODBias;
+
+    // LRU cache of the patch height maps with the byte budget
+    std::auto_ptr<CTileCache> m_pPatchDataCache;
+
+    std::wstring m_strSrcDemFile;
+    mutable UINT64 m_DEMHash;
+    mutable HRESULT m_hrDEMHash; // S_FALSE until the hash is calculated
 };
@@ -0,0 +1,119 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <float.h>
+
+// Instruction sets used by the height map processing kernels
+enum SIMD_LEVEL
+{
+    SIMD_LEVEL_SCALAR = 0,
+    SIMD_LEVEL_SSE41,
+    SIMD_LEVEL_AVX2,
+    SIMD_LEVEL_NUM_LEVELS
+};
+
+// Returns the best instruction set supported by the CPU and the OS
+SIMD_LEVEL GetSupportedSIMDLevel();
+
+// Returns the name of the instruction set
+LPCTSTR GetSIMDLevelName(SIMD_LEVEL SIMDLevel);
+
+// Calculates minimal and maximal elevations of the block of height map samples
+void CalculateMinMaxElevation(const UINT16 *pData,
+                              size_t DataPitch,
+                              int iNumCols, int iNumRows,
+                              UINT16 &MinElevation,
+                              UINT16 &MaxElevation,
+                              SIMD_LEVEL SIMDLevel = GetSupportedSIMDLevel());
+
+// Calculates the maximal absolute difference between the (2*iPatchSize+1) x (2*iPatchSize+1)
+// children samples and the bilinear interpolation of the (iPatchSize+1) x (iPatchSize+1) parent
+// samples. The last row and column of the children samples are not tested.
+// Interpolation weights are 0 or 1/2, so the error is an exact multiple of 1/4. It is
+// returned in 1/4 units
+UINT CalculateMaxInterpolationError(const UINT16 *pParentData,
+                                    size_t ParentDataPitch,
+                                    const UINT16 *pChildrenData,
+                                    size_t ChildrenDataPitch,
+                                    int iPatchSize,
+                                    SIMD_LEVEL SIMDLevel = GetSupportedSIMDLevel());
+
+// Bilinearly interpolates the 2x2 sample quads. Quad i is stored at pQuads[4*i] in the order
+// (0,0), (1,0), (0,1), (1,1), and (pFracX[i], pFracY[i]) is the position of the point inside the quad.
+// If pGradX and pGradY are not NULL, derivatives of the interpolated elevations along the columns
+// and the rows are also returned
+void InterpolateSampleQuads(const UINT16 *pQuads,
+                            const float *pFracX,
+                            const float *pFracY,
+                            int iNumQuads,
+                            float *pHeights,
+                            float *pGradX = NULL,
+                            float *pGradY = NULL,
+                            SIMD_LEVEL SIMDLevel = GetSupportedSIMDLevel());
+
+// Calculates the maximal vertical distance between the height map samples covered by the triangle
+// and the triangle plane. Vertices are given by the columns and rows of the samples; they must not
+// lie on one line. Samples are visited row by row, and the error of the first sample, which is not
+// less than fErrorThreshold, is returned as soon as it is found
+float CalculateTriangleMaxError(const UINT16 *pData,
+                                size_t DataPitch,
+                                const int piVertCols[3],
+                                const int piVertRows[3],
+                                float fErrorThreshold = +FLT_MAX,
+                                SIMD_LEVEL SIMDLevel = GetSupportedSIMDLevel());
+
+// Size of the block of samples packed by PackHeightMapBlock()
+const int PACKED_BLOCK_SIZE = 16;
+
+// Coding parameters of the packed 16x16 block. The first row is stored as offsets from
+// the minimal elevation of the row. Other rows are stored either as offsets from the minimal
+// elevation of the block or, if it takes fewer bits, as differences from the row above
+// minus the minimal difference. Sample r of the column is thus decoded as
+// ((Sample[r-1] & PrevRowMask) + RowOffset + Offset[r]) mod 2^16
+struct SPackedBlockDesc
+{
+    UINT16 FirstRowOffset;
+    UINT16 RowOffset;
+    BYTE uiFirstRowBits;
+    BYTE uiRowBits;
+    BYTE bDeltaRows;
+    BYTE uiReserved;
+};
+
+// Selects the coding of the block that takes the fewest bits
+void InitPackedBlockDesc(const UINT16 *pSrc, size_t SrcPitch, SPackedBlockDesc &Desc);
+
+// Returns the size of the packed block in 16-bit words. The size is a multiple of 16
+inline int GetPackedBlockSize(const SPackedBlockDesc &Desc)
+{
+    int iLaneBits = Desc.uiFirstRowBits + (PACKED_BLOCK_SIZE-1) * Desc.uiRowBits;
+    return ((iLaneBits + 15) >> 4) * PACKED_BLOCK_SIZE;
+}
+
+// Packs the 16x16 block of samples. Column i of the block is stored in lane i: the offsets of
+// the lane are concatenated starting from the top row and split into 16-bit words. Word w of
+// all lanes is stored contiguously at pPackedData[w*16], so all samples of one row are
+// extracted with the same shift
+void PackHeightMapBlock(const UINT16 *pSrc,
+                        size_t SrcPitch,
+                        const SPackedBlockDesc &Desc,
+                        UINT16 *pPackedData);
+
+// Decodes the block packed by PackHeightMapBlock()
+void UnpackHeightMapBlock(const UINT16 *pPackedData,
+                          const SPackedBlockDesc &Desc,
+                          UINT16 *pDst,
+                          size_t DstPitch,
+                          SIMD_LEVEL SIMDLevel = GetSupportedSIMDLevel());
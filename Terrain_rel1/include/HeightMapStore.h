@@ -0,0 +1,318 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <vector>
+#include <memory>
+#include "TileCache.h"
+#include "HeightMapKernels.h"
+
+// Base class for the storage of the whole terrain height map
+class CHeightMapStore
+{
+public:
+    CHeightMapStore() : m_iNumCols(0), m_iNumRows(0){}
+    virtual ~CHeightMapStore(void){}
+
+    // Copies samples (iCol*iStep, iRow*iStep), iStartCol <= iCol < iEndCol, iStartRow <= iRow < iEndRow
+    // to the specified memory location. Sample coordinates are clamped to the height map extent
+    // The method must be thread safe
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const = 0;
+
+    unsigned int GetNumCols()const{return m_iNumCols;}
+    unsigned int GetNumRows()const{return m_iNumRows;}
+
+    // Copies the 2x2 quads of samples (iCol*iStep, iRow*iStep), iCol = pCols[i], pCols[i]+1, iRow = pRows[i], pRows[i]+1,
+    // for the batch of positions. Quad i is stored at pQuads[4*i] in the order (0,0), (1,0), (0,1), (1,1). Sample
+    // coordinates are clamped as in FillHeightMap(). The default implementation calls FillHeightMap() for each
+    // quad; stores with random access to the samples gather them directly. The method must be thread safe
+    virtual void GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const;
+
+    // Returns statistics of the tile cache if the store streams the data
+    virtual bool GetTileCacheStatistics(CTileCache::SStatistics &Stat)const{return false;}
+
+    // Returns true if some samples could not be read from the disk and were returned as zeros.
+    // The errors are reported to the user by the store. Data calculated from such samples must not be saved
+    virtual bool HasReadErrors()const{return false;}
+
+    // Returns maximal difference between the samples returned for the step and
+    // the source height map. Only lossy stores return non-zero error
+    virtual float GetMaxReconstructionError(int iStep)const{return 0;}
+
+    // Returns log2 of the spacing of the source samples in the region iStartCol <= iCol < iEndCol,
+    // iStartRow <= iRow < iEndRow. Samples between the source ones are interpolated, so there is no
+    // finer data in the region. Stores of the full resolution data return 0
+    virtual int GetSampleSpacingLog2(int iStartCol, int iEndCol, int iStartRow, int iEndRow)const{return 0;}
+
+    // Returns bounds of the elevations in the region without reading all its samples. The bounds
+    // may be conservative. Returns false if the store does not provide such bounds
+    virtual bool GetElevationBounds(int iStartCol, int iEndCol, int iStartRow, int iEndRow,
+                                    UINT16 &MinElevation, UINT16 &MaxElevation)const{return false;}
+
+    // Starts asynchronous reads of the data required to fill the region with the specified step.
+    // Returns true if the data is resident, so that FillHeightMap() will not wait for the storage.
+    // Stores, which do not stream the data from the disk, always return true
+    virtual bool PrefetchRegion(int iStartCol, int iEndCol,
+                                int iStartRow, int iEndRow,
+                                int iStep)const{return true;}
+
+    // Moves the data of the completed asynchronous reads into the store. Must be called
+    // periodically, e.g. once per frame
+    virtual void ProcessAsyncReads(){}
+
+    // Replaces samples (iCol, iRow), iStartCol <= iCol < iEndCol, iStartRow <= iRow < iEndRow, with the
+    // specified ones. The region must be inside the height map. Stores, which can not be edited, return
+    // E_NOTIMPL. The method must not be called while other threads read the data
+    virtual HRESULT UpdateRegion(const UINT16 *pSamples,
+                                 size_t SamplesPitch,
+                                 int iStartCol, int iEndCol,
+                                 int iStartRow, int iEndRow){return E_NOTIMPL;}
+
+protected:
+    unsigned int m_iNumCols, m_iNumRows;
+
+private:
+    CHeightMapStore(const CHeightMapStore&);
+    const CHeightMapStore& operator = (const CHeightMapStore&);
+};
+
+// Height map stored in memory in row-major order
+class CResidentHeightMap : public CHeightMapStore
+{
+public:
+    CResidentHeightMap(unsigned int iNumCols, unsigned int iNumRows);
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    virtual void GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const;
+
+    virtual HRESULT UpdateRegion(const UINT16 *pSamples,
+                                 size_t SamplesPitch,
+                                 int iStartCol, int iEndCol,
+                                 int iStartRow, int iEndRow);
+
+    UINT16* GetDataPtr(){return &m_TheHeightMap[0];}
+    const UINT16* GetDataPtr()const{return &m_TheHeightMap[0];}
+
+private:
+    std::vector<UINT16> m_TheHeightMap;
+};
+
+// Height map stored in memory in the Z-order tiled layout. Samples are grouped into
+// 8x8 tiles with row-major order inside each tile. Tiles are arranged in Morton order
+// inside 32x32 tile blocks, and blocks are stored in row-major order. Samples of a coarse
+// patch, which are gathered with a large step, then lie in a few pages instead of
+// one page per sample as in the row-major layout
+class CMortonHeightMap : public CHeightMapStore
+{
+public:
+    // Copies the height map from the source store
+    CMortonHeightMap(const CHeightMapStore &SrcHeightMap);
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    virtual void GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const;
+
+    virtual HRESULT UpdateRegion(const UINT16 *pSamples,
+                                 size_t SamplesPitch,
+                                 int iStartCol, int iEndCol,
+                                 int iStartRow, int iEndRow);
+
+    enum
+    {
+        TILE_SIZE_LOG2 = 3,  // Tile size in samples
+        BLOCK_SIZE_LOG2 = 5  // Block size in tiles
+    };
+
+private:
+    std::vector<UINT16> m_Samples;
+    // Morton code is the sum of the interleaved column and row bits, so the offset of
+    // the sample (iCol, iRow) is m_ColOffsets[iCol] + m_RowOffsets[iRow]
+    std::vector<size_t> m_ColOffsets;
+    std::vector<size_t> m_RowOffsets;
+};
+
+// Decorator keeping decimated copies of the source height map. Level k contains every
+// 2^k-th sample of the source in row-major order, so the patch requested with step 2^k
+// is copied by rows rather than gathered sample by sample. Requests with other steps
+// are forwarded to the source
+class CDecimatedHeightMap : public CHeightMapStore
+{
+public:
+    // Builds the decimated levels. The object takes ownership of the source height map
+    CDecimatedHeightMap(CHeightMapStore *pSrcHeightMap);
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    virtual void GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const;
+
+    virtual bool GetTileCacheStatistics(CTileCache::SStatistics &Stat)const{return m_pSrcHeightMap->GetTileCacheStatistics(Stat);}
+    virtual float GetMaxReconstructionError(int iStep)const{return m_pSrcHeightMap->GetMaxReconstructionError(iStep);}
+    virtual bool PrefetchRegion(int iStartCol, int iEndCol, int iStartRow, int iEndRow, int iStep)const
+    {
+        return m_pSrcHeightMap->PrefetchRegion(iStartCol, iEndCol, iStartRow, iEndRow, iStep);
+    }
+    virtual void ProcessAsyncReads(){m_pSrcHeightMap->ProcessAsyncReads();}
+
+    // Updates the source and the samples of the decimated levels taken from the region
+    virtual HRESULT UpdateRegion(const UINT16 *pSamples,
+                                 size_t SamplesPitch,
+                                 int iStartCol, int iEndCol,
+                                 int iStartRow, int iEndRow);
+
+private:
+    struct SLevel
+    {
+        unsigned int uiNumCols, uiNumRows;
+        std::vector<UINT16> Samples;
+    };
+
+    std::auto_ptr<CHeightMapStore> m_pSrcHeightMap;
+    // m_Levels[k-1] is the level k. The last sample of each row and column is the
+    // last sample of the source, as the requested coordinates are clamped
+    std::vector<SLevel> m_Levels;
+};
+
+// Height map losslessly compressed in memory. The height map is split into 16x16 blocks,
+// each packed with the number of bits required for its elevation range or vertical
+// differences (see PackHeightMapBlock()). Any block is located in constant time and decoded
+// with SIMD instructions. Every 2^k-th samples are compressed in the same way, so the patch
+// of any level is assembled from whole blocks rather than gathered sample by sample
+class CBlockCompressedHeightMap : public CHeightMapStore
+{
+public:
+    // Compresses the height map from the source store
+    CBlockCompressedHeightMap(const CHeightMapStore &SrcHeightMap);
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    // Repacks the blocks containing the samples of the region. Blocks, which do not fit
+    // into their previous location, are moved to the end of the packed data
+    virtual HRESULT UpdateRegion(const UINT16 *pSamples,
+                                 size_t SamplesPitch,
+                                 int iStartCol, int iEndCol,
+                                 int iStartRow, int iEndRow);
+
+    // Size of the compressed data of all levels including the block descriptions
+    size_t GetCompressedSize()const;
+
+private:
+    struct SBlockDesc
+    {
+        UINT32 uiDataOffset; // Offset of the packed data in 16-word units
+        SPackedBlockDesc Packing;
+    };
+
+    // Level k contains every 2^k-th sample of the source height map
+    struct SLevel
+    {
+        unsigned int uiNumCols, uiNumRows;
+        unsigned int uiNumBlocksX, uiNumBlocksY;
+        std::vector<SBlockDesc> Blocks;
+        std::vector<UINT16> PackedData;
+    };
+
+    void CompressLevel(const CHeightMapStore &SrcHeightMap, int iStep, SLevel &Level);
+    void FillLevelHeightMap(const SLevel &Level,
+                            UINT16 *pDataPtr,
+                            size_t DataPitch,
+                            int iStartCol, int iEndCol,
+                            int iStartRow, int iEndRow,
+                            int iStep)const;
+
+    std::vector<SLevel> m_Levels;
+};
+
+// Height map stored in the pre-tiled file, which is mapped into the process address space.
+// Pages are faulted in by the OS when the data is first accessed and can be shared
+// between processes
+class CMappedTiledHeightMap : public CHeightMapStore
+{
+public:
+    CMappedTiledHeightMap();
+    ~CMappedTiledHeightMap();
+
+    // Opens the tiled height map file
+    HRESULT Open(LPCTSTR strFilePath);
+    void Close();
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    virtual void GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const;
+
+    // Writes the height map to the tiled file
+    static HRESULT CreateTiledFile(LPCTSTR strFilePath,
+                                   const CHeightMapStore &SrcHeightMap,
+                                   int iTileSize = DEFAULT_TILE_SIZE);
+
+    enum {DEFAULT_TILE_SIZE = 64};
+
+private:
+    // File header. Tiles are stored in row-major order starting from
+    // TILES_DATA_OFFSET; samples inside each tile are also row-major
+    struct STiledFileHeader
+    {
+        UINT32 uiSignature;
+        UINT32 uiVersion;
+        UINT32 uiNumCols, uiNumRows;
+        UINT32 uiTileSizeLog2;
+        UINT32 uiNumTilesX, uiNumTilesY;
+        UINT32 uiReserved;
+    };
+    enum
+    {
+        TILED_FILE_SIGNATURE = 0x504D4854, // 'THMP'
+        TILED_FILE_VERSION = 1,
+        TILES_DATA_OFFSET = 4096 // Page-aligned start of the tile data
+    };
+
+    // Returns pointer to the specified sample. Samples in the same tile row are contiguous
+    const UINT16* GetSamplePtr(int iSrcCol, int iSrcRow)const
+    {
+        int iTileMask = (1 << m_iTileSizeLog2) - 1;
+        size_t TileInd = (iSrcCol >> m_iTileSizeLog2) + (size_t)(iSrcRow >> m_iTileSizeLog2) * m_iNumTilesX;
+        return m_pTiles + (TileInd << (2*m_iTileSizeLog2)) + ((iSrcRow & iTileMask) << m_iTileSizeLog2) + (iSrcCol & iTileMask);
+    }
+
+    HANDLE m_hFile;
+    HANDLE m_hFileMapping;
+    const BYTE *m_pMappedData;
+    const UINT16 *m_pTiles;
+    int m_iTileSizeLog2;
+    unsigned int m_iNumTilesX, m_iNumTilesY;
+};
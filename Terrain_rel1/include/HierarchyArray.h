@@ -17,40 +17,66 @@
 #include "DynamicQuadTreeNode.h"
 
 // Template class implementing hierarchy array, which is a quad tree indexed by 
-// quad tree node location
+// quad tree node location. The array may also cover a forest of quad trees, in which
+// case the level l contains (numRootsHorz << l) x (numRootsVert << l) elements
 template <class T>
 class HierarchyArray
 {
 public:
+	HierarchyArray() : m_numRootsHorz(1), m_numRootsVert(1){}
+
 	T& operator [] (const SQuadTreeNodeLocation &at)
 	{
-		return m_data[at.level][at.horzOrder + (at.vertOrder << at.level)];
+		return m_data[at.level][at.horzOrder + at.vertOrder * (m_numRootsHorz << at.level)];
 	}
 	const T& operator [] (const SQuadTreeNodeLocation &at) const
 	{
-		return m_data[at.level][at.horzOrder + (at.vertOrder << at.level)];
+		return m_data[at.level][at.horzOrder + at.vertOrder * (m_numRootsHorz << at.level)];
 	}
 
-	void Resize(size_t numLevelsInHierarchy)
+	void Resize(size_t numLevelsInHierarchy, size_t numRootsHorz = 1, size_t numRootsVert = 1)
 	{
+		m_numRootsHorz = numRootsHorz;
+		m_numRootsVert = numRootsVert;
 		m_data.resize(numLevelsInHierarchy);
 		if( numLevelsInHierarchy )
 		{
 			for(size_t level = numLevelsInHierarchy; level--; )
 			{
-				size_t numElementsInLevel = 1 << level;
-				m_data[level].resize(numElementsInLevel*numElementsInLevel);
+				m_data[level].resize(GetNumElementsInLevel(level));
 			}
 		}
 	}
 
+	// Returns the total number of elements in all trees of the forest at the level
+	size_t GetNumElementsInLevel(size_t level) const
+	{
+		return (m_numRootsHorz << level) * (m_numRootsVert << level);
+	}
+
 	bool Empty() const
 	{
 		return m_data.empty();
 	}
 
+	size_t GetNumLevels() const
+	{
+		return m_data.size();
+	}
+
+	// Returns elements of the level stored row by row
+	T* GetLevelData(size_t level)
+	{
+		return &m_data[level][0];
+	}
+	const T* GetLevelData(size_t level) const
+	{
+		return &m_data[level][0];
+	}
+
 private:
 	std::vector<std::vector<T> > m_data;
+	size_t m_numRootsHorz, m_numRootsVert;
 };
 
 
@@ -0,0 +1,105 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <memory>
+#include <string>
+#include <algorithm>
+#include "HeightMapStore.h"
+#include "TileCache.h"
+
+// Virtual height map composed of many DEM files. The mosaic is described by the text index file:
+//
+//  DEMMosaic
+//  # <first column> <first row> <width> <height> <tile file>
+//  0    0 4096 4096 N45E006.tif
+//  4096 0 4096 4096 N45E007.tif
+//
+// Tile file paths are relative to the folder of the index file. Tiles listed later cover the
+// earlier ones where they overlap, and samples not covered by any tile are zero.
+// Only the index is read when the mosaic is opened. Tiles are decoded by the thread requesting
+// the data and kept in the LRU cache limited by the byte budget. The budget should hold a row
+// of tiles, as the preprocessing scans the height map by rows.
+// Every 2^OVERVIEW_STEP_LOG2-th sample of each decoded tile is also kept in the resident overview,
+// so coarse patches are assembled without decoding the tiles again.
+// The derived files and the hierarchy cache are validated against the index file and the paths,
+// sizes and modification times of the tile files (see CElevationDataSource::GetDEMHash())
+class CMosaicHeightMap : public CHeightMapStore, public ITileLoader
+{
+public:
+    CMosaicHeightMap();
+    ~CMosaicHeightMap();
+
+    // Reads the index file. Errors are reported to the user
+    HRESULT Open(LPCTSTR strIndexFile, size_t TileCacheBudget);
+    void Close();
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    virtual bool GetTileCacheStatistics(CTileCache::SStatistics &Stat)const;
+
+    // ITileLoader
+    virtual HRESULT LoadTile(UINT64 TileKey, std::vector<UINT16> &TileData);
+
+    // Returns true if the file starts with the mosaic index signature
+    static bool IsMosaicIndexFile(LPCTSTR strFilePath);
+    // Returns the paths of the tile files listed in the index file. Errors are not reported
+    static HRESULT GetTileFiles(LPCTSTR strIndexFile, std::vector<std::wstring> &TileFiles);
+
+    enum {OVERVIEW_STEP_LOG2 = 4};
+
+private:
+    struct STileDesc
+    {
+        std::wstring strFilePath;
+        UINT uiStartCol, uiStartRow;
+        UINT uiNumCols, uiNumRows;
+    };
+
+    // Parses the index file. Errors are reported to the user if bReportErrors is true
+    static HRESULT ReadIndexFile(LPCTSTR strIndexFile, bool bReportErrors, std::vector<STileDesc> &Tiles, UINT64 &MosaicCols, UINT64 &MosaicRows);
+
+    // Tile edges split the mosaic into the grid of cells, each covered by a single tile or by none
+    static int GetCellIndex(const std::vector<UINT> &CellEdges, UINT uiCoord)
+    {
+        return (int)(std::upper_bound(CellEdges.begin(), CellEdges.end(), uiCoord) - CellEdges.begin()) - 1;
+    }
+    int GetCellTile(int iCellX, int iCellY)const
+    {
+        return m_CellTiles[iCellX + iCellY * (m_CellEdgesX.size()-1)];
+    }
+
+    // Copies the tile samples, which are not covered by other tiles, to the overview
+    void UpdateOverview(int iTile, const UINT16 *pTileData);
+    // Makes sure the overview contains the samples of the tile
+    void LoadTileOverview(int iTile)const;
+
+    std::vector<STileDesc> m_Tiles;
+    std::vector<UINT> m_CellEdgesX, m_CellEdgesY;
+    std::vector<int> m_CellTiles; // Index of the tile covering the cell or -1
+    std::auto_ptr<CTileCache> m_pTileCache;
+
+    // Sample (i, j) of the overview is the sample (min(i * 2^OVERVIEW_STEP_LOG2, NumCols-1),
+    // min(j * 2^OVERVIEW_STEP_LOG2, NumRows-1)) of the mosaic
+    UINT m_uiOverviewCols, m_uiOverviewRows;
+    std::vector<UINT16> m_Overview;
+    std::vector<bool> m_IsTileInOverview;
+    // Decoding errors are reported once per tile. Guarded by m_csOverview as well
+    std::vector<bool> m_IsTileErrorReported;
+    mutable CRITICAL_SECTION m_csOverview;
+};
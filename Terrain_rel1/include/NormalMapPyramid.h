@@ -0,0 +1,107 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <vector>
+#include "DynamicQuadTreeNode.h"
+
+// Interface of the object generating normal maps of the quad tree nodes for the pyramid file
+__interface INormalMapGenerator
+{
+    // Returns the size of the node normal map data or 0 if the normal map is not stored in the file
+    size_t GetNormalMapDataSize(const SQuadTreeNodeLocation &Pos);
+    // Writes all mip levels of the node normal map in the format uploaded by the patch
+    // Fails if the height map of the node is not available, which aborts the baking
+    HRESULT GenerateNormalMap(const SQuadTreeNodeLocation &Pos, BYTE *pNormalMapData);
+};
+
+// Memory-mapped file of the normal maps baked for the quad tree nodes of static terrain, so that
+// the patches upload them instead of calculating and compressing the normal maps at run time.
+// Each stored node has a block holding all mip levels. The file is validated
+// against the parameters and the hash of the DEM it was baked with. Nodes, whose height map is
+// modified after the file is opened, are discarded and their normal maps are generated at run time
+class CNormalMapPyramid
+{
+public:
+    // Parameters, which determine the normal maps
+    struct SDesc
+    {
+        UINT64 DEMHash; // See CElevationDataSource::GetDEMHash()
+        UINT32 uiNumLevels;
+        UINT32 uiNumRootNodesHorz, uiNumRootNodesVert;
+        UINT32 uiPatchSize;
+        UINT32 uiNormalMapLODBias;
+        UINT32 uiNumMips;
+        UINT32 bCompressed;
+        float fElevationSampleSpacing;
+        float fElevationScale;
+    };
+
+    CNormalMapPyramid();
+    ~CNormalMapPyramid();
+
+    // Opens the pyramid file. Fails if the file was baked with different parameters or for different DEM
+    HRESULT Open(LPCTSTR strFilePath, const SDesc &ExpectedDesc);
+    void Close();
+
+    // Returns the normal map data of the node or NULL if the node is not stored in the file
+    // or was discarded
+    const BYTE* GetNormalMapData(const SQuadTreeNodeLocation &Pos, size_t &DataSize)const;
+
+    // Discards the normal map of the node, whose height map was modified. The data returned
+    // for the node before the call stays valid while the file is open
+    void DiscardNode(const SQuadTreeNodeLocation &Pos);
+
+    // Bakes the normal maps of the nodes into the file
+    static HRESULT CreatePyramidFile(LPCTSTR strFilePath,
+                                     const SDesc &Desc,
+                                     INormalMapGenerator *pGenerator);
+
+private:
+    // File header followed by the table of the node blocks, which is indexed as the nodes
+    // are enumerated level by level, row by row. Node blocks start at the page boundary after
+    // the table and are 16-byte aligned
+    struct SFileHeader
+    {
+        UINT32 uiSignature;
+        UINT32 uiVersion;
+        SDesc Desc;
+        UINT64 NumNodes;
+    };
+    struct SNodeBlock
+    {
+        UINT64 Offset;
+        UINT64 Size; // Zero for the nodes, which are not stored
+    };
+    enum
+    {
+        PYRAMID_FILE_SIGNATURE = 0x504D4E54, // 'TNMP'
+        PYRAMID_FILE_VERSION = 2,
+        PAGE_SIZE = 4096
+    };
+
+    static UINT64 GetNodeIndex(const SDesc &Desc, const SQuadTreeNodeLocation &Pos);
+    static UINT64 GetNumNodes(const SDesc &Desc){return GetNodeIndex(Desc, SQuadTreeNodeLocation(0, 0, Desc.uiNumLevels));}
+
+    HANDLE m_hFile;
+    HANDLE m_hFileMapping;
+    const BYTE *m_pMappedData;
+    const SNodeBlock *m_pNodeBlocks;
+    SDesc m_Desc;
+    // Flags of the discarded nodes indexed as the node blocks
+    std::vector<bool> m_DiscardedNodes;
+
+    CNormalMapPyramid(const CNormalMapPyramid&);
+    const CNormalMapPyramid& operator = (const CNormalMapPyramid&);
+};
@@ -0,0 +1,75 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <vector>
+#include "HeightMapStore.h"
+
+// Synthetic height map generated on the fly, which allows testing terrains far larger than the memory.
+// The height map is described by the text file:
+//
+//  DEMProcedural
+//  # <width> <height> <seed>
+//  131072 131072 1
+//
+// The elevation is the sum of the column and the row profiles, which are fractal value noise
+// functions tabulated when the height map is opened, and the per-sample detail hashed from the
+// sample coordinates. Every sample is thus reproducible from its coordinates, and only the
+// profiles are kept in memory. The procedural height map is used directly or streamed to the
+// tile pyramid; other derived stores are not created from it
+class CProceduralHeightMap : public CHeightMapStore
+{
+public:
+    CProceduralHeightMap();
+
+    // Reads the description file and tabulates the profiles. Errors are reported to the user
+    HRESULT Open(LPCTSTR strDescFile);
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    virtual void GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const;
+
+    // Returns the elevation of the sample. Coordinates must be inside the height map
+    UINT16 GetSample(UINT uiCol, UINT uiRow)const
+    {
+        return (UINT16)(m_ColProfile[uiCol] + m_RowProfile[uiRow] + GetDetail(uiCol, uiRow));
+    }
+
+    // Returns true if the file starts with the procedural height map signature
+    static bool IsProceduralHeightMapFile(LPCTSTR strFilePath);
+
+    // Dimensions are limited so that the sample coordinates of the height map padded to the
+    // extent of the quad trees fit int
+    enum {MAX_DIMENSION = 1 << 29};
+
+private:
+    static UINT GetDetail(UINT uiCol, UINT uiRow)
+    {
+        UINT uiHash = (uiCol * 0x9E3779B1U) ^ (uiRow * 0x85EBCA77U);
+        uiHash ^= uiHash >> 15;
+        return (uiHash * 0x2C1B3C6DU) >> (32 - DETAIL_BITS);
+    }
+
+    static void CreateProfile(UINT uiNumSamples, UINT uiSeed, std::vector<UINT16> &Profile);
+
+    // Each profile spans [0, MAX_PROFILE_ELEVATION], so that the sum never exceeds 16 bits
+    enum {DETAIL_BITS = 8};
+    enum {MAX_PROFILE_ELEVATION = (0xFFFF - ((1 << DETAIL_BITS)-1)) / 2};
+
+    std::vector<UINT16> m_ColProfile, m_RowProfile;
+};
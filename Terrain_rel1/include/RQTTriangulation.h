@@ -134,13 +134,19 @@ private:
     bool m_bIsEncodingMode;
 
     CRQTVertsEnabledFlags m_EnabledFlags;
+
+    // Upper bound of the errors of the triangles of the disabled vertices with respect to the
+    // source height map. Only known for the triangulations built by CTriangDataSource, otherwise +FLT_MAX
+    float m_fDisabledVertsErrorBound;
     
     CBitStream *m_pEncodedRQTBitStream;
 
     friend class CTriangDataSource;
 };
 
-// Pack vertex indices into single UINT32 value
+// Pack vertex indices into single UINT32 value. The indices address the sample in the patch
+// elevation data rather than in the whole height map, so the terrain size is not limited by
+// the 16-bit fields
 inline 
 UINT CalculatePackedIndex(int iVertXInd, int iVertYInd, int iLevel, 
                           int iNumLevelsInQuadTree,
@@ -154,6 +160,7 @@ UINT CalculatePackedIndex(int iVertXInd, int iVertYInd, int iLevel,
     iVertYInd += iElevDataBoundaryExtension;
     iVertYInd = max(iVertYInd, 0);
 
+    assert( iVertXInd <= 0x0FFFF && iVertYInd <= 0x0FFFF );
     return (iVertXInd & 0x0FFFF) | ((iVertYInd & 0x0FFFF) << 16);
 }
 
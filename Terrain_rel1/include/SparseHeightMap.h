@@ -0,0 +1,83 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <string>
+#include "HeightMapStore.h"
+#include "DEMReader.h"
+
+// Sparse multi-resolution height map composed of resident layers of different resolution, e.g.
+// the coarse global DEM and a few high resolution survey insets. The layers are listed in the
+// text description file:
+//
+//  DEMSparse
+//  # <sample spacing> <first column> <first row> <width> <height> <layer file>
+//  16 0     0    8192 4096 global.tif
+//  1  20480 8192 6000 5000 survey.tif
+//
+// The layer with the spacing 2^k contains every 2^k-th sample of the full resolution grid starting
+// from the specified sample, whose coordinates must be multiples of the spacing. Layer file paths
+// are relative to the folder of the description file. Finer layers cover the coarser ones, and among
+// the layers of the same spacing the later listed one wins. Samples between the layer samples are
+// bilinearly interpolated, and samples not covered by any layer are zero.
+// Only the layer samples are kept in memory, so derived stores, which hold all samples of the full
+// resolution grid, are not created from the sparse height map. The hierarchy cache of the sparse height
+// map is validated against the layer files as well as against the description file
+class CSparseHeightMap : public CHeightMapStore
+{
+public:
+    CSparseHeightMap();
+
+    // Reads the description file and decodes the layers. Errors are reported to the user
+    HRESULT Open(LPCTSTR strDescFile, DEM_PARALLEL_FOR_FUNC pParallelFor = NULL, void *pUserData = NULL);
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    // Returns the finest spacing of the layers intersecting the region
+    virtual int GetSampleSpacingLog2(int iStartCol, int iEndCol, int iStartRow, int iEndRow)const;
+
+    // Returns bounds of the layer samples, from which the samples of the region are interpolated
+    virtual bool GetElevationBounds(int iStartCol, int iEndCol, int iStartRow, int iEndRow,
+                                    UINT16 &MinElevation, UINT16 &MaxElevation)const;
+
+    // Returns true if the file starts with the sparse height map signature
+    static bool IsSparseHeightMapFile(LPCTSTR strFilePath);
+    // Returns the paths of the layer files listed in the description file. Errors are not reported
+    static HRESULT GetLayerFiles(LPCTSTR strDescFile, std::vector<std::wstring> &LayerFiles);
+
+    enum {MAX_SPACING_LOG2 = 12};
+
+private:
+    struct SLayer
+    {
+        int iSpacingLog2;
+        UINT uiStartCol, uiStartRow; // Full resolution coordinates of the first sample
+        UINT uiNumCols, uiNumRows;
+        std::vector<UINT16> Samples;
+
+        // Full resolution coordinates of the last sample
+        UINT GetEndCol()const{return uiStartCol + ((uiNumCols-1) << iSpacingLog2);}
+        UINT GetEndRow()const{return uiStartRow + ((uiNumRows-1) << iSpacingLog2);}
+    };
+
+    // Parses the description file. Errors are reported to the user if bReportErrors is true
+    static HRESULT ReadDescFile(LPCTSTR strDescFile, bool bReportErrors, std::vector<SLayer> &Layers, std::vector<std::wstring> &LayerFiles);
+
+    // Layers are sorted from the coarsest to the finest one, so that finer layers are drawn over coarser ones
+    std::vector<SLayer> m_Layers;
+};
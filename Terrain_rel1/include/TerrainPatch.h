@@ -16,6 +16,7 @@
 #include "DynamicQuadTreeNode.h"
 
 class CDX11PatchCache;
+class CNormalMapPyramid;
 
 // Class implementing common data for all patches in the quad tree
 class CDX11PatchesCommon
@@ -36,6 +37,10 @@ public:
     // Releases Direct3D11 device resources
     void OnD3D11DestroyDevice( );
 
+    // Sets the pyramid of the baked normal maps, which patches upload instead of generating
+    // the normal maps. The pyramid must not be closed while the patches exist
+    void SetNormalMapPyramid(const CNormalMapPyramid *pNormalMapPyramid){m_pNormalMapPyramid = pNormalMapPyramid;}
+
 private:
     friend class CTerrainPatch;
     friend class CDX11TriangulatedPatch;
@@ -48,6 +53,7 @@ private:
     float m_fElevationSampleSpacing, m_fElevationScale;
     int m_iNumLevelsInPatchHierarchy;
 	bool m_bAsyncModeWorkaround;
+    const CNormalMapPyramid *m_pNormalMapPyramid;
 };
 
 class CTerrainPatch
@@ -109,6 +115,14 @@ private:
     void DefineElevDataTexDesc(D3D11_TEXTURE2D_DESC &ElevDataTexDesc);
     void DefineNormalMapDesc(D3D11_TEXTURE2D_DESC &NormalMapDesc);
 
+    // Returns the size of the normal map data with all mip levels
+    static size_t GetNormalMapDataSize(const CDX11PatchesCommon *pPatchCommon, int iPatchSize, int iHighResElevDataLODBias);
+    // Calculates all mip levels of the patch normal map. Returns pointer to the data
+    static const BYTE* GenerateNormalMap(const CDX11PatchesCommon *pPatchCommon,
+                                  const class CPatchElevationData *pPatchElevData,
+                                  std::vector<BYTE> &NormalMapData,
+                                  std::vector<BYTE> &NormalMapDataBC3);
+
     // Flag indicating if height map has already been loaded to GPU
     bool m_bElevMapIsValid;
     
@@ -123,6 +137,7 @@ private:
     std::vector<BYTE> m_NormalMapData;// Normal map stores only x,y components (1 byte/component). 
                                       // z component is calculated in the shader as sqrt(1 - x^2 - y^2)
     std::vector<BYTE> m_NormalMapDataBC3; // Compressed normal map data
+    const BYTE *m_pBakedNormalMapData; // Normal map data in the pyramid file
    
     HRESULT CreateIndexBuffer();
 	
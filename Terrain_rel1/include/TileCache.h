@@ -0,0 +1,107 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <vector>
+#include <list>
+#include <map>
+
+// Interface of the object loading height map tiles on cache misses
+// The method is called from several threads simultaneously
+__interface ITileLoader
+{
+    HRESULT LoadTile(UINT64 TileKey, std::vector<UINT16> &TileData);
+};
+
+// Thread-safe LRU cache of decoded height map tiles limited by the byte budget
+class CTileCache
+{
+public:
+    CTileCache(ITileLoader *pLoader, size_t BudgetBytes);
+    ~CTileCache();
+
+    // Returns tile data loading the tile if necessary. Tile is pinned in the cache
+    // until ReleaseTile() is called. NULL is returned if the tile failed to load.
+    // The tile loaded while Clear() or InvalidateTile() is called is returned detached from
+    // the cache, since it could have been read before the source data changed
+    const UINT16* AcquireTile(UINT64 TileKey);
+    // Tiles invalidated while they were pinned are identified by the data pointer
+    // returned by AcquireTile()
+    void ReleaseTile(UINT64 TileKey, const UINT16 *pTileData = NULL);
+
+    // Returns true if the tile is in the cache. The tile is not pinned, so it can be evicted
+    // before it is acquired
+    bool IsTileResident(UINT64 TileKey)const;
+
+    // Inserts the tile loaded outside the cache, e.g. by an asynchronous read. The data are
+    // swapped into the cache. Nothing is changed if the tile is already resident
+    void InsertTile(UINT64 TileKey, std::vector<UINT16> &TileData);
+
+    // Removes the tile from the cache, so that it is reloaded on the next request. If the
+    // tile is pinned, its data remain valid until the tile is released
+    void InvalidateTile(UINT64 TileKey);
+
+    // Removes all tiles from the cache and releases recycled buffers. Pinned tiles
+    // are detached, so their data remain valid until the tiles are released
+    void Clear();
+
+    struct SStatistics
+    {
+        size_t BudgetBytes;
+        size_t ResidentBytes;
+        size_t PeakResidentBytes;
+        UINT64 uiNumHits;
+        UINT64 uiNumMisses;
+    };
+    void GetStatistics(SStatistics &Stat)const;
+
+private:
+    struct STileEntry
+    {
+        std::vector<UINT16> Data;
+        int iPinCount;
+        std::list<UINT64>::iterator LRUPos;
+    };
+    typedef std::map<UINT64, STileEntry> TileMapType;
+    // Invalidated pinned tiles are keyed by their data
+    typedef std::map<const UINT16*, STileEntry> DetachedTileMapType;
+
+    // Removes the tile from the cache. The data of the pinned tile are moved to the detached tiles
+    // Must be called when the critical section is entered
+    void RemoveTile(TileMapType::iterator TileIt);
+    // Evicts least recently used unpinned tiles until resident size fits the budget
+    // Must be called when the critical section is entered
+    void EvictTiles();
+    // Moves the buffer to the free list if the list is not full
+    // Must be called when the critical section is entered
+    void RecycleBuffer(std::vector<UINT16> &Buffer);
+
+    // Buffers of the evicted tiles are passed to the loader on subsequent misses,
+    // so that the tiles of the same size are loaded without memory allocation
+    enum {MAX_FREE_BUFFERS = 16};
+    std::vector< std::vector<UINT16> > m_FreeBuffers;
+
+    ITileLoader *m_pLoader;
+    TileMapType m_Tiles;
+    DetachedTileMapType m_DetachedTiles;
+    std::list<UINT64> m_LRUList; // Most recently used tiles are at the front
+    // Incremented by Clear() and InvalidateTile(), so that the tiles, whose loading
+    // started before the invalidation, are not inserted
+    UINT m_uiInvalidationCount;
+    SStatistics m_Stat;
+    mutable CRITICAL_SECTION m_cs;
+
+    CTileCache(const CTileCache&);
+    const CTileCache& operator = (const CTileCache&);
+};
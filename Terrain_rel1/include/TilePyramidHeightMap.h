@@ -0,0 +1,134 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#pragma once
+
+#include <memory>
+#include <map>
+#include <set>
+#include "HeightMapStore.h"
+#include "TileCache.h"
+#include "AsyncFileReader.h"
+
+// Height map streamed from the on-disk tile pyramid. Level k of the pyramid contains every
+// 2^k-th sample of the full resolution height map, so a patch of any quad tree level is
+// assembled from a few tiles. Decoded tiles are kept in the LRU cache limited by the byte
+// budget; cache misses are loaded by the thread requesting the data. Tiles can also be
+// prefetched with asynchronous reads, which are inserted into the cache when completed
+class CTilePyramidHeightMap : public CHeightMapStore, public ITileLoader, public IAsyncReadHandler
+{
+public:
+    CTilePyramidHeightMap();
+    ~CTilePyramidHeightMap();
+
+    // Opens the pyramid file
+    HRESULT Open(LPCTSTR strFilePath, size_t TileCacheBudget);
+    void Close();
+
+    virtual void FillHeightMap(UINT16 *pDataPtr,
+                               size_t DataPitch,
+                               int iStartCol, int iEndCol,
+                               int iStartRow, int iEndRow,
+                               int iStep)const;
+
+    // Samples are read from the cached tiles without intermediate buffers
+    virtual void GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const;
+
+    virtual bool GetTileCacheStatistics(CTileCache::SStatistics &Stat)const;
+
+    virtual bool HasReadErrors()const;
+
+    // Starts asynchronous reads of the tiles, which are neither resident nor being read
+    virtual bool PrefetchRegion(int iStartCol, int iEndCol,
+                                int iStartRow, int iEndRow,
+                                int iStep)const;
+    virtual void ProcessAsyncReads();
+
+    // ITileLoader
+    virtual HRESULT LoadTile(UINT64 TileKey, std::vector<UINT16> &TileData);
+
+    // IAsyncReadHandler
+    virtual void OnReadCompleted(UINT64 TileKey, HRESULT hr);
+
+    // Builds the pyramid file from the height map
+    static HRESULT CreatePyramidFile(LPCTSTR strFilePath,
+                                     const CHeightMapStore &SrcHeightMap,
+                                     int iTileSize = DEFAULT_TILE_SIZE);
+
+    enum {DEFAULT_TILE_SIZE = 128};
+
+protected:
+    // Description of the pyramid level. Level descriptions follow the header
+    struct SLevelDesc
+    {
+        UINT32 uiNumCols, uiNumRows;
+        UINT32 uiNumTilesX, uiNumTilesY;
+        UINT64 DataOffset; // Offset of the first tile in the file
+    };
+
+    // Calculates the dimensions of the pyramid levels
+    static void InitLevelDescs(UINT32 uiNumCols, UINT32 uiNumRows, int iTileSizeLog2, std::vector<SLevelDesc> &Levels);
+
+    static UINT64 GetTileKey(int iLevel, int iTileX, int iTileY)
+    {
+        return ((UINT64)iLevel << 56) | ((UINT64)iTileY << 28) | (UINT64)iTileX;
+    }
+
+    // Returns the pyramid level containing the samples requested with the step
+    int GetLevelForStep(int iStep)const;
+
+    // Returns index of the level sample corresponding to the requested column/row. Indices are
+    // clamped to the height map extent in the same way as in FillHeightMap()
+    static int GetLevelSampleIndex(int iInd, int iStep, int iLevel, unsigned int uiNumSrcSamples, unsigned int uiNumLevelSamples)
+    {
+        int iSrcInd = max(0, iInd*iStep);
+        return (iSrcInd >= (int)uiNumSrcSamples-1) ? (int)uiNumLevelSamples-1 : (iSrcInd >> iLevel);
+    }
+
+    // The tile cache and the level descriptions are shared with the derived
+    // stores, which produce tiles of the same pyramid in a different way
+    int m_iTileSizeLog2;
+    std::vector<SLevelDesc> m_Levels;
+    std::auto_ptr<CTileCache> m_pTileCache;
+
+private:
+    struct SPyramidFileHeader
+    {
+        UINT32 uiSignature;
+        UINT32 uiVersion;
+        UINT32 uiNumCols, uiNumRows;
+        UINT32 uiTileSizeLog2;
+        UINT32 uiNumLevels;
+    };
+    enum
+    {
+        PYRAMID_FILE_SIGNATURE = 0x59504854, // 'THPY'
+        PYRAMID_FILE_VERSION = 1
+    };
+
+    // Returns offset of the tile in the pyramid file
+    UINT64 GetTileOffset(UINT64 TileKey)const;
+
+    HANDLE m_hFile;
+
+    // Tiles, which failed to load, are reported once. Their samples are returned as zeros
+    std::set<UINT64> m_FailedTiles;
+    mutable CRITICAL_SECTION m_csFailedTiles;
+
+    // Separate overlapped handle of the same file for the asynchronous reads. Tiles being
+    // read are kept in m_PendingReads until the reads are completed
+    std::auto_ptr<CAsyncFileReader> m_pAsyncReader;
+    typedef std::map<UINT64, std::vector<UINT16> > PendingReadsMapType;
+    mutable PendingReadsMapType m_PendingReads;
+    mutable CRITICAL_SECTION m_csPendingReads;
+};
@@ -24,8 +24,9 @@ public:
     CTriangDataSource(void);
     ~CTriangDataSource(void);
 
-    // Init empty triangulation data source object
-    void Init(int iNumLevelsInHierarchy, int iPatchSize, float fFinestLevelTriangErrorThreshold);
+    // Init empty triangulation data source object for the forest of quad trees
+    void Init(int iNumLevelsInHierarchy, int iPatchSize, float fFinestLevelTriangErrorThreshold,
+              int iNumRootNodesHorz = 1, int iNumRootNodesVert = 1);
 
     // Decodes child patch triangulations taking parent patch triangulation as input
     CRQTTriangulation* DecodeTriangulation(const SQuadTreeNodeLocation &pos);
@@ -40,6 +41,10 @@ public:
 
     int GetNumLevelsInHierarchy();
 
+    // Gets dimensions of the grid of the quad trees covering the terrain
+    int GetNumRootNodesHorz(){return m_iNumRootNodesHorz;}
+    int GetNumRootNodesVert(){return m_iNumRootNodesVert;}
+
     // Gets number of levels in single patch quad tree
     // If patch size is 128x128, then its quad tree consists of 8 level
     int GetNumLevelsInLocalPatchQT(){return m_iNumLevelsInPatchQuadTree;}
@@ -57,7 +62,8 @@ public:
     // Loads the data from file
     HRESULT LoadFromFile(LPCTSTR FilePath);
 
-    // Builds adaptive triangulation for the specified patch
+    // Builds adaptive triangulation for the specified patch. Child triangulations may be NULL. If they are
+    // built by this method from the same data source, vertices disabled in the children are not tested
     CRQTTriangulation* CreateAdaptiveTriangulation(class CPatchElevationData *pElevData,
                                      class CRQTTriangulation *pLBChildTriangulation,
                                      class CRQTTriangulation *pRBChildTriangulation,
@@ -67,8 +73,20 @@ public:
                                      float &fTriangulationError,
                                      UINT &uiNumTriangles);
 
+    // Measures throughput of the triangle error kernels on the finest level patches of the
+    // data source and appends it to the statistics file
+    void BenchmarkTriangleErrorKernels(class CElevationDataSource *pDataSource, LPCTSTR strStatFile);
+
+    // Measures throughput of decoding the triangulations of the data source and generating their
+    // index lists and appends it to the statistics file
+    void BenchmarkTriangulationDecoding(LPCTSTR strStatFile);
+
 private:
+    // Maximal number of quad trees along one side of the terrain accepted from the file
+    enum {MAX_ROOT_NODES = 1 << 16};
+
     int m_iNumLevelsInHierarchy, m_iNumLevelsInPatchQuadTree;
+    int m_iNumRootNodesHorz, m_iNumRootNodesVert;
     float m_fFinestLevelTriangErrorThreshold;
 
     struct SRQTTriangInfo
@@ -55,7 +55,8 @@ HRESULT CAdaptiveModelDX11Render::Init(const SRenderingParams &Params,
     hr = __super::Init(Params, pDataSource, pTriangDataSource);
     CHECK_HR_RET(hr, _T("CBlockBasedAdaptiveModel::Init() failed"));
     
-    // Initialize common data for all patches
+    // Initialize common data for all patches. Normal maps baked for the previous terrain are not used
+    m_pNormalMapPyramid.reset();
     m_pPatchCommon.reset( 
         new CDX11PatchesCommon(m_Params.m_fElevationSamplingInterval,
                                m_Params.m_fElevationScale,
@@ -90,7 +91,7 @@ HRESULT CAdaptiveModelDX11Render::Init(const SRenderingParams &Params,
 // The method hierarchically traverses the tree and updates all device resources
 void CAdaptiveModelDX11Render::RecursiveUpdateDeviceResources(CPatchQuadTreeNode &PatchNode)
 {
-    if( PatchNode.GetPos().level > 0 )
+    if( PatchNode.GetData().pPatch.get() )
     {
         // Update resource of the current patch
         HRESULT hr = PatchNode.GetData().pPatch->UpdateDeviceResources();
@@ -111,7 +112,8 @@ void CAdaptiveModelDX11Render::RecursiveUpdateDeviceResources(CPatchQuadTreeNode
 // The method hierarchically traverses the tree and create all D3D device resources
 void CAdaptiveModelDX11Render::RecursiveCreateD3D11PatchResources(CPatchQuadTreeNode &PatchNode)
 {
-    if( PatchNode.GetPos().level > 0 )
+    // Nodes in the padded area of the height map have no patches
+    if( PatchNode.GetPos().level > 0 && PatchNode.GetData().BoundBox.bIsBoxValid )
     {
         // Create resource for the current patch
         CreatePatchForNode(PatchNode, PatchNode.GetData().m_pElevData.get(), PatchNode.GetData().m_pAdaptiveTriangulation.get());
@@ -397,8 +399,11 @@ HRESULT CAdaptiveModelDX11Render::OnD3D11CreateDevice( ID3D11Device* pd3dDevice,
     CHECK_HR_RET(hr, _T("Failed to create patch common device objects"));
 
     // Create and udpate all resources in the tree
-    RecursiveCreateD3D11PatchResources(m_PatchQuadTreeRoot);
-    RecursiveUpdateDeviceResources(m_PatchQuadTreeRoot);
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+    {
+        RecursiveCreateD3D11PatchResources(*m_PatchQuadTreeRoots[iRoot]);
+        RecursiveUpdateDeviceResources(*m_PatchQuadTreeRoots[iRoot]);
+    }
 
     // Create vertex input layout for bounding box buffer
     const D3D11_INPUT_ELEMENT_DESC layout[] =
@@ -457,6 +462,99 @@ std::auto_ptr<CTerrainPatch> CAdaptiveModelDX11Render::CreatePatch(class CPatchE
                 new CTerrainPatch(m_pPatchCommon.get(), pPatchElevData, pAdaptiveTriangulation) );
 }
 
+// Discards the baked normal maps of the patches affected by the region
+void CAdaptiveModelDX11Render::OnRegionUpdated(int iStartCol, int iEndCol, int iStartRow, int iEndRow)
+{
+    if( !m_pNormalMapPyramid.get() )
+        return;
+    // Normal maps are generated from the patch height maps, so they depend on the same samples
+    for(int iLevel = 1; iLevel < m_iNumLevelsInPatchHierarchy; iLevel++)
+    {
+        int iStartHorz, iEndHorz, iStartVert, iEndVert;
+        m_pDataSource->GetPatchesAffectedByRegion(iLevel, iStartCol, iEndCol, iStartRow, iEndRow, iStartHorz, iEndHorz, iStartVert, iEndVert);
+        for(int iVert = iStartVert; iVert < iEndVert; iVert++)
+            for(int iHorz = iStartHorz; iHorz < iEndHorz; iHorz++)
+                m_pNormalMapPyramid->DiscardNode( SQuadTreeNodeLocation(iHorz, iVert, iLevel) );
+    }
+}
+
+// Returns parameters of the normal maps baked for the current terrain and rendering parameters
+HRESULT CAdaptiveModelDX11Render::GetNormalMapPyramidDesc(CNormalMapPyramid::SDesc &Desc)const
+{
+    memset(&Desc, 0, sizeof(Desc));
+    HRESULT hr = m_pDataSource->GetDEMHash(Desc.DEMHash);
+    if( FAILED(hr) )
+        return hr;
+    Desc.uiNumLevels = m_iNumLevelsInPatchHierarchy;
+    Desc.uiNumRootNodesHorz = m_iNumRootNodesHorz;
+    Desc.uiNumRootNodesVert = m_iNumRootNodesVert;
+    Desc.uiPatchSize = m_iPatchSize;
+    Desc.uiNormalMapLODBias = m_RenderParams.m_iNormalMapLODBias;
+    Desc.uiNumMips = CTerrainPatch::NORMAL_MAP_MIPS;
+    Desc.bCompressed = m_RenderParams.m_bCompressNormalMap;
+    Desc.fElevationSampleSpacing = m_Params.m_fElevationSamplingInterval;
+    Desc.fElevationScale = m_Params.m_fElevationScale;
+    return S_OK;
+}
+
+// Opens the file of the normal maps baked for the static terrain
+HRESULT CAdaptiveModelDX11Render::OpenNormalMapPyramid(LPCTSTR strFilePath)
+{
+    m_pPatchCommon->SetNormalMapPyramid(NULL);
+    m_pNormalMapPyramid.reset( new CNormalMapPyramid );
+    CNormalMapPyramid::SDesc Desc;
+    HRESULT hr = GetNormalMapPyramidDesc(Desc);
+    if( SUCCEEDED(hr) )
+        hr = m_pNormalMapPyramid->Open(strFilePath, Desc);
+    if( FAILED(hr) )
+    {
+        m_pNormalMapPyramid.reset();
+        return hr;
+    }
+    m_pPatchCommon->SetNormalMapPyramid(m_pNormalMapPyramid.get());
+    return S_OK;
+}
+
+// Bakes the normal maps of all patches, which may be created, into the file and opens it
+HRESULT CAdaptiveModelDX11Render::ConstructNormalMapPyramid(LPCTSTR strFilePath)
+{
+    // The file being rewritten must not be mapped
+    m_pPatchCommon->SetNormalMapPyramid(NULL);
+    m_pNormalMapPyramid.reset();
+
+    CNormalMapPyramid::SDesc Desc;
+    HRESULT hr = GetNormalMapPyramidDesc(Desc);
+    CHECK_HR_RET(hr, _T("Normal map pyramid requires the source DEM to validate the file"));
+    hr = CNormalMapPyramid::CreatePyramidFile(strFilePath, Desc, this);
+    CHECK_HR_RET(hr, _T("Failed to create normal map pyramid file %s"), strFilePath);
+
+    return OpenNormalMapPyramid(strFilePath);
+}
+
+// Patches are created for the nodes below the root, whose ancestors are refined
+size_t CAdaptiveModelDX11Render::GetNormalMapDataSize(const SQuadTreeNodeLocation &Pos)
+{
+    if( Pos.level == 0 || m_pDataSource->IsPatchInPaddedArea(Pos) )
+        return 0;
+    if( Pos.level > 1 && !m_pDataSource->HasFinerData(GetParentLocation(Pos)) )
+        return 0;
+    return CTerrainPatch::GetNormalMapDataSize(m_pPatchCommon.get(), m_iPatchSize, m_pDataSource->GetHighResDataLODBias(Pos.level));
+}
+
+HRESULT CAdaptiveModelDX11Render::GenerateNormalMap(const SQuadTreeNodeLocation &Pos, BYTE *pNormalMapData)
+{
+    // Patch data are not available if the height map store failed to read them
+    std::auto_ptr<CPatchElevationData> pElevData( m_pDataSource->GetElevData(Pos) );
+    if( !pElevData.get() )
+        return E_FAIL;
+    std::vector<BYTE> NormalMapData, NormalMapDataBC3;
+    const BYTE *pGeneratedData = CTerrainPatch::GenerateNormalMap(m_pPatchCommon.get(), pElevData.get(), NormalMapData, NormalMapDataBC3);
+    if( !pGeneratedData )
+        return E_FAIL;
+    memcpy(pNormalMapData, pGeneratedData, CTerrainPatch::GetNormalMapDataSize(m_pPatchCommon.get(), m_iPatchSize, pElevData->GetHighResDataLODBias()));
+    return S_OK;
+}
+
 // The method hierarchically traverses the tree and releases all D3D device resources
 void CAdaptiveModelDX11Render::RecursiveDestroyD3D11PatchResources(CPatchQuadTreeNode &PatchNode)
 {
@@ -483,7 +581,8 @@ void CAdaptiveModelDX11Render::OnD3D11DestroyDevice( )
 {
     WaitForAsyncTasks();
 
-    RecursiveDestroyD3D11PatchResources(m_PatchQuadTreeRoot);
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+        RecursiveDestroyD3D11PatchResources(*m_PatchQuadTreeRoots[iRoot]);
 
     m_pElevationColorsSRV.Release();
     m_pRenderEffect11.Release();
@@ -649,22 +748,25 @@ int CAdaptiveModelDX11Render::RenderPatches(const D3DXMATRIX &WorldViewProjMatr,
 
 // Method renders terrain mini map
 void CAdaptiveModelDX11Render::RenderTerrainMap(const D3DXVECTOR4 &ScreenPos,
-                                                SPatchRenderingInfo pLevel1Patches[4])
+                                                const std::vector<SPatchRenderingInfo> &Level1Patches)
 {
     m_pd3dDeviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
-    // Use 4 patches at the coarsest resolution level to render the map
-    for(int iLevel1Patch = 0; iLevel1Patch < 4; iLevel1Patch++)
+    // The map keeps the aspect ratio of the terrain: the longer side of the 
+    // grid of quad trees spans the whole map
+    float fPatchMapSize = 1.f / (float)(max(m_iNumRootNodesHorz, m_iNumRootNodesVert) << 1);
+    // Use patches at the coarsest resolution level to render the map
+    for(size_t iLevel1Patch = 0; iLevel1Patch < Level1Patches.size(); iLevel1Patch++)
     {
-        if(pLevel1Patches[iLevel1Patch].pPatch)
+        if(Level1Patches[iLevel1Patch].pPatch)
         {
-            CTerrainPatch *pDX11Wrpr = pLevel1Patches[iLevel1Patch].pPatch;
+            CTerrainPatch *pDX11Wrpr = Level1Patches[iLevel1Patch].pPatch;
             m_RenderEffectVars.m_pevElevationMap->SetResource( pDX11Wrpr->GetElevDataSRV() );
             // Set patch screen location
             D3DXVECTOR4 ScrPos;
-            ScrPos.x = ScreenPos.x + ((iLevel1Patch & 0x01) ? ScreenPos.z/2.f : 0.f);
-            ScrPos.y = ScreenPos.y - ScreenPos.w + ((iLevel1Patch >> 0x01) ? ScreenPos.w/2.f : 0.f);
-            ScrPos.z = ScreenPos.z/2.f;
-            ScrPos.w = ScreenPos.w/2.f;
+            ScrPos.x = ScreenPos.x + (float)pDX11Wrpr->m_pos.horzOrder * ScreenPos.z * fPatchMapSize;
+            ScrPos.y = ScreenPos.y - ScreenPos.w + (float)pDX11Wrpr->m_pos.vertOrder * ScreenPos.w * fPatchMapSize;
+            ScrPos.z = ScreenPos.z * fPatchMapSize;
+            ScrPos.w = ScreenPos.w * fPatchMapSize;
             m_RenderEffectVars.m_pevTerrainMapPos_PS->SetFloatVector(ScrPos);
             m_RenderEffectVars.m_pevRenderHeightMapPreview_FL10->GetPassByIndex(0)->Apply(0, m_pd3dDeviceContext);
             // Render
@@ -781,18 +883,25 @@ void CAdaptiveModelDX11Render::RenderQuadTreePreview(ID3D11DeviceContext* pd3dIm
     QuadTreePreviewPos_PS.z *= 2.f;
     QuadTreePreviewPos_PS.w *= 2.f;
         
-    const CPatchQuadTreeNode *pRoot = m_OptimalPatchesList[0].pPatchQuadTreeNode;
-    for(; pRoot->GetAncestor(); pRoot = pRoot->GetAncestor());
-    const CPatchQuadTreeNode *pLevel1Patches[4] = {NULL};
-    pRoot->GetDescendants(pLevel1Patches[0], pLevel1Patches[1], pLevel1Patches[2], pLevel1Patches[3]);
-    if(pLevel1Patches[0] && pLevel1Patches[1] && pLevel1Patches[2] && pLevel1Patches[3])
+    std::vector<SPatchRenderingInfo> Lvl1PtchRndrInfo;
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
     {
-        SPatchRenderingInfo pLvl1PtchRndrInfo[4];
-        for(int i=0; i<4; i++)
-            pLvl1PtchRndrInfo[i].pPatch = pLevel1Patches[i]->GetData().pPatch.get();
-        // Render small terrain map
-        RenderTerrainMap(QuadTreePreviewPos_PS, pLvl1PtchRndrInfo);
+        const CPatchQuadTreeNode *pLevel1Patches[4] = {NULL};
+        m_PatchQuadTreeRoots[iRoot]->GetDescendants(pLevel1Patches[0], pLevel1Patches[1], pLevel1Patches[2], pLevel1Patches[3]);
+        if(pLevel1Patches[0] && pLevel1Patches[1] && pLevel1Patches[2] && pLevel1Patches[3])
+        {
+            for(int i=0; i<4; i++)
+            {
+                SPatchRenderingInfo Lvl1PtchInfo = {pLevel1Patches[i]->GetData().pPatch.get()};
+                Lvl1PtchRndrInfo.push_back(Lvl1PtchInfo);
+            }
+        }
     }
+    // Render small terrain map
+    RenderTerrainMap(QuadTreePreviewPos_PS, Lvl1PtchRndrInfo);
+
+    // Patch locations are normalized by the longer side of the grid of quad trees
+    int iNumRootNodesAlongMapSide = max(m_iNumRootNodesHorz, m_iNumRootNodesVert);
 
     D3D11_MAPPED_SUBRESOURCE MappedData;
     pd3dImmediateContext->Map( m_pBoundBoxInstBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &MappedData );
@@ -809,8 +918,9 @@ void CAdaptiveModelDX11Render::RenderQuadTreePreview(ID3D11DeviceContext* pd3dIm
         int iVertOrder = patchIt->pPatchQuadTreeNode->GetPos().vertOrder;
         int iLevel = patchIt->pPatchQuadTreeNode->GetPos().level;
 
-        pBoundBox[iOptimalPatchNum].vMin = D3DXVECTOR3( (float) iHorzOrder   /(float)(1<<iLevel), 0, (float)iVertOrder    /(float)(1<<iLevel) );
-        pBoundBox[iOptimalPatchNum].vMax = D3DXVECTOR3( (float)(iHorzOrder+1)/(float)(1<<iLevel), 0, (float)(iVertOrder+1)/(float)(1<<iLevel) );
+        float fLevelDim = (float)(iNumRootNodesAlongMapSide<<iLevel);
+        pBoundBox[iOptimalPatchNum].vMin = D3DXVECTOR3( (float) iHorzOrder   /fLevelDim, 0, (float)iVertOrder    /fLevelDim );
+        pBoundBox[iOptimalPatchNum].vMax = D3DXVECTOR3( (float)(iHorzOrder+1)/fLevelDim, 0, (float)(iVertOrder+1)/fLevelDim );
         unsigned long color;
 
         if( patchIt->bIsPatchVisible )
@@ -0,0 +1,129 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "AsyncFileReader.h"
+
+CAsyncFileReader::CAsyncFileReader() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hCompletionPort(NULL),
+    m_lNumPendingReads(0)
+{
+}
+
+CAsyncFileReader::~CAsyncFileReader()
+{
+    Close();
+}
+
+// Opens the file for overlapped reads
+HRESULT CAsyncFileReader::Open(LPCTSTR strFilePath)
+{
+    Close();
+
+    m_hFile = CreateFile(strFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if( m_hFile == INVALID_HANDLE_VALUE )
+        return E_FAIL;
+
+    // Completions are only dequeued by ProcessCompletedReads(), so no concurrency is required
+    m_hCompletionPort = CreateIoCompletionPort(m_hFile, NULL, 0, 1);
+    if( m_hCompletionPort == NULL )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+void CAsyncFileReader::Close()
+{
+    if( m_hFile != INVALID_HANDLE_VALUE )
+    {
+        CancelIoEx(m_hFile, NULL);
+        WaitForPendingReads();
+        CloseHandle(m_hFile);
+    }
+    m_hFile = INVALID_HANDLE_VALUE;
+    if( m_hCompletionPort != NULL )
+        CloseHandle(m_hCompletionPort);
+    m_hCompletionPort = NULL;
+}
+
+// Waits for all pending reads and releases their requests
+void CAsyncFileReader::WaitForPendingReads()
+{
+    while( m_lNumPendingReads > 0 )
+    {
+        DWORD dwBytesRead = 0;
+        ULONG_PTR CompletionKey = 0;
+        OVERLAPPED *pOverlapped = NULL;
+        GetQueuedCompletionStatus(m_hCompletionPort, &dwBytesRead, &CompletionKey, &pOverlapped, INFINITE);
+        if( pOverlapped == NULL )
+            break;
+        delete reinterpret_cast<SReadRequest*>(pOverlapped);
+        InterlockedDecrement(&m_lNumPendingReads);
+    }
+}
+
+// Starts reading dwSize bytes at the Offset to the buffer
+HRESULT CAsyncFileReader::BeginRead(UINT64 Offset, void *pBuffer, DWORD dwSize, UINT64 RequestKey)
+{
+    if( m_hFile == INVALID_HANDLE_VALUE )
+        return E_FAIL;
+    if( InterlockedIncrement(&m_lNumPendingReads) > MAX_PENDING_READS )
+    {
+        InterlockedDecrement(&m_lNumPendingReads);
+        return E_PENDING;
+    }
+
+    SReadRequest *pRequest = new SReadRequest;
+    memset(&pRequest->Overlapped, 0, sizeof(pRequest->Overlapped));
+    pRequest->Overlapped.Offset = (DWORD)(Offset & 0xFFFFFFFF);
+    pRequest->Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    pRequest->RequestKey = RequestKey;
+    pRequest->dwSize = dwSize;
+    // The completion is queued to the port even if the read completes synchronously
+    if( !ReadFile(m_hFile, pBuffer, dwSize, NULL, &pRequest->Overlapped) && GetLastError() != ERROR_IO_PENDING )
+    {
+        delete pRequest;
+        InterlockedDecrement(&m_lNumPendingReads);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+// Passes the completed reads to the handler without waiting for the pending ones
+UINT CAsyncFileReader::ProcessCompletedReads(IAsyncReadHandler *pHandler)
+{
+    UINT uiNumProcessed = 0;
+    while( m_lNumPendingReads > 0 )
+    {
+        DWORD dwBytesRead = 0;
+        ULONG_PTR CompletionKey = 0;
+        OVERLAPPED *pOverlapped = NULL;
+        BOOL bSucceeded = GetQueuedCompletionStatus(m_hCompletionPort, &dwBytesRead, &CompletionKey, &pOverlapped, 0);
+        // NULL overlapped structure means that there are no more completions
+        if( pOverlapped == NULL )
+            break;
+
+        std::auto_ptr<SReadRequest> pRequest( reinterpret_cast<SReadRequest*>(pOverlapped) );
+        InterlockedDecrement(&m_lNumPendingReads);
+        HRESULT hr = (bSucceeded && dwBytesRead == pRequest->dwSize) ? S_OK : E_FAIL;
+        pHandler->OnReadCompleted(pRequest->RequestKey, hr);
+        uiNumProcessed++;
+    }
+    return uiNumProcessed;
+}
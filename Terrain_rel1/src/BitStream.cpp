@@ -18,6 +18,10 @@
 
 CBitStream::CBitStream(void) : 
     m_AccessMode(BIT_STREAM_ACCESS_MODE_UNDEFINED),
+    m_NextByte(0),
+    m_BitBuffer(0),
+    m_iNumBufferedBits(0),
+    total_bits(0),
     MaxBits(0)
 {
 }
@@ -31,8 +35,9 @@ void CBitStream::StartReading()
 {
     assert(m_AccessMode == BIT_STREAM_ACCESS_MODE_UNDEFINED);
     total_bits = MaxBits;
-    m_CurrentByteIter = m_BitSequence.begin();
-    m_iBitsLeftInCurrByte = 0;
+    m_NextByte = 0;
+    m_BitBuffer = 0;
+    m_iNumBufferedBits = 0;
     m_AccessMode = BIT_STREAM_ACCESS_MODE_READING;
 }
 
@@ -41,8 +46,8 @@ void CBitStream::StartWriting()
 {
     assert(m_AccessMode == BIT_STREAM_ACCESS_MODE_UNDEFINED);
     m_BitSequence.clear();
-    m_iBitsLeftInCurrByte = 8;
-    m_CurrentByte = 0;
+    m_BitBuffer = 0;
+    m_iNumBufferedBits = 0;
     total_bits = 0;
     MaxBits = 0;
     m_AccessMode = BIT_STREAM_ACCESS_MODE_WRITING;
@@ -51,10 +56,15 @@ void CBitStream::StartWriting()
 void CBitStream::FinishWriting()
 {
     m_AccessMode = BIT_STREAM_ACCESS_MODE_UNDEFINED;
-    if( m_iBitsLeftInCurrByte < 8 )
+    // Output the remaining bits. The last byte is padded with zeroes
+    while( m_iNumBufferedBits > 0 )
     {
-        m_BitSequence.push_back( (BYTE)(m_CurrentByte >> m_iBitsLeftInCurrByte) );
+        m_BitSequence.push_back( (BYTE)m_BitBuffer );
+        m_BitBuffer >>= 8;
+        m_iNumBufferedBits -= 8;
     }
+    m_BitBuffer = 0;
+    m_iNumBufferedBits = 0;
     MaxBits = total_bits;
 }
 
@@ -63,11 +73,49 @@ void CBitStream::FinishReading()
     m_AccessMode = BIT_STREAM_ACCESS_MODE_UNDEFINED;
 }
 
+void CBitStream::RefillReadBuffer()
+{
+    // Buffer contains less than 32 bits, so at least 4 bytes fit into it
+    size_t BytesLeft = m_BitSequence.size() - m_NextByte;
+    if( BytesLeft >= 8 )
+    {
+        // Fast path: 8 bytes are loaded at once and the whole ones, which fit into the buffer, are consumed.
+        // The bits of the next byte, which do not fit, are the same as when the byte is loaded
+        UINT64 uiWord = 0;
+        const BYTE *pBytes = &m_BitSequence[m_NextByte];
+        for(int iByte = 0; iByte < 8; iByte++)
+            uiWord |= (UINT64)pBytes[iByte] << (iByte*8);
+        int iNumBytes = (64 - m_iNumBufferedBits) >> 3;
+        m_BitBuffer |= uiWord << m_iNumBufferedBits;
+        m_NextByte += iNumBytes;
+        m_iNumBufferedBits += iNumBytes*8;
+    }
+    else
+    {
+        while( m_iNumBufferedBits <= 56 && m_NextByte < m_BitSequence.size() )
+        {
+            m_BitBuffer |= (UINT64)m_BitSequence[m_NextByte++] << m_iNumBufferedBits;
+            m_iNumBufferedBits += 8;
+        }
+    }
+}
+
+void CBitStream::FlushWriteBuffer()
+{
+    size_t SequenceSize = m_BitSequence.size();
+    m_BitSequence.resize(SequenceSize + 4);
+    for(int iByte = 0; iByte < 4; iByte++)
+        m_BitSequence[SequenceSize + iByte] = (BYTE)(m_BitBuffer >> (iByte*8));
+    m_BitBuffer >>= 32;
+    m_iNumBufferedBits -= 32;
+}
+
 const CBitStream& CBitStream::operator = (const CBitStream &BS)
 {
     m_BitSequence = BS.m_BitSequence;
-    m_CurrentByte = 0;
-    m_iBitsLeftInCurrByte = 0;
+    m_NextByte = 0;
+    m_BitBuffer = 0;
+    m_iNumBufferedBits = 0;
     total_bits = 0;
     MaxBits = BS.MaxBits;
 
@@ -107,6 +155,7 @@ void CBitStream::LoadFromFile(FILE *pInputFile)
     }
     
     total_bits = 0;
-    m_CurrentByte = 0;
-    m_iBitsLeftInCurrByte = 0;
+    m_NextByte = 0;
+    m_BitBuffer = 0;
+    m_iNumBufferedBits = 0;
 }
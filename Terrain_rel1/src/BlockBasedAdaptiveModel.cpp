@@ -79,6 +79,16 @@ void STDMETHODCALLTYPE CIncreaseLODTask::Execute()
     // Do all work required to refine the model
     for(int iChildNum = 0; iChildNum < 4; iChildNum++)
     {
+        CPatchQuadTreeNode &CurrChildNode = *m_pFloatingDescendantNodes[iChildNum];
+        m_pBlockBasedModel->CalculatePatchBoundingBox( CurrChildNode.GetPos(), m_pDataSource, CurrChildNode.GetData().BoundBox);
+        CurrChildNode.GetData().m_fGuaranteedPatchErrorBound = m_pBlockBasedModel->CalculateGuaranteedPatchErrorBound( CurrChildNode.GetPos() );
+    }
+
+    for(int iChildNum = 0; iChildNum < 4; iChildNum++)
+    {
+        // Patches in the padded area of the height map are not created
+        if( !m_pFloatingDescendantNodes[iChildNum]->GetData().BoundBox.bIsBoxValid )
+            continue;
         // Get child height maps
         m_pFloatingDescendantNodes[iChildNum]->GetData().m_pElevData.reset( m_pDataSource->GetElevData( m_pFloatingDescendantNodes[iChildNum]->GetPos() ) );
     }
@@ -88,6 +98,8 @@ void STDMETHODCALLTYPE CIncreaseLODTask::Execute()
         // Get triangulations
         for(int iChildNum = 0; iChildNum < 4; iChildNum++)
         {
+            if( !m_pFloatingDescendantNodes[iChildNum]->GetData().BoundBox.bIsBoxValid )
+                continue;
             m_pFloatingDescendantNodes[iChildNum]->GetData().m_pAdaptiveTriangulation.reset(
                     m_pTriangDataSource->DecodeTriangulation( m_pFloatingDescendantNodes[iChildNum]->GetPos() ) );
         }
@@ -97,17 +109,12 @@ void STDMETHODCALLTYPE CIncreaseLODTask::Execute()
     for(int iChildNum = 0; iChildNum < 4; iChildNum++)
     {
         CPatchQuadTreeNode &CurrChildNode = *m_pFloatingDescendantNodes[iChildNum];
+        if( !CurrChildNode.GetData().BoundBox.bIsBoxValid )
+            continue;
 
         CurrChildNode.GetData().pPatch = 
             m_pBlockBasedModel->CreatePatch( CurrChildNode.GetData().m_pElevData.get(), 
                                              CurrChildNode.GetData().m_pAdaptiveTriangulation.get() );
-
-        float fPatchElevDataErrorBound = m_pDataSource->GetPatchElevDataErrorBound(CurrChildNode.GetPos()) * m_pBlockBasedModel->m_Params.m_fElevationScale;
-        float fTriangulationError = 0.f;
-        if( m_pTriangDataSource )
-            fTriangulationError = m_pTriangDataSource->GetTriangulationErrorBound(CurrChildNode.GetPos());
-        CurrChildNode.GetData().m_fGuaranteedPatchErrorBound = (fPatchElevDataErrorBound + fTriangulationError) * m_pBlockBasedModel->m_Params.m_fElevationScale ;
-        m_pBlockBasedModel->CalculatePatchBoundingBox( CurrChildNode.GetPos(), m_pDataSource, CurrChildNode.GetData().BoundBox);
     }
 	m_bTaskComplete = true;
 }
@@ -140,7 +147,9 @@ void STDMETHODCALLTYPE CDecreaseLODTask::Execute()
 ///////////////////////////////////////////////////////////////////////////////
 
 CBlockBasedAdaptiveModel::CBlockBasedAdaptiveModel(void) : 
-    m_iTotalTrianglesRendered(0)
+    m_iTotalTrianglesRendered(0),
+    m_iNumRootNodesHorz(0),
+    m_iNumRootNodesVert(0)
 {
     D3DXMATRIX mDummyProj;
     D3DXMatrixIdentity(&mDummyProj);
@@ -151,6 +160,7 @@ CBlockBasedAdaptiveModel::~CBlockBasedAdaptiveModel(void)
 {
     // Task manager must be destroyed after all tasks are completed!
     gTaskMgr.Shutdown();
+    DestroyQuadTreeRoots();
 }
 
 HRESULT CBlockBasedAdaptiveModel::Init(const SRenderingParams &Params,
@@ -172,8 +182,15 @@ HRESULT CBlockBasedAdaptiveModel::Init(const SRenderingParams &Params,
             CHECK_HR_RET(E_FAIL, _T("Number of levels in compressed elevation data (%d) is not equal to the number of levels in triangulation data source(%d)"),  m_iNumLevelsInPatchHierarchy, m_pTriangDataSource->GetNumLevelsInHierarchy() );
         if( m_iPatchSize != m_pTriangDataSource->GetPatchSize() )
             CHECK_HR_RET(E_FAIL, _T("Patch size in compressed elevation data (%d) is not equal to the patch size in triangulation data source(%d)"),  m_iPatchSize, m_pTriangDataSource->GetPatchSize() );
+        if( m_pDataSource->GetNumRootNodesHorz() != m_pTriangDataSource->GetNumRootNodesHorz() ||
+            m_pDataSource->GetNumRootNodesVert() != m_pTriangDataSource->GetNumRootNodesVert() )
+            CHECK_HR_RET(E_FAIL, _T("Grid of quad trees in elevation data (%dx%d) is not equal to the grid in triangulation data source(%dx%d)"),  
+                         m_pDataSource->GetNumRootNodesHorz(), m_pDataSource->GetNumRootNodesVert(), 
+                         m_pTriangDataSource->GetNumRootNodesHorz(), m_pTriangDataSource->GetNumRootNodesVert() );
     }
 
+    CreateQuadTreeRoots();
+
     // Initialize the model in coarsest state
     RestartAdaptiveModel();
 
@@ -211,9 +228,17 @@ void CBlockBasedAdaptiveModel::CalculatePatchBoundingBox(const SQuadTreeNodeLoca
     PatchBoundingBox.fMinY = fMinY * fHeightFieldSpacing;
     PatchBoundingBox.fMaxY = fMaxY * fHeightFieldSpacing;
 
-    // Get patch min/max height
+    // Get patch min/max height. Patches in the padded area have no elevation data
+    // and are never rendered, so their boxes are only kept well-formed
     UINT16 MinZ, MaxZ;
-	pElev->GetPatchMinMaxElevation(pos, MinZ, MaxZ);
+    bool bIsPatchInPaddedArea = pElev->IsPatchInPaddedArea(pos);
+    if( bIsPatchInPaddedArea )
+    {
+        MinZ = pElev->GetGlobalMinElevation();
+        MaxZ = pElev->GetGlobalMaxElevation();
+    }
+    else
+	    pElev->GetPatchMinMaxElevation(pos, MinZ, MaxZ);
     PatchBoundingBox.fMinZ = (float)MinZ * m_Params.m_fElevationScale;
     PatchBoundingBox.fMaxZ = (float)MaxZ * m_Params.m_fElevationScale;
 
@@ -224,7 +249,16 @@ void CBlockBasedAdaptiveModel::CalculatePatchBoundingBox(const SQuadTreeNodeLoca
         std::swap( PatchBoundingBox.fMaxY, PatchBoundingBox.fMaxZ );
     }
 
-    PatchBoundingBox.bIsBoxValid = true;
+    PatchBoundingBox.bIsBoxValid = !bIsPatchInPaddedArea;
+}
+
+float CBlockBasedAdaptiveModel::CalculateGuaranteedPatchErrorBound(const SQuadTreeNodeLocation &pos)const
+{
+    float fPatchElevDataErrorBound = m_pDataSource->GetPatchElevDataErrorBound(pos) * m_Params.m_fElevationScale;
+    float fTriangulationError = 0.f;
+    if( m_pTriangDataSource )
+        fTriangulationError = m_pTriangDataSource->GetTriangulationErrorBound(pos);
+    return (fPatchElevDataErrorBound + fTriangulationError) * m_Params.m_fElevationScale;
 }
 
 static float GetDistanceToBox(const SPatchBoundingBox &BoundBox, 
@@ -518,7 +552,8 @@ void CBlockBasedAdaptiveModel::RecursiveDetermineOptimalPatches(CPatchQuadTreeNo
 
 			    for( int iChild = 0; iChild < 4; iChild++ )
                 {
-				    descendantNodes[iChild]->GetData().pPatch->UpdateDeviceResources();
+                    if( descendantNodes[iChild]->GetData().pPatch.get() )
+				        descendantNodes[iChild]->GetData().pPatch->UpdateDeviceResources();
                 }
 
 			    PatchNode.CreateDescendants(descendantNodes[0], descendantNodes[1], descendantNodes[2], descendantNodes[3]);
@@ -542,15 +577,26 @@ void CBlockBasedAdaptiveModel::RecursiveDetermineOptimalPatches(CPatchQuadTreeNo
 	    }
 	    else
 	    {
+            // Root patches are always refined. Other patches are refined only if the data
+            // source has finer data for them
 		    if( iLevel < m_iNumLevelsInPatchHierarchy - 1 &&
-			    ( iLevel == 0 || data.m_fPatchScrSpaceError > m_Params.m_fScrSpaceErrorBound ) )
+			    ( iLevel == 0 || (data.m_fPatchScrSpaceError > m_Params.m_fScrSpaceErrorBound && m_pDataSource->HasFinerData(PatchNode.GetPos())) ) )
 		    {
-			    std::auto_ptr<CPatchQuadTreeNode> pDescendants[4];
-			    PatchNode.CreateFloatingDescendants(pDescendants[0], pDescendants[1], pDescendants[2], pDescendants[3]);
-                data.m_pIncreaseLODTask.reset( new CIncreaseLODTask(pDescendants, m_pDataSource, m_pTriangDataSource, this) );
-			    if( !AddTask(data.m_pIncreaseLODTask.get()) )
-                    // If task failed to create, release it and repeat attempt next time
-                    data.m_pIncreaseLODTask.reset();
+                // Reads of the data of all children are started before the task is created,
+                // so that the worker threads do not wait for the storage. If the data is not
+                // resident yet, the attempt is repeated next time
+                bool bDataResident = true;
+                for(int iChild = 0; iChild < 4; iChild++)
+                    bDataResident = m_pDataSource->PrefetchElevData( GetChildLocation(PatchNode.GetPos(), iChild) ) && bDataResident;
+                if( bDataResident )
+                {
+			        std::auto_ptr<CPatchQuadTreeNode> pDescendants[4];
+			        PatchNode.CreateFloatingDescendants(pDescendants[0], pDescendants[1], pDescendants[2], pDescendants[3]);
+                    data.m_pIncreaseLODTask.reset( new CIncreaseLODTask(pDescendants, m_pDataSource, m_pTriangDataSource, this) );
+			        if( !AddTask(data.m_pIncreaseLODTask.get()) )
+                        // If task failed to create, release it and repeat attempt next time
+                        data.m_pIncreaseLODTask.reset();
+                }
 		    }
 		    AddPatchToOptimalPatchesList( &PatchNode );
 	    }
@@ -565,9 +611,17 @@ void CBlockBasedAdaptiveModel::UpdateModel(const D3DXVECTOR3 &vCameraPosition,
     m_CameraViewMatrix = CameraViewMatrix;
     D3DXMatrixMultiply(&m_CameraViewProjMatrix, &m_CameraViewMatrix, &m_CameraProjMatrix); 
     ExtractViewFrustumPlanesFromMatrix(m_CameraViewProjMatrix, m_CameraViewFrustum);
+    // Move the data of the completed asynchronous reads into the height map store
+    m_pDataSource->ProcessAsyncReads();
+    // Recreate patches affected by the height map updates
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+        if( m_PatchQuadTreeRoots[iRoot]->GetData().m_bUpdateRequired )
+            RecursiveRecreateUpdatedPatches( *m_PatchQuadTreeRoots[iRoot] );
     // Clear optimal patches list
     m_OptimalPatchesList.clear();
-    RecursiveDetermineOptimalPatches( m_PatchQuadTreeRoot );
+    // Optimal patches of all trees go to the same list
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+        RecursiveDetermineOptimalPatches( *m_PatchQuadTreeRoots[iRoot] );
 }
 
 
@@ -584,15 +638,142 @@ void CBlockBasedAdaptiveModel::GetLastFrameComplexity( int &iOptimalPatchesCount
 }
 
 
-// Builds adaptive triangulations for the whole hierarchy
+// Data of the task set building the triangulations of the subtrees rooted at the same level
+struct CBlockBasedAdaptiveModel::STriangBuildTaskSetData
+{
+    CBlockBasedAdaptiveModel *pModel;
+    int iSubtreeLevel;
+    float fSubtreeTriangErrorThreshold;
+    std::vector<SQuadTreeNodeLocation> SubtreeRoots;
+    // Statistics and build time of each task
+    std::vector<TriangulationStatType> SubtreeStat;
+    std::vector<double> SubtreeBuildTime;
+    // Triangulations of the subtree roots indexed as the nodes of the subtree level.
+    // They are taken by the serial pass building the coarser levels
+    std::vector<CRQTTriangulation*> SubtreeTriangulations;
+    int iNumSubtreesHorz;
+};
+
+void CBlockBasedAdaptiveModel::BuildSubtreeTriangulationsTask(VOID* pvInfo, INT iContext, UINT uTaskId, UINT uTaskCount)
+{
+    STriangBuildTaskSetData &TaskSetData = *static_cast<STriangBuildTaskSetData*>(pvInfo);
+    CBlockBasedAdaptiveModel *pModel = TaskSetData.pModel;
+    const SQuadTreeNodeLocation &Pos = TaskSetData.SubtreeRoots[uTaskId];
+
+    LARGE_INTEGER PerfFreq, StartTick, EndTick;
+    QueryPerformanceFrequency( &PerfFreq );
+    QueryPerformanceCounter( &StartTick );
+
+    // Each task builds its own subtree and only encodes the triangulations of its nodes,
+    // so the encoded data do not depend on the order the tasks are executed in
+    TaskSetData.SubtreeStat[uTaskId].resize( pModel->m_iNumLevelsInPatchHierarchy );
+    std::auto_ptr<CPatchElevationData> pElevData( pModel->m_pDataSource->GetElevData(Pos) );
+    std::auto_ptr<CRQTTriangulation> pTriangulation;
+    pModel->RecursiveBuildPatchTriangulations(Pos, TaskSetData.fSubtreeTriangErrorThreshold, pElevData.get(), pTriangulation, TaskSetData.SubtreeStat[uTaskId], NULL);
+    TaskSetData.SubtreeTriangulations[Pos.horzOrder + Pos.vertOrder * TaskSetData.iNumSubtreesHorz] = pTriangulation.release();
+
+    QueryPerformanceCounter( &EndTick );
+    TaskSetData.SubtreeBuildTime[uTaskId] = (double)(EndTick.QuadPart - StartTick.QuadPart) / (double)PerfFreq.QuadPart;
+}
+
+// Builds adaptive triangulations for the whole hierarchy. Subtrees rooted at the level, which has
+// enough nodes to load all cores, are built in parallel. Coarser levels are then built on this thread
 void CBlockBasedAdaptiveModel::ConstructPatchAdaptiveTriangulations()
 {
     m_AdaptiveTriangulationStat.resize( m_iNumLevelsInPatchHierarchy );
 
     float fFinestLevelTriangErrorThreshold = m_pTriangDataSource->GetFinestLevelTriangErrorThreshold();
+    float fRootTriangErrorThreshold = fFinestLevelTriangErrorThreshold * (float)(1 << (m_iNumLevelsInPatchHierarchy-1));
+
+    SYSTEM_INFO SystemInfo;
+    GetSystemInfo(&SystemInfo);
+    int iNumCores = max((int)SystemInfo.dwNumberOfProcessors, 1);
+
+    LARGE_INTEGER PerfFreq, StartTick, EndTick;
+    QueryPerformanceFrequency( &PerfFreq );
+    QueryPerformanceCounter( &StartTick );
+
+    // Find the nodes visited by the serial traversal at the coarsest level, which gives several
+    // subtrees per core for load balancing. Subtrees differ in size when the data is sparse
+    const int SUBTREES_PER_CORE = 8;
+    STriangBuildTaskSetData TaskSetData;
+    TaskSetData.pModel = this;
+    TaskSetData.iSubtreeLevel = 0;
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+        TaskSetData.SubtreeRoots.push_back( m_PatchQuadTreeRoots[iRoot]->GetPos() );
+    while( TaskSetData.iSubtreeLevel < m_iNumLevelsInPatchHierarchy-1 &&
+           (TaskSetData.iSubtreeLevel == 0 || (int)TaskSetData.SubtreeRoots.size() < SUBTREES_PER_CORE * iNumCores) )
+    {
+        std::vector<SQuadTreeNodeLocation> ChildRoots;
+        for(size_t iNode = 0; iNode < TaskSetData.SubtreeRoots.size(); iNode++)
+        {
+            const SQuadTreeNodeLocation &Pos = TaskSetData.SubtreeRoots[iNode];
+            if( !AreChildTriangulationsBuilt(Pos) )
+                continue;
+            for(int iChild = 0; iChild < 4; iChild++)
+            {
+                SQuadTreeNodeLocation ChildPos = GetChildLocation(Pos, iChild);
+                if( !m_pDataSource->IsPatchInPaddedArea(ChildPos) )
+                    ChildRoots.push_back(ChildPos);
+            }
+        }
+        TaskSetData.SubtreeRoots.swap(ChildRoots);
+        TaskSetData.iSubtreeLevel++;
+    }
+
+    UINT uiNumSubtrees = (UINT)TaskSetData.SubtreeRoots.size();
+    double dTaskSetTime = 0, dTotalTaskTime = 0;
+    if( TaskSetData.iSubtreeLevel > 0 )
+    {
+        LARGE_INTEGER TaskSetStartTick, TaskSetEndTick;
+        QueryPerformanceCounter( &TaskSetStartTick );
+        TaskSetData.fSubtreeTriangErrorThreshold = fRootTriangErrorThreshold / (float)(1 << TaskSetData.iSubtreeLevel);
+        TaskSetData.SubtreeStat.resize(uiNumSubtrees);
+        TaskSetData.SubtreeBuildTime.resize(uiNumSubtrees);
+        TaskSetData.iNumSubtreesHorz = m_iNumRootNodesHorz << TaskSetData.iSubtreeLevel;
+        TaskSetData.SubtreeTriangulations.resize( (size_t)TaskSetData.iNumSubtreesHorz * (m_iNumRootNodesVert << TaskSetData.iSubtreeLevel), NULL );
+
+        TASKSETHANDLE hTaskSet;
+        if( uiNumSubtrees > 0 && gTaskMgr.CreateTaskSet(BuildSubtreeTriangulationsTask, &TaskSetData, uiNumSubtrees, NULL, 0, "Build triangulations", &hTaskSet) )
+        {
+            gTaskMgr.WaitForSet(hTaskSet);
+            gTaskMgr.ReleaseHandle(hTaskSet);
+        }
+        else
+        {
+            // Build the subtrees on this thread if the task set could not be created
+            for(UINT uiTask = 0; uiTask < uiNumSubtrees; uiTask++)
+                BuildSubtreeTriangulationsTask(&TaskSetData, 0, uiTask, uiNumSubtrees);
+        }
+        QueryPerformanceCounter( &TaskSetEndTick );
+        dTaskSetTime = (double)(TaskSetEndTick.QuadPart - TaskSetStartTick.QuadPart) / (double)PerfFreq.QuadPart;
+
+        for(UINT uiTask = 0; uiTask < uiNumSubtrees; uiTask++)
+        {
+            dTotalTaskTime += TaskSetData.SubtreeBuildTime[uiTask];
+            for(int iLevel = 0; iLevel < m_iNumLevelsInPatchHierarchy; iLevel++)
+            {
+                m_AdaptiveTriangulationStat[iLevel].m_llTotalTriangles += TaskSetData.SubtreeStat[uiTask][iLevel].m_llTotalTriangles;
+                m_AdaptiveTriangulationStat[iLevel].TotalCompressedDataSize += TaskSetData.SubtreeStat[uiTask][iLevel].TotalCompressedDataSize;
+            }
+        }
+    }
 
-    std::auto_ptr<CRQTTriangulation> pDummyTriang;
-    RecursiveBuildPatchTriangulations(SQuadTreeNodeLocation(), fFinestLevelTriangErrorThreshold * (float)(1 << (m_iNumLevelsInPatchHierarchy-1)), NULL, pDummyTriang);
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+    {
+        std::auto_ptr<CRQTTriangulation> pDummyTriang;
+        RecursiveBuildPatchTriangulations(m_PatchQuadTreeRoots[iRoot]->GetPos(), fRootTriangErrorThreshold, NULL, pDummyTriang, m_AdaptiveTriangulationStat,
+                                          TaskSetData.iSubtreeLevel > 0 ? &TaskSetData : NULL);
+    }
+
+    // Triangulations of the subtrees, which were not taken by the traversal
+    for(size_t iSubtree = 0; iSubtree < TaskSetData.SubtreeTriangulations.size(); iSubtree++)
+        delete TaskSetData.SubtreeTriangulations[iSubtree];
+
+    QueryPerformanceCounter( &EndTick );
+    double dBuildTime = (double)(EndTick.QuadPart - StartTick.QuadPart) / (double)PerfFreq.QuadPart;
+    // Single-thread build time is estimated as the total time of the tasks plus the serial part
+    double dSingleThreadTime = dBuildTime - dTaskSetTime + dTotalTaskTime;
 
     // Output statistics
     FILE *pStatFile;
@@ -603,9 +784,14 @@ void CBlockBasedAdaptiveModel::ConstructPatchAdaptiveTriangulations()
         LONGLONG llTotalTrianglesInFullResInAllLevels = 0;
         for(int iLevel = 1; iLevel < m_iNumLevelsInPatchHierarchy; iLevel++)
         {
-            int iLevelDim = 1<<iLevel;
+            // Patches in the padded area have no triangulations
+            LONGLONG llNumPatchesInLevel = 0;
+            for(int iVert = 0; iVert < (m_iNumRootNodesVert << iLevel); iVert++)
+                for(int iHorz = 0; iHorz < (m_iNumRootNodesHorz << iLevel); iHorz++)
+                    if( !m_pDataSource->IsPatchInPaddedArea(SQuadTreeNodeLocation(iHorz, iVert, iLevel)) )
+                        llNumPatchesInLevel++;
             int iNumTrisInFullRes = (m_iPatchSize+3 - 1) * (m_iPatchSize+3 - 1) * 2;
-            LONGLONG llNumTrisInFullResLevel = (LONGLONG)iNumTrisInFullRes * iLevelDim*iLevelDim;
+            LONGLONG llNumTrisInFullResLevel = (LONGLONG)iNumTrisInFullRes * llNumPatchesInLevel;
             llTotalTrianglesInFullResInAllLevels += llNumTrisInFullResLevel;
             float fTriangleFraction = (float)m_AdaptiveTriangulationStat[iLevel].m_llTotalTriangles / (float)llNumTrisInFullResLevel;
             float fBitsPerTri = (float)m_AdaptiveTriangulationStat[iLevel].TotalCompressedDataSize / (float)m_AdaptiveTriangulationStat[iLevel].m_llTotalTriangles * 8.f;
@@ -619,10 +805,13 @@ void CBlockBasedAdaptiveModel::ConstructPatchAdaptiveTriangulations()
         _ftprintf_s(pStatFile, _T("\nAverage: %.1lf%% total # triangles; bits/tri: %.3lf\n"),  fAverageTriangleFraction * 100.f, fAverageBitsPerTri );
         
         _ftprintf_s(pStatFile, _T("Total compressed tri size: %ld bytes\n"),  TotalCompressedDataSize );
-        LONGLONG TotalSamples = (1 << 2*(m_iNumLevelsInPatchHierarchy+m_iNumLevelsInLocalPatchQT-2) );
+        LONGLONG TotalSamples = ((LONGLONG)1 << 2*(m_iNumLevelsInPatchHierarchy+m_iNumLevelsInLocalPatchQT-2)) * m_iNumRootNodesHorz * m_iNumRootNodesVert;
         float fCompressedTriBPS = (float)TotalCompressedDataSize / (float)TotalSamples * 8.f;
         _ftprintf_s(pStatFile, _T("Compressed tri bps: %.3f\n"),  fCompressedTriBPS);
-        
+
+        _ftprintf_s(pStatFile, _T("\nBuild time: %.2lf s on %d cores (%d subtrees of level %d)\n"), dBuildTime, iNumCores, uiNumSubtrees, TaskSetData.iSubtreeLevel);
+        _ftprintf_s(pStatFile, _T("Single thread estimate: %.2lf s; speedup: %.2lfx; efficiency: %.0lf%%\n"),
+                    dSingleThreadTime, dSingleThreadTime / max(dBuildTime, 1e-9), dSingleThreadTime / max(dBuildTime, 1e-9) / iNumCores * 100.0);
 
         fclose(pStatFile);
     }
@@ -634,21 +823,34 @@ void CBlockBasedAdaptiveModel::ConstructPatchAdaptiveTriangulations()
 void CBlockBasedAdaptiveModel::RecursiveBuildPatchTriangulations(const SQuadTreeNodeLocation &pos,
                                                                  float fTriangulationErrorThreshold,
                                                                  CPatchElevationData *pElevData, 
-                                                                 std::auto_ptr<class CRQTTriangulation> &pAdaptiveTriangulation)
+                                                                 std::auto_ptr<class CRQTTriangulation> &pAdaptiveTriangulation,
+                                                                 TriangulationStatType &Stat,
+                                                                 STriangBuildTaskSetData *pBuiltSubtrees)
 {
+    // Descendants of the patch in the padded area are also in this area
+    if( m_pDataSource->IsPatchInPaddedArea(pos) )
+        return;
+
     float fElevDataErrorBound = m_pDataSource->GetPatchElevDataErrorBound(pos) * m_Params.m_fElevationScale;
     float fTriangulationError = 0.f;
     UINT uiNumTriangles = 0;
 
     // If there are finer levels, process them first
     std::auto_ptr<CRQTTriangulation> pChildTriangulation[4];
-    if( pos.level < m_iNumLevelsInPatchHierarchy-1 )
+    if( AreChildTriangulationsBuilt(pos) )
     {
         for(int iChild = 0; iChild < 4; iChild++)
         {
             SQuadTreeNodeLocation ChildPos = GetChildLocation(pos, iChild);
+            if( pBuiltSubtrees && ChildPos.level == pBuiltSubtrees->iSubtreeLevel )
+            {
+                CRQTTriangulation *&pSubtreeTriangulation = pBuiltSubtrees->SubtreeTriangulations[ChildPos.horzOrder + ChildPos.vertOrder * pBuiltSubtrees->iNumSubtreesHorz];
+                pChildTriangulation[iChild].reset( pSubtreeTriangulation );
+                pSubtreeTriangulation = NULL;
+                continue;
+            }
             std::auto_ptr<CPatchElevationData> pChildElevData( m_pDataSource->GetElevData( ChildPos ) );
-            RecursiveBuildPatchTriangulations(ChildPos, fTriangulationErrorThreshold/2.f, pChildElevData.get(), pChildTriangulation[iChild]);
+            RecursiveBuildPatchTriangulations(ChildPos, fTriangulationErrorThreshold/2.f, pChildElevData.get(), pChildTriangulation[iChild], Stat, pBuiltSubtrees);
         }
     }
 
@@ -671,9 +873,9 @@ void CBlockBasedAdaptiveModel::RecursiveBuildPatchTriangulations(const SQuadTree
 
     // Update statistics
     if( pos.level < m_iNumLevelsInPatchHierarchy-1 )
-        m_AdaptiveTriangulationStat[pos.level+1].TotalCompressedDataSize += m_pTriangDataSource->GetEncodedTriangulationsSize(pos);
+        Stat[pos.level+1].TotalCompressedDataSize += m_pTriangDataSource->GetEncodedTriangulationsSize(pos);
 
-    m_AdaptiveTriangulationStat[pos.level].m_llTotalTriangles += uiNumTriangles;
+    Stat[pos.level].m_llTotalTriangles += uiNumTriangles;
 }
 
 // Recursively traverses the tree and waits while each async taks (if any) is completed
@@ -696,22 +898,170 @@ void CBlockBasedAdaptiveModel::RecursiveWaitForAsyncTaks(CPatchQuadTreeNode &Pat
 // Waits while all async tasks are completed
 void CBlockBasedAdaptiveModel::WaitForAsyncTasks()
 {
-    RecursiveWaitForAsyncTaks(m_PatchQuadTreeRoot);
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+        RecursiveWaitForAsyncTaks(*m_PatchQuadTreeRoots[iRoot]);
+}
+
+// Creates root nodes of the quad trees covering the data source height map
+void CBlockBasedAdaptiveModel::CreateQuadTreeRoots()
+{
+    WaitForAsyncTasks();
+    DestroyQuadTreeRoots();
+    m_iNumRootNodesHorz = m_pDataSource->GetNumRootNodesHorz();
+    m_iNumRootNodesVert = m_pDataSource->GetNumRootNodesVert();
+    m_PatchQuadTreeRoots.reserve(m_iNumRootNodesHorz * m_iNumRootNodesVert);
+    for(int iVert = 0; iVert < m_iNumRootNodesVert; iVert++)
+        for(int iHorz = 0; iHorz < m_iNumRootNodesHorz; iHorz++)
+            m_PatchQuadTreeRoots.push_back( new CPatchQuadTreeNode( SQuadTreeNodeLocation(iHorz, iVert, 0) ) );
+}
+
+void CBlockBasedAdaptiveModel::DestroyQuadTreeRoots()
+{
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+        delete m_PatchQuadTreeRoots[iRoot];
+    m_PatchQuadTreeRoots.clear();
 }
 
 // Initializes the model in corsest representation
 void CBlockBasedAdaptiveModel::RestartAdaptiveModel()
 {
     WaitForAsyncTasks();
-    m_PatchQuadTreeRoot.GetData().Label = SPatchQuadTreeNodeData :: OPTIMAL_PATCH;
-    m_PatchQuadTreeRoot.GetData().m_fGuaranteedPatchErrorBound = FLT_MAX/2;
-    CalculatePatchBoundingBox(m_PatchQuadTreeRoot.GetPos(), m_pDataSource, m_PatchQuadTreeRoot.GetData().BoundBox);
-    m_PatchQuadTreeRoot.DestroyDescendants();
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+    {
+        CPatchQuadTreeNode &Root = *m_PatchQuadTreeRoots[iRoot];
+        Root.GetData().Label = SPatchQuadTreeNodeData :: OPTIMAL_PATCH;
+        Root.GetData().m_fGuaranteedPatchErrorBound = FLT_MAX/2;
+        CalculatePatchBoundingBox(Root.GetPos(), m_pDataSource, Root.GetData().BoundBox);
+        Root.DestroyDescendants();
+    }
 }
 
 void CBlockBasedAdaptiveModel::GetTerrainBoundingBox(SPatchBoundingBox &BoundBox)
 {
-    CalculatePatchBoundingBox(m_PatchQuadTreeRoot.GetPos(), m_pDataSource, BoundBox);
+    // Union of the bounding boxes of all trees
+    CalculatePatchBoundingBox(m_PatchQuadTreeRoots[0]->GetPos(), m_pDataSource, BoundBox);
+    for(size_t iRoot = 1; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+    {
+        SPatchBoundingBox RootBoundBox;
+        CalculatePatchBoundingBox(m_PatchQuadTreeRoots[iRoot]->GetPos(), m_pDataSource, RootBoundBox);
+        BoundBox.fMinX = min(BoundBox.fMinX, RootBoundBox.fMinX);
+        BoundBox.fMaxX = max(BoundBox.fMaxX, RootBoundBox.fMaxX);
+        BoundBox.fMinY = min(BoundBox.fMinY, RootBoundBox.fMinY);
+        BoundBox.fMaxY = max(BoundBox.fMaxY, RootBoundBox.fMaxY);
+        BoundBox.fMinZ = min(BoundBox.fMinZ, RootBoundBox.fMinZ);
+        BoundBox.fMaxZ = max(BoundBox.fMaxZ, RootBoundBox.fMaxZ);
+    }
+}
+
+// Replaces height map samples in the region and rebuilds the affected part of the model
+//
+// The method operates as follows:
+// 1. All async tasks are completed, so that no other thread accesses the data source
+// 2. Elevation data source updates the height map, min/max elevations and error bounds
+//    of the affected patches only
+// 3. Triangulations of the patches, whose elevation data depend on the region, are rebuilt
+// 4. Resident nodes covering the region are traversed: their bounding boxes and error bounds
+//    are updated, pending refinement tasks, which used the previous data, are discarded, and
+//    the patches are marked for recreation. The patches are recreated by UpdateModel(),
+//    because device resources are updated from the rendering thread
+HRESULT CBlockBasedAdaptiveModel::UpdateRegion(const UINT16 *pSamples,
+                                               size_t SamplesPitch,
+                                               int iStartCol, int iEndCol,
+                                               int iStartRow, int iEndRow)
+{
+    WaitForAsyncTasks();
+
+    HRESULT hr = m_pDataSource->UpdateRegion(pSamples, SamplesPitch, iStartCol, iEndCol, iStartRow, iEndRow);
+    if( FAILED(hr) )
+        return hr;
+
+    OnRegionUpdated(iStartCol, iEndCol, iStartRow, iEndRow);
+
+    if( m_pTriangDataSource )
+    {
+        float fFinestLevelTriangErrorThreshold = m_pTriangDataSource->GetFinestLevelTriangErrorThreshold();
+        for(int iLevel = 1; iLevel < m_iNumLevelsInPatchHierarchy; iLevel++)
+        {
+            // Same threshold as in RecursiveBuildPatchTriangulations()
+            float fTriangulationErrorThreshold = fFinestLevelTriangErrorThreshold * (float)(1 << (m_iNumLevelsInPatchHierarchy-1 - iLevel));
+            int iStartHorz, iEndHorz, iStartVert, iEndVert;
+            m_pDataSource->GetPatchesAffectedByRegion(iLevel, iStartCol, iEndCol, iStartRow, iEndRow, iStartHorz, iEndHorz, iStartVert, iEndVert);
+            for(int iVert = iStartVert; iVert < iEndVert; iVert++)
+                for(int iHorz = iStartHorz; iHorz < iEndHorz; iHorz++)
+                {
+                    SQuadTreeNodeLocation pos(iHorz, iVert, iLevel);
+                    if( m_pDataSource->IsPatchInPaddedArea(pos) )
+                        continue;
+                    float fElevDataErrorBound = m_pDataSource->GetPatchElevDataErrorBound(pos) * m_Params.m_fElevationScale;
+                    std::auto_ptr<CPatchElevationData> pElevData( m_pDataSource->GetElevData(pos) );
+                    float fTriangulationError = 0.f;
+                    UINT uiNumTriangles = 0;
+                    std::auto_ptr<CRQTTriangulation> pAdaptiveTriangulation( 
+                        m_pTriangDataSource->CreateAdaptiveTriangulation(pElevData.get(), NULL, NULL, NULL, NULL,
+                                                                         max(fTriangulationErrorThreshold, fElevDataErrorBound/4.f) / m_Params.m_fElevationScale,
+                                                                         fTriangulationError, uiNumTriangles) );
+                    if( pAdaptiveTriangulation.get() )
+                        m_pTriangDataSource->EncodeTriangulation( pos, *pAdaptiveTriangulation, fTriangulationError );
+                }
+        }
+    }
+
+    SUpdatedRegion Region = {iStartCol, iEndCol, iStartRow, iEndRow};
+    for(size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); iRoot++)
+        RecursiveMarkUpdatedPatches(*m_PatchQuadTreeRoots[iRoot], Region);
+
+    return S_OK;
+}
+
+void CBlockBasedAdaptiveModel::RecursiveMarkUpdatedPatches(CPatchQuadTreeNode &PatchNode, const SUpdatedRegion &Region)
+{
+    const SQuadTreeNodeLocation &pos = PatchNode.GetPos();
+    int iStartHorz, iEndHorz, iStartVert, iEndVert;
+    m_pDataSource->GetPatchesAffectedByRegion(pos.level, Region.iStartCol, Region.iEndCol, Region.iStartRow, Region.iEndRow, 
+                                              iStartHorz, iEndHorz, iStartVert, iEndVert);
+    if( (int)pos.horzOrder < iStartHorz || (int)pos.horzOrder >= iEndHorz ||
+        (int)pos.vertOrder < iStartVert || (int)pos.vertOrder >= iEndVert )
+        return;
+
+    SPatchQuadTreeNodeData &data = PatchNode.GetData();
+    data.m_bUpdateRequired = true;
+    // Floating descendants were created from the previous data
+    data.m_pIncreaseLODTask.reset();
+    CalculatePatchBoundingBox(pos, m_pDataSource, data.BoundBox);
+    if( pos.level > 0 )
+        data.m_fGuaranteedPatchErrorBound = CalculateGuaranteedPatchErrorBound(pos);
+
+    CPatchQuadTreeNode *pDescendantNode[4];
+    PatchNode.GetDescendants(pDescendantNode[0], pDescendantNode[1], pDescendantNode[2], pDescendantNode[3]);
+    for(int iChild=0; iChild<4; iChild++)
+        if( pDescendantNode[iChild] )
+            RecursiveMarkUpdatedPatches(*pDescendantNode[iChild], Region);
+}
+
+void CBlockBasedAdaptiveModel::RecursiveRecreateUpdatedPatches(CPatchQuadTreeNode &PatchNode)
+{
+    SPatchQuadTreeNodeData &data = PatchNode.GetData();
+    if( !data.m_bUpdateRequired )
+        return;
+
+    // Root node has no patch
+    if( PatchNode.GetPos().level > 0 && data.BoundBox.bIsBoxValid )
+    {
+        // Release the previous data first, so that its cached tile can be reused
+        data.m_pElevData.reset();
+        data.m_pElevData.reset( m_pDataSource->GetElevData( PatchNode.GetPos() ) );
+        if( m_pTriangDataSource )
+            data.m_pAdaptiveTriangulation.reset( m_pTriangDataSource->DecodeTriangulation( PatchNode.GetPos() ) );
+        CreatePatchForNode(PatchNode, data.m_pElevData.get(), data.m_pAdaptiveTriangulation.get());
+        data.pPatch->UpdateDeviceResources();
+    }
+    data.m_bUpdateRequired = false;
+
+    CPatchQuadTreeNode *pDescendantNode[4];
+    PatchNode.GetDescendants(pDescendantNode[0], pDescendantNode[1], pDescendantNode[2], pDescendantNode[3]);
+    for(int iChild=0; iChild<4; iChild++)
+        if( pDescendantNode[iChild] )
+            RecursiveRecreateUpdatedPatches(*pDescendantNode[iChild]);
 }
 
 template <typename T>
@@ -918,9 +1268,20 @@ bool CBlockBasedAdaptiveModel::RayCast(const D3DXVECTOR3 &origin, const D3DXVECT
 	typedef std::pair<const CPatchQuadTreeNode*, EnterExitPair> StackFrame;
 	std::vector<StackFrame> traversalStack;
 
-	StackFrame current(&m_PatchQuadTreeRoot, EnterExitPair(FLT_MAX, FLT_MAX));
-	if( !IntersectRayAxisAlignedBox(xmOrigin, xmDirection, current.first->GetData().BoundBox, &current.second.first, &current.second.second) )
+	// push roots of all trees hit by the ray sorted by distance - nearest goes last
+	for( size_t iRoot = 0; iRoot < m_PatchQuadTreeRoots.size(); ++iRoot )
+	{
+		StackFrame root(m_PatchQuadTreeRoots[iRoot], EnterExitPair(FLT_MAX, FLT_MAX));
+		if( !IntersectRayAxisAlignedBox(xmOrigin, xmDirection, root.first->GetData().BoundBox, &root.second.first, &root.second.second) )
+			continue;
+		traversalStack.push_back(root);
+		for( size_t j = traversalStack.size()-1; j > 0 && traversalStack[j].second.first > traversalStack[j-1].second.first; --j )
+			std::swap(traversalStack[j], traversalStack[j-1]);
+	}
+	if( traversalStack.empty() )
 		return false;
+	StackFrame current = traversalStack.back();
+	traversalStack.pop_back();
 
 	D3DXVECTOR3 tmpOrigin = origin;
 	D3DXVECTOR3 tmpDir = direction;
@@ -947,8 +1308,10 @@ bool CBlockBasedAdaptiveModel::RayCast(const D3DXVECTOR3 &origin, const D3DXVECT
 			for( int i = 0; i < 4; ++i )
 			{
 				assert(children[i].first);
-				IntersectRayAxisAlignedBox(xmOrigin, xmDirection, children[i].first->GetData().BoundBox,
-					&children[i].second.first, &children[i].second.second);
+				// Nodes in the padded area have no height map
+				if( children[i].first->GetData().BoundBox.bIsBoxValid )
+					IntersectRayAxisAlignedBox(xmOrigin, xmDirection, children[i].first->GetData().BoundBox,
+						&children[i].second.first, &children[i].second.second);
 				// sort by enter distance
 				for( int j = i; j > 0; --j )
 					if( children[j].second.first < children[j-1].second.first )
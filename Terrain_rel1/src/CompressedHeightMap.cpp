@@ -0,0 +1,423 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "CompressedHeightMap.h"
+#include <stdexcept>
+
+namespace
+{
+    // Adaptive Golomb-Rice coder of the prediction residuals. The Rice parameter is
+    // estimated from the mean magnitude of the recently coded residuals
+    class CResidualCoder
+    {
+    public:
+        CResidualCoder() : m_uiSum(4), m_uiCount(1) {}
+
+        void Encode(CBitStream &Stream, int iResidual)
+        {
+            // Map the residual to non-negative value: 0,-1,1,-2,2... -> 0,1,2,3,4...
+            UINT uiValue = iResidual >= 0 ? (UINT)iResidual << 1 : ((UINT)(-iResidual) << 1) - 1;
+            int k = GetRiceParameter();
+            UINT uiQuotient = uiValue >> k;
+            if( uiQuotient < ESCAPE_LENGTH )
+            {
+                // Unary code of the quotient: uiQuotient ones followed by zero
+                Stream.WriteBits((1u << uiQuotient) - 1, uiQuotient + 1);
+                Stream.WriteBits(uiValue, k);
+            }
+            else
+            {
+                // Rare large values are written as is
+                Stream.WriteBits((1u << ESCAPE_LENGTH) - 1, ESCAPE_LENGTH);
+                Stream.WriteBits(uiValue, ESCAPE_VALUE_BITS);
+            }
+            Update(uiValue);
+        }
+
+        int Decode(CBitStream &Stream)
+        {
+            int k = GetRiceParameter();
+            UINT uiQuotient = 0;
+            while( uiQuotient < ESCAPE_LENGTH && Stream.ReadBit() )
+                uiQuotient++;
+            UINT uiValue;
+            if( uiQuotient < ESCAPE_LENGTH )
+                uiValue = (uiQuotient << k) | Stream.ReadBits(k);
+            else
+                uiValue = Stream.ReadBits(ESCAPE_VALUE_BITS);
+            Update(uiValue);
+            return (uiValue & 1) ? -(int)((uiValue + 1) >> 1) : (int)(uiValue >> 1);
+        }
+
+    private:
+        enum
+        {
+            ESCAPE_LENGTH = 24,
+            ESCAPE_VALUE_BITS = 18 // Residuals of 16-bit indices do not exceed 2^17 after mapping
+        };
+
+        int GetRiceParameter()const
+        {
+            int k = 0;
+            while( (m_uiCount << k) < m_uiSum && k < 16 )
+                k++;
+            return k;
+        }
+
+        void Update(UINT uiValue)
+        {
+            m_uiSum += uiValue;
+            if( ++m_uiCount == 64 )
+            {
+                m_uiSum >>= 1;
+                m_uiCount >>= 1;
+            }
+        }
+
+        UINT m_uiSum, m_uiCount;
+    };
+
+    // Refinement labels are 1 for half of the samples and 0 or 2 for a quarter each
+    void EncodeRefinementLabel(CBitStream &Stream, int iLabel)
+    {
+        if( iLabel == 1 )
+            Stream.WriteBit(0);
+        else
+        {
+            Stream.WriteBit(1);
+            Stream.WriteBit(iLabel >> 1);
+        }
+    }
+
+    int DecodeRefinementLabel(CBitStream &Stream)
+    {
+        if( !Stream.ReadBit() )
+            return 1;
+        return Stream.ReadBit() ? 2 : 0;
+    }
+
+    // Same as QuantizeValue() in ElevDataDecompressor.fx for the quantizer uiStep/2
+    int QuantizeElevation(int iElevation, UINT uiStep)
+    {
+        return (int)( (2*(INT64)iElevation + uiStep) / (2*(INT64)uiStep) );
+    }
+
+    UINT16 DequantizeElevation(int iQuantizedElev, UINT uiStep)
+    {
+        return (UINT16)min( (INT64)iQuantizedElev * uiStep, (INT64)0xFFFF );
+    }
+
+    // Predicts the quantized elevation of the sample with at least one odd coordinate by
+    // interpolating the refined samples with even coordinates. Missing neighbors at the
+    // tile boundary are replaced by the opposite ones
+    int InterpolateQuantizedElev(const std::vector<int> &Quantized, int iTileSize, int iWidth, int iHeight, int iX, int iY)
+    {
+        int iX0 = iX & ~1, iX1 = (iX & 1) && iX+1 < iWidth  ? iX+1 : iX0;
+        int iY0 = iY & ~1, iY1 = (iY & 1) && iY+1 < iHeight ? iY+1 : iY0;
+        int iSum = Quantized[iX0 + iY0*iTileSize] + Quantized[iX1 + iY0*iTileSize] + 
+                   Quantized[iX0 + iY1*iTileSize] + Quantized[iX1 + iY1*iTileSize];
+        // Rounding is the same as in QuantizeValue() applied to the bilinearly interpolated elevation
+        return (iSum + 2) >> 2;
+    }
+
+    // Median edge detector predictor used for the coarsest level
+    int PredictQuantizedElev(const std::vector<int> &Quantized, int iTileSize, int iX, int iY)
+    {
+        if( iX == 0 && iY == 0 )
+            return 0;
+        if( iY == 0 )
+            return Quantized[iX-1];
+        if( iX == 0 )
+            return Quantized[(iY-1)*iTileSize];
+        int a = Quantized[iX-1 + iY*iTileSize];
+        int b = Quantized[iX + (iY-1)*iTileSize];
+        int c = Quantized[iX-1 + (iY-1)*iTileSize];
+        if( c >= max(a,b) )
+            return min(a,b);
+        if( c <= min(a,b) )
+            return max(a,b);
+        return a + b - c;
+    }
+}
+
+CCompressedHeightMap::CCompressedHeightMap() :
+    m_uiQuantStep(0)
+{
+}
+
+CCompressedHeightMap::~CCompressedHeightMap()
+{
+    Close();
+}
+
+void CCompressedHeightMap::Close()
+{
+    CTilePyramidHeightMap::Close();
+    m_EncodedTiles.clear();
+    m_LevelStartTile.clear();
+    m_uiQuantStep = 0;
+}
+
+UINT CCompressedHeightMap::GetQuantizationStep(float fReconstrPrecision)
+{
+    return max( 1, (int)(fReconstrPrecision * 2.f) );
+}
+
+float CCompressedHeightMap::GetMaxReconstructionError(int iStep)const
+{
+    int iLevel = 0;
+    while( (2 << iLevel) <= iStep && iLevel+1 < (int)m_Levels.size() )
+        iLevel++;
+    return (float)(m_uiQuantStep << iLevel) * 0.5f;
+}
+
+size_t CCompressedHeightMap::GetCompressedSize()const
+{
+    size_t Size = 0;
+    for(size_t iTile = 0; iTile < m_EncodedTiles.size(); iTile++)
+        Size += (m_EncodedTiles[iTile].GetMaxBits() + 7) / 8;
+    return Size;
+}
+
+// Loads the compressed file to memory
+HRESULT CCompressedHeightMap::Open(LPCTSTR strFilePath, size_t TileCacheBudget)
+{
+    Close();
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("rb") ) != 0 )
+        return E_FAIL;
+
+    SCompressedFileHeader Header;
+    if( fread(&Header, sizeof(Header), 1, pFile) != 1 ||
+        Header.uiSignature != COMPRESSED_FILE_SIGNATURE ||
+        Header.uiVersion != COMPRESSED_FILE_VERSION ||
+        Header.uiTileSizeLog2 == 0 || Header.uiTileSizeLog2 > 12 ||
+        Header.uiNumCols == 0 || Header.uiNumRows == 0 ||
+        Header.uiQuantStep == 0 )
+    {
+        fclose(pFile);
+        return E_FAIL;
+    }
+
+    InitLevelDescs(Header.uiNumCols, Header.uiNumRows, Header.uiTileSizeLog2, m_Levels);
+    if( Header.uiNumLevels != m_Levels.size() )
+    {
+        fclose(pFile);
+        Close();
+        return E_FAIL;
+    }
+
+    size_t NumTiles = 0;
+    m_LevelStartTile.resize(m_Levels.size());
+    for(int iLevel = (int)m_Levels.size()-1; iLevel >= 0; iLevel--)
+    {
+        m_LevelStartTile[iLevel] = NumTiles;
+        NumTiles += (size_t)m_Levels[iLevel].uiNumTilesX * m_Levels[iLevel].uiNumTilesY;
+    }
+
+    m_EncodedTiles.resize(NumTiles);
+    try
+    {
+        for(size_t iTile = 0; iTile < NumTiles; iTile++)
+            m_EncodedTiles[iTile].LoadFromFile(pFile);
+    }
+    catch(const std::exception &)
+    {
+        fclose(pFile);
+        Close();
+        return E_FAIL;
+    }
+    fclose(pFile);
+
+    m_iNumCols = Header.uiNumCols;
+    m_iNumRows = Header.uiNumRows;
+    m_iTileSizeLog2 = Header.uiTileSizeLog2;
+    m_uiQuantStep = Header.uiQuantStep;
+    m_pTileCache.reset( new CTileCache(this, TileCacheBudget) );
+
+    return S_OK;
+}
+
+// Decodes the tile. The method is called by the tile cache on the thread that requested
+// the data. The parent tile is requested from the same cache, so decoding the tile
+// of the fine level also decodes its missing ancestors
+HRESULT CCompressedHeightMap::LoadTile(UINT64 TileKey, std::vector<UINT16> &TileData)
+{
+    int iLevel = (int)(TileKey >> 56);
+    int iTileY = (int)((TileKey >> 28) & 0x0FFFFFFF);
+    int iTileX = (int)(TileKey & 0x0FFFFFFF);
+    const SLevelDesc &Level = m_Levels[iLevel];
+    assert( iTileX < (int)Level.uiNumTilesX && iTileY < (int)Level.uiNumTilesY );
+
+    int iTileSize = 1 << m_iTileSizeLog2;
+    int iWidth  = min(iTileSize, (int)Level.uiNumCols - (iTileX << m_iTileSizeLog2));
+    int iHeight = min(iTileSize, (int)Level.uiNumRows - (iTileY << m_iTileSizeLog2));
+    UINT uiStep = m_uiQuantStep << iLevel;
+
+    // Reading changes the stream state, so several threads work with their own copies
+    CBitStream EncodedTile;
+    EncodedTile = m_EncodedTiles[ m_LevelStartTile[iLevel] + iTileX + (size_t)iTileY * Level.uiNumTilesX ];
+    EncodedTile.StartReading();
+
+    std::vector<int> Quantized(iTileSize * iTileSize, 0);
+    CResidualCoder ResidualCoder;
+    if( iLevel == (int)m_Levels.size()-1 )
+    {
+        // The coarsest level is coded with the spatial prediction
+        for(int iY = 0; iY < iHeight; iY++)
+            for(int iX = 0; iX < iWidth; iX++)
+                Quantized[iX + iY*iTileSize] = PredictQuantizedElev(Quantized, iTileSize, iX, iY) + ResidualCoder.Decode(EncodedTile);
+    }
+    else
+    {
+        UINT64 ParentTileKey = GetTileKey(iLevel+1, iTileX >> 1, iTileY >> 1);
+        const UINT16 *pParentTile = m_pTileCache->AcquireTile(ParentTileKey);
+        if( !pParentTile )
+        {
+            TileData.clear();
+            return E_FAIL;
+        }
+
+        // Refine samples with even coordinates, which are present in the parent tile.
+        // Parent elevation is clamped to UINT16_MAX only if the dequantized value exceeds
+        // it, so rounding up always restores the parent quantized value
+        UINT uiParentStep = uiStep * 2;
+        const UINT16 *pParentSamples = pParentTile + ((iTileX & 1) + (iTileY & 1) * iTileSize) * (iTileSize/2);
+        for(int iY = 0; iY < iHeight; iY += 2)
+            for(int iX = 0; iX < iWidth; iX += 2)
+            {
+                int iParentQuantized = (int)( (pParentSamples[iX/2 + (iY/2)*iTileSize] + uiParentStep - 1) / uiParentStep );
+                Quantized[iX + iY*iTileSize] = iParentQuantized*2 + DecodeRefinementLabel(EncodedTile) - 1;
+            }
+        m_pTileCache->ReleaseTile(ParentTileKey);
+
+        // Interpolate the remaining samples and correct them with the residuals
+        for(int iY = 0; iY < iHeight; iY++)
+            for(int iX = (iY & 1) ? 0 : 1; iX < iWidth; iX += (iY & 1) ? 1 : 2)
+                Quantized[iX + iY*iTileSize] = InterpolateQuantizedElev(Quantized, iTileSize, iWidth, iHeight, iX, iY) + ResidualCoder.Decode(EncodedTile);
+    }
+    EncodedTile.FinishReading();
+
+    // Samples outside the level are clamped to the last row/column as in the tile pyramid
+    TileData.resize(iTileSize * iTileSize);
+    for(int iY = 0; iY < iTileSize; iY++)
+    {
+        UINT16 *pDstRow = &TileData[iY*iTileSize];
+        if( iY < iHeight )
+        {
+            for(int iX = 0; iX < iWidth; iX++)
+                pDstRow[iX] = DequantizeElevation(Quantized[iX + iY*iTileSize], uiStep);
+            for(int iX = iWidth; iX < iTileSize; iX++)
+                pDstRow[iX] = pDstRow[iWidth-1];
+        }
+        else
+            memcpy(pDstRow, &TileData[(iHeight-1)*iTileSize], iTileSize * sizeof(UINT16));
+    }
+
+    return S_OK;
+}
+
+// Tiles are written in the order they are decoded, so that the parent tile is
+// always quantized before its children
+HRESULT CCompressedHeightMap::CreateCompressedFile(LPCTSTR strFilePath,
+                                                   const CHeightMapStore &SrcHeightMap,
+                                                   float fReconstrPrecision,
+                                                   int iTileSize)
+{
+    if( iTileSize <= 1 || (iTileSize & (iTileSize-1)) || fReconstrPrecision < 0 )
+        return E_INVALIDARG;
+
+    SCompressedFileHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    Header.uiSignature = COMPRESSED_FILE_SIGNATURE;
+    Header.uiVersion = COMPRESSED_FILE_VERSION;
+    Header.uiNumCols = SrcHeightMap.GetNumCols();
+    Header.uiNumRows = SrcHeightMap.GetNumRows();
+    while( (1 << Header.uiTileSizeLog2) < iTileSize )
+        Header.uiTileSizeLog2++;
+    std::vector<SLevelDesc> Levels;
+    InitLevelDescs(Header.uiNumCols, Header.uiNumRows, Header.uiTileSizeLog2, Levels);
+    Header.uiNumLevels = (UINT32)Levels.size();
+    Header.uiQuantStep = GetQuantizationStep(fReconstrPrecision);
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("wb") ) != 0 )
+        return E_FAIL;
+
+    HRESULT hr = S_OK;
+    if( fwrite(&Header, sizeof(Header), 1, pFile) != 1 )
+        hr = E_FAIL;
+
+    std::vector<UINT16> Elevations( iTileSize*iTileSize );
+    std::vector<int> Quantized( iTileSize*iTileSize );
+    try
+    {
+        for(int iLevel = (int)Levels.size()-1; iLevel >= 0 && SUCCEEDED(hr); iLevel--)
+        {
+            const SLevelDesc &Level = Levels[iLevel];
+            UINT uiStep = Header.uiQuantStep << iLevel;
+            for(UINT iTileY = 0; iTileY < Level.uiNumTilesY; iTileY++)
+                for(UINT iTileX = 0; iTileX < Level.uiNumTilesX; iTileX++)
+                {
+                    SrcHeightMap.FillHeightMap(&Elevations[0], iTileSize,
+                                               iTileX*iTileSize, (iTileX+1)*iTileSize,
+                                               iTileY*iTileSize, (iTileY+1)*iTileSize,
+                                               1 << iLevel);
+                    int iWidth  = min(iTileSize, (int)(Level.uiNumCols - iTileX*iTileSize));
+                    int iHeight = min(iTileSize, (int)(Level.uiNumRows - iTileY*iTileSize));
+                    for(int iY = 0; iY < iHeight; iY++)
+                        for(int iX = 0; iX < iWidth; iX++)
+                            Quantized[iX + iY*iTileSize] = QuantizeElevation(Elevations[iX + iY*iTileSize], uiStep);
+
+                    CBitStream EncodedTile;
+                    EncodedTile.StartWriting();
+                    CResidualCoder ResidualCoder;
+                    if( iLevel == (int)Levels.size()-1 )
+                    {
+                        for(int iY = 0; iY < iHeight; iY++)
+                            for(int iX = 0; iX < iWidth; iX++)
+                                ResidualCoder.Encode(EncodedTile, Quantized[iX + iY*iTileSize] - PredictQuantizedElev(Quantized, iTileSize, iX, iY));
+                    }
+                    else
+                    {
+                        // The same sample is quantized with twice larger step on the parent level
+                        for(int iY = 0; iY < iHeight; iY += 2)
+                            for(int iX = 0; iX < iWidth; iX += 2)
+                            {
+                                int iParentQuantized = QuantizeElevation(Elevations[iX + iY*iTileSize], uiStep*2);
+                                int iLabel = Quantized[iX + iY*iTileSize] - iParentQuantized*2 + 1;
+                                assert( iLabel >= 0 && iLabel <= 2 );
+                                EncodeRefinementLabel(EncodedTile, iLabel);
+                            }
+
+                        for(int iY = 0; iY < iHeight; iY++)
+                            for(int iX = (iY & 1) ? 0 : 1; iX < iWidth; iX += (iY & 1) ? 1 : 2)
+                                ResidualCoder.Encode(EncodedTile, Quantized[iX + iY*iTileSize] - InterpolateQuantizedElev(Quantized, iTileSize, iWidth, iHeight, iX, iY));
+                    }
+                    EncodedTile.FinishWriting();
+                    EncodedTile.SaveToFile(pFile);
+                }
+        }
+    }
+    catch(const std::exception &)
+    {
+        hr = E_FAIL;
+    }
+
+    fclose(pFile);
+
+    return hr;
+}
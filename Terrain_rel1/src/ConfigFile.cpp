@@ -89,9 +89,29 @@ HRESULT ParseConfigurationFile( LPCWSTR ConfigFilePath )
         {
             ParseParameterString(g_strRawDEMDataFile, MAX_PATH_LENGTH, pConfigFile);
         }
+        else if( wcscmp(L"TiledHeightMapFile", Parameter) == 0 )
+        {
+            ParseParameterString(g_strTiledHeightMapFile, MAX_PATH_LENGTH, pConfigFile);
+        }
+        else if( wcscmp(L"TilePyramidFile", Parameter) == 0 )
+        {
+            ParseParameterString(g_strTilePyramidFile, MAX_PATH_LENGTH, pConfigFile);
+        }
+        else if( wcscmp(L"CompressedHeightMapFile", Parameter) == 0 )
+        {
+            ParseParameterString(g_strCompressedHeightMapFile, MAX_PATH_LENGTH, pConfigFile);
+        }
+        else if( wcscmp(L"HierarchyCacheFile", Parameter) == 0 )
+        {
+            ParseParameterString(g_strHierarchyCacheFile, MAX_PATH_LENGTH, pConfigFile);
+        }
         else if( wcscmp(L"EncodedRQTTriangFile", Parameter) == 0 )
         {
             ParseParameterString(g_strEncodedRQTTriangFile, MAX_PATH_LENGTH, pConfigFile);
+        }
+        else if( wcscmp(L"NormalMapPyramidFile", Parameter) == 0 )
+        {
+            ParseParameterString(g_strNormalMapPyramidFile, MAX_PATH_LENGTH, pConfigFile);
         }
 		else if( wcscmp(L"CameraTrack", Parameter) == 0 )
         {
@@ -138,6 +158,58 @@ HRESULT ParseConfigurationFile( LPCWSTR ConfigFilePath )
             {
                 g_iPatchSize = ParseParameterInt( Value );
             }
+            else if( wcscmp(L"TileCacheBudgetMB", Parameter) == 0 )
+            {
+                g_iTileCacheBudgetMB = ParseParameterInt( Value );
+            }
+            else if( wcscmp(L"PatchDataCacheBudgetMB", Parameter) == 0 )
+            {
+                g_iPatchDataCacheBudgetMB = ParseParameterInt( Value );
+            }
+            else if( wcscmp(L"BenchmarkElevDataKernels", Parameter) == 0 )
+            {
+                if( FAILED(ParseParameterBool( Value, g_bBenchmarkElevDataKernels ) ) )
+                {
+                    LOG_ERROR( L"Failed to parse value of the parameter \"%s\"", Parameter);
+                    goto ERROR_EXIT;
+                }
+            }
+            else if( wcscmp(L"VerifyProceduralHeightMap", Parameter) == 0 )
+            {
+                if( FAILED(ParseParameterBool( Value, g_bVerifyProceduralHeightMap ) ) )
+                {
+                    LOG_ERROR( L"Failed to parse value of the parameter \"%s\"", Parameter);
+                    goto ERROR_EXIT;
+                }
+            }
+            else if( wcscmp(L"MortonHeightMapLayout", Parameter) == 0 )
+            {
+                if( FAILED(ParseParameterBool( Value, g_bMortonHeightMapLayout ) ) )
+                {
+                    LOG_ERROR( L"Failed to parse value of the parameter \"%s\"", Parameter);
+                    goto ERROR_EXIT;
+                }
+            }
+            else if( wcscmp(L"BlockCompressedHeightMap", Parameter) == 0 )
+            {
+                if( FAILED(ParseParameterBool( Value, g_bBlockCompressedHeightMap ) ) )
+                {
+                    LOG_ERROR( L"Failed to parse value of the parameter \"%s\"", Parameter);
+                    goto ERROR_EXIT;
+                }
+            }
+            else if( wcscmp(L"DecimatedLODPyramid", Parameter) == 0 )
+            {
+                if( FAILED(ParseParameterBool( Value, g_bDecimatedLODPyramid ) ) )
+                {
+                    LOG_ERROR( L"Failed to parse value of the parameter \"%s\"", Parameter);
+                    goto ERROR_EXIT;
+                }
+            }
+            else if( wcscmp(L"ReconstrPrecision", Parameter) == 0 )
+            {
+                g_fReconstrPrecision = ParseParameterFloat( Value );
+            }
             else if( wcscmp(L"ScreenSpaceThreshold", Parameter) == 0 )
             {
                 g_TerrainRenderParams.m_fScrSpaceErrorBound = ParseParameterFloat( Value );
@@ -0,0 +1,1075 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+
+// This file does not use the precompiled header because it must compile without the Windows headers
+#include "DEMReader.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+// Huffman decoding table of the inflater. Codes not longer than FAST_BITS are decoded
+// with a single table lookup, longer codes are decoded bit by bit
+class CHuffmanTable
+{
+public:
+    enum {FAST_BITS = 10, MAX_BITS = 15, MAX_SYMBOLS = 288};
+
+    bool Build(const unsigned char *pLengths, int iNumSymbols)
+    {
+        memset(m_Count, 0, sizeof(m_Count));
+        for(int iSym = 0; iSym < iNumSymbols; iSym++)
+            m_Count[pLengths[iSym]]++;
+        m_Count[0] = 0;
+
+        // Check that the code is not over-subscribed. Incomplete codes are allowed
+        int iLeft = 1;
+        for(int iLen = 1; iLen <= MAX_BITS; iLen++)
+        {
+            iLeft <<= 1;
+            iLeft -= m_Count[iLen];
+            if( iLeft < 0 )
+                return false;
+        }
+
+        // Sort symbols by code length and assign canonical codes
+        int Offsets[MAX_BITS+2];
+        int NextCode[MAX_BITS+2];
+        Offsets[1] = 0;
+        NextCode[1] = 0;
+        for(int iLen = 1; iLen <= MAX_BITS; iLen++)
+        {
+            Offsets[iLen+1] = Offsets[iLen] + m_Count[iLen];
+            NextCode[iLen+1] = (NextCode[iLen] + m_Count[iLen]) << 1;
+        }
+
+        memset(m_FastTable, 0, sizeof(m_FastTable));
+        for(int iSym = 0; iSym < iNumSymbols; iSym++)
+        {
+            int iLen = pLengths[iSym];
+            if( iLen == 0 )
+                continue;
+            m_Symbols[Offsets[iLen]++] = (unsigned short)iSym;
+            int iCode = NextCode[iLen]++;
+            if( iLen <= FAST_BITS )
+            {
+                // Codes are stored starting from the most significant bit while
+                // the bit stream is read starting from the least significant one
+                int iReversedCode = 0;
+                for(int iBit = 0; iBit < iLen; iBit++)
+                    iReversedCode |= ((iCode >> iBit) & 1) << (iLen-1-iBit);
+                for(int iEntry = iReversedCode; iEntry < (1<<FAST_BITS); iEntry += 1<<iLen)
+                    m_FastTable[iEntry] = (unsigned short)((iSym << 4) | iLen);
+            }
+        }
+        return true;
+    }
+
+    // Decodes the symbol from the bit buffer. Returns -1 if the code is invalid
+    int Decode(unsigned long long BitBuffer, int &iCodeLength)const
+    {
+        unsigned int uiEntry = m_FastTable[BitBuffer & ((1<<FAST_BITS)-1)];
+        if( uiEntry )
+        {
+            iCodeLength = uiEntry & 15;
+            return uiEntry >> 4;
+        }
+
+        int iCode = 0, iFirst = 0, iIndex = 0;
+        for(int iLen = 1; iLen <= MAX_BITS; iLen++)
+        {
+            iCode |= (int)(BitBuffer >> (iLen-1)) & 1;
+            int iCount = m_Count[iLen];
+            if( iCode - iFirst < iCount )
+            {
+                iCodeLength = iLen;
+                return m_Symbols[iIndex + iCode - iFirst];
+            }
+            iIndex += iCount;
+            iFirst = (iFirst + iCount) << 1;
+            iCode <<= 1;
+        }
+        return -1;
+    }
+
+private:
+    unsigned short m_FastTable[1<<FAST_BITS]; // (Symbol << 4) | CodeLength, 0 if the code is longer
+    unsigned short m_Count[MAX_BITS+1];
+    unsigned short m_Symbols[MAX_SYMBOLS];
+};
+
+// Decoder of the raw deflate stream (RFC 1951)
+class CInflater
+{
+public:
+    CInflater(const unsigned char *pSrc, size_t SrcSize, unsigned char *pDst, size_t DstSize) :
+        m_pSrc(pSrc),
+        m_pSrcEnd(pSrc + SrcSize),
+        m_pDstStart(pDst),
+        m_pDst(pDst),
+        m_pDstEnd(pDst + DstSize),
+        m_BitBuffer(0),
+        m_iNumBits(0),
+        m_iNumPaddingBits(0)
+    {
+    }
+
+    ptrdiff_t Inflate()
+    {
+        bool bFinalBlock = false;
+        while( !bFinalBlock )
+        {
+            bFinalBlock = GetBits(1) != 0;
+            bool bSuccess = false;
+            switch( GetBits(2) )
+            {
+                case 0: bSuccess = InflateStoredBlock(); break;
+                case 1: bSuccess = InflateFixedBlock(); break;
+                case 2: bSuccess = InflateDynamicBlock(); break;
+            }
+            if( !bSuccess || IsOverrun() )
+                return -1;
+        }
+        return m_pDst - m_pDstStart;
+    }
+
+private:
+    void Refill()
+    {
+        while( m_iNumBits <= 56 )
+        {
+            if( m_pSrc < m_pSrcEnd )
+                m_BitBuffer |= (unsigned long long)(*m_pSrc++) << m_iNumBits;
+            else
+                m_iNumPaddingBits += 8; // Pad the stream with zeroes
+            m_iNumBits += 8;
+        }
+    }
+
+    unsigned int GetBits(int iNumBits)
+    {
+        if( m_iNumBits < iNumBits )
+            Refill();
+        unsigned int uiBits = (unsigned int)(m_BitBuffer & ((1ull << iNumBits) - 1));
+        m_BitBuffer >>= iNumBits;
+        m_iNumBits -= iNumBits;
+        return uiBits;
+    }
+
+    int DecodeSymbol(const CHuffmanTable &Table)
+    {
+        if( m_iNumBits < CHuffmanTable::MAX_BITS )
+            Refill();
+        int iCodeLength = 0;
+        int iSymbol = Table.Decode(m_BitBuffer, iCodeLength);
+        m_BitBuffer >>= iCodeLength;
+        m_iNumBits -= iCodeLength;
+        return iSymbol;
+    }
+
+    // Returns true if the decoder consumed padding bits beyond the end of the stream
+    bool IsOverrun()const
+    {
+        return m_iNumBits < m_iNumPaddingBits;
+    }
+
+    bool InflateStoredBlock()
+    {
+        // Skip to the byte boundary and return unused whole bytes to the stream
+        m_BitBuffer >>= m_iNumBits & 7;
+        m_iNumBits &= ~7;
+        if( IsOverrun() )
+            return false;
+        m_pSrc -= (m_iNumBits - m_iNumPaddingBits) >> 3;
+        m_BitBuffer = 0;
+        m_iNumBits = m_iNumPaddingBits = 0;
+
+        if( m_pSrcEnd - m_pSrc < 4 )
+            return false;
+        size_t Length = m_pSrc[0] | (m_pSrc[1] << 8);
+        size_t InvLength = m_pSrc[2] | (m_pSrc[3] << 8);
+        m_pSrc += 4;
+        if( Length != (~InvLength & 0xFFFF) ||
+            (size_t)(m_pSrcEnd - m_pSrc) < Length ||
+            (size_t)(m_pDstEnd - m_pDst) < Length )
+            return false;
+        memcpy(m_pDst, m_pSrc, Length);
+        m_pSrc += Length;
+        m_pDst += Length;
+        return true;
+    }
+
+    bool InflateFixedBlock()
+    {
+        unsigned char Lengths[CHuffmanTable::MAX_SYMBOLS];
+        int iSym = 0;
+        for(; iSym < 144; iSym++) Lengths[iSym] = 8;
+        for(; iSym < 256; iSym++) Lengths[iSym] = 9;
+        for(; iSym < 280; iSym++) Lengths[iSym] = 7;
+        for(; iSym < 288; iSym++) Lengths[iSym] = 8;
+        m_LitLenTable.Build(Lengths, 288);
+        for(iSym = 0; iSym < 30; iSym++) Lengths[iSym] = 5;
+        m_DistTable.Build(Lengths, 30);
+        return InflateCompressedBlock();
+    }
+
+    bool InflateDynamicBlock()
+    {
+        static const unsigned char CodeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+        int iNumLitLenCodes = GetBits(5) + 257;
+        int iNumDistCodes = GetBits(5) + 1;
+        int iNumCodeLengthCodes = GetBits(4) + 4;
+        if( iNumLitLenCodes > 286 || iNumDistCodes > 30 )
+            return false;
+
+        unsigned char Lengths[CHuffmanTable::MAX_SYMBOLS + 32];
+        memset(Lengths, 0, 19);
+        for(int iCode = 0; iCode < iNumCodeLengthCodes; iCode++)
+            Lengths[CodeLengthOrder[iCode]] = (unsigned char)GetBits(3);
+        CHuffmanTable CodeLengthTable;
+        if( !CodeLengthTable.Build(Lengths, 19) )
+            return false;
+
+        int iNumLengths = iNumLitLenCodes + iNumDistCodes;
+        for(int iLen = 0; iLen < iNumLengths; )
+        {
+            int iSymbol = DecodeSymbol(CodeLengthTable);
+            if( iSymbol < 0 )
+                return false;
+            if( iSymbol < 16 )
+            {
+                Lengths[iLen++] = (unsigned char)iSymbol;
+                continue;
+            }
+
+            unsigned char RepeatedLength = 0;
+            int iRepeatCount;
+            if( iSymbol == 16 )
+            {
+                if( iLen == 0 )
+                    return false;
+                RepeatedLength = Lengths[iLen-1];
+                iRepeatCount = 3 + GetBits(2);
+            }
+            else if( iSymbol == 17 )
+                iRepeatCount = 3 + GetBits(3);
+            else
+                iRepeatCount = 11 + GetBits(7);
+            if( iLen + iRepeatCount > iNumLengths )
+                return false;
+            while( iRepeatCount-- )
+                Lengths[iLen++] = RepeatedLength;
+        }
+        if( Lengths[256] == 0 )
+            return false; // No end of block code
+
+        if( !m_LitLenTable.Build(Lengths, iNumLitLenCodes) ||
+            !m_DistTable.Build(Lengths + iNumLitLenCodes, iNumDistCodes) )
+            return false;
+        return InflateCompressedBlock();
+    }
+
+    bool InflateCompressedBlock()
+    {
+        static const unsigned short LengthBase[29] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const unsigned char LengthExtraBits[29] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+            3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const unsigned short DistBase[30] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+            257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const unsigned char DistExtraBits[30] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+            7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+        for(;;)
+        {
+            int iSymbol = DecodeSymbol(m_LitLenTable);
+            if( iSymbol < 256 )
+            {
+                if( iSymbol < 0 || m_pDst == m_pDstEnd )
+                    return false;
+                *m_pDst++ = (unsigned char)iSymbol;
+                continue;
+            }
+            if( iSymbol == 256 )
+                return !IsOverrun();
+
+            iSymbol -= 257;
+            if( iSymbol >= 29 )
+                return false;
+            size_t Length = LengthBase[iSymbol] + GetBits(LengthExtraBits[iSymbol]);
+            int iDistSymbol = DecodeSymbol(m_DistTable);
+            if( iDistSymbol < 0 || iDistSymbol >= 30 )
+                return false;
+            size_t Dist = DistBase[iDistSymbol] + GetBits(DistExtraBits[iDistSymbol]);
+            if( IsOverrun() ||
+                Dist > (size_t)(m_pDst - m_pDstStart) ||
+                Length > (size_t)(m_pDstEnd - m_pDst) )
+                return false;
+
+            const unsigned char *pMatch = m_pDst - Dist;
+            if( Dist >= Length )
+            {
+                memcpy(m_pDst, pMatch, Length);
+                m_pDst += Length;
+            }
+            else
+            {
+                // Overlapping match repeats the last Dist bytes
+                while( Length-- )
+                    *m_pDst++ = *pMatch++;
+            }
+        }
+    }
+
+    const unsigned char *m_pSrc, *m_pSrcEnd;
+    unsigned char *m_pDstStart, *m_pDst, *m_pDstEnd;
+    unsigned long long m_BitBuffer;
+    int m_iNumBits;
+    int m_iNumPaddingBits;
+    CHuffmanTable m_LitLenTable, m_DistTable;
+};
+
+ptrdiff_t CDEMReader::Inflate(const unsigned char *pSrc, size_t SrcSize, unsigned char *pDst, size_t DstSize)
+{
+    // Check the zlib header. Adler-32 checksum at the end of the stream is ignored
+    if( SrcSize < 2 ||
+        (pSrc[0] & 0x0F) != 8 ||                     // Deflate compression
+        ((pSrc[0] << 8) | pSrc[1]) % 31 != 0 ||
+        (pSrc[1] & 0x20) != 0 )                      // Preset dictionary
+        return -1;
+
+    CInflater Inflater(pSrc + 2, SrcSize - 2, pDst, DstSize);
+    return Inflater.Inflate();
+}
+
+ptrdiff_t CDEMReader::DecodeLZW(const unsigned char *pSrc, size_t SrcSize, unsigned char *pDst, size_t DstSize)
+{
+    enum
+    {
+        CLEAR_CODE = 256,
+        EOI_CODE = 257,
+        FIRST_CODE = 258,
+        MAX_CODE_BITS = 12
+    };
+    // String table. Each string is the prefix string followed by the suffix byte
+    std::vector<unsigned short> Prefix(1 << MAX_CODE_BITS);
+    std::vector<unsigned char> Suffix(1 << MAX_CODE_BITS), FirstByte(1 << MAX_CODE_BITS);
+    std::vector<unsigned short> Length(1 << MAX_CODE_BITS);
+    for(int iCode = 0; iCode < 256; iCode++)
+    {
+        Suffix[iCode] = FirstByte[iCode] = (unsigned char)iCode;
+        Length[iCode] = 1;
+    }
+
+    const unsigned char *pSrcEnd = pSrc + SrcSize;
+    unsigned char *pDstStart = pDst, *pDstEnd = pDst + DstSize;
+    unsigned int uiBitBuffer = 0;
+    int iNumBits = 0;
+    int iCodeBits = 9;
+    int iNextCode = FIRST_CODE;
+    int iPrevCode = -1;
+    while( pDst < pDstEnd )
+    {
+        // Codes are packed starting from the most significant bit
+        while( iNumBits < iCodeBits )
+        {
+            if( pSrc == pSrcEnd )
+                return pDst - pDstStart; // Some encoders omit the end of information code
+            uiBitBuffer = (uiBitBuffer << 8) | *pSrc++;
+            iNumBits += 8;
+        }
+        int iCode = (uiBitBuffer >> (iNumBits - iCodeBits)) & ((1 << iCodeBits) - 1);
+        iNumBits -= iCodeBits;
+
+        if( iCode == EOI_CODE )
+            break;
+        if( iCode == CLEAR_CODE )
+        {
+            iCodeBits = 9;
+            iNextCode = FIRST_CODE;
+            iPrevCode = -1;
+            continue;
+        }
+
+        if( iPrevCode < 0 )
+        {
+            if( iCode >= 256 )
+                return -1;
+            *pDst++ = (unsigned char)iCode;
+            iPrevCode = iCode;
+            continue;
+        }
+
+        if( iCode > iNextCode || (iCode == iNextCode && iNextCode == (1 << MAX_CODE_BITS)) )
+            return -1;
+        // Add the new string: previous string followed by the first byte of the current one
+        // If the code is not yet in the table, it refers to the string being added
+        if( iNextCode < (1 << MAX_CODE_BITS) )
+        {
+            Prefix[iNextCode] = (unsigned short)iPrevCode;
+            FirstByte[iNextCode] = FirstByte[iPrevCode];
+            Suffix[iNextCode] = FirstByte[iCode < iNextCode ? iCode : iPrevCode];
+            Length[iNextCode] = Length[iPrevCode] + 1;
+            iNextCode++;
+            // The code width is increased one code early
+            if( iNextCode >= (1 << iCodeBits) - 1 && iCodeBits < MAX_CODE_BITS )
+                iCodeBits++;
+        }
+
+        // Output the string from the last byte to the first one
+        int iStrLength = Length[iCode];
+        int iNumBytesToSkip = 0;
+        if( iStrLength > pDstEnd - pDst )
+        {
+            iNumBytesToSkip = iStrLength - (int)(pDstEnd - pDst);
+            iStrLength = (int)(pDstEnd - pDst);
+        }
+        int iStrCode = iCode;
+        for(; iNumBytesToSkip > 0; iNumBytesToSkip--)
+            iStrCode = Prefix[iStrCode];
+        for(unsigned char *pByte = pDst + iStrLength - 1; pByte >= pDst; pByte--)
+        {
+            *pByte = Suffix[iStrCode];
+            iStrCode = Prefix[iStrCode];
+        }
+        pDst += iStrLength;
+        iPrevCode = iCode;
+    }
+
+    return pDst - pDstStart;
+}
+
+static FILE* OpenFileForReading(const wchar_t *strFilePath)
+{
+#ifdef _WIN32
+    FILE *pFile = NULL;
+    if( _wfopen_s(&pFile, strFilePath, L"rb") != 0 )
+        return NULL;
+    return pFile;
+#else
+    size_t PathLength = wcstombs(NULL, strFilePath, 0);
+    if( PathLength == (size_t)-1 )
+        return NULL;
+    std::vector<char> Path(PathLength + 1);
+    wcstombs(&Path[0], strFilePath, Path.size());
+    // Config files use Windows path separators
+    for(size_t iChar = 0; iChar < PathLength; iChar++)
+        if( Path[iChar] == '\\' )
+            Path[iChar] = '/';
+    return fopen(&Path[0], "rb");
+#endif
+}
+
+CDEMReader::CDEMReader() :
+    m_pFile(NULL),
+    m_Format(FORMAT_UNKNOWN),
+    m_uiWidth(0),
+    m_uiHeight(0),
+    m_pParallelFor(NULL),
+    m_pParallelForUserData(NULL),
+    m_bBigEndian(false),
+    m_bBigTIFF(false),
+    m_uiCompression(TIFF_COMPRESSION_NONE),
+    m_uiPredictor(1)
+{
+}
+
+CDEMReader::~CDEMReader()
+{
+    Close();
+}
+
+void CDEMReader::SetParallelFor(DEM_PARALLEL_FOR_FUNC pParallelFor, void *pUserData)
+{
+    m_pParallelFor = pParallelFor;
+    m_pParallelForUserData = pUserData;
+}
+
+void CDEMReader::Close()
+{
+    if( m_pFile )
+        fclose(m_pFile);
+    m_pFile = NULL;
+    m_Format = FORMAT_UNKNOWN;
+    m_uiWidth = m_uiHeight = 0;
+    m_Chunks.clear();
+    m_PNGData.clear();
+}
+
+bool CDEMReader::SetError(const char *strError)
+{
+    m_strError = strError;
+    return false;
+}
+
+bool CDEMReader::Seek(unsigned long long Offset)
+{
+#ifdef _WIN32
+    return _fseeki64(m_pFile, (__int64)Offset, SEEK_SET) == 0;
+#else
+    return fseeko(m_pFile, (off_t)Offset, SEEK_SET) == 0;
+#endif
+}
+
+bool CDEMReader::ReadBytes(void *pDst, size_t Size)
+{
+    return Size == 0 || fread(pDst, Size, 1, m_pFile) == 1;
+}
+
+unsigned int CDEMReader::GetUInt16(const unsigned char *p)const
+{
+    return m_bBigEndian ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+unsigned int CDEMReader::GetUInt32(const unsigned char *p)const
+{
+    return m_bBigEndian ?
+        ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] :
+        p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+unsigned long long CDEMReader::GetUInt64(const unsigned char *p)const
+{
+    unsigned long long Low = GetUInt32(m_bBigEndian ? p + 4 : p);
+    unsigned long long High = GetUInt32(m_bBigEndian ? p : p + 4);
+    return (High << 32) | Low;
+}
+
+bool CDEMReader::Open(const wchar_t *strFilePath, unsigned int uiRawWidth, unsigned int uiRawHeight)
+{
+    Close();
+    m_strError.clear();
+
+    m_pFile = OpenFileForReading(strFilePath);
+    if( !m_pFile )
+        return SetError("Failed to open the file");
+
+    unsigned char Signature[8];
+    memset(Signature, 0, sizeof(Signature));
+    bool bSuccess;
+    size_t SignatureSize = fread(Signature, 1, sizeof(Signature), m_pFile);
+    static const unsigned char PNGSignature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    if( SignatureSize >= 4 &&
+        ((Signature[0] == 'I' && Signature[1] == 'I') || (Signature[0] == 'M' && Signature[1] == 'M')) )
+    {
+        m_Format = FORMAT_TIFF;
+        bSuccess = OpenTIFF();
+    }
+    else if( SignatureSize == 8 && memcmp(Signature, PNGSignature, 8) == 0 )
+    {
+        m_Format = FORMAT_PNG;
+        bSuccess = OpenPNG();
+    }
+    else
+    {
+        m_Format = FORMAT_RAW;
+        unsigned long long FileSize = 0;
+#ifdef _WIN32
+        bSuccess = _fseeki64(m_pFile, 0, SEEK_END) == 0;
+        FileSize = _ftelli64(m_pFile);
+#else
+        bSuccess = fseeko(m_pFile, 0, SEEK_END) == 0;
+        FileSize = ftello(m_pFile);
+#endif
+        if( uiRawWidth == 0 || uiRawHeight == 0 )
+            bSuccess = SetError("Unknown file format");
+        else if( !bSuccess || FileSize != (unsigned long long)uiRawWidth * uiRawHeight * sizeof(unsigned short) )
+            bSuccess = SetError("RAW file size does not match the specified dimensions");
+        m_uiWidth = uiRawWidth;
+        m_uiHeight = uiRawHeight;
+    }
+
+    if( !bSuccess )
+    {
+        std::string strError = m_strError;
+        Close();
+        m_strError = strError;
+    }
+    return bSuccess;
+}
+
+bool CDEMReader::Read(unsigned short *pDst, size_t DstPitch)
+{
+    if( DstPitch < m_uiWidth )
+        return SetError("Invalid destination pitch");
+    switch( m_Format )
+    {
+        case FORMAT_TIFF: return ReadTIFF(pDst, DstPitch);
+        case FORMAT_PNG:  return ReadPNG(pDst, DstPitch);
+        case FORMAT_RAW:  return ReadRAW(pDst, DstPitch);
+        default: return SetError("The file is not open");
+    }
+}
+
+// Reads values of the TIFF directory entry
+bool CDEMReader::ReadTIFFTag(const unsigned char *pEntry, std::vector<unsigned long long> &Values)
+{
+    unsigned int uiType = GetUInt16(pEntry + 2);
+    unsigned long long Count = m_bBigTIFF ? GetUInt64(pEntry + 4) : GetUInt32(pEntry + 4);
+    size_t ValueSize;
+    switch( uiType )
+    {
+        case 1:  ValueSize = 1; break; // BYTE
+        case 3:  ValueSize = 2; break; // SHORT
+        case 4:  ValueSize = 4; break; // LONG
+        case 16: ValueSize = 8; break; // LONG8
+        default: return SetError("Unsupported TIFF tag type");
+    }
+    // Number of values is limited by the number of strips in the largest supported image
+    if( Count == 0 || Count > (1 << 26) )
+        return SetError("Invalid TIFF tag value count");
+
+    // Values are stored in the entry if they fit
+    const unsigned char *pValueField = pEntry + (m_bBigTIFF ? 12 : 8);
+    size_t DataSize = (size_t)Count * ValueSize;
+    std::vector<unsigned char> Data;
+    const unsigned char *pData = pValueField;
+    if( DataSize > (size_t)(m_bBigTIFF ? 8 : 4) )
+    {
+        Data.resize(DataSize);
+        unsigned long long Offset = m_bBigTIFF ? GetUInt64(pValueField) : GetUInt32(pValueField);
+        if( !Seek(Offset) || !ReadBytes(&Data[0], DataSize) )
+            return SetError("Failed to read TIFF tag values");
+        pData = &Data[0];
+    }
+
+    Values.resize((size_t)Count);
+    for(size_t iValue = 0; iValue < Values.size(); iValue++)
+    {
+        const unsigned char *pValue = pData + iValue * ValueSize;
+        switch( ValueSize )
+        {
+            case 1: Values[iValue] = *pValue; break;
+            case 2: Values[iValue] = GetUInt16(pValue); break;
+            case 4: Values[iValue] = GetUInt32(pValue); break;
+            case 8: Values[iValue] = GetUInt64(pValue); break;
+        }
+    }
+    return true;
+}
+
+bool CDEMReader::OpenTIFF()
+{
+    unsigned char Header[16];
+    if( !Seek(0) || !ReadBytes(Header, 8) )
+        return SetError("Failed to read TIFF header");
+    m_bBigEndian = Header[0] == 'M';
+
+    unsigned long long IFDOffset;
+    unsigned int uiVersion = GetUInt16(Header + 2);
+    if( uiVersion == 42 )
+    {
+        m_bBigTIFF = false;
+        IFDOffset = GetUInt32(Header + 4);
+    }
+    else if( uiVersion == 43 )
+    {
+        m_bBigTIFF = true;
+        if( !ReadBytes(Header + 8, 8) || GetUInt16(Header + 4) != 8 )
+            return SetError("Invalid BigTIFF header");
+        IFDOffset = GetUInt64(Header + 8);
+    }
+    else
+        return SetError("Invalid TIFF header");
+
+    // Read the first image file directory
+    unsigned char CountField[8];
+    if( !Seek(IFDOffset) || !ReadBytes(CountField, m_bBigTIFF ? 8 : 2) )
+        return SetError("Failed to read TIFF directory");
+    unsigned long long NumEntries = m_bBigTIFF ? GetUInt64(CountField) : GetUInt16(CountField);
+    if( NumEntries == 0 || NumEntries > 4096 )
+        return SetError("Invalid TIFF directory");
+    size_t EntrySize = m_bBigTIFF ? 20 : 12;
+    std::vector<unsigned char> Entries( (size_t)NumEntries * EntrySize );
+    if( !ReadBytes(&Entries[0], Entries.size()) )
+        return SetError("Failed to read TIFF directory");
+
+    unsigned long long TileWidth = 0, TileHeight = 0, RowsPerStrip = 0;
+    unsigned long long SamplesPerPixel = 1;
+    std::vector<unsigned long long> BitsPerSample, SampleFormat, Offsets, ByteCounts;
+    m_uiCompression = TIFF_COMPRESSION_NONE;
+    m_uiPredictor = 1;
+    bool bTiled = false;
+    for(size_t iEntry = 0; iEntry < (size_t)NumEntries; iEntry++)
+    {
+        const unsigned char *pEntry = &Entries[iEntry * EntrySize];
+        unsigned int uiTag = GetUInt16(pEntry);
+        std::vector<unsigned long long> Values;
+        switch( uiTag )
+        {
+            case 256: // ImageWidth
+            case 257: // ImageLength
+            case 259: // Compression
+            case 277: // SamplesPerPixel
+            case 278: // RowsPerStrip
+            case 317: // Predictor
+            case 322: // TileWidth
+            case 323: // TileLength
+                if( !ReadTIFFTag(pEntry, Values) )
+                    return false;
+                if( Values[0] > 0xFFFFFFFFull )
+                    return SetError("Invalid TIFF tag value");
+                switch( uiTag )
+                {
+                    case 256: m_uiWidth = (unsigned int)Values[0]; break;
+                    case 257: m_uiHeight = (unsigned int)Values[0]; break;
+                    case 259: m_uiCompression = (unsigned int)Values[0]; break;
+                    case 277: SamplesPerPixel = Values[0]; break;
+                    case 278: RowsPerStrip = Values[0]; break;
+                    case 317: m_uiPredictor = (unsigned int)Values[0]; break;
+                    case 322: TileWidth = Values[0]; break;
+                    case 323: TileHeight = Values[0]; break;
+                }
+                break;
+
+            case 258: // BitsPerSample
+                if( !ReadTIFFTag(pEntry, BitsPerSample) ) return false;
+                break;
+            case 339: // SampleFormat
+                if( !ReadTIFFTag(pEntry, SampleFormat) ) return false;
+                break;
+            case 273: // StripOffsets
+            case 324: // TileOffsets
+                if( !ReadTIFFTag(pEntry, Offsets) ) return false;
+                bTiled = uiTag == 324;
+                break;
+            case 279: // StripByteCounts
+            case 325: // TileByteCounts
+                if( !ReadTIFFTag(pEntry, ByteCounts) ) return false;
+                break;
+        }
+    }
+
+    if( m_uiWidth == 0 || m_uiHeight == 0 )
+        return SetError("Invalid TIFF image dimensions");
+    if( SamplesPerPixel != 1 )
+        return SetError("Only single channel TIFF images are supported");
+    for(size_t iSample = 0; iSample < BitsPerSample.size(); iSample++)
+        if( BitsPerSample[iSample] != 16 )
+            return SetError("Only 16-bit TIFF images are supported");
+    if( BitsPerSample.empty() )
+        return SetError("Only 16-bit TIFF images are supported");
+    for(size_t iSample = 0; iSample < SampleFormat.size(); iSample++)
+        if( SampleFormat[iSample] != 1 )
+            return SetError("Only unsigned integer TIFF samples are supported");
+    if( m_uiCompression != TIFF_COMPRESSION_NONE &&
+        m_uiCompression != TIFF_COMPRESSION_LZW &&
+        m_uiCompression != TIFF_COMPRESSION_ADOBE_DEFLATE &&
+        m_uiCompression != TIFF_COMPRESSION_DEFLATE )
+        return SetError("Unsupported TIFF compression");
+    if( m_uiPredictor != 1 && m_uiPredictor != 2 )
+        return SetError("Unsupported TIFF predictor");
+
+    unsigned int uiChunkWidth, uiChunkHeight;
+    if( bTiled )
+    {
+        if( TileWidth == 0 || TileHeight == 0 || TileWidth > 65536 || TileHeight > 65536 )
+            return SetError("Invalid TIFF tile dimensions");
+        uiChunkWidth = (unsigned int)TileWidth;
+        uiChunkHeight = (unsigned int)TileHeight;
+    }
+    else
+    {
+        uiChunkWidth = m_uiWidth;
+        uiChunkHeight = (RowsPerStrip == 0 || RowsPerStrip > m_uiHeight) ? m_uiHeight : (unsigned int)RowsPerStrip;
+    }
+    unsigned int uiNumChunksX = (m_uiWidth + uiChunkWidth - 1) / uiChunkWidth;
+    unsigned int uiNumChunksY = (m_uiHeight + uiChunkHeight - 1) / uiChunkHeight;
+    size_t NumChunks = (size_t)uiNumChunksX * uiNumChunksY;
+    if( Offsets.size() != NumChunks || ByteCounts.size() != NumChunks )
+        return SetError("Invalid number of TIFF strips or tiles");
+
+    m_Chunks.resize(NumChunks);
+    for(unsigned int uiChunkY = 0; uiChunkY < uiNumChunksY; uiChunkY++)
+        for(unsigned int uiChunkX = 0; uiChunkX < uiNumChunksX; uiChunkX++)
+        {
+            size_t iChunk = (size_t)uiChunkY * uiNumChunksX + uiChunkX;
+            SChunk &Chunk = m_Chunks[iChunk];
+            if( ByteCounts[iChunk] > (1 << 30) )
+                return SetError("TIFF strip or tile is too large");
+            Chunk.FileOffset = Offsets[iChunk];
+            Chunk.Size = (size_t)ByteCounts[iChunk];
+            Chunk.BufferOffset = 0;
+            Chunk.uiX = uiChunkX * uiChunkWidth;
+            Chunk.uiY = uiChunkY * uiChunkHeight;
+            Chunk.uiWidth = uiChunkWidth;
+            // The last strip contains only the remaining rows, while tiles are always complete
+            Chunk.uiHeight = bTiled ? uiChunkHeight : std::min(uiChunkHeight, m_uiHeight - Chunk.uiY);
+        }
+
+    return true;
+}
+
+struct CDEMReader::SDecodeTaskData
+{
+    const CDEMReader *pReader;
+    const SChunk *pChunks;
+    const unsigned char *pBuffer;
+    unsigned short *pDst;
+    size_t DstPitch;
+    unsigned char *pResults;
+};
+
+// Decodes one strip or tile into the destination buffer
+void CDEMReader::DecodeChunkTask(void *pTaskData, unsigned int uiTask)
+{
+    const SDecodeTaskData &TaskData = *(const SDecodeTaskData*)pTaskData;
+    const CDEMReader &Reader = *TaskData.pReader;
+    const SChunk &Chunk = TaskData.pChunks[uiTask];
+    const unsigned char *pSrc = TaskData.pBuffer + Chunk.BufferOffset;
+
+    size_t RowSize = (size_t)Chunk.uiWidth * sizeof(unsigned short);
+    size_t DecodedSize = RowSize * Chunk.uiHeight;
+    const unsigned char *pSamples = pSrc;
+    std::vector<unsigned char> DecodedData;
+    if( Reader.m_uiCompression == TIFF_COMPRESSION_NONE )
+    {
+        if( Chunk.Size < DecodedSize )
+            return;
+    }
+    else
+    {
+        DecodedData.resize(DecodedSize);
+        ptrdiff_t DecodedBytes = Reader.m_uiCompression == TIFF_COMPRESSION_LZW ?
+            DecodeLZW(pSrc, Chunk.Size, &DecodedData[0], DecodedSize) :
+            Inflate(pSrc, Chunk.Size, &DecodedData[0], DecodedSize);
+        if( DecodedBytes != (ptrdiff_t)DecodedSize )
+            return;
+        pSamples = &DecodedData[0];
+    }
+
+    // Tiles crossing the image boundary are clipped
+    unsigned int uiNumCols = std::min(Chunk.uiWidth, Reader.m_uiWidth - Chunk.uiX);
+    unsigned int uiNumRows = std::min(Chunk.uiHeight, Reader.m_uiHeight - Chunk.uiY);
+    for(unsigned int uiRow = 0; uiRow < uiNumRows; uiRow++)
+    {
+        const unsigned char *pSrcRow = pSamples + uiRow * RowSize;
+        unsigned short *pDstRow = TaskData.pDst + (size_t)(Chunk.uiY + uiRow) * TaskData.DstPitch + Chunk.uiX;
+        if( Reader.m_uiPredictor == 2 )
+        {
+            // Horizontal differencing: each sample is stored as the difference with the left one
+            unsigned int uiValue = 0;
+            for(unsigned int uiCol = 0; uiCol < uiNumCols; uiCol++)
+            {
+                uiValue += Reader.GetUInt16(pSrcRow + uiCol*2);
+                pDstRow[uiCol] = (unsigned short)uiValue;
+            }
+        }
+        else
+        {
+            for(unsigned int uiCol = 0; uiCol < uiNumCols; uiCol++)
+                pDstRow[uiCol] = (unsigned short)Reader.GetUInt16(pSrcRow + uiCol*2);
+        }
+    }
+
+    TaskData.pResults[uiTask] = 1;
+}
+
+bool CDEMReader::ReadTIFF(unsigned short *pDst, size_t DstPitch)
+{
+    // Compressed data is read in batches to limit the memory footprint. Reading is sequential,
+    // while the strips and tiles of the batch are decoded in parallel
+    const size_t MaxBatchSize = 64 << 20;
+    std::vector<unsigned char> Buffer;
+    std::vector<unsigned char> Results;
+    for(size_t iFirstChunk = 0; iFirstChunk < m_Chunks.size(); )
+    {
+        size_t iEndChunk = iFirstChunk;
+        size_t BatchSize = 0;
+        while( iEndChunk < m_Chunks.size() &&
+               (iEndChunk == iFirstChunk || BatchSize + m_Chunks[iEndChunk].Size <= MaxBatchSize) )
+        {
+            m_Chunks[iEndChunk].BufferOffset = BatchSize;
+            BatchSize += m_Chunks[iEndChunk].Size;
+            iEndChunk++;
+        }
+
+        Buffer.resize( std::max(BatchSize, (size_t)1) );
+        for(size_t iChunk = iFirstChunk; iChunk < iEndChunk; iChunk++)
+        {
+            const SChunk &Chunk = m_Chunks[iChunk];
+            if( !Seek(Chunk.FileOffset) || !ReadBytes(&Buffer[Chunk.BufferOffset], Chunk.Size) )
+                return SetError("Failed to read TIFF strip or tile");
+        }
+
+        unsigned int uiNumTasks = (unsigned int)(iEndChunk - iFirstChunk);
+        Results.assign(uiNumTasks, 0);
+        SDecodeTaskData TaskData;
+        TaskData.pReader = this;
+        TaskData.pChunks = &m_Chunks[iFirstChunk];
+        TaskData.pBuffer = &Buffer[0];
+        TaskData.pDst = pDst;
+        TaskData.DstPitch = DstPitch;
+        TaskData.pResults = &Results[0];
+        if( m_pParallelFor && uiNumTasks > 1 )
+            m_pParallelFor(DecodeChunkTask, &TaskData, uiNumTasks, m_pParallelForUserData);
+        else
+        {
+            for(unsigned int uiTask = 0; uiTask < uiNumTasks; uiTask++)
+                DecodeChunkTask(&TaskData, uiTask);
+        }
+
+        for(unsigned int uiTask = 0; uiTask < uiNumTasks; uiTask++)
+            if( !Results[uiTask] )
+                return SetError("Failed to decode TIFF strip or tile");
+
+        iFirstChunk = iEndChunk;
+    }
+    return true;
+}
+
+bool CDEMReader::OpenPNG()
+{
+    // PNG data is big endian
+    m_bBigEndian = true;
+
+    // IHDR chunk must follow the signature
+    unsigned char IHDR[8 + 13 + 4];
+    if( !ReadBytes(IHDR, sizeof(IHDR)) ||
+        GetUInt32(IHDR) != 13 ||
+        memcmp(IHDR + 4, "IHDR", 4) != 0 )
+        return SetError("Invalid PNG header");
+
+    const unsigned char *pData = IHDR + 8;
+    m_uiWidth = GetUInt32(pData);
+    m_uiHeight = GetUInt32(pData + 4);
+    unsigned int uiBitDepth = pData[8];
+    unsigned int uiColorType = pData[9];
+    unsigned int uiInterlace = pData[12];
+    if( m_uiWidth == 0 || m_uiHeight == 0 || m_uiWidth > (1u << 30) || m_uiHeight > (1u << 30) )
+        return SetError("Invalid PNG image dimensions");
+    if( uiBitDepth != 16 || uiColorType != 0 )
+        return SetError("Only 16-bit grayscale PNG images are supported");
+    if( pData[10] != 0 || pData[11] != 0 || uiInterlace != 0 )
+        return SetError("Interlaced PNG images are not supported");
+
+    return true;
+}
+
+// Paeth predictor of the PNG filter type 4
+static inline unsigned char PaethPredictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if( pa <= pb && pa <= pc )
+        return (unsigned char)a;
+    return (unsigned char)(pb <= pc ? b : c);
+}
+
+bool CDEMReader::ReadPNG(unsigned short *pDst, size_t DstPitch)
+{
+    // Concatenate the IDAT chunks. The file is positioned after the IHDR chunk
+    m_PNGData.clear();
+    for(;;)
+    {
+        unsigned char ChunkHeader[8];
+        if( !ReadBytes(ChunkHeader, sizeof(ChunkHeader)) )
+            return SetError("Unexpected end of PNG file");
+        size_t ChunkSize = GetUInt32(ChunkHeader);
+        if( memcmp(ChunkHeader + 4, "IEND", 4) == 0 )
+            break;
+        if( memcmp(ChunkHeader + 4, "IDAT", 4) == 0 )
+        {
+            size_t PrevSize = m_PNGData.size();
+            m_PNGData.resize(PrevSize + ChunkSize);
+            if( !ReadBytes(&m_PNGData[PrevSize], ChunkSize) )
+                return SetError("Failed to read PNG data");
+            ChunkSize = 0;
+        }
+        // Skip the chunk data and CRC
+        if( fseek(m_pFile, (long)(ChunkSize + 4), SEEK_CUR) != 0 )
+            return SetError("Unexpected end of PNG file");
+    }
+    if( m_PNGData.empty() )
+        return SetError("PNG file contains no image data");
+
+    // The zlib stream of the PNG image is decoded on a single thread
+    // Each row is prefixed by the filter type byte
+    size_t RowSize = (size_t)m_uiWidth * sizeof(unsigned short);
+    std::vector<unsigned char> FilteredData( (RowSize + 1) * m_uiHeight );
+    ptrdiff_t DecodedBytes = Inflate(&m_PNGData[0], m_PNGData.size(), &FilteredData[0], FilteredData.size());
+    std::vector<unsigned char>().swap(m_PNGData);
+    if( DecodedBytes != (ptrdiff_t)FilteredData.size() )
+        return SetError("Failed to decompress PNG data");
+
+    const int BytesPerPixel = 2;
+    const unsigned char *pPrevRow = NULL;
+    for(unsigned int uiRow = 0; uiRow < m_uiHeight; uiRow++)
+    {
+        unsigned char *pRow = &FilteredData[uiRow * (RowSize + 1)];
+        unsigned int uiFilter = *pRow++;
+        switch( uiFilter )
+        {
+            case 0: break;
+            case 1: // Sub
+                for(size_t i = BytesPerPixel; i < RowSize; i++)
+                    pRow[i] += pRow[i - BytesPerPixel];
+                break;
+            case 2: // Up
+                if( pPrevRow )
+                    for(size_t i = 0; i < RowSize; i++)
+                        pRow[i] += pPrevRow[i];
+                break;
+            case 3: // Average
+                for(size_t i = 0; i < RowSize; i++)
+                {
+                    int iLeft = i >= BytesPerPixel ? pRow[i - BytesPerPixel] : 0;
+                    int iUp = pPrevRow ? pPrevRow[i] : 0;
+                    pRow[i] += (unsigned char)((iLeft + iUp) >> 1);
+                }
+                break;
+            case 4: // Paeth
+                for(size_t i = 0; i < RowSize; i++)
+                {
+                    int iLeft = i >= BytesPerPixel ? pRow[i - BytesPerPixel] : 0;
+                    int iUp = pPrevRow ? pPrevRow[i] : 0;
+                    int iUpLeft = (pPrevRow && i >= BytesPerPixel) ? pPrevRow[i - BytesPerPixel] : 0;
+                    pRow[i] += PaethPredictor(iLeft, iUp, iUpLeft);
+                }
+                break;
+            default:
+                return SetError("Invalid PNG filter type");
+        }
+
+        unsigned short *pDstRow = pDst + (size_t)uiRow * DstPitch;
+        for(unsigned int uiCol = 0; uiCol < m_uiWidth; uiCol++)
+            pDstRow[uiCol] = (unsigned short)GetUInt16(pRow + uiCol*2);
+        pPrevRow = pRow;
+    }
+    return true;
+}
+
+bool CDEMReader::ReadRAW(unsigned short *pDst, size_t DstPitch)
+{
+    // RAW data is little endian
+    m_bBigEndian = false;
+    if( !Seek(0) )
+        return SetError("Failed to read RAW data");
+    size_t RowSize = (size_t)m_uiWidth * sizeof(unsigned short);
+    std::vector<unsigned char> Row(RowSize);
+    for(unsigned int uiRow = 0; uiRow < m_uiHeight; uiRow++)
+    {
+        if( !ReadBytes(&Row[0], RowSize) )
+            return SetError("Failed to read RAW data");
+        unsigned short *pDstRow = pDst + (size_t)uiRow * DstPitch;
+        for(unsigned int uiCol = 0; uiCol < m_uiWidth; uiCol++)
+            pDstRow[uiCol] = (unsigned short)GetUInt16(&Row[uiCol*2]);
+    }
+    return true;
+}
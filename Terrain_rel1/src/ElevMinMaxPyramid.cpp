@@ -0,0 +1,195 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "ElevMinMaxPyramid.h"
+#include "HeightMapKernels.h"
+
+CElevMinMaxPyramid::CElevMinMaxPyramid(const UINT16 *pElevData, size_t ElevDataPitch, int iPatchSize) :
+    m_pElevData(pElevData),
+    m_ElevDataPitch(ElevDataPitch),
+    m_iPatchSize(iPatchSize)
+{
+    // Residuals of all levels are calculated from the samples rather than bounded using the finer
+    // level, because the minimal and the maximal residuals must be attained by some samples of the
+    // block to bound the triangle error from below
+    UINT16 MaxElevation = 0;
+    for(int iBlockSize = FINEST_BLOCK_SIZE; ; iBlockSize *= 2)
+    {
+        m_Levels.push_back( SLevel() );
+        SLevel &Level = m_Levels.back();
+        Level.iBlockSize = iBlockSize;
+        Level.iNumBlocks = max( (iPatchSize + iBlockSize - 1) / iBlockSize, 1 );
+        Level.MinResiduals.resize(Level.iNumBlocks * Level.iNumBlocks);
+        Level.MaxResiduals.resize(Level.iNumBlocks * Level.iNumBlocks);
+        for(int iBlockY = 0; iBlockY < Level.iNumBlocks; iBlockY++)
+        {
+            int iStartRow = iBlockY * iBlockSize;
+            int iEndRow = min(iStartRow + iBlockSize, iPatchSize);
+            for(int iBlockX = 0; iBlockX < Level.iNumBlocks; iBlockX++)
+            {
+                int iStartCol = iBlockX * iBlockSize;
+                int iEndCol = min(iStartCol + iBlockSize, iPatchSize);
+                double dMinResidual = 0, dMaxResidual = 0;
+                for(int iRow = iStartRow; iRow <= iEndRow; iRow++)
+                {
+                    // Interpolation is linear along the row
+                    double dRowStart = InterpolateCorners(iStartCol, iStartRow, iEndCol, iEndRow, iStartCol, iRow);
+                    double dRowEnd = InterpolateCorners(iStartCol, iStartRow, iEndCol, iEndRow, iEndCol, iRow);
+                    double dRowStep = (dRowEnd - dRowStart) / (double)max(iEndCol - iStartCol, 1);
+                    const UINT16 *pRowElevData = pElevData + iRow * ElevDataPitch;
+                    for(int iCol = iStartCol; iCol <= iEndCol; iCol++)
+                    {
+                        UINT16 Elevation = pRowElevData[iCol];
+                        double dResidual = (double)Elevation - (dRowStart + dRowStep * (double)(iCol - iStartCol));
+                        dMinResidual = min(dMinResidual, dResidual);
+                        dMaxResidual = max(dMaxResidual, dResidual);
+                        MaxElevation = max(MaxElevation, Elevation);
+                    }
+                }
+                int iBlockInd = iBlockX + iBlockY * Level.iNumBlocks;
+                Level.MinResiduals[iBlockInd] = (float)dMinResidual;
+                Level.MaxResiduals[iBlockInd] = (float)dMaxResidual;
+            }
+        }
+        if( Level.iNumBlocks == 1 )
+            break;
+    }
+
+    // All values involved in the exact triangle error calculation do not exceed the maximal
+    // elevation, so its rounding error as well as the rounding of the residuals is far less
+    // than 2^-18 of the maximal elevation
+    m_dRoundingMargin = (double)MaxElevation / (double)(1 << 18);
+}
+
+double CElevMinMaxPyramid::InterpolateCorners(int iStartCol, int iStartRow, int iEndCol, int iEndRow, int iCol, int iRow)const
+{
+    double dFracX = (double)(iCol - iStartCol) / (double)max(iEndCol - iStartCol, 1);
+    double dFracY = (double)(iRow - iStartRow) / (double)max(iEndRow - iStartRow, 1);
+    double dElev00 = m_pElevData[iStartCol + iStartRow * m_ElevDataPitch];
+    double dElev10 = m_pElevData[iEndCol   + iStartRow * m_ElevDataPitch];
+    double dElev01 = m_pElevData[iStartCol + iEndRow   * m_ElevDataPitch];
+    double dElev11 = m_pElevData[iEndCol   + iEndRow   * m_ElevDataPitch];
+    return (dElev00 * (1-dFracX) + dElev10 * dFracX) * (1-dFracY) + (dElev01 * (1-dFracX) + dElev11 * dFracX) * dFracY;
+}
+
+bool CElevMinMaxPyramid::CompareTriangleErrorWithThreshold(const int piVertCols[3],
+                                                           const int piVertRows[3],
+                                                           float fErrorThreshold,
+                                                           bool &bThresholdExceeded)const
+{
+    int iMinCol = min(min(piVertCols[0], piVertCols[1]), piVertCols[2]);
+    int iMaxCol = max(max(piVertCols[0], piVertCols[1]), piVertCols[2]);
+    int iMinRow = min(min(piVertRows[0], piVertRows[1]), piVertRows[2]);
+    int iMaxRow = max(max(piVertRows[0], piVertRows[1]), piVertRows[2]);
+    // Flange triangles are not covered by the pyramid
+    if( iMinCol < 0 || iMinRow < 0 || iMaxCol > m_iPatchSize || iMaxRow > m_iPatchSize )
+        return false;
+    // Small triangles cover a few samples, which are faster to test directly
+    int iExtent = max(iMaxCol - iMinCol, iMaxRow - iMinRow);
+    if( iExtent < FINEST_BLOCK_SIZE )
+        return false;
+
+    int iDoubledArea = (piVertCols[1] - piVertCols[0]) * (piVertRows[2] - piVertRows[0]) -
+                       (piVertCols[2] - piVertCols[0]) * (piVertRows[1] - piVertRows[0]);
+    if( iDoubledArea == 0 )
+        return false;
+
+    // Triangle plane z = Elev0 + dZdX*(x-Col0) + dZdY*(y-Row0)
+    double dElev[3];
+    for(int iVert = 0; iVert < 3; iVert++)
+        dElev[iVert] = (double)m_pElevData[piVertCols[iVert] + piVertRows[iVert]*m_ElevDataPitch];
+    double dZdX = ( (dElev[1] - dElev[0]) * (double)(piVertRows[2] - piVertRows[0]) -
+                    (dElev[2] - dElev[0]) * (double)(piVertRows[1] - piVertRows[0]) ) / (double)iDoubledArea;
+    double dZdY = ( (dElev[2] - dElev[0]) * (double)(piVertCols[1] - piVertCols[0]) -
+                    (dElev[1] - dElev[0]) * (double)(piVertCols[2] - piVertCols[0]) ) / (double)iDoubledArea;
+
+    // Level is selected such that the bounding box is covered by a few blocks
+    int iLevel = 0;
+    while( iLevel < (int)m_Levels.size()-1 && m_Levels[iLevel].iBlockSize * BLOCKS_PER_TRIANGLE < iExtent )
+        iLevel++;
+    const SLevel &Level = m_Levels[iLevel];
+    int iStartBlockX = iMinCol / Level.iBlockSize;
+    int iEndBlockX = min( (iMaxCol-1) / Level.iBlockSize, Level.iNumBlocks-1 );
+    int iStartBlockY = iMinRow / Level.iBlockSize;
+    int iEndBlockY = min( (iMaxRow-1) / Level.iBlockSize, Level.iNumBlocks-1 );
+
+    // Samples are inside the triangle or on its edges if all edge functions are non-negative
+    int iOrientation = iDoubledArea > 0 ? 1 : -1;
+    double dUpperBound = 0, dLowerBound = 0;
+    for(int iBlockY = iStartBlockY; iBlockY <= iEndBlockY; iBlockY++)
+        for(int iBlockX = iStartBlockX; iBlockX <= iEndBlockX; iBlockX++)
+        {
+            int iBlockCols[2] = { iBlockX * Level.iBlockSize, min((iBlockX+1) * Level.iBlockSize, m_iPatchSize) };
+            int iBlockRows[2] = { iBlockY * Level.iBlockSize, min((iBlockY+1) * Level.iBlockSize, m_iPatchSize) };
+
+            bool bBlockOutside = false, bBlockInside = true;
+            for(int iEdge = 0; iEdge < 3 && !bBlockOutside; iEdge++)
+            {
+                int iNextVert = (iEdge+1) % 3;
+                int iEdgeX = piVertCols[iNextVert] - piVertCols[iEdge];
+                int iEdgeY = piVertRows[iNextVert] - piVertRows[iEdge];
+                int iNumCornersOutside = 0;
+                for(int iCorner = 0; iCorner < 4; iCorner++)
+                {
+                    int iDirX = iBlockCols[iCorner & 0x01] - piVertCols[iEdge];
+                    int iDirY = iBlockRows[iCorner >> 1] - piVertRows[iEdge];
+                    if( iOrientation * (iEdgeX * iDirY - iEdgeY * iDirX) < 0 )
+                        iNumCornersOutside++;
+                }
+                bBlockOutside = iNumCornersOutside == 4;
+                bBlockInside &= iNumCornersOutside == 0;
+            }
+            if( bBlockOutside )
+                continue;
+
+            // Covered samples lie in the part of the block inside the bounding box. Difference between
+            // the block interpolation and the triangle plane is bilinear, so its range is attained at the corners
+            int iClippedCols[2] = { max(iBlockCols[0], iMinCol), min(iBlockCols[1], iMaxCol) };
+            int iClippedRows[2] = { max(iBlockRows[0], iMinRow), min(iBlockRows[1], iMaxRow) };
+            double dMinDiff = +DBL_MAX, dMaxDiff = -DBL_MAX;
+            for(int iCorner = 0; iCorner < 4; iCorner++)
+            {
+                int iCol = iClippedCols[iCorner & 0x01], iRow = iClippedRows[iCorner >> 1];
+                double dDiff = InterpolateCorners(iBlockCols[0], iBlockRows[0], iBlockCols[1], iBlockRows[1], iCol, iRow) -
+                               (dElev[0] + dZdX * (double)(iCol - piVertCols[0]) + dZdY * (double)(iRow - piVertRows[0]));
+                dMinDiff = min(dMinDiff, dDiff);
+                dMaxDiff = max(dMaxDiff, dDiff);
+            }
+
+            // Distance from the sample to the plane is the difference plus the sample residual
+            int iBlockInd = iBlockX + iBlockY * Level.iNumBlocks;
+            double dMinResidual = Level.MinResiduals[iBlockInd];
+            double dMaxResidual = Level.MaxResiduals[iBlockInd];
+            dUpperBound = max( dUpperBound, max(dMaxDiff + dMaxResidual, -(dMinDiff + dMinResidual)) );
+            // If all samples of the block are covered, the samples with the minimal and
+            // the maximal residuals are at least this far from the plane
+            if( bBlockInside )
+            {
+                dLowerBound = max( dLowerBound, max(dMinDiff + dMaxResidual, -(dMaxDiff + dMinResidual)) );
+                if( dLowerBound >= (double)fErrorThreshold + m_dRoundingMargin )
+                {
+                    bThresholdExceeded = true;
+                    return true;
+                }
+            }
+        }
+
+    if( dUpperBound < (double)fErrorThreshold - m_dRoundingMargin )
+    {
+        bThresholdExceeded = false;
+        return true;
+    }
+    return false;
+}
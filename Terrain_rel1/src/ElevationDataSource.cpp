@@ -15,12 +15,15 @@
 
 #include "ElevationDataSource.h"
 #include "DynamicQuadTreeNode.h"
+#include "TilePyramidHeightMap.h"
+#include "CompressedHeightMap.h"
+#include "MosaicHeightMap.h"
+#include "SparseHeightMap.h"
+#include "ProceduralHeightMap.h"
+#include "DEMReader.h"
+#include "TaskMgrTBB.h"
 #include <exception>
 
-#include <wincodec.h>
-#include <wincodecsdk.h>
-#pragma comment(lib, "WindowsCodecs.lib")
-
 // Elevation data
 CPatchElevationData::CPatchElevationData(const class CElevationDataSource *pDataSource, 
                                          const SQuadTreeNodeLocation &pos,
@@ -36,9 +39,15 @@ CPatchElevationData::CPatchElevationData(const class CElevationDataSource *pData
     m_iRightBndrExt  ( iRightBndrExt),
     m_iTopBndrExt    (  iTopBndrExt),
     m_iHighResDataLODBias (iHighResDataLODBias),
+    m_pHeightMap(NULL),
+    m_pHighResHeightMap(NULL),
     m_HighResDataPitch(0),
+    m_HighResHeightMapSize(0),
+    m_pDataCache(NULL),
+    m_DataKey(0),
     m_iPatchSize(pDataSource->GetPatchSize()),
-    m_ErrorBound(pDataSource->GetPatchElevDataErrorBound(pos))
+    m_ErrorBound(pDataSource->GetPatchElevDataErrorBound(pos)),
+    m_fMaxReconstructionError(pDataSource->GetMaxReconstructionError(pos.level))
 
 {
     // Height map data returned by the data source will have the following layout:
@@ -55,16 +64,18 @@ CPatchElevationData::CPatchElevationData(const class CElevationDataSource *pData
     //         iPatchSize
     int iPatchSize = GetPatchSize();
     m_Pitch = (iPatchSize + m_iBottomBndrExt + m_iTopBndrExt);
-    m_HeightMap.resize( (iPatchSize + m_iLeftBndrExt + m_iRightBndrExt)*m_Pitch );
+    m_HeightMapSize = (iPatchSize + m_iLeftBndrExt + m_iRightBndrExt)*m_Pitch;
     if( m_iHighResDataLODBias )
     {
         m_HighResDataPitch = m_Pitch << m_iHighResDataLODBias;
-        m_HighResHeightMap.resize( ((iPatchSize + m_iLeftBndrExt + m_iRightBndrExt)<<m_iHighResDataLODBias)*m_HighResDataPitch );
+        m_HighResHeightMapSize = ((iPatchSize + m_iLeftBndrExt + m_iRightBndrExt)<<m_iHighResDataLODBias)*m_HighResDataPitch;
     }
 }
 
 CPatchElevationData::~CPatchElevationData(void)
 {
+    if( m_pDataCache )
+        m_pDataCache->ReleaseTile(m_DataKey, m_pHeightMap);
 }
 
 int CPatchElevationData::GetPatchSize()const
@@ -93,7 +104,7 @@ void CPatchElevationData::GetDataPtr( const UINT16* &pDataPtr,
     
     // Get data pointer
     Pitch = m_Pitch;
-    pDataPtr = &m_HeightMap[ (m_iLeftBndrExt - LeftBoundaryExtension) + (m_iBottomBndrExt-BottomBoundaryExtension) *m_Pitch]; 
+    pDataPtr = &m_pHeightMap[ (m_iLeftBndrExt - LeftBoundaryExtension) + (m_iBottomBndrExt-BottomBoundaryExtension) *m_Pitch]; 
 }
 
 void CPatchElevationData::GetHighResDataPtr( const UINT16* &pHighResDataPtr, 
@@ -111,7 +122,7 @@ void CPatchElevationData::GetHighResDataPtr( const UINT16* &pHighResDataPtr,
     if( m_iHighResDataLODBias )
     {
         HighResDataPitch = m_HighResDataPitch;
-        pHighResDataPtr = &m_HighResHeightMap[ ((m_iLeftBndrExt<<m_iHighResDataLODBias) - LeftBoundaryExtension) + ((m_iBottomBndrExt<<m_iHighResDataLODBias) - BottomBoundaryExtension) *m_HighResDataPitch]; 
+        pHighResDataPtr = &m_pHighResHeightMap[ ((m_iLeftBndrExt<<m_iHighResDataLODBias) - LeftBoundaryExtension) + ((m_iBottomBndrExt<<m_iHighResDataLODBias) - BottomBoundaryExtension) *m_HighResDataPitch]; 
     }
     else
     {
@@ -124,126 +135,379 @@ UINT16 CPatchElevationData::GetApproximationErrorBound()const
     return m_ErrorBound;
 }
 
+// Calculates 64-bit hash of the file content. The words are distributed between four
+// independent lanes so that hashing keeps up with the sequential read of the file
+static HRESULT CalculateFileHash(LPCTSTR strFilePath, UINT64 &Hash)
+{
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("rb") ) != 0 || pFile == NULL )
+        return E_FAIL;
+
+    const UINT64 Prime = 0x100000001B3ULL; // 64-bit FNV prime
+    UINT64 Lanes[4] = {0xCBF29CE484222325ULL, 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL};
+    UINT64 FileSize = 0;
+    std::vector<UINT64> Buffer(1 << 17);
+    size_t BytesRead;
+    while( (BytesRead = fread(&Buffer[0], 1, Buffer.size() * sizeof(UINT64), pFile)) > 0 )
+    {
+        FileSize += BytesRead;
+        // Zero the unused bytes of the last incomplete word
+        size_t NumWords = (BytesRead + sizeof(UINT64) - 1) / sizeof(UINT64);
+        memset( (BYTE*)&Buffer[0] + BytesRead, 0, NumWords * sizeof(UINT64) - BytesRead );
+        for(size_t iWord = 0; iWord < NumWords; iWord++)
+        {
+            UINT64 &Lane = Lanes[iWord & 3];
+            Lane ^= Buffer[iWord];
+            Lane = ((Lane << 29) | (Lane >> 35)) * Prime;
+        }
+    }
+    bool bReadError = ferror(pFile) != 0;
+    fclose(pFile);
+    if( bReadError )
+        return E_FAIL;
+
+    Hash = FileSize;
+    for(int iLane = 0; iLane < 4; iLane++)
+    {
+        // Final avalanche of the lane bits
+        UINT64 Lane = Lanes[iLane];
+        Lane ^= Lane >> 33;
+        Lane *= 0xFF51AFD7ED558CCDULL;
+        Lane ^= Lane >> 33;
+        Lane *= 0xC4CEB9FE1A85EC53ULL;
+        Lane ^= Lane >> 33;
+        Hash = (Hash ^ Lane) * Prime;
+    }
+    return S_OK;
+}
+
+// Returns the DEM file followed by the files it refers to: the tiles of the mosaic or the layers
+// of the sparse height map
+static HRESULT GetDEMFiles(LPCTSTR strSrcDemFile, std::vector<std::wstring> &DEMFiles)
+{
+    std::vector<std::wstring> ReferencedFiles;
+    HRESULT hr = S_OK;
+    if( CMosaicHeightMap::IsMosaicIndexFile(strSrcDemFile) )
+        hr = CMosaicHeightMap::GetTileFiles(strSrcDemFile, ReferencedFiles);
+    else if( CSparseHeightMap::IsSparseHeightMapFile(strSrcDemFile) )
+        hr = CSparseHeightMap::GetLayerFiles(strSrcDemFile, ReferencedFiles);
+    if( FAILED(hr) )
+        return hr;
+    DEMFiles.assign(1, std::wstring(strSrcDemFile));
+    DEMFiles.insert(DEMFiles.end(), ReferencedFiles.begin(), ReferencedFiles.end());
+    return S_OK;
+}
+
+// Calculates the hash of the DEM file content. The files it refers to are identified by their
+// paths, sizes and modification times, since hashing the content of the large mosaic or of the
+// sparse height map layers would take as long as the preprocessing
+static HRESULT CalculateDEMHash(LPCTSTR strSrcDemFile, UINT64 &Hash)
+{
+    std::vector<std::wstring> DEMFiles;
+    HRESULT hr = GetDEMFiles(strSrcDemFile, DEMFiles);
+    if( SUCCEEDED(hr) )
+        hr = CalculateFileHash(strSrcDemFile, Hash);
+    if( FAILED(hr) )
+        return hr;
+
+    const UINT64 Prime = 0x100000001B3ULL; // 64-bit FNV prime
+    for(size_t iFile = 1; iFile < DEMFiles.size(); iFile++)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA FileAttribs;
+        if( !GetFileAttributesEx(DEMFiles[iFile].c_str(), GetFileExInfoStandard, &FileAttribs) )
+            return E_FAIL;
+        for(size_t iChar = 0; iChar < DEMFiles[iFile].length(); iChar++)
+            Hash = (Hash ^ (UINT64)DEMFiles[iFile][iChar]) * Prime;
+        Hash = (Hash ^ (((UINT64)FileAttribs.nFileSizeHigh << 32) | FileAttribs.nFileSizeLow)) * Prime;
+        Hash = (Hash ^ (((UINT64)FileAttribs.ftLastWriteTime.dwHighDateTime << 32) | FileAttribs.ftLastWriteTime.dwLowDateTime)) * Prime;
+    }
+    return S_OK;
+}
+
 // Creates data source from the specified raw data file
 CElevationDataSource::CElevationDataSource(LPCTSTR strSrcDemFile,
-                                           int iPatchSize):
+                                           int iPatchSize,
+                                           const SElevDataSourceParams &Params):
     m_iPatchSize(iPatchSize),
     m_iRequiredLeftBoundaryExt(0),
     m_iRequiredBottomBoundaryExt(0),
     m_iRequiredRightBoundaryExt(0),
     m_iRequiredTopBoundaryExt(0),
-    m_iHighResDataLODBias(0)
+    m_iHighResDataLODBias(0),
+    m_strSrcDemFile(strSrcDemFile),
+    m_DEMHash(0),
+    m_hrDEMHash(S_FALSE)
 {
-    HRESULT hr;
     if( iPatchSize & (iPatchSize-1) )
     {
         CHECK_HR(E_FAIL, _T("Patch size (%d) must be power of 2"), iPatchSize );
         throw std::exception("Patch size must be power of 2");
     }
 
-    V( CoInitialize(NULL) );
+    m_pHeightMap.reset( CreateHeightMapStore(strSrcDemFile, Params) );
+    m_pPatchDataCache.reset( new CTileCache(this, Params.PatchDataCacheBudget) );
+
+    m_iNumCols = m_pHeightMap->GetNumCols();
+    m_iNumRows = m_pHeightMap->GetNumRows();
+
+    // The tree covers the shorter side of the height map, and the longer side is covered
+    // by several trees. Square height map is covered by the single tree
+    m_iNumLevels = 1;
+    while( (m_iPatchSize << (m_iNumLevels-1)) < (int)min(m_iNumCols, m_iNumRows)-1 )
+        m_iNumLevels++;
+    int iTreeSpan = m_iPatchSize << (m_iNumLevels-1);
+    m_iNumRootNodesHorz = max( ((int)m_iNumCols-1 + iTreeSpan-1) / iTreeSpan, 1 );
+    m_iNumRootNodesVert = max( ((int)m_iNumRows-1 + iTreeSpan-1) / iTreeSpan, 1 );
+
+    m_MinMaxElevation.Resize(m_iNumLevels, m_iNumRootNodesHorz, m_iNumRootNodesVert);
+    m_ErrorBounds.Resize(m_iNumLevels-1, m_iNumRootNodesHorz, m_iNumRootNodesVert);
+
+    // Min/max elevations and error bounds depend only on the DEM and the patch size,
+    // so they are loaded from the cache file if it was created for the same data.
+    // If the raw data file is absent (only derived files are shipped), the cache is not used
+    bool bUseHierarchyCache = Params.strHierarchyCacheFile && *Params.strHierarchyCacheFile;
+    UINT64 DEMHash = 0;
+    if( bUseHierarchyCache && FAILED(GetDEMHash(DEMHash)) )
+        bUseHierarchyCache = false;
+    if( !bUseHierarchyCache || FAILED(LoadHierarchyCache(Params.strHierarchyCacheFile, DEMHash, Params)) )
+    {
+        // Calcualte min/max elevations
+        CalculateMinMaxElevations();
+
+        // Calcualte world space error bounds
+        CalculatePatchErrorBounds();
+
+        // Hierarchies calculated from the samples, which failed to load, are not cached
+        if( bUseHierarchyCache && !m_pHeightMap->HasReadErrors() )
+        {
+            HRESULT hr = SaveHierarchyCache(Params.strHierarchyCacheFile, DEMHash, Params);
+            CHECK_HR(hr, _T("Failed to save hierarchy cache file %s"), Params.strHierarchyCacheFile );
+        }
+    }
+}
+
+HRESULT CElevationDataSource::GetDEMHash(UINT64 &DEMHash)const
+{
+    if( m_hrDEMHash == S_FALSE )
+        m_hrDEMHash = CalculateDEMHash(m_strSrcDemFile.c_str(), m_DEMHash);
+    DEMHash = m_DEMHash;
+    return m_hrDEMHash;
+}
+
+// Returns true if the derived file does not exist or is older than some of the source files
+static bool IsDerivedFileOutdated(const std::vector<std::wstring> &SrcFiles, LPCTSTR strDerivedFile)
+{
+    WIN32_FILE_ATTRIBUTE_DATA SrcFileAttribs, DerivedFileAttribs;
+    if( !GetFileAttributesEx(strDerivedFile, GetFileExInfoStandard, &DerivedFileAttribs) )
+        return true;
+    for(size_t iFile = 0; iFile < SrcFiles.size(); iFile++)
+        if( GetFileAttributesEx(SrcFiles[iFile].c_str(), GetFileExInfoStandard, &SrcFileAttribs) &&
+            CompareFileTime(&SrcFileAttribs.ftLastWriteTime, &DerivedFileAttribs.ftLastWriteTime) > 0 )
+            return true;
+    return false;
+}
 
-    // Create components to read 16-bit png data
-    CComPtr<IWICImagingFactory> pFactory;
-    hr = pFactory.CoCreateInstance(CLSID_WICImagingFactory);
-    CHECK_HR(hr, _T("Failed to create WICImagingFactory"));
-   
-    CComPtr<IWICStream> pInputStream;
-    hr = pFactory->CreateStream(&pInputStream);
-    CHECK_HR(hr, _T("Failed to create WICStream"));
+// Creates the height map store as specified by the parameters
+CHeightMapStore* CElevationDataSource :: CreateHeightMapStore(LPCTSTR strSrcDemFile, const SElevDataSourceParams &Params)
+{
+    // Other stores would keep all interpolated samples of the sparse height map, so it is always used directly
+    if( CSparseHeightMap::IsSparseHeightMapFile(strSrcDemFile) )
+        return LoadHeightMap(strSrcDemFile, Params);
 
-    hr = pInputStream->InitializeFromFilename(strSrcDemFile, GENERIC_READ);
-    CHECK_HR(hr, _T("Failed to initialize WICStream from file") );
+    HRESULT hr;
+    std::auto_ptr<CHeightMapStore> pHeightMap;
+    bool bUseTiledFile = Params.strTiledHeightMapFile && *Params.strTiledHeightMapFile;
+    bool bUsePyramidFile = Params.strTilePyramidFile && *Params.strTilePyramidFile;
+    bool bUseCompressedFile = Params.strCompressedHeightMapFile && *Params.strCompressedHeightMapFile;
 
-    CComPtr<IWICBitmapDecoder> pDecoder;
-    hr = pFactory->CreateDecoderFromStream(
-                  pInputStream,
-                  0, // vendor
-                  WICDecodeMetadataCacheOnDemand,
-                  &pDecoder);
-    CHECK_HR(hr, _T("Failed to Create decoder from stream") );
+    // If the DEM files cannot be listed, only the DEM file is checked. The error is reported when it is loaded
+    std::vector<std::wstring> DEMFiles;
+    if( FAILED(GetDEMFiles(strSrcDemFile, DEMFiles)) )
+        DEMFiles.assign(1, std::wstring(strSrcDemFile));
 
-    //GUID ContainerFormat;
-    //pDecoder->GetContainerFormat(&ContainerFormat);
-    //if( ContainerFormat == GUID_ContainerFormatPng )
-    //    printf("Container Format: PNG\n");
-    //else if( ContainerFormat == GUID_ContainerFormatTiff )
-    //    printf("Container Format: TIFF\n");
+    // The procedural height map is used directly unless it is streamed to the tile pyramid, which is
+    // written tile by tile. Other stores would keep all generated samples in memory
+    if( CProceduralHeightMap::IsProceduralHeightMapFile(strSrcDemFile) )
+    {
+        pHeightMap.reset( LoadHeightMap(strSrcDemFile, Params) );
+        if( !bUsePyramidFile )
+            return pHeightMap.release();
 
-    UINT frameCount = 0;
-    hr = pDecoder->GetFrameCount(&frameCount);
-    //printf("Frame count %d\n", frameCount);
-    assert( frameCount == 1 );
+        std::auto_ptr<CTilePyramidHeightMap> pPyramidHeightMap( new CTilePyramidHeightMap );
+        if( !IsDerivedFileOutdated(DEMFiles, Params.strTilePyramidFile) &&
+            SUCCEEDED(pPyramidHeightMap->Open(Params.strTilePyramidFile, Params.TileCacheBudget)) )
+            return pPyramidHeightMap.release();
 
-    CComPtr<IWICBitmapFrameDecode> pTheFrame;
-    pDecoder->GetFrame(0, &pTheFrame);
+        hr = CTilePyramidHeightMap::CreatePyramidFile(Params.strTilePyramidFile, *pHeightMap);
+        if( SUCCEEDED(hr) )
+            hr = pPyramidHeightMap->Open(Params.strTilePyramidFile, Params.TileCacheBudget);
+        CHECK_HR(hr, _T("Failed to create tile pyramid file %s. Procedural height map will be used directly"), Params.strTilePyramidFile );
+        if( SUCCEEDED(hr) )
+            return pPyramidHeightMap.release();
+        return pHeightMap.release();
+    }
 
-    UINT width = 0;
-    UINT height = 0;
-    pTheFrame->GetSize(&width, &height);
+    // Try to open the compressed height map and the tile pyramid first as they do not
+    // require any other data. The compressed file is rebuilt if the precision changes
+    if( bUseCompressedFile )
+    {
+        std::auto_ptr<CCompressedHeightMap> pCompressedHeightMap( new CCompressedHeightMap );
+        if( !IsDerivedFileOutdated(DEMFiles, Params.strCompressedHeightMapFile) &&
+            SUCCEEDED(pCompressedHeightMap->Open(Params.strCompressedHeightMapFile, Params.TileCacheBudget)) &&
+            pCompressedHeightMap->GetReconstructionPrecision() == CCompressedHeightMap::GetQuantizationStep(Params.fReconstrPrecision) * 0.5f )
+            return pCompressedHeightMap.release();
+    }
+    else if( bUsePyramidFile )
+    {
+        std::auto_ptr<CTilePyramidHeightMap> pPyramidHeightMap( new CTilePyramidHeightMap );
+        if( !IsDerivedFileOutdated(DEMFiles, Params.strTilePyramidFile) &&
+            SUCCEEDED(pPyramidHeightMap->Open(Params.strTilePyramidFile, Params.TileCacheBudget)) )
+            return pPyramidHeightMap.release();
+    }
 
-    // Calculate minimal number of columns and rows
-    // in the form 2^n+1 that encompass the data
-    m_iNumCols = 1;
-    m_iNumRows = 1;
-    while( m_iNumCols+1 < width || m_iNumRows+1 < height)
+    if( bUseTiledFile )
     {
-        m_iNumCols *= 2;
-        m_iNumRows *= 2;
+        std::auto_ptr<CMappedTiledHeightMap> pMappedHeightMap( new CMappedTiledHeightMap );
+        if( IsDerivedFileOutdated(DEMFiles, Params.strTiledHeightMapFile) || 
+            FAILED(pMappedHeightMap->Open(Params.strTiledHeightMapFile)) )
+        {
+            // Tiled file does not exist or is invalid: create it from the raw data file
+            std::auto_ptr<CHeightMapStore> pSrcHeightMap( LoadHeightMap(strSrcDemFile, Params) );
+            hr = CMappedTiledHeightMap::CreateTiledFile(Params.strTiledHeightMapFile, *pSrcHeightMap);
+            if( SUCCEEDED(hr) )
+                hr = pMappedHeightMap->Open(Params.strTiledHeightMapFile);
+            CHECK_HR(hr, _T("Failed to create tiled height map file %s. Resident height map will be used"), Params.strTiledHeightMapFile );
+            // Fall back to the resident height map if the tiled file cannot be used
+            if( FAILED(hr) )
+                pHeightMap = pSrcHeightMap;
+        }
+        if( !pHeightMap.get() )
+            pHeightMap = pMappedHeightMap;
+    }
+    else
+    {
+        pHeightMap.reset( LoadHeightMap(strSrcDemFile, Params) );
+        if( Params.bBlockCompressedHeightMap )
+            pHeightMap.reset( new CBlockCompressedHeightMap(*pHeightMap) );
+        else if( Params.bMortonHeightMapLayout )
+            pHeightMap.reset( new CMortonHeightMap(*pHeightMap) );
     }
 
-    m_iNumLevels = 1;
-    while( (m_iPatchSize << (m_iNumLevels-1)) < (int)m_iNumCols ||
-           (m_iPatchSize << (m_iNumLevels-1)) < (int)m_iNumRows )
-        m_iNumLevels++;
+    if( bUseCompressedFile )
+    {
+        // Compress the loaded height map
+        std::auto_ptr<CCompressedHeightMap> pCompressedHeightMap( new CCompressedHeightMap );
+        hr = CCompressedHeightMap::CreateCompressedFile(Params.strCompressedHeightMapFile, *pHeightMap, Params.fReconstrPrecision);
+        if( SUCCEEDED(hr) )
+            hr = pCompressedHeightMap->Open(Params.strCompressedHeightMapFile, Params.TileCacheBudget);
+        CHECK_HR(hr, _T("Failed to create compressed height map file %s"), Params.strCompressedHeightMapFile );
+        if( SUCCEEDED(hr) )
+            return pCompressedHeightMap.release();
+    }
+    else if( bUsePyramidFile )
+    {
+        // Build the pyramid from the loaded height map
+        std::auto_ptr<CTilePyramidHeightMap> pPyramidHeightMap( new CTilePyramidHeightMap );
+        hr = CTilePyramidHeightMap::CreatePyramidFile(Params.strTilePyramidFile, *pHeightMap);
+        if( SUCCEEDED(hr) )
+            hr = pPyramidHeightMap->Open(Params.strTilePyramidFile, Params.TileCacheBudget);
+        CHECK_HR(hr, _T("Failed to create tile pyramid file %s"), Params.strTilePyramidFile );
+        if( SUCCEEDED(hr) )
+            return pPyramidHeightMap.release();
+    }
 
-    m_iNumCols++;
-    m_iNumRows++;
+    // The tile pyramid already stores decimated levels, so only other stores are decorated
+    if( Params.bDecimatedLODPyramid )
+        pHeightMap.reset( new CDecimatedHeightMap(pHeightMap.release()) );
+
+    return pHeightMap.release();
+}
 
-    GUID pixelFormat = { 0 };
-    pTheFrame->GetPixelFormat(&pixelFormat);
-    if( pixelFormat != GUID_WICPixelFormat16bppGray )
+// Executes the task set on the task manager threads and waits for its completion
+static void ExecuteTaskSet(TASKSETFUNC pTaskSetFunc, VOID *pTaskSetData, UINT uiNumTasks, LPCSTR strTaskSetName)
+{
+    TASKSETHANDLE hTaskSet;
+    if( gTaskMgr.CreateTaskSet(pTaskSetFunc, pTaskSetData, uiNumTasks, NULL, 0, strTaskSetName, &hTaskSet) )
     {
-        assert(false);
-        throw std::exception("expected 16 bit format");
+        gTaskMgr.WaitForSet(hTaskSet);
+        gTaskMgr.ReleaseHandle(hTaskSet);
     }
+    else
+    {
+        // Execute the tasks on this thread if the task set could not be created
+        for(UINT uiTask = 0; uiTask < uiNumTasks; uiTask++)
+            pTaskSetFunc(pTaskSetData, 0, uiTask, uiNumTasks);
+    }
+}
+
+// Data of the task set decoding the DEM file
+struct SDEMDecodeTaskSetData
+{
+    DEM_TASK_FUNC pTaskFunc;
+    void *pTaskData;
+};
+
+static void DEMDecodeTaskSetFunc(VOID* pvInfo, INT iContext, UINT uTaskId, UINT uTaskCount)
+{
+    const SDEMDecodeTaskSetData &TaskSetData = *static_cast<const SDEMDecodeTaskSetData*>(pvInfo);
+    TaskSetData.pTaskFunc(TaskSetData.pTaskData, uTaskId);
+}
+
+// Runs DEM decoding tasks on the task manager threads
+static void DEMDecodeParallelFor(DEM_TASK_FUNC pTaskFunc, void *pTaskData, unsigned int uiNumTasks, void *pUserData)
+{
+    SDEMDecodeTaskSetData TaskSetData = {pTaskFunc, pTaskData};
+    ExecuteTaskSet(DEMDecodeTaskSetFunc, &TaskSetData, uiNumTasks, "Decode DEM");
+}
+
+// Decodes the raw data file. Only the samples of the file are stored: the height map is
+// padded to the extent of the quad trees by clamping the coordinates of the requested samples.
+// The mosaic of DEM files is not decoded: its tiles are streamed through the tile cache.
+// Only the layers of the sparse height map are decoded. The procedural height map is generated on the fly
+CHeightMapStore* CElevationDataSource :: LoadHeightMap(LPCTSTR strSrcDemFile, const SElevDataSourceParams &Params)
+{
+    if( CMosaicHeightMap::IsMosaicIndexFile(strSrcDemFile) )
+    {
+        std::auto_ptr<CMosaicHeightMap> pMosaicHeightMap( new CMosaicHeightMap );
+        if( FAILED(pMosaicHeightMap->Open(strSrcDemFile, Params.TileCacheBudget)) )
+            throw std::exception("Failed to open DEM mosaic");
+        return pMosaicHeightMap.release();
+    }
+    if( CSparseHeightMap::IsSparseHeightMapFile(strSrcDemFile) )
+    {
+        std::auto_ptr<CSparseHeightMap> pSparseHeightMap( new CSparseHeightMap );
+        if( FAILED(pSparseHeightMap->Open(strSrcDemFile, DEMDecodeParallelFor, NULL)) )
+            throw std::exception("Failed to open sparse height map");
+        return pSparseHeightMap.release();
+    }
+    if( CProceduralHeightMap::IsProceduralHeightMapFile(strSrcDemFile) )
+    {
+        std::auto_ptr<CProceduralHeightMap> pProceduralHeightMap( new CProceduralHeightMap );
+        if( FAILED(pProceduralHeightMap->Open(strSrcDemFile)) )
+            throw std::exception("Failed to open procedural height map");
+        return pProceduralHeightMap.release();
+    }
+
+    CDEMReader DEMReader;
+    DEMReader.SetParallelFor(DEMDecodeParallelFor, NULL);
+    if( !DEMReader.Open(strSrcDemFile, Params.uiRawDEMWidth, Params.uiRawDEMHeight) )
+    {
+        CHECK_HR(E_FAIL, _T("Failed to open DEM file %s: %S"), strSrcDemFile, DEMReader.GetErrorMessage() );
+        throw std::exception("Failed to open DEM file");
+    }
+
+    UINT width = DEMReader.GetWidth();
+    UINT height = DEMReader.GetHeight();
 
     // Load the data
-    m_TheHeightMap.resize( m_iNumCols * m_iNumRows );
-    WICRect SrcRect;
-    SrcRect.X = 0;
-    SrcRect.Y = 0;
-    SrcRect.Height = height;
-    SrcRect.Width = width;
-    pTheFrame->CopyPixels(
-      &SrcRect,
-      (UINT)m_iNumCols*2, //UINT stride
-      (UINT)m_TheHeightMap.size()*2, //UINT bufferSize
-      (BYTE*)&m_TheHeightMap[0]);
-
-    // Duplicate the last row and column
-    for(UINT iRow = 0; iRow < height; iRow++)
-        for(UINT iCol = width; iCol < m_iNumCols; iCol++)
-            m_TheHeightMap[iCol + iRow * m_iNumCols] = m_TheHeightMap[(width-1) + iRow * m_iNumCols];
-    for(UINT iCol = 0; iCol < m_iNumCols; iCol++)
-        for(UINT iRow = height; iRow < m_iNumRows; iRow++)
-            m_TheHeightMap[iCol + iRow * m_iNumCols] = m_TheHeightMap[iCol + (height-1) * m_iNumCols];
-
-    pTheFrame.Release();
-    pFactory.Release();
-    pDecoder.Release();
-    pInputStream.Release();
-
-    CoUninitialize();
-
-    m_MinMaxElevation.Resize(m_iNumLevels);
-    m_ErrorBounds.Resize(m_iNumLevels-1);
-    
-    // Calcualte min/max elevations
-    CalculateMinMaxElevations();
+    std::auto_ptr<CResidentHeightMap> pHeightMap( new CResidentHeightMap(width, height) );
+    if( !DEMReader.Read(pHeightMap->GetDataPtr(), width) )
+    {
+        CHECK_HR(E_FAIL, _T("Failed to decode DEM file %s: %S"), strSrcDemFile, DEMReader.GetErrorMessage() );
+        throw std::exception("Failed to decode DEM file");
+    }
 
-    // Calcualte world space error bounds
-    CalculatePatchErrorBounds();
+    return pHeightMap.release();
 }
 
 CElevationDataSource::~CElevationDataSource(void)
@@ -258,13 +522,7 @@ void CElevationDataSource :: FillPatchHeightMap(UINT16 *pDataPtr,
                                                 int iStartRow, int iEndRow, 
                                                 int iStep)const
 {
-    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
-        for(int iCol = iStartCol; iCol < iEndCol; iCol++)
-        {
-            int iSrcCol = max(0, iCol*iStep); iSrcCol = min(iSrcCol, (int)m_iNumCols-1);
-            int iSrcRow = max(0, iRow*iStep); iSrcRow = min(iSrcRow, (int)m_iNumRows-1);
-            pDataPtr[(iCol-iStartCol) + (iRow-iStartRow) * DataPitch] = m_TheHeightMap[iSrcCol + iSrcRow * m_iNumCols];
-        }
+    m_pHeightMap->FillHeightMap(pDataPtr, DataPitch, iStartCol, iEndCol, iStartRow, iEndRow, iStep);
 }
 
 // Copies height map to the specified memory location
@@ -286,6 +544,50 @@ void CElevationDataSource :: FillPatchHeightMap(const SQuadTreeNodeLocation &pos
     FillPatchHeightMap(pDataPtr, DataPitch, iStartCol<<iLODBias, iEndCol<<iLODBias, iStartRow<<iLODBias, iEndRow<<iLODBias, iStep>>iLODBias);
 }
 
+// Starts asynchronous reads of the data filled by FillPatchHeightMap() with the same arguments
+bool CElevationDataSource :: PrefetchPatchHeightMap(const SQuadTreeNodeLocation &pos,
+                                                    int iLeftExt,
+                                                    int iBottomExt,
+                                                    int iRightExt,
+                                                    int iTopExt,
+                                                    int iLODBias)const
+{
+    int iStep = 1 << (m_iNumLevels-1 - pos.level);
+    int iStartCol =  pos.horzOrder    * m_iPatchSize - iLeftExt;
+    int iEndCol   = (pos.horzOrder+1) * m_iPatchSize + iRightExt;
+    int iStartRow =  pos.vertOrder    * m_iPatchSize - iBottomExt;
+    int iEndRow   = (pos.vertOrder+1) * m_iPatchSize + iTopExt;
+    return m_pHeightMap->PrefetchRegion(iStartCol<<iLODBias, iEndCol<<iLODBias, iStartRow<<iLODBias, iEndRow<<iLODBias, iStep>>iLODBias);
+}
+
+// Starts asynchronous reads of the source data of the patch height maps
+// Returns true if the patch data is in the cache or its source data is resident
+bool CElevationDataSource :: PrefetchElevData(const SQuadTreeNodeLocation &Pos)const
+{
+    if( m_pPatchDataCache->IsTileResident( GetPatchDataKey(Pos) ) )
+        return true;
+
+    // Both height maps are prefetched, so the reads of the high resolution
+    // data are issued even if the main data is not resident yet
+    int iHighResDataLODBias = GetHighResDataLODBias(Pos.level);
+    bool bResident = PrefetchPatchHeightMap( Pos, 
+                                             m_iRequiredLeftBoundaryExt, 
+                                             m_iRequiredBottomBoundaryExt, 
+                                             m_iRequiredRightBoundaryExt, 
+                                             m_iRequiredTopBoundaryExt,
+                                             0 );
+    if( iHighResDataLODBias )
+    {
+        bResident = PrefetchPatchHeightMap( Pos, 
+                                            m_iRequiredLeftBoundaryExt, 
+                                            m_iRequiredBottomBoundaryExt, 
+                                            m_iRequiredRightBoundaryExt, 
+                                            m_iRequiredTopBoundaryExt,
+                                            iHighResDataLODBias ) && bResident;
+    }
+    return bResident;
+}
+
 void CElevationDataSource :: GetPatchMinMaxElevation(const SQuadTreeNodeLocation &pos,
                                                      UINT16 &MinElevation, 
                                                      UINT16 &MaxElevation)const
@@ -296,12 +598,18 @@ void CElevationDataSource :: GetPatchMinMaxElevation(const SQuadTreeNodeLocation
 
 UINT16 CElevationDataSource :: GetGlobalMinElevation()const
 {
-    return m_MinMaxElevation[SQuadTreeNodeLocation()].first;
+    UINT16 MinElevation = UINT16_MAX;
+    for(int iRoot = 0; iRoot < m_iNumRootNodesHorz * m_iNumRootNodesVert; iRoot++)
+        MinElevation = min( MinElevation, m_MinMaxElevation.GetLevelData(0)[iRoot].first );
+    return MinElevation;
 }
 
 UINT16 CElevationDataSource :: GetGlobalMaxElevation()const
 {
-    return m_MinMaxElevation[SQuadTreeNodeLocation()].second;
+    UINT16 MaxElevation = 0;
+    for(int iRoot = 0; iRoot < m_iNumRootNodesHorz * m_iNumRootNodesVert; iRoot++)
+        MaxElevation = max( MaxElevation, m_MinMaxElevation.GetLevelData(0)[iRoot].second );
+    return MaxElevation;
 }
 
 UINT16 CElevationDataSource :: GetPatchElevDataErrorBound(const SQuadTreeNodeLocation &pos)const
@@ -312,56 +620,494 @@ UINT16 CElevationDataSource :: GetPatchElevDataErrorBound(const SQuadTreeNodeLoc
         return 0;
 }
 
-// Calculates min/max elevations for the hierarchy
-void CElevationDataSource :: CalculateMinMaxElevations()
+// Returns true if the descendants of the patch contain samples, which are not present in the patch
+bool CElevationDataSource :: HasFinerData(const SQuadTreeNodeLocation &pos)const
 {
-    // Calculate min/max elevations for the finest level patches
-    int iPatchesAlongFinestLevelSide = 1 << (m_iNumLevels-1);
-    for( int vertOrder = 0; vertOrder < iPatchesAlongFinestLevelSide; vertOrder++)
+    if( pos.level >= m_iNumLevels-1 )
+        return false;
+    int iStepLog2 = m_iNumLevels-1 - pos.level;
+    int iPatchSpan = m_iPatchSize << iStepLog2;
+    return m_pHeightMap->GetSampleSpacingLog2(pos.horzOrder * iPatchSpan, (pos.horzOrder+1) * iPatchSpan + 1,
+                                              pos.vertOrder * iPatchSpan, (pos.vertOrder+1) * iPatchSpan + 1) < iStepLog2;
+}
+
+// Gathers the sample quads surrounding the query positions
+void CElevationDataSource :: GatherQueryBatch(const D3DXVECTOR2 *pPositions, int iNumQueries, int iStepLog2, SQueryBatch &Batch)const
+{
+    assert( iNumQueries <= QUERY_BATCH_SIZE );
+    float fMaxCol = (float)(m_pHeightMap->GetNumCols()-1);
+    float fMaxRow = (float)(m_pHeightMap->GetNumRows()-1);
+    float fInvStep = 1.f / (float)(1 << iStepLog2);
+    for(int iQuery = 0; iQuery < iNumQueries; iQuery++)
     {
-        for( int horzOrder = 0; horzOrder < iPatchesAlongFinestLevelSide; horzOrder++)
+        // Coordinates are not negative after clamping, so truncation is the floor
+        float fCol = min( max(pPositions[iQuery].x, 0.f), fMaxCol ) * fInvStep;
+        float fRow = min( max(pPositions[iQuery].y, 0.f), fMaxRow ) * fInvStep;
+        Batch.Cols[iQuery] = (int)fCol;
+        Batch.Rows[iQuery] = (int)fRow;
+        Batch.FracX[iQuery] = fCol - (float)Batch.Cols[iQuery];
+        Batch.FracY[iQuery] = fRow - (float)Batch.Rows[iQuery];
+    }
+    m_pHeightMap->GatherSampleQuads(Batch.Cols, Batch.Rows, iNumQueries, 1 << iStepLog2, Batch.Quads);
+}
+
+// Returns bilinearly interpolated elevations at the positions
+void CElevationDataSource :: QueryHeights(const D3DXVECTOR2 *pPositions, float *pHeights, size_t NumQueries, int iStepLog2)const
+{
+    SQueryBatch Batch;
+    for(size_t Start = 0; Start < NumQueries; Start += QUERY_BATCH_SIZE)
+    {
+        int iNumQueries = (int)min(NumQueries - Start, (size_t)QUERY_BATCH_SIZE);
+        GatherQueryBatch(pPositions + Start, iNumQueries, iStepLog2, Batch);
+        InterpolateSampleQuads(Batch.Quads, Batch.FracX, Batch.FracY, iNumQueries, pHeights + Start);
+    }
+}
+
+// Returns normals of the bilinearly interpolated surface at the positions
+void CElevationDataSource :: QueryNormals(const D3DXVECTOR2 *pPositions, D3DXVECTOR3 *pNormals, size_t NumQueries,
+                                          float fSampleSpacing, float fElevationScale, int iStepLog2)const
+{
+    SQueryBatch Batch;
+    float Heights[QUERY_BATCH_SIZE], GradX[QUERY_BATCH_SIZE], GradY[QUERY_BATCH_SIZE];
+    // Gradients are calculated per level sample
+    float fGradScale = fElevationScale / (fSampleSpacing * (float)(1 << iStepLog2));
+    for(size_t Start = 0; Start < NumQueries; Start += QUERY_BATCH_SIZE)
+    {
+        int iNumQueries = (int)min(NumQueries - Start, (size_t)QUERY_BATCH_SIZE);
+        GatherQueryBatch(pPositions + Start, iNumQueries, iStepLog2, Batch);
+        InterpolateSampleQuads(Batch.Quads, Batch.FracX, Batch.FracY, iNumQueries, Heights, GradX, GradY);
+        for(int iQuery = 0; iQuery < iNumQueries; iQuery++)
         {
-            std::pair<UINT16, UINT16> &CurrPatchMinMaxElev = m_MinMaxElevation[SQuadTreeNodeLocation(horzOrder, vertOrder, m_iNumLevels-1)];
-            int iStartCol = horzOrder*m_iPatchSize;
-            int iStartRow = vertOrder*m_iPatchSize;
-            CurrPatchMinMaxElev.first = CurrPatchMinMaxElev.second = m_TheHeightMap[iStartCol + iStartRow*m_iNumCols];
-            for(int iRow = iStartRow; iRow <= iStartRow + m_iPatchSize; iRow++)
-                for(int iCol = iStartCol; iCol <= iStartCol + m_iPatchSize; iCol++)
-                {
-                    UINT16 CurrElev = m_TheHeightMap[iCol + iRow*m_iNumCols];
-                    CurrPatchMinMaxElev.first = min(CurrPatchMinMaxElev.first, CurrElev);
-                    CurrPatchMinMaxElev.second = max(CurrPatchMinMaxElev.second, CurrElev);
-                }
+            float fNx = -GradX[iQuery] * fGradScale;
+            float fNy = -GradY[iQuery] * fGradScale;
+            float fInvLen = 1.f / sqrtf(fNx*fNx + fNy*fNy + 1.f);
+            pNormals[Start + iQuery] = D3DXVECTOR3(fNx * fInvLen, fNy * fInvLen, fInvLen);
         }
     }
+}
+
+// Calculates min/max elevations for the hierarchy
+// Data of the task set calculating min/max elevations of the finest level patches
+struct CElevationDataSource::SMinMaxTaskSetData
+{
+    CElevationDataSource *pDataSource;
+    SIMD_LEVEL SIMDLevel;
+};
+
+void CElevationDataSource :: CalculateMinMaxElevationsTask(VOID* pvInfo, INT iContext, UINT uTaskId, UINT uTaskCount)
+{
+    const SMinMaxTaskSetData &TaskSetData = *static_cast<const SMinMaxTaskSetData*>(pvInfo);
+    TaskSetData.pDataSource->CalculateFinestLevelMinMaxElevations(uTaskId, TaskSetData.SIMDLevel);
+}
+
+// Calculates min/max elevations for the finest level patches in the specified row
+void CElevationDataSource :: CalculateFinestLevelMinMaxElevations(int iPatchRow, SIMD_LEVEL SIMDLevel)
+{
+    std::vector<UINT16> PatchHeightMap( (m_iPatchSize+1) * (m_iPatchSize+1) );
+    int iFinestLevelPatchesHorz = m_iNumRootNodesHorz << (m_iNumLevels-1);
+    for( int horzOrder = 0; horzOrder < iFinestLevelPatchesHorz; horzOrder++)
+        CalculateFinestLevelMinMaxElevation(SQuadTreeNodeLocation(horzOrder, iPatchRow, m_iNumLevels-1), PatchHeightMap, SIMDLevel);
+}
+
+void CElevationDataSource :: CalculateFinestLevelMinMaxElevation(const SQuadTreeNodeLocation &Pos,
+                                                                 std::vector<UINT16> &PatchHeightMap,
+                                                                 SIMD_LEVEL SIMDLevel)
+{
+    std::pair<UINT16, UINT16> &CurrPatchMinMaxElev = m_MinMaxElevation[Pos];
+    if( IsPatchInPaddedArea(Pos) )
+    {
+        // Samples of the patch duplicate the samples of its neighbours. Empty range
+        // does not affect min/max elevations of the ancestors
+        CurrPatchMinMaxElev.first = UINT16_MAX;
+        CurrPatchMinMaxElev.second = 0;
+        return;
+    }
+    // Samples of the sparse height map are not interpolated in the regions without the full
+    // resolution data: the elevations are bounded by the source samples
+    int iStartCol =  Pos.horzOrder    * m_iPatchSize;
+    int iEndCol   = (Pos.horzOrder+1) * m_iPatchSize + 1;
+    int iStartRow =  Pos.vertOrder    * m_iPatchSize;
+    int iEndRow   = (Pos.vertOrder+1) * m_iPatchSize + 1;
+    if( m_pHeightMap->GetSampleSpacingLog2(iStartCol, iEndCol, iStartRow, iEndRow) > 0 &&
+        m_pHeightMap->GetElevationBounds(iStartCol, iEndCol, iStartRow, iEndRow, CurrPatchMinMaxElev.first, CurrPatchMinMaxElev.second) )
+        return;
+    FillPatchHeightMap(Pos, &PatchHeightMap[0], m_iPatchSize+1, 0,0,1,1);
+    CalculateMinMaxElevation(&PatchHeightMap[0], m_iPatchSize+1, m_iPatchSize+1, m_iPatchSize+1,
+                             CurrPatchMinMaxElev.first, CurrPatchMinMaxElev.second, SIMDLevel);
+}
+
+// Calculates min/max elevations of the coarse level patch from its children
+void CElevationDataSource :: CalculateMinMaxElevationFromChildren(const SQuadTreeNodeLocation &Pos)
+{
+    std::pair<UINT16, UINT16> &CurrPatchMinMaxElev = m_MinMaxElevation[Pos];
+    std::pair<UINT16, UINT16> &LBChildMinMaxElev = m_MinMaxElevation[GetChildLocation(Pos, 0)];
+    std::pair<UINT16, UINT16> &RBChildMinMaxElev = m_MinMaxElevation[GetChildLocation(Pos, 1)];
+    std::pair<UINT16, UINT16> &LTChildMinMaxElev = m_MinMaxElevation[GetChildLocation(Pos, 2)];
+    std::pair<UINT16, UINT16> &RTChildMinMaxElev = m_MinMaxElevation[GetChildLocation(Pos, 3)];
+
+    CurrPatchMinMaxElev.first = min( LBChildMinMaxElev.first, RBChildMinMaxElev.first );
+    CurrPatchMinMaxElev.first = min( CurrPatchMinMaxElev.first, LTChildMinMaxElev.first );
+    CurrPatchMinMaxElev.first = min( CurrPatchMinMaxElev.first, RTChildMinMaxElev.first );
+
+    CurrPatchMinMaxElev.second = max( LBChildMinMaxElev.second, RBChildMinMaxElev.second);
+    CurrPatchMinMaxElev.second = max( CurrPatchMinMaxElev.second, LTChildMinMaxElev.second );
+    CurrPatchMinMaxElev.second = max( CurrPatchMinMaxElev.second, RTChildMinMaxElev.second );
+}
+
+void CElevationDataSource :: CalculateMinMaxElevations(SIMD_LEVEL SIMDLevel, bool bParallel)
+{
+    // Calculate min/max elevations for the finest level patches. Each row of patches is processed by a separate task
+    int iFinestLevelPatchesVert = m_iNumRootNodesVert << (m_iNumLevels-1);
+    if( bParallel )
+    {
+        SMinMaxTaskSetData TaskSetData = {this, SIMDLevel};
+        ExecuteTaskSet(CalculateMinMaxElevationsTask, &TaskSetData, iFinestLevelPatchesVert, "Min/max elevations");
+    }
+    else
+    {
+        for( int vertOrder = 0; vertOrder < iFinestLevelPatchesVert; vertOrder++)
+            CalculateFinestLevelMinMaxElevations(vertOrder, SIMDLevel);
+    }
 
     // Recursively calculate min/max elevations for the coarser levels
-    for( HierarchyReverseIterator it(m_iNumLevels-1); it.IsValid(); it.Next() )
+    for( HierarchyReverseIterator it(m_iNumLevels-1, m_iNumRootNodesHorz, m_iNumRootNodesVert); it.IsValid(); it.Next() )
+        CalculateMinMaxElevationFromChildren(it);
+
+    // Coarse levels of the lossy compressed height map are quantized with larger steps, so
+    // their samples may be outside the range of the finest level samples
+    for( int iLevel = 0; iLevel < m_iNumLevels-1; iLevel++ )
     {
-        std::pair<UINT16, UINT16> &CurrPatchMinMaxElev = m_MinMaxElevation[it];
-        std::pair<UINT16, UINT16> &LBChildMinMaxElev = m_MinMaxElevation[GetChildLocation(it, 0)];
-        std::pair<UINT16, UINT16> &RBChildMinMaxElev = m_MinMaxElevation[GetChildLocation(it, 1)];
-        std::pair<UINT16, UINT16> &LTChildMinMaxElev = m_MinMaxElevation[GetChildLocation(it, 2)];
-        std::pair<UINT16, UINT16> &RTChildMinMaxElev = m_MinMaxElevation[GetChildLocation(it, 3)];
+        int iStep = 1 << (m_iNumLevels-1 - iLevel);
+        int iMaxError = (int)ceil( m_pHeightMap->GetMaxReconstructionError(iStep) + m_pHeightMap->GetMaxReconstructionError(1) );
+        if( iMaxError == 0 )
+            continue;
+        std::pair<UINT16, UINT16> *pLevelMinMax = m_MinMaxElevation.GetLevelData(iLevel);
+        size_t NumElementsInLevel = m_MinMaxElevation.GetNumElementsInLevel(iLevel);
+        for(size_t Elem = 0; Elem < NumElementsInLevel; Elem++)
+        {
+            pLevelMinMax[Elem].first  = (UINT16)max( (int)pLevelMinMax[Elem].first - iMaxError, 0 );
+            pLevelMinMax[Elem].second = (UINT16)min( (int)pLevelMinMax[Elem].second + iMaxError, 0xFFFF );
+        }
+    }
+}
+
+// Measures the throughput of the min/max elevation calculation for all supported
+// instruction sets on one and all threads and writes the results to the file
+void CElevationDataSource :: BenchmarkMinMaxElevations(LPCTSTR strStatFile)
+{
+    FILE *pStatFile;
+    if( _tfopen_s(&pStatFile, strStatFile, _T("wt")) != 0 )
+        return;
+
+    double dBytesProcessed = (double)m_MinMaxElevation.GetNumElementsInLevel(m_iNumLevels-1) * 
+                             (m_iPatchSize+1) * (m_iPatchSize+1) * sizeof(UINT16);
+    _ftprintf_s(pStatFile, _T("Height map: %d x %d, patch size: %d\n"), m_iNumCols, m_iNumRows, m_iPatchSize);
+
+    LARGE_INTEGER PerfFreq;
+    QueryPerformanceFrequency( &PerfFreq );
+    for(int iSIMDLevel = SIMD_LEVEL_SCALAR; iSIMDLevel <= GetSupportedSIMDLevel(); iSIMDLevel++)
+    {
+        for(int iParallel = 0; iParallel < 2; iParallel++)
+        {
+            // The best of several runs is reported to exclude the first access to the data
+            const int NUM_RUNS = 3;
+            double dBestTime = 0;
+            for(int iRun = 0; iRun < NUM_RUNS; iRun++)
+            {
+                LARGE_INTEGER StartTick, EndTick;
+                QueryPerformanceCounter( &StartTick );
+                CalculateMinMaxElevations( (SIMD_LEVEL)iSIMDLevel, iParallel != 0 );
+                QueryPerformanceCounter( &EndTick );
+                double dTime = (double)(EndTick.QuadPart - StartTick.QuadPart) / (double)PerfFreq.QuadPart;
+                if( iRun == 0 || dTime < dBestTime )
+                    dBestTime = dTime;
+            }
+            _ftprintf_s(pStatFile, _T("Min/max elevations (%s, %s): %.1lf ms, %.2lf GB/s\n"), 
+                        GetSIMDLevelName((SIMD_LEVEL)iSIMDLevel), 
+                        iParallel ? _T("all threads") : _T("1 thread"),
+                        dBestTime * 1000.0,
+                        dBytesProcessed / max(dBestTime, 1e-9) / 1e9 );
+        }
+    }
+
+    fclose(pStatFile);
+}
+
+// Returns time of fetching the patches of the level from the height map store
+static double MeasurePatchFetchTime(const CHeightMapStore &HeightMap,
+                                    const std::vector<SQuadTreeNodeLocation> &Patches,
+                                    int iPatchSize,
+                                    int iNumLevels)
+{
+    LARGE_INTEGER PerfFreq, StartTick, EndTick;
+    QueryPerformanceFrequency( &PerfFreq );
+    std::vector<UINT16> PatchHeightMap( (iPatchSize+1) * (iPatchSize+1) );
+    QueryPerformanceCounter( &StartTick );
+    for(size_t iPatch = 0; iPatch < Patches.size(); iPatch++)
+    {
+        const SQuadTreeNodeLocation &Pos = Patches[iPatch];
+        int iStep = 1 << (iNumLevels-1 - Pos.level);
+        HeightMap.FillHeightMap(&PatchHeightMap[0], iPatchSize+1, 
+                                Pos.horzOrder * iPatchSize, (Pos.horzOrder+1) * iPatchSize + 1,
+                                Pos.vertOrder * iPatchSize, (Pos.vertOrder+1) * iPatchSize + 1,
+                                iStep);
+    }
+    QueryPerformanceCounter( &EndTick );
+    return (double)(EndTick.QuadPart - StartTick.QuadPart) / (double)PerfFreq.QuadPart;
+}
+
+// Fetches patches of every level from the height map stored in the row-major layout, in the
+// Z-order layout and block-compressed. Patches are visited in pseudo-random order as during
+// the camera movement
+void CElevationDataSource :: BenchmarkHeightMapLayouts(LPCTSTR strStatFile)
+{
+    FILE *pStatFile;
+    if( _tfopen_s(&pStatFile, strStatFile, _T("at")) != 0 )
+        return;
+
+    std::auto_ptr<CResidentHeightMap> pRowMajorHeightMap( new CResidentHeightMap(m_iNumCols, m_iNumRows) );
+    m_pHeightMap->FillHeightMap(pRowMajorHeightMap->GetDataPtr(), m_iNumCols, 0, m_iNumCols, 0, m_iNumRows, 1);
+    std::auto_ptr<CMortonHeightMap> pMortonHeightMap( new CMortonHeightMap(*pRowMajorHeightMap) );
+    std::auto_ptr<CBlockCompressedHeightMap> pCompressedHeightMap( new CBlockCompressedHeightMap(*pRowMajorHeightMap) );
+
+    _ftprintf_s(pStatFile, _T("Patch fetch throughput, row-major vs Z-order layout vs block-compressed (ratio %.2lf):\n"),
+                (double)m_iNumCols * m_iNumRows * sizeof(UINT16) / pCompressedHeightMap->GetCompressedSize() );
+    const int MAX_PATCHES_PER_LEVEL = 4096;
+    unsigned int uiRandom = 1;
+    for(int iLevel = 0; iLevel < m_iNumLevels; iLevel++)
+    {
+        std::vector<SQuadTreeNodeLocation> Patches;
+        int iNumPatchesInLevel = (int)m_MinMaxElevation.GetNumElementsInLevel(iLevel);
+        int iNumPatches = min(iNumPatchesInLevel, MAX_PATCHES_PER_LEVEL);
+        int iLevelPatchesHorz = m_iNumRootNodesHorz << iLevel;
+        for(int iPatch = 0; iPatch < iNumPatches; iPatch++)
+        {
+            uiRandom = uiRandom * 1664525 + 1013904223;
+            int iPatchInd = (uiRandom >> 8) % iNumPatchesInLevel;
+            Patches.push_back( SQuadTreeNodeLocation(iPatchInd % iLevelPatchesHorz, iPatchInd / iLevelPatchesHorz, iLevel) );
+        }
+
+        // The best of several runs is reported
+        const int NUM_RUNS = 3;
+        double dRowMajorTime = 0, dMortonTime = 0, dCompressedTime = 0;
+        for(int iRun = 0; iRun < NUM_RUNS; iRun++)
+        {
+            double dTime = MeasurePatchFetchTime(*pRowMajorHeightMap, Patches, m_iPatchSize, m_iNumLevels);
+            if( iRun == 0 || dTime < dRowMajorTime )
+                dRowMajorTime = dTime;
+            dTime = MeasurePatchFetchTime(*pMortonHeightMap, Patches, m_iPatchSize, m_iNumLevels);
+            if( iRun == 0 || dTime < dMortonTime )
+                dMortonTime = dTime;
+            dTime = MeasurePatchFetchTime(*pCompressedHeightMap, Patches, m_iPatchSize, m_iNumLevels);
+            if( iRun == 0 || dTime < dCompressedTime )
+                dCompressedTime = dTime;
+        }
+        double dNumSamples = (double)iNumPatches * (m_iPatchSize+1) * (m_iPatchSize+1);
+        _ftprintf_s(pStatFile, _T("Level %d (%d patches): row-major %.1lf MSamples/s, Z-order %.1lf MSamples/s (speedup %.2lf), ")
+                               _T("block-compressed %.1lf MSamples/s (speedup %.2lf)\n"),
+                    iLevel, iNumPatches,
+                    dNumSamples / max(dRowMajorTime, 1e-9) / 1e6,
+                    dNumSamples / max(dMortonTime, 1e-9) / 1e6,
+                    dRowMajorTime / max(dMortonTime, 1e-9),
+                    dNumSamples / max(dCompressedTime, 1e-9) / 1e6,
+                    dRowMajorTime / max(dCompressedTime, 1e-9) );
+    }
+
+    fclose(pStatFile);
+}
+
+// Data of the task set calculating error bounds of the patches of one level
+struct CElevationDataSource::SErrorBoundsTaskSetData
+{
+    CElevationDataSource *pDataSource;
+    int iLevel;
+};
+
+void CElevationDataSource :: CalculatePatchErrorBoundsTask(VOID* pvInfo, INT iContext, UINT uTaskId, UINT uTaskCount)
+{
+    const SErrorBoundsTaskSetData &TaskSetData = *static_cast<const SErrorBoundsTaskSetData*>(pvInfo);
+    TaskSetData.pDataSource->CalculatePatchErrorBounds(TaskSetData.iLevel, uTaskId);
+}
+
+// Calculates error bounds of the patches in the specified row of the level
+void CElevationDataSource :: CalculatePatchErrorBounds(int iLevel, int iPatchRow)
+{
+    std::vector<UINT16> ParentHeightMap( (m_iPatchSize+1) * (m_iPatchSize+1) );
+    std::vector<UINT16> ChildrenHeightMap( (m_iPatchSize*2+1) * (m_iPatchSize*2+1) );
+    for(int iPatchCol = 0; iPatchCol < (m_iNumRootNodesHorz << iLevel); iPatchCol++)
+        CalculatePatchErrorBound(SQuadTreeNodeLocation(iPatchCol, iPatchRow, iLevel), ParentHeightMap, ChildrenHeightMap);
+}
+
+// Calculates error bound of the patch. Error bounds of its children must be already calculated
+void CElevationDataSource :: CalculatePatchErrorBound(const SQuadTreeNodeLocation &Pos,
+                                                      std::vector<UINT16> &ParentHeightMap,
+                                                      std::vector<UINT16> &ChildrenHeightMap)
+{
+    // Patches in the padded area are never rendered, and patches without
+    // finer data are not refined
+    if( IsPatchInPaddedArea(Pos) || !HasFinerData(Pos) )
+    {
+        m_ErrorBounds[Pos] = 0;
+        return;
+    }
 
-        CurrPatchMinMaxElev.first = min( LBChildMinMaxElev.first, RBChildMinMaxElev.first );
-        CurrPatchMinMaxElev.first = min( CurrPatchMinMaxElev.first, LTChildMinMaxElev.first );
-        CurrPatchMinMaxElev.first = min( CurrPatchMinMaxElev.first, RTChildMinMaxElev.first );
+    FillPatchHeightMap(Pos, &ParentHeightMap[0], m_iPatchSize+1,0,0,1,1);
 
-        CurrPatchMinMaxElev.second = max( LBChildMinMaxElev.second, RBChildMinMaxElev.second);
-        CurrPatchMinMaxElev.second = max( CurrPatchMinMaxElev.second, LTChildMinMaxElev.second );
-        CurrPatchMinMaxElev.second = max( CurrPatchMinMaxElev.second, RTChildMinMaxElev.second );
+    int iStep = 1 << (m_iNumLevels-1 - (Pos.level+1));
+    int iStartCol =  Pos.horzOrder    * m_iPatchSize*2;
+    int iEndCol   = (Pos.horzOrder+1) * m_iPatchSize*2+1;
+    int iStartRow =  Pos.vertOrder    * m_iPatchSize*2;
+    int iEndRow   = (Pos.vertOrder+1) * m_iPatchSize*2+1;
+    FillPatchHeightMap(&ChildrenHeightMap[0], m_iPatchSize*2+1, iStartCol, iEndCol, iStartRow, iEndRow, iStep);
+
+    // Interpolation error is measured in 1/4 units
+    UINT uiInterpolationError = CalculateMaxInterpolationError(&ParentHeightMap[0], m_iPatchSize+1, 
+                                                               &ChildrenHeightMap[0], m_iPatchSize*2+1,
+                                                               m_iPatchSize);
+    int iCurrPatchError = 0;
+    if( Pos.level < m_iNumLevels-2 )
+    {
+        // Add child interpolation errors
+        for(int i=0; i<4; i++)
+            iCurrPatchError = max(iCurrPatchError, (int)m_ErrorBounds[GetChildLocation(Pos,i)]);
     }
+    // Sum of the integer child error and the interpolation error is truncated
+    iCurrPatchError += (int)(uiInterpolationError >> 2);
+    m_ErrorBounds[Pos] = (UINT16)min(iCurrPatchError, UINT16_MAX);
 }
 
 void CElevationDataSource :: CalculatePatchErrorBounds()
 {
+    // Start from the finest level. Patches of one level depend only on the finer level,
+    // so each row of patches is processed by a separate task
+    for(int iLevel = m_iNumLevels-2; iLevel >= 0; iLevel--)
+    {
+        SErrorBoundsTaskSetData TaskSetData = {this, iLevel};
+        ExecuteTaskSet(CalculatePatchErrorBoundsTask, &TaskSetData, m_iNumRootNodesVert << iLevel, "Patch error bounds");
+    }
+
+#ifdef _DEBUG
+    // Optimized error bounds must be exactly the same as calculated by the reference implementation
+    HierarchyArray<UINT16> ReferenceErrorBounds;
+    CalculatePatchErrorBoundsReference(ReferenceErrorBounds);
+    for( HierarchyReverseIterator it(m_iNumLevels-1, m_iNumRootNodesHorz, m_iNumRootNodesVert); it.IsValid(); it.Next() )
+    {
+        if( m_ErrorBounds[it] != ReferenceErrorBounds[it] )
+        {
+            LOG_ERROR(_T("Error bound of the patch (%d,%d,%d) is %d, while the reference value is %d"), 
+                      it.Horz(), it.Vert(), it.Level(), m_ErrorBounds[it], ReferenceErrorBounds[it]);
+            assert(false);
+            break;
+        }
+    }
+#endif
+}
+
+// Every sample of the procedural height map is reproduced from its coordinates, so the data of
+// the patches far from the origin and their min/max elevations are checked against the generator
+HRESULT CElevationDataSource :: VerifyProceduralHeightMap()const
+{
+    if( !CProceduralHeightMap::IsProceduralHeightMapFile(m_strSrcDemFile.c_str()) )
+    {
+        LOG_ERROR(_T("%s is not a procedural height map description file"), m_strSrcDemFile.c_str());
+        return E_INVALIDARG;
+    }
+    CProceduralHeightMap HeightMap;
+    HRESULT hr = HeightMap.Open(m_strSrcDemFile.c_str());
+    if( FAILED(hr) )
+        return hr;
+
+    std::vector<UINT16> PatchHeightMap( (m_iPatchSize+1) * (m_iPatchSize+1) );
+    for(int iLevel = 0; iLevel < m_iNumLevels; iLevel++)
+    {
+        int iStep = 1 << (m_iNumLevels-1 - iLevel);
+        // Last patches of the level, which are not in the padded area
+        int iLastHorz = (m_iNumRootNodesHorz << iLevel) - 1;
+        while( iLastHorz > 0 && IsPatchInPaddedArea(SQuadTreeNodeLocation(iLastHorz, 0, iLevel)) )
+            iLastHorz--;
+        int iLastVert = (m_iNumRootNodesVert << iLevel) - 1;
+        while( iLastVert > 0 && IsPatchInPaddedArea(SQuadTreeNodeLocation(0, iLastVert, iLevel)) )
+            iLastVert--;
+
+        for(int iCorner = 0; iCorner < 4; iCorner++)
+        {
+            SQuadTreeNodeLocation Pos( (iCorner & 1) ? iLastHorz : 0, (iCorner & 2) ? iLastVert : 0, iLevel );
+            FillPatchHeightMap(Pos, &PatchHeightMap[0], m_iPatchSize+1, 0,0,1,1);
+            UINT16 MinElevation, MaxElevation;
+            GetPatchMinMaxElevation(Pos, MinElevation, MaxElevation);
+            UINT16 MinSample = UINT16_MAX, MaxSample = 0;
+            for(int iRow = 0; iRow <= m_iPatchSize; iRow++)
+                for(int iCol = 0; iCol <= m_iPatchSize; iCol++)
+                {
+                    UINT uiCol = min( (UINT)(Pos.horzOrder * m_iPatchSize + iCol) * iStep, m_iNumCols-1 );
+                    UINT uiRow = min( (UINT)(Pos.vertOrder * m_iPatchSize + iRow) * iStep, m_iNumRows-1 );
+                    UINT16 Sample = HeightMap.GetSample(uiCol, uiRow);
+                    if( PatchHeightMap[iCol + iRow * (m_iPatchSize+1)] != Sample )
+                    {
+                        LOG_ERROR(_T("Sample (%u,%u) of the patch (%d,%d,%d) is %d, while the generated value is %d"),
+                                  uiCol, uiRow, Pos.horzOrder, Pos.vertOrder, Pos.level, PatchHeightMap[iCol + iRow * (m_iPatchSize+1)], Sample);
+                        return E_FAIL;
+                    }
+                    MinSample = min(MinSample, Sample);
+                    MaxSample = max(MaxSample, Sample);
+                }
+
+            // Bounds of the finest level patch are calculated from its samples. Bounds of the coarser
+            // patches also cover the samples between the samples of the patch
+            bool bFinestLevel = iLevel == m_iNumLevels-1;
+            if( bFinestLevel ? (MinElevation != MinSample || MaxElevation != MaxSample) :
+                               (MinElevation > MinSample || MaxElevation < MaxSample) )
+            {
+                LOG_ERROR(_T("Elevation bounds of the patch (%d,%d,%d) are [%d,%d], while the generated samples are in [%d,%d]"),
+                          Pos.horzOrder, Pos.vertOrder, Pos.level, MinElevation, MaxElevation, MinSample, MaxSample);
+                return E_FAIL;
+            }
+        }
+    }
+
+    // Queries at the sample positions return the samples exactly. The positions are spread over
+    // the far rows of the terrain
+    enum {NUM_QUERIES = 64};
+    D3DXVECTOR2 Positions[NUM_QUERIES];
+    float Heights[NUM_QUERIES];
+    for(int iQuery = 0; iQuery < NUM_QUERIES; iQuery++)
+    {
+        UINT uiCol = (UINT)( (UINT64)(m_iNumCols-1) * (iQuery % 16 + 1) / 16 );
+        UINT uiRow = (UINT)( (UINT64)(m_iNumRows-1) * (iQuery / 16 + 13) / 16 );
+        Positions[iQuery] = D3DXVECTOR2( (float)(uiCol - iQuery % 3), (float)uiRow );
+    }
+    QueryHeights(Positions, Heights, NUM_QUERIES);
+    for(int iQuery = 0; iQuery < NUM_QUERIES; iQuery++)
+    {
+        UINT16 Sample = HeightMap.GetSample( (UINT)Positions[iQuery].x, (UINT)Positions[iQuery].y );
+        if( Heights[iQuery] != (float)Sample )
+        {
+            LOG_ERROR(_T("Height at (%.0f,%.0f) is %f, while the generated value is %d"),
+                      Positions[iQuery].x, Positions[iQuery].y, Heights[iQuery], Sample);
+            return E_FAIL;
+        }
+    }
+
+    return S_OK;
+}
+
+#ifdef _DEBUG
+// Reference implementation of the error bounds calculation used to verify the optimized one
+void CElevationDataSource :: CalculatePatchErrorBoundsReference(HierarchyArray<UINT16> &ErrorBounds)const
+{
+    ErrorBounds.Resize(m_iNumLevels-1, m_iNumRootNodesHorz, m_iNumRootNodesVert);
     std::vector<UINT16> ParentHeightMap, ChildrenHeightMap;
     ParentHeightMap.resize( (m_iPatchSize+1) * (m_iPatchSize+1) );
     ChildrenHeightMap.resize( (m_iPatchSize*2+1) * (m_iPatchSize*2+1) );
     // Start from the coarsest level
-    for( HierarchyReverseIterator it(m_iNumLevels-1); it.IsValid(); it.Next() )
+    for( HierarchyReverseIterator it(m_iNumLevels-1, m_iNumRootNodesHorz, m_iNumRootNodesVert); it.IsValid(); it.Next() )
     {
+        if( IsPatchInPaddedArea(it) || !HasFinerData(it) )
+        {
+            ErrorBounds[it] = 0;
+            continue;
+        }
+
         FillPatchHeightMap(it, &ParentHeightMap[0], m_iPatchSize+1,0,0,1,1);
 
         int iStep = 1 << (m_iNumLevels-1 - (it.Level()+1));
@@ -411,11 +1157,127 @@ void CElevationDataSource :: CalculatePatchErrorBounds()
         {
             // Add child interpolation errors
             for(int i=0; i<4; i++)
-                CurrPatchError = max(CurrPatchError, m_ErrorBounds[GetChildLocation(it,i)]);
+                CurrPatchError = max(CurrPatchError, ErrorBounds[GetChildLocation(it,i)]);
         }
         CurrPatchError += fInterpolationError;
-        m_ErrorBounds[it] = (UINT16)min(max(0, (int)CurrPatchError ), UINT16_MAX);
+        ErrorBounds[it] = (UINT16)min(max(0, (int)CurrPatchError ), UINT16_MAX);
+    }
+}
+#endif
+
+HRESULT CElevationDataSource :: LoadHierarchyCache(LPCTSTR strFilePath, UINT64 DEMHash, const SElevDataSourceParams &Params)
+{
+    HANDLE hFile = CreateFile(strFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if( hFile == INVALID_HANDLE_VALUE )
+        return E_FAIL;
+
+    size_t NumMinMaxElements = GetNumHierarchyElements(m_iNumLevels);
+    size_t NumErrorBounds = GetNumHierarchyElements(m_iNumLevels-1);
+    size_t ExpectedFileSize = sizeof(SHierarchyCacheHeader) + 
+                              NumMinMaxElements * 2 * sizeof(UINT16) + 
+                              NumErrorBounds * sizeof(UINT16);
+    LARGE_INTEGER FileSize;
+    if( !GetFileSizeEx(hFile, &FileSize) || FileSize.QuadPart != (LONGLONG)ExpectedFileSize )
+    {
+        CloseHandle(hFile);
+        return E_FAIL;
+    }
+
+    HANDLE hFileMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    const BYTE *pMappedData = hFileMapping ? (const BYTE*)MapViewOfFile(hFileMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    HRESULT hr = E_FAIL;
+    if( pMappedData )
+    {
+        const SHierarchyCacheHeader &Header = *(const SHierarchyCacheHeader*)pMappedData;
+        if( Header.uiSignature == HIERARCHY_CACHE_SIGNATURE &&
+            Header.uiVersion == HIERARCHY_CACHE_VERSION &&
+            Header.DEMHash == DEMHash &&
+            Header.uiPatchSize == (UINT32)m_iPatchSize &&
+            Header.uiNumLevels == (UINT32)m_iNumLevels &&
+            Header.uiNumRootNodesHorz == (UINT32)m_iNumRootNodesHorz &&
+            Header.uiNumRootNodesVert == (UINT32)m_iNumRootNodesVert &&
+            Header.uiNumCols == m_iNumCols && 
+            Header.uiNumRows == m_iNumRows &&
+            Header.uiRawDEMWidth == Params.uiRawDEMWidth &&
+            Header.uiRawDEMHeight == Params.uiRawDEMHeight &&
+            Header.fMaxReconstructionError == m_pHeightMap->GetMaxReconstructionError(1) )
+        {
+            const UINT16 *pMinMax = (const UINT16*)(pMappedData + sizeof(SHierarchyCacheHeader));
+            for(int iLevel = 0; iLevel < m_iNumLevels; iLevel++)
+            {
+                std::pair<UINT16, UINT16> *pLevelMinMax = m_MinMaxElevation.GetLevelData(iLevel);
+                size_t NumElementsInLevel = m_MinMaxElevation.GetNumElementsInLevel(iLevel);
+                for(size_t Elem = 0; Elem < NumElementsInLevel; Elem++, pMinMax += 2)
+                    pLevelMinMax[Elem] = std::pair<UINT16, UINT16>(pMinMax[0], pMinMax[1]);
+            }
+
+            const UINT16 *pErrorBounds = pMinMax;
+            for(int iLevel = 0; iLevel < m_iNumLevels-1; iLevel++)
+            {
+                size_t NumElementsInLevel = m_ErrorBounds.GetNumElementsInLevel(iLevel);
+                memcpy(m_ErrorBounds.GetLevelData(iLevel), pErrorBounds, NumElementsInLevel * sizeof(UINT16));
+                pErrorBounds += NumElementsInLevel;
+            }
+            hr = S_OK;
+        }
+        UnmapViewOfFile(pMappedData);
     }
+    if( hFileMapping )
+        CloseHandle(hFileMapping);
+    CloseHandle(hFile);
+
+    return hr;
+}
+
+HRESULT CElevationDataSource :: SaveHierarchyCache(LPCTSTR strFilePath, UINT64 DEMHash, const SElevDataSourceParams &Params)const
+{
+    SHierarchyCacheHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    Header.uiSignature = HIERARCHY_CACHE_SIGNATURE;
+    Header.uiVersion = HIERARCHY_CACHE_VERSION;
+    Header.DEMHash = DEMHash;
+    Header.uiPatchSize = m_iPatchSize;
+    Header.uiNumLevels = m_iNumLevels;
+    Header.uiNumRootNodesHorz = m_iNumRootNodesHorz;
+    Header.uiNumRootNodesVert = m_iNumRootNodesVert;
+    Header.uiNumCols = m_iNumCols;
+    Header.uiNumRows = m_iNumRows;
+    Header.uiRawDEMWidth = Params.uiRawDEMWidth;
+    Header.uiRawDEMHeight = Params.uiRawDEMHeight;
+    Header.fMaxReconstructionError = m_pHeightMap->GetMaxReconstructionError(1);
+
+    std::vector<UINT16> Data;
+    Data.reserve( GetNumHierarchyElements(m_iNumLevels) * 2 + GetNumHierarchyElements(m_iNumLevels-1) );
+    for(int iLevel = 0; iLevel < m_iNumLevels; iLevel++)
+    {
+        const std::pair<UINT16, UINT16> *pLevelMinMax = m_MinMaxElevation.GetLevelData(iLevel);
+        size_t NumElementsInLevel = m_MinMaxElevation.GetNumElementsInLevel(iLevel);
+        for(size_t Elem = 0; Elem < NumElementsInLevel; Elem++)
+        {
+            Data.push_back(pLevelMinMax[Elem].first);
+            Data.push_back(pLevelMinMax[Elem].second);
+        }
+    }
+    for(int iLevel = 0; iLevel < m_iNumLevels-1; iLevel++)
+    {
+        const UINT16 *pLevelErrorBounds = m_ErrorBounds.GetLevelData(iLevel);
+        Data.insert(Data.end(), pLevelErrorBounds, pLevelErrorBounds + m_ErrorBounds.GetNumElementsInLevel(iLevel));
+    }
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("wb") ) != 0 || pFile == NULL )
+        return E_FAIL;
+    bool bSuccess = fwrite(&Header, sizeof(Header), 1, pFile) == 1 &&
+                    fwrite(&Data[0], sizeof(UINT16), Data.size(), pFile) == Data.size();
+    bSuccess = (fclose(pFile) == 0) && bSuccess;
+    if( !bSuccess )
+    {
+        // Do not leave incomplete file
+        DeleteFile(strFilePath);
+        return E_FAIL;
+    }
+
+    return S_OK;
 }
 
 int CElevationDataSource :: GetNumLevelsInHierarchy()const
@@ -431,32 +1293,63 @@ int CElevationDataSource :: GetPatchSize()const
 // Decompresses child height map taking their parent height map as input
 CPatchElevationData* CElevationDataSource :: GetElevData(const struct SQuadTreeNodeLocation &Pos)const
 {
-    int iHighResDataLODBias = max(0, min(m_iHighResDataLODBias, (m_iNumLevels-1) - Pos.level) );
     CPatchElevationData* pElevData = new CPatchElevationData( this, Pos, 
                                            m_iRequiredLeftBoundaryExt, 
                                            m_iRequiredBottomBoundaryExt, 
                                            m_iRequiredRightBoundaryExt, 
                                            m_iRequiredTopBoundaryExt,
-                                           iHighResDataLODBias );
+                                           GetHighResDataLODBias(Pos.level) );
+    // Height maps of the recently used patches are taken from the cache, otherwise
+    // they are loaded by LoadTile() into the buffer of the evicted patch
+    UINT64 PatchKey = GetPatchDataKey(Pos);
+    const UINT16 *pPatchData = m_pPatchDataCache->AcquireTile(PatchKey);
+    if( !pPatchData )
+    {
+        delete pElevData;
+        return NULL;
+    }
+    pElevData->m_pDataCache = m_pPatchDataCache.get();
+    pElevData->m_DataKey = PatchKey;
+    pElevData->m_pHeightMap = pPatchData;
+    if( pElevData->m_iHighResDataLODBias )
+        pElevData->m_pHighResHeightMap = pPatchData + pElevData->m_HeightMapSize;
+    return pElevData;
+}
+
+HRESULT CElevationDataSource::LoadTile(UINT64 PatchKey, std::vector<UINT16> &PatchData)
+{
+    SQuadTreeNodeLocation Pos;
+    Pos.level = (int)(PatchKey >> 56);
+    Pos.vertOrder = (int)((PatchKey >> 28) & 0x0FFFFFFF);
+    Pos.horzOrder = (int)(PatchKey & 0x0FFFFFFF);
+
+    // Temporary object is only used to calculate the layout of the height maps
+    CPatchElevationData Layout( this, Pos, 
+                                m_iRequiredLeftBoundaryExt, 
+                                m_iRequiredBottomBoundaryExt, 
+                                m_iRequiredRightBoundaryExt, 
+                                m_iRequiredTopBoundaryExt,
+                                GetHighResDataLODBias(Pos.level) );
+    PatchData.resize(Layout.m_HeightMapSize + Layout.m_HighResHeightMapSize);
     FillPatchHeightMap( Pos, 
-                        &pElevData->m_HeightMap[0],
-                        pElevData->m_Pitch,
+                        &PatchData[0],
+                        Layout.m_Pitch,
                         m_iRequiredLeftBoundaryExt, 
                         m_iRequiredBottomBoundaryExt, 
                         m_iRequiredRightBoundaryExt, 
                         m_iRequiredTopBoundaryExt );
-    if( iHighResDataLODBias )
+    if( Layout.m_iHighResDataLODBias )
     {
         FillPatchHeightMap( Pos, 
-                    &pElevData->m_HighResHeightMap[0],
-                    pElevData->m_HighResDataPitch,
+                    &PatchData[Layout.m_HeightMapSize],
+                    Layout.m_HighResDataPitch,
                     m_iRequiredLeftBoundaryExt, 
                     m_iRequiredBottomBoundaryExt, 
                     m_iRequiredRightBoundaryExt, 
                     m_iRequiredTopBoundaryExt,
-                    iHighResDataLODBias);
+                    Layout.m_iHighResDataLODBias);
     }
-    return pElevData;
+    return S_OK;
 }
 
 void CElevationDataSource::SetRequiredElevDataBoundaryExtensions(int iRequiredLeftBoundaryExt,
@@ -465,13 +1358,121 @@ void CElevationDataSource::SetRequiredElevDataBoundaryExtensions(int iRequiredLe
                                                                  int iRequiredTopBoundaryExt)
 {
     // Elevation data must contain extended data provided by data source
-    m_iRequiredLeftBoundaryExt   = max( iRequiredLeftBoundaryExt,  LB_DATA_EXTENSION_WIDTH);
-    m_iRequiredBottomBoundaryExt = max( iRequiredBottomBoundaryExt,LB_DATA_EXTENSION_WIDTH);
-    m_iRequiredRightBoundaryExt  = max( iRequiredRightBoundaryExt, RT_DATA_EXTENSION_WIDTH);
-    m_iRequiredTopBoundaryExt    = max( iRequiredTopBoundaryExt,   RT_DATA_EXTENSION_WIDTH);
+    iRequiredLeftBoundaryExt   = max( iRequiredLeftBoundaryExt,  LB_DATA_EXTENSION_WIDTH);
+    iRequiredBottomBoundaryExt = max( iRequiredBottomBoundaryExt,LB_DATA_EXTENSION_WIDTH);
+    iRequiredRightBoundaryExt  = max( iRequiredRightBoundaryExt, RT_DATA_EXTENSION_WIDTH);
+    iRequiredTopBoundaryExt    = max( iRequiredTopBoundaryExt,   RT_DATA_EXTENSION_WIDTH);
+    if( iRequiredLeftBoundaryExt   == m_iRequiredLeftBoundaryExt   &&
+        iRequiredBottomBoundaryExt == m_iRequiredBottomBoundaryExt &&
+        iRequiredRightBoundaryExt  == m_iRequiredRightBoundaryExt  &&
+        iRequiredTopBoundaryExt    == m_iRequiredTopBoundaryExt )
+        return;
+
+    m_iRequiredLeftBoundaryExt   = iRequiredLeftBoundaryExt;
+    m_iRequiredBottomBoundaryExt = iRequiredBottomBoundaryExt;
+    m_iRequiredRightBoundaryExt  = iRequiredRightBoundaryExt;
+    m_iRequiredTopBoundaryExt    = iRequiredTopBoundaryExt;
+    InvalidatePatchDataCache();
 }
 
 void CElevationDataSource::SetHighResDataLODBias(int iHighResDataLODBias)
 {
+    if( m_iHighResDataLODBias == iHighResDataLODBias )
+        return;
     m_iHighResDataLODBias = iHighResDataLODBias;
-}
\ No newline at end of file
+    InvalidatePatchDataCache();
+}
+
+void CElevationDataSource::InvalidatePatchDataCache()
+{
+    // Patches, which are still alive, keep their detached data until they are destroyed.
+    // Patch height maps being loaded with the previous layout are not cached either
+    m_pPatchDataCache->Clear();
+}
+
+// Returns the range [iStartPatch, iEndPatch) of the patches along one axis, whose samples
+// [(i*P - iLowExt)*iStep, ((i+1)*P + iHighExt)*iStep) overlap the samples [iStart, iEnd)
+static void GetPatchRange(int iStart, int iEnd, int iNumSamples, int iPatchSize, int iStep, int iNumPatches,
+                          int iLowExt, int iHighExt, int &iStartPatch, int &iEndPatch)
+{
+    int iPatchSpan = iPatchSize * iStep;
+    int iFirstSampleOffset = iStart - (iHighExt-1) * iStep;
+    iStartPatch = (iFirstSampleOffset > 0) ? (iFirstSampleOffset + iPatchSpan-1) / iPatchSpan - 1 : 0;
+    iStartPatch = max(iStartPatch, 0);
+    // Patches past the last sample read the clamped last sample
+    if( iEnd >= iNumSamples )
+        iEndPatch = iNumPatches;
+    else
+        iEndPatch = min( (iEnd-1 + iLowExt * iStep) / iPatchSpan + 1, iNumPatches );
+}
+
+void CElevationDataSource::GetPatchesInRegion(int iLevel,
+                                              int iStartCol, int iEndCol,
+                                              int iStartRow, int iEndRow,
+                                              int iLeftExt, int iBottomExt, int iRightExt, int iTopExt,
+                                              int &iStartHorz, int &iEndHorz,
+                                              int &iStartVert, int &iEndVert)const
+{
+    int iStep = 1 << (m_iNumLevels-1 - iLevel);
+    GetPatchRange(iStartCol, iEndCol, m_iNumCols, m_iPatchSize, iStep, m_iNumRootNodesHorz << iLevel, iLeftExt, iRightExt, iStartHorz, iEndHorz);
+    GetPatchRange(iStartRow, iEndRow, m_iNumRows, m_iPatchSize, iStep, m_iNumRootNodesVert << iLevel, iBottomExt, iTopExt, iStartVert, iEndVert);
+}
+
+HRESULT CElevationDataSource::UpdateRegion(const UINT16 *pSamples,
+                                           size_t SamplesPitch,
+                                           int iStartCol, int iEndCol,
+                                           int iStartRow, int iEndRow)
+{
+    HRESULT hr = S_OK;
+    if( iStartCol < 0 || iStartRow < 0 || iEndCol > (int)m_iNumCols || iEndRow > (int)m_iNumRows || 
+        iStartCol >= iEndCol || iStartRow >= iEndRow )
+        hr = E_INVALIDARG;
+    CHECK_HR_RET(hr, _T("Updated region [%d,%d)x[%d,%d) is outside the height map (%dx%d)"), 
+                 iStartCol, iEndCol, iStartRow, iEndRow, m_iNumCols, m_iNumRows);
+
+    hr = m_pHeightMap->UpdateRegion(pSamples, SamplesPitch, iStartCol, iEndCol, iStartRow, iEndRow);
+    CHECK_HR_RET(hr, _T("Failed to update the height map. Only the height map kept in memory can be edited"));
+
+    // Min/max elevations and error bounds are calculated from the patch samples with the
+    // right and top extensions of one sample. Lossy stores, whose coarse level min/max
+    // elevations are widened, can not be edited
+    int iStartHorz, iEndHorz, iStartVert, iEndVert;
+    std::vector<UINT16> PatchHeightMap( (m_iPatchSize+1) * (m_iPatchSize+1) );
+    GetPatchesInRegion(m_iNumLevels-1, iStartCol, iEndCol, iStartRow, iEndRow, 0,0,1,1, iStartHorz, iEndHorz, iStartVert, iEndVert);
+    SIMD_LEVEL SIMDLevel = GetSupportedSIMDLevel();
+    for(int iVert = iStartVert; iVert < iEndVert; iVert++)
+        for(int iHorz = iStartHorz; iHorz < iEndHorz; iHorz++)
+            CalculateFinestLevelMinMaxElevation(SQuadTreeNodeLocation(iHorz, iVert, m_iNumLevels-1), PatchHeightMap, SIMDLevel);
+    // Only the ancestors of the updated patches are recalculated at the coarser levels
+    for(int iLevel = m_iNumLevels-2; iLevel >= 0; iLevel--)
+    {
+        iStartHorz >>= 1; iEndHorz = (iEndHorz+1) >> 1;
+        iStartVert >>= 1; iEndVert = (iEndVert+1) >> 1;
+        for(int iVert = iStartVert; iVert < iEndVert; iVert++)
+            for(int iHorz = iStartHorz; iHorz < iEndHorz; iHorz++)
+                CalculateMinMaxElevationFromChildren(SQuadTreeNodeLocation(iHorz, iVert, iLevel));
+    }
+
+    // The samples of the parent patch cover the samples of its children, so the ancestors of
+    // the patches with updated error bounds are also in the region at the coarser level
+    std::vector<UINT16> ChildrenHeightMap( (m_iPatchSize*2+1) * (m_iPatchSize*2+1) );
+    for(int iLevel = m_iNumLevels-2; iLevel >= 0; iLevel--)
+    {
+        GetPatchesInRegion(iLevel, iStartCol, iEndCol, iStartRow, iEndRow, 0,0,1,1, iStartHorz, iEndHorz, iStartVert, iEndVert);
+        for(int iVert = iStartVert; iVert < iEndVert; iVert++)
+            for(int iHorz = iStartHorz; iHorz < iEndHorz; iHorz++)
+                CalculatePatchErrorBound(SQuadTreeNodeLocation(iHorz, iVert, iLevel), PatchHeightMap, ChildrenHeightMap);
+    }
+
+    // Cached height maps of the affected patches are reloaded on the next request. Patch
+    // data objects created before the update keep the previous samples
+    for(int iLevel = 0; iLevel < m_iNumLevels; iLevel++)
+    {
+        GetPatchesAffectedByRegion(iLevel, iStartCol, iEndCol, iStartRow, iEndRow, iStartHorz, iEndHorz, iStartVert, iEndVert);
+        for(int iVert = iStartVert; iVert < iEndVert; iVert++)
+            for(int iHorz = iStartHorz; iHorz < iEndHorz; iHorz++)
+                m_pPatchDataCache->InvalidateTile( GetPatchDataKey(SQuadTreeNodeLocation(iHorz, iVert, iLevel)) );
+    }
+
+    return S_OK;
+}
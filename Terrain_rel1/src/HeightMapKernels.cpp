@@ -0,0 +1,1031 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "HeightMapKernels.h"
+
+#include <intrin.h>
+#include <smmintrin.h>
+// AVX2 intrinsics are available starting from Visual Studio 2012
+#if _MSC_VER >= 1700
+#   include <immintrin.h>
+#   define HEIGHT_MAP_KERNELS_AVX2
+#endif
+
+static SIMD_LEVEL DetectSIMDLevel()
+{
+    int CPUInfo[4];
+    __cpuid(CPUInfo, 1);
+    bool bSSE41 = (CPUInfo[2] & (1 << 19)) != 0;
+    if( !bSSE41 )
+        return SIMD_LEVEL_SCALAR;
+
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+    // AVX requires the OS to save YMM registers on context switches
+    bool bOSXSAVE = (CPUInfo[2] & (1 << 27)) != 0;
+    bool bAVX = (CPUInfo[2] & (1 << 28)) != 0;
+    __cpuid(CPUInfo, 0);
+    int iMaxFunctionId = CPUInfo[0];
+    if( bOSXSAVE && bAVX && (_xgetbv(0) & 6) == 6 && iMaxFunctionId >= 7 )
+    {
+        __cpuidex(CPUInfo, 7, 0);
+        if( CPUInfo[1] & (1 << 5) )
+            return SIMD_LEVEL_AVX2;
+    }
+#endif
+
+    return SIMD_LEVEL_SSE41;
+}
+
+static const SIMD_LEVEL g_SupportedSIMDLevel = DetectSIMDLevel();
+
+SIMD_LEVEL GetSupportedSIMDLevel()
+{
+    return g_SupportedSIMDLevel;
+}
+
+LPCTSTR GetSIMDLevelName(SIMD_LEVEL SIMDLevel)
+{
+    switch(SIMDLevel)
+    {
+        case SIMD_LEVEL_SCALAR: return _T("Scalar");
+        case SIMD_LEVEL_SSE41:  return _T("SSE4.1");
+        case SIMD_LEVEL_AVX2:   return _T("AVX2");
+        default: return _T("Unknown");
+    }
+}
+
+static void CalculateMinMaxElevationScalar(const UINT16 *pData, size_t DataPitch, int iNumCols, int iNumRows,
+                                           UINT16 &MinElevation, UINT16 &MaxElevation)
+{
+    UINT16 MinElev = pData[0], MaxElev = pData[0];
+    for(int iRow = 0; iRow < iNumRows; iRow++)
+    {
+        const UINT16 *pRow = pData + iRow * DataPitch;
+        for(int iCol = 0; iCol < iNumCols; iCol++)
+        {
+            MinElev = min(MinElev, pRow[iCol]);
+            MaxElev = max(MaxElev, pRow[iCol]);
+        }
+    }
+    MinElevation = MinElev;
+    MaxElevation = MaxElev;
+}
+
+static void CalculateMinMaxElevationSSE41(const UINT16 *pData, size_t DataPitch, int iNumCols, int iNumRows,
+                                          UINT16 &MinElevation, UINT16 &MaxElevation)
+{
+    __m128i MinElev = _mm_set1_epi16((short)pData[0]);
+    __m128i MaxElev = MinElev;
+    int iNumVectorCols = iNumCols & ~7;
+    for(int iRow = 0; iRow < iNumRows; iRow++)
+    {
+        const UINT16 *pRow = pData + iRow * DataPitch;
+        int iCol = 0;
+        for(; iCol < iNumVectorCols; iCol += 8)
+        {
+            __m128i Elev = _mm_loadu_si128((const __m128i*)(pRow + iCol));
+            MinElev = _mm_min_epu16(MinElev, Elev);
+            MaxElev = _mm_max_epu16(MaxElev, Elev);
+        }
+        for(; iCol < iNumCols; iCol++)
+        {
+            __m128i Elev = _mm_set1_epi16((short)pRow[iCol]);
+            MinElev = _mm_min_epu16(MinElev, Elev);
+            MaxElev = _mm_max_epu16(MaxElev, Elev);
+        }
+    }
+    // Horizontal reduction: the maximum is found as the minimum of the inverted values
+    MinElevation = (UINT16)_mm_extract_epi16(_mm_minpos_epu16(MinElev), 0);
+    MaxElevation = (UINT16)~_mm_extract_epi16(_mm_minpos_epu16(_mm_xor_si128(MaxElev, _mm_set1_epi32(-1))), 0);
+}
+
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+static void CalculateMinMaxElevationAVX2(const UINT16 *pData, size_t DataPitch, int iNumCols, int iNumRows,
+                                         UINT16 &MinElevation, UINT16 &MaxElevation)
+{
+    __m256i MinElev = _mm256_set1_epi16((short)pData[0]);
+    __m256i MaxElev = MinElev;
+    int iNumVectorCols = iNumCols & ~15;
+    for(int iRow = 0; iRow < iNumRows; iRow++)
+    {
+        const UINT16 *pRow = pData + iRow * DataPitch;
+        int iCol = 0;
+        for(; iCol < iNumVectorCols; iCol += 16)
+        {
+            __m256i Elev = _mm256_loadu_si256((const __m256i*)(pRow + iCol));
+            MinElev = _mm256_min_epu16(MinElev, Elev);
+            MaxElev = _mm256_max_epu16(MaxElev, Elev);
+        }
+        for(; iCol < iNumCols; iCol++)
+        {
+            __m256i Elev = _mm256_set1_epi16((short)pRow[iCol]);
+            MinElev = _mm256_min_epu16(MinElev, Elev);
+            MaxElev = _mm256_max_epu16(MaxElev, Elev);
+        }
+    }
+    __m128i MinElev128 = _mm_min_epu16(_mm256_castsi256_si128(MinElev), _mm256_extracti128_si256(MinElev, 1));
+    __m128i MaxElev128 = _mm_max_epu16(_mm256_castsi256_si128(MaxElev), _mm256_extracti128_si256(MaxElev, 1));
+    // Avoid AVX-SSE transition penalty
+    _mm256_zeroupper();
+    MinElevation = (UINT16)_mm_extract_epi16(_mm_minpos_epu16(MinElev128), 0);
+    MaxElevation = (UINT16)~_mm_extract_epi16(_mm_minpos_epu16(_mm_xor_si128(MaxElev128, _mm_set1_epi32(-1))), 0);
+}
+#endif
+
+void CalculateMinMaxElevation(const UINT16 *pData,
+                              size_t DataPitch,
+                              int iNumCols, int iNumRows,
+                              UINT16 &MinElevation,
+                              UINT16 &MaxElevation,
+                              SIMD_LEVEL SIMDLevel)
+{
+    assert( iNumCols > 0 && iNumRows > 0 );
+    assert( SIMDLevel <= g_SupportedSIMDLevel );
+    switch(SIMDLevel)
+    {
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+        case SIMD_LEVEL_AVX2:
+            CalculateMinMaxElevationAVX2(pData, DataPitch, iNumCols, iNumRows, MinElevation, MaxElevation);
+            break;
+#endif
+        case SIMD_LEVEL_SSE41:
+            CalculateMinMaxElevationSSE41(pData, DataPitch, iNumCols, iNumRows, MinElevation, MaxElevation);
+            break;
+
+        default:
+            CalculateMinMaxElevationScalar(pData, DataPitch, iNumCols, iNumRows, MinElevation, MaxElevation);
+    }
+}
+
+// Interpolation of the parent samples is calculated in 1/4 units. Each parent row is first
+// upsampled horizontally: even samples are 2*P[i], odd samples are P[i] + P[i+1]. The
+// interpolation for the even child row 2*r is then 2*U[r], and for the odd row 2*r+1 it is U[r] + U[r+1]
+static void UpsampleParentRowScalar(const UINT16 *pParentRow, int iPatchSize, INT32 *pUpsampledRow)
+{
+    for(int iCol = 0; iCol < iPatchSize; iCol++)
+    {
+        pUpsampledRow[iCol*2]   = pParentRow[iCol] * 2;
+        pUpsampledRow[iCol*2+1] = pParentRow[iCol] + pParentRow[iCol+1];
+    }
+}
+
+static UINT CalculateRowInterpolationErrorScalar(const UINT16 *pChildRow, const INT32 *pUpsampledRow0, const INT32 *pUpsampledRow1, int iNumCols)
+{
+    UINT uiMaxError = 0;
+    for(int iCol = 0; iCol < iNumCols; iCol++)
+    {
+        INT32 iError = abs( pChildRow[iCol]*4 - (pUpsampledRow0[iCol] + pUpsampledRow1[iCol]) );
+        uiMaxError = max(uiMaxError, (UINT)iError);
+    }
+    return uiMaxError;
+}
+
+static void UpsampleParentRowSSE41(const UINT16 *pParentRow, int iPatchSize, INT32 *pUpsampledRow)
+{
+    int iCol = 0;
+    for(; iCol + 4 <= iPatchSize; iCol += 4)
+    {
+        __m128i Elev0 = _mm_cvtepu16_epi32( _mm_loadl_epi64((const __m128i*)(pParentRow + iCol)) );
+        __m128i Elev1 = _mm_cvtepu16_epi32( _mm_loadl_epi64((const __m128i*)(pParentRow + iCol + 1)) );
+        __m128i Even = _mm_add_epi32(Elev0, Elev0);
+        __m128i Odd = _mm_add_epi32(Elev0, Elev1);
+        _mm_storeu_si128((__m128i*)(pUpsampledRow + iCol*2),     _mm_unpacklo_epi32(Even, Odd));
+        _mm_storeu_si128((__m128i*)(pUpsampledRow + iCol*2 + 4), _mm_unpackhi_epi32(Even, Odd));
+    }
+    UpsampleParentRowScalar(pParentRow + iCol, iPatchSize - iCol, pUpsampledRow + iCol*2);
+}
+
+static UINT CalculateRowInterpolationErrorSSE41(const UINT16 *pChildRow, const INT32 *pUpsampledRow0, const INT32 *pUpsampledRow1, int iNumCols)
+{
+    __m128i MaxError = _mm_setzero_si128();
+    int iCol = 0;
+    for(; iCol + 4 <= iNumCols; iCol += 4)
+    {
+        __m128i HighResElev = _mm_slli_epi32( _mm_cvtepu16_epi32( _mm_loadl_epi64((const __m128i*)(pChildRow + iCol)) ), 2 );
+        __m128i InterpolatedElev = _mm_add_epi32( _mm_loadu_si128((const __m128i*)(pUpsampledRow0 + iCol)),
+                                                  _mm_loadu_si128((const __m128i*)(pUpsampledRow1 + iCol)) );
+        MaxError = _mm_max_epi32(MaxError, _mm_abs_epi32(_mm_sub_epi32(HighResElev, InterpolatedElev)));
+    }
+    MaxError = _mm_max_epi32(MaxError, _mm_shuffle_epi32(MaxError, _MM_SHUFFLE(1,0,3,2)));
+    MaxError = _mm_max_epi32(MaxError, _mm_shuffle_epi32(MaxError, _MM_SHUFFLE(2,3,0,1)));
+    UINT uiMaxError = (UINT)_mm_cvtsi128_si32(MaxError);
+    return max(uiMaxError, CalculateRowInterpolationErrorScalar(pChildRow + iCol, pUpsampledRow0 + iCol, pUpsampledRow1 + iCol, iNumCols - iCol));
+}
+
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+static void UpsampleParentRowAVX2(const UINT16 *pParentRow, int iPatchSize, INT32 *pUpsampledRow)
+{
+    int iCol = 0;
+    for(; iCol + 8 <= iPatchSize; iCol += 8)
+    {
+        __m256i Elev0 = _mm256_cvtepu16_epi32( _mm_loadu_si128((const __m128i*)(pParentRow + iCol)) );
+        __m256i Elev1 = _mm256_cvtepu16_epi32( _mm_loadu_si128((const __m128i*)(pParentRow + iCol + 1)) );
+        __m256i Even = _mm256_add_epi32(Elev0, Elev0);
+        __m256i Odd = _mm256_add_epi32(Elev0, Elev1);
+        // Unpack instructions operate within 128-bit lanes
+        __m256i Lo = _mm256_unpacklo_epi32(Even, Odd);
+        __m256i Hi = _mm256_unpackhi_epi32(Even, Odd);
+        _mm256_storeu_si256((__m256i*)(pUpsampledRow + iCol*2),     _mm256_permute2x128_si256(Lo, Hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(pUpsampledRow + iCol*2 + 8), _mm256_permute2x128_si256(Lo, Hi, 0x31));
+    }
+    _mm256_zeroupper();
+    UpsampleParentRowSSE41(pParentRow + iCol, iPatchSize - iCol, pUpsampledRow + iCol*2);
+}
+
+static UINT CalculateRowInterpolationErrorAVX2(const UINT16 *pChildRow, const INT32 *pUpsampledRow0, const INT32 *pUpsampledRow1, int iNumCols)
+{
+    __m256i MaxError = _mm256_setzero_si256();
+    int iCol = 0;
+    for(; iCol + 8 <= iNumCols; iCol += 8)
+    {
+        __m256i HighResElev = _mm256_slli_epi32( _mm256_cvtepu16_epi32( _mm_loadu_si128((const __m128i*)(pChildRow + iCol)) ), 2 );
+        __m256i InterpolatedElev = _mm256_add_epi32( _mm256_loadu_si256((const __m256i*)(pUpsampledRow0 + iCol)),
+                                                     _mm256_loadu_si256((const __m256i*)(pUpsampledRow1 + iCol)) );
+        MaxError = _mm256_max_epi32(MaxError, _mm256_abs_epi32(_mm256_sub_epi32(HighResElev, InterpolatedElev)));
+    }
+    __m128i MaxError128 = _mm_max_epi32(_mm256_castsi256_si128(MaxError), _mm256_extracti128_si256(MaxError, 1));
+    _mm256_zeroupper();
+    MaxError128 = _mm_max_epi32(MaxError128, _mm_shuffle_epi32(MaxError128, _MM_SHUFFLE(1,0,3,2)));
+    MaxError128 = _mm_max_epi32(MaxError128, _mm_shuffle_epi32(MaxError128, _MM_SHUFFLE(2,3,0,1)));
+    UINT uiMaxError = (UINT)_mm_cvtsi128_si32(MaxError128);
+    return max(uiMaxError, CalculateRowInterpolationErrorSSE41(pChildRow + iCol, pUpsampledRow0 + iCol, pUpsampledRow1 + iCol, iNumCols - iCol));
+}
+#endif
+
+// Number of the parent columns processed by CalculateMaxInterpolationError() at once
+enum {INTERPOLATION_ERROR_BLOCK_SIZE = 128};
+
+UINT CalculateMaxInterpolationError(const UINT16 *pParentData,
+                                    size_t ParentDataPitch,
+                                    const UINT16 *pChildrenData,
+                                    size_t ChildrenDataPitch,
+                                    int iPatchSize,
+                                    SIMD_LEVEL SIMDLevel)
+{
+    assert( SIMDLevel <= g_SupportedSIMDLevel );
+    void (*UpsampleParentRow)(const UINT16*, int, INT32*) = UpsampleParentRowScalar;
+    UINT (*CalculateRowInterpolationError)(const UINT16*, const INT32*, const INT32*, int) = CalculateRowInterpolationErrorScalar;
+    switch(SIMDLevel)
+    {
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+        case SIMD_LEVEL_AVX2:
+            UpsampleParentRow = UpsampleParentRowAVX2;
+            CalculateRowInterpolationError = CalculateRowInterpolationErrorAVX2;
+            break;
+#endif
+        case SIMD_LEVEL_SSE41:
+            UpsampleParentRow = UpsampleParentRowSSE41;
+            CalculateRowInterpolationError = CalculateRowInterpolationErrorSSE41;
+            break;
+        default:
+            break;
+    }
+
+    // Parent columns are processed in blocks, so that the upsampled rows are kept on the stack
+    INT32 UpsampledRows[2][INTERPOLATION_ERROR_BLOCK_SIZE*2];
+    UINT uiMaxError = 0;
+    for(int iStartCol = 0; iStartCol < iPatchSize; iStartCol += INTERPOLATION_ERROR_BLOCK_SIZE)
+    {
+        int iNumCols = min(iPatchSize - iStartCol, (int)INTERPOLATION_ERROR_BLOCK_SIZE);
+        int iNumHighResCols = iNumCols*2;
+        INT32 *pUpsampledRow0 = UpsampledRows[0];
+        INT32 *pUpsampledRow1 = UpsampledRows[1];
+        UpsampleParentRow(pParentData + iStartCol, iNumCols, pUpsampledRow0);
+        for(int iParentRow = 0; iParentRow < iPatchSize; iParentRow++)
+        {
+            UpsampleParentRow(pParentData + (iParentRow+1) * ParentDataPitch + iStartCol, iNumCols, pUpsampledRow1);
+            const UINT16 *pEvenChildRow = pChildrenData + (iParentRow*2) * ChildrenDataPitch + iStartCol*2;
+            const UINT16 *pOddChildRow = pEvenChildRow + ChildrenDataPitch;
+            uiMaxError = max(uiMaxError, CalculateRowInterpolationError(pEvenChildRow, pUpsampledRow0, pUpsampledRow0, iNumHighResCols));
+            uiMaxError = max(uiMaxError, CalculateRowInterpolationError(pOddChildRow,  pUpsampledRow0, pUpsampledRow1, iNumHighResCols));
+            std::swap(pUpsampledRow0, pUpsampledRow1);
+        }
+    }
+    return uiMaxError;
+}
+
+static void InterpolateSampleQuadsScalar(const UINT16 *pQuads, const float *pFracX, const float *pFracY, int iNumQuads,
+                                        float *pHeights, float *pGradX, float *pGradY)
+{
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+    {
+        const UINT16 *pQuad = pQuads + 4*iQuad;
+        float fBottom = (float)pQuad[0] + pFracX[iQuad] * ((float)pQuad[1] - (float)pQuad[0]);
+        float fTop    = (float)pQuad[2] + pFracX[iQuad] * ((float)pQuad[3] - (float)pQuad[2]);
+        pHeights[iQuad] = fBottom + pFracY[iQuad] * (fTop - fBottom);
+        if( pGradX )
+        {
+            // Differences of the samples are exact, so the gradients are calculated from them
+            // rather than from the interpolated elevations
+            float fBottomSlope = (float)pQuad[1] - (float)pQuad[0];
+            float fTopSlope    = (float)pQuad[3] - (float)pQuad[2];
+            float fLeftSlope   = (float)pQuad[2] - (float)pQuad[0];
+            float fRightSlope  = (float)pQuad[3] - (float)pQuad[1];
+            pGradX[iQuad] = fBottomSlope + pFracY[iQuad] * (fTopSlope - fBottomSlope);
+            pGradY[iQuad] = fLeftSlope + pFracX[iQuad] * (fRightSlope - fLeftSlope);
+        }
+    }
+}
+
+// Corner samples of 4 quads are transposed, so that each register holds the same corner of all quads
+static void InterpolateSampleQuadsSSE41(const UINT16 *pQuads, const float *pFracX, const float *pFracY, int iNumQuads,
+                                        float *pHeights, float *pGradX, float *pGradY)
+{
+    int iQuad = 0;
+    for(; iQuad + 4 <= iNumQuads; iQuad += 4)
+    {
+        __m128i Quads01 = _mm_loadu_si128( (const __m128i*)(pQuads + 4*iQuad) );
+        __m128i Quads23 = _mm_loadu_si128( (const __m128i*)(pQuads + 4*iQuad + 8) );
+        __m128 Corner00 = _mm_cvtepi32_ps( _mm_cvtepu16_epi32(Quads01) );
+        __m128 Corner10 = _mm_cvtepi32_ps( _mm_cvtepu16_epi32(_mm_srli_si128(Quads01, 8)) );
+        __m128 Corner01 = _mm_cvtepi32_ps( _mm_cvtepu16_epi32(Quads23) );
+        __m128 Corner11 = _mm_cvtepi32_ps( _mm_cvtepu16_epi32(_mm_srli_si128(Quads23, 8)) );
+        _MM_TRANSPOSE4_PS(Corner00, Corner10, Corner01, Corner11);
+
+        __m128 FracX = _mm_loadu_ps(pFracX + iQuad);
+        __m128 FracY = _mm_loadu_ps(pFracY + iQuad);
+        __m128 BottomSlope = _mm_sub_ps(Corner10, Corner00);
+        __m128 TopSlope = _mm_sub_ps(Corner11, Corner01);
+        __m128 Bottom = _mm_add_ps( Corner00, _mm_mul_ps(FracX, BottomSlope) );
+        __m128 Top = _mm_add_ps( Corner01, _mm_mul_ps(FracX, TopSlope) );
+        _mm_storeu_ps( pHeights + iQuad, _mm_add_ps(Bottom, _mm_mul_ps(FracY, _mm_sub_ps(Top, Bottom))) );
+        if( pGradX )
+        {
+            __m128 LeftSlope = _mm_sub_ps(Corner01, Corner00);
+            __m128 RightSlope = _mm_sub_ps(Corner11, Corner10);
+            _mm_storeu_ps( pGradX + iQuad, _mm_add_ps(BottomSlope, _mm_mul_ps(FracY, _mm_sub_ps(TopSlope, BottomSlope))) );
+            _mm_storeu_ps( pGradY + iQuad, _mm_add_ps(LeftSlope, _mm_mul_ps(FracX, _mm_sub_ps(RightSlope, LeftSlope))) );
+        }
+    }
+    InterpolateSampleQuadsScalar(pQuads + 4*iQuad, pFracX + iQuad, pFracY + iQuad, iNumQuads - iQuad,
+                                 pHeights + iQuad, pGradX ? pGradX + iQuad : NULL, pGradY ? pGradY + iQuad : NULL);
+}
+
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+// Quads i and i+4 share a register, so that the in-lane transpose puts quads 0-3 in the lower
+// lane and quads 4-7 in the upper lane
+static void InterpolateSampleQuadsAVX2(const UINT16 *pQuads, const float *pFracX, const float *pFracY, int iNumQuads,
+                                       float *pHeights, float *pGradX, float *pGradY)
+{
+    int iQuad = 0;
+    for(; iQuad + 8 <= iNumQuads; iQuad += 8)
+    {
+        const UINT16 *pQuad = pQuads + 4*iQuad;
+        __m256 Corners[4];
+        for(int i = 0; i < 4; i++)
+        {
+            __m128i QuadPair = _mm_unpacklo_epi64( _mm_loadl_epi64((const __m128i*)(pQuad + 4*i)), _mm_loadl_epi64((const __m128i*)(pQuad + 4*(i+4))) );
+            Corners[i] = _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32(QuadPair) );
+        }
+        __m256 Tmp0 = _mm256_unpacklo_ps(Corners[0], Corners[1]);
+        __m256 Tmp1 = _mm256_unpacklo_ps(Corners[2], Corners[3]);
+        __m256 Tmp2 = _mm256_unpackhi_ps(Corners[0], Corners[1]);
+        __m256 Tmp3 = _mm256_unpackhi_ps(Corners[2], Corners[3]);
+        __m256 Corner00 = _mm256_shuffle_ps(Tmp0, Tmp1, _MM_SHUFFLE(1,0,1,0));
+        __m256 Corner10 = _mm256_shuffle_ps(Tmp0, Tmp1, _MM_SHUFFLE(3,2,3,2));
+        __m256 Corner01 = _mm256_shuffle_ps(Tmp2, Tmp3, _MM_SHUFFLE(1,0,1,0));
+        __m256 Corner11 = _mm256_shuffle_ps(Tmp2, Tmp3, _MM_SHUFFLE(3,2,3,2));
+
+        __m256 FracX = _mm256_loadu_ps(pFracX + iQuad);
+        __m256 FracY = _mm256_loadu_ps(pFracY + iQuad);
+        __m256 BottomSlope = _mm256_sub_ps(Corner10, Corner00);
+        __m256 TopSlope = _mm256_sub_ps(Corner11, Corner01);
+        __m256 Bottom = _mm256_add_ps( Corner00, _mm256_mul_ps(FracX, BottomSlope) );
+        __m256 Top = _mm256_add_ps( Corner01, _mm256_mul_ps(FracX, TopSlope) );
+        _mm256_storeu_ps( pHeights + iQuad, _mm256_add_ps(Bottom, _mm256_mul_ps(FracY, _mm256_sub_ps(Top, Bottom))) );
+        if( pGradX )
+        {
+            __m256 LeftSlope = _mm256_sub_ps(Corner01, Corner00);
+            __m256 RightSlope = _mm256_sub_ps(Corner11, Corner10);
+            _mm256_storeu_ps( pGradX + iQuad, _mm256_add_ps(BottomSlope, _mm256_mul_ps(FracY, _mm256_sub_ps(TopSlope, BottomSlope))) );
+            _mm256_storeu_ps( pGradY + iQuad, _mm256_add_ps(LeftSlope, _mm256_mul_ps(FracX, _mm256_sub_ps(RightSlope, LeftSlope))) );
+        }
+    }
+    // Avoid AVX-SSE transition penalty
+    _mm256_zeroupper();
+    InterpolateSampleQuadsSSE41(pQuads + 4*iQuad, pFracX + iQuad, pFracY + iQuad, iNumQuads - iQuad,
+                                pHeights + iQuad, pGradX ? pGradX + iQuad : NULL, pGradY ? pGradY + iQuad : NULL);
+}
+#endif
+
+void InterpolateSampleQuads(const UINT16 *pQuads,
+                            const float *pFracX,
+                            const float *pFracY,
+                            int iNumQuads,
+                            float *pHeights,
+                            float *pGradX,
+                            float *pGradY,
+                            SIMD_LEVEL SIMDLevel)
+{
+    assert( (pGradX == NULL) == (pGradY == NULL) );
+    assert( SIMDLevel <= g_SupportedSIMDLevel );
+    switch(SIMDLevel)
+    {
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+        case SIMD_LEVEL_AVX2:
+            InterpolateSampleQuadsAVX2(pQuads, pFracX, pFracY, iNumQuads, pHeights, pGradX, pGradY);
+            break;
+#endif
+        case SIMD_LEVEL_SSE41:
+            InterpolateSampleQuadsSSE41(pQuads, pFracX, pFracY, iNumQuads, pHeights, pGradX, pGradY);
+            break;
+
+        default:
+            InterpolateSampleQuadsScalar(pQuads, pFracX, pFracY, iNumQuads, pHeights, pGradX, pGradY);
+    }
+}
+
+// Barycentric coordinates of the sample are the absolute values of the cross products of the
+// directions from the triangle vertices to the sample divided by the doubled triangle area. The cross
+// products are integers, which change by the same amount from one sample of the row to the next, so
+// they are calculated incrementally without rounding. Interpolated elevation is calculated in the same
+// order as in the scalar code, so all instruction sets return exactly the same errors
+struct STriangleErrorParams
+{
+    int iVertCols[3], iVertRows[3];
+    float fDoubledArea;
+    float fElev0, fElev1, fElev2;
+    float fDCrossU, fDCrossV, fDCrossW; // Increments of the cross products along the row
+};
+
+// Rows covered by the triangle are passed to the kernels in batches, so that the
+// constants are set up once for many short rows
+enum {TRIANGLE_ROW_BATCH_SIZE = 64};
+struct STriangleRowBatch
+{
+    int iNumRows;
+    int piRows[TRIANGLE_ROW_BATCH_SIZE];
+    int piStartCols[TRIANGLE_ROW_BATCH_SIZE];
+    int piNumCols[TRIANGLE_ROW_BATCH_SIZE];
+};
+
+// Returns the cross products at the sample
+static inline void GetTriangleCrossProducts(const STriangleErrorParams &Params, int iCol, int iRow,
+                                            float &fCrossU, float &fCrossV, float &fCrossW)
+{
+    int iDirX0 = iCol - Params.iVertCols[0], iDirY0 = iRow - Params.iVertRows[0];
+    int iDirX1 = iCol - Params.iVertCols[1], iDirY1 = iRow - Params.iVertRows[1];
+    int iDirX2 = iCol - Params.iVertCols[2], iDirY2 = iRow - Params.iVertRows[2];
+    fCrossU = (float)(iDirX1 * iDirY2 - iDirY1 * iDirX2);
+    fCrossV = (float)(iDirX0 * iDirY2 - iDirY0 * iDirX2);
+    fCrossW = (float)(iDirX0 * iDirY1 - iDirY0 * iDirX1);
+}
+
+// The kernels return the maximal error of the samples of the rows or the error of the first sample,
+// which is not less than the threshold
+static float CalculateTriangleRowsErrorScalar(const UINT16 *pData, size_t DataPitch, const STriangleErrorParams &Params,
+                                              const STriangleRowBatch &Batch, float fErrorThreshold)
+{
+    float fMaxError = 0;
+    for(int iBatchRow = 0; iBatchRow < Batch.iNumRows; iBatchRow++)
+    {
+        const UINT16 *pRow = pData + Batch.piStartCols[iBatchRow] + Batch.piRows[iBatchRow]*DataPitch;
+        float fCrossU, fCrossV, fCrossW;
+        GetTriangleCrossProducts(Params, Batch.piStartCols[iBatchRow], Batch.piRows[iBatchRow], fCrossU, fCrossV, fCrossW);
+        for(int iCol = 0; iCol < Batch.piNumCols[iBatchRow]; iCol++)
+        {
+            float fBaricentricU = fabsf(fCrossU) / Params.fDoubledArea;
+            float fBaricentricV = fabsf(fCrossV) / Params.fDoubledArea;
+            float fBaricentricW = fabsf(fCrossW) / Params.fDoubledArea;
+            float fTriangleZ = fBaricentricU * Params.fElev0 + fBaricentricV * Params.fElev1 + fBaricentricW * Params.fElev2;
+            float fError = fabsf( (float)pRow[iCol] - fTriangleZ );
+            if( fError >= fErrorThreshold )
+                return fError;
+            fMaxError = max(fMaxError, fError);
+            fCrossU += Params.fDCrossU;
+            fCrossV += Params.fDCrossV;
+            fCrossW += Params.fDCrossW;
+        }
+    }
+    return fMaxError;
+}
+
+// Samples past the end of the row are copied to the temporary buffer, so that the memory after
+// the last row is never read. Errors of the lanes past the end of the row are set to zero
+static float CalculateTriangleRowsErrorSSE41(const UINT16 *pData, size_t DataPitch, const STriangleErrorParams &Params,
+                                             const STriangleRowBatch &Batch, float fErrorThreshold)
+{
+    const __m128 AbsMask = _mm_castsi128_ps( _mm_set1_epi32(0x7FFFFFFF) );
+    const __m128 LaneOffsets = _mm_setr_ps(0, 1, 2, 3);
+    __m128 LaneDCrossU = _mm_mul_ps( LaneOffsets, _mm_set1_ps(Params.fDCrossU) );
+    __m128 LaneDCrossV = _mm_mul_ps( LaneOffsets, _mm_set1_ps(Params.fDCrossV) );
+    __m128 LaneDCrossW = _mm_mul_ps( LaneOffsets, _mm_set1_ps(Params.fDCrossW) );
+    __m128 DCrossU = _mm_set1_ps(Params.fDCrossU * 4);
+    __m128 DCrossV = _mm_set1_ps(Params.fDCrossV * 4);
+    __m128 DCrossW = _mm_set1_ps(Params.fDCrossW * 4);
+    __m128 DoubledArea = _mm_set1_ps(Params.fDoubledArea);
+    __m128 Elev0 = _mm_set1_ps(Params.fElev0);
+    __m128 Elev1 = _mm_set1_ps(Params.fElev1);
+    __m128 Elev2 = _mm_set1_ps(Params.fElev2);
+    __m128 Threshold = _mm_set1_ps(fErrorThreshold);
+    __m128 MaxError = _mm_setzero_ps();
+    for(int iBatchRow = 0; iBatchRow < Batch.iNumRows; iBatchRow++)
+    {
+        const UINT16 *pRow = pData + Batch.piStartCols[iBatchRow] + Batch.piRows[iBatchRow]*DataPitch;
+        int iNumCols = Batch.piNumCols[iBatchRow];
+        float fCrossU, fCrossV, fCrossW;
+        GetTriangleCrossProducts(Params, Batch.piStartCols[iBatchRow], Batch.piRows[iBatchRow], fCrossU, fCrossV, fCrossW);
+        __m128 CrossU = _mm_add_ps( _mm_set1_ps(fCrossU), LaneDCrossU );
+        __m128 CrossV = _mm_add_ps( _mm_set1_ps(fCrossV), LaneDCrossV );
+        __m128 CrossW = _mm_add_ps( _mm_set1_ps(fCrossW), LaneDCrossW );
+        for(int iCol = 0; iCol < iNumCols; iCol += 4)
+        {
+            int iNumLanes = iNumCols - iCol;
+            __m128i Samples;
+            if( iNumLanes >= 4 )
+                Samples = _mm_loadl_epi64( (const __m128i*)(pRow + iCol) );
+            else
+            {
+                UINT16 TailSamples[4] = {0};
+                for(int iLane = 0; iLane < iNumLanes; iLane++)
+                    TailSamples[iLane] = pRow[iCol + iLane];
+                Samples = _mm_loadl_epi64( (const __m128i*)TailSamples );
+            }
+            __m128 BaricentricU = _mm_div_ps( _mm_and_ps(CrossU, AbsMask), DoubledArea );
+            __m128 BaricentricV = _mm_div_ps( _mm_and_ps(CrossV, AbsMask), DoubledArea );
+            __m128 BaricentricW = _mm_div_ps( _mm_and_ps(CrossW, AbsMask), DoubledArea );
+            __m128 TriangleZ = _mm_add_ps( _mm_add_ps(_mm_mul_ps(BaricentricU, Elev0), _mm_mul_ps(BaricentricV, Elev1)), _mm_mul_ps(BaricentricW, Elev2) );
+            __m128 Elev = _mm_cvtepi32_ps( _mm_cvtepu16_epi32(Samples) );
+            __m128 Error = _mm_and_ps( _mm_sub_ps(Elev, TriangleZ), AbsMask );
+            if( iNumLanes < 4 )
+                Error = _mm_and_ps( Error, _mm_cmplt_ps(LaneOffsets, _mm_set1_ps((float)iNumLanes)) );
+            int iExceededMask = _mm_movemask_ps( _mm_cmpge_ps(Error, Threshold) );
+            if( iExceededMask )
+            {
+                // Return the error of the first sample as the scalar code does
+                float fErrors[4];
+                _mm_storeu_ps(fErrors, Error);
+                unsigned long ulFirstLane;
+                _BitScanForward(&ulFirstLane, iExceededMask);
+                return fErrors[ulFirstLane];
+            }
+            MaxError = _mm_max_ps(MaxError, Error);
+            CrossU = _mm_add_ps(CrossU, DCrossU);
+            CrossV = _mm_add_ps(CrossV, DCrossV);
+            CrossW = _mm_add_ps(CrossW, DCrossW);
+        }
+    }
+    MaxError = _mm_max_ps(MaxError, _mm_shuffle_ps(MaxError, MaxError, _MM_SHUFFLE(1,0,3,2)));
+    MaxError = _mm_max_ps(MaxError, _mm_shuffle_ps(MaxError, MaxError, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtss_f32(MaxError);
+}
+
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+static float CalculateTriangleRowsErrorAVX2(const UINT16 *pData, size_t DataPitch, const STriangleErrorParams &Params,
+                                            const STriangleRowBatch &Batch, float fErrorThreshold)
+{
+    const __m256 AbsMask = _mm256_castsi256_ps( _mm256_set1_epi32(0x7FFFFFFF) );
+    const __m256 LaneOffsets = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 LaneDCrossU = _mm256_mul_ps( LaneOffsets, _mm256_set1_ps(Params.fDCrossU) );
+    __m256 LaneDCrossV = _mm256_mul_ps( LaneOffsets, _mm256_set1_ps(Params.fDCrossV) );
+    __m256 LaneDCrossW = _mm256_mul_ps( LaneOffsets, _mm256_set1_ps(Params.fDCrossW) );
+    __m256 DCrossU = _mm256_set1_ps(Params.fDCrossU * 8);
+    __m256 DCrossV = _mm256_set1_ps(Params.fDCrossV * 8);
+    __m256 DCrossW = _mm256_set1_ps(Params.fDCrossW * 8);
+    __m256 DoubledArea = _mm256_set1_ps(Params.fDoubledArea);
+    __m256 Elev0 = _mm256_set1_ps(Params.fElev0);
+    __m256 Elev1 = _mm256_set1_ps(Params.fElev1);
+    __m256 Elev2 = _mm256_set1_ps(Params.fElev2);
+    __m256 Threshold = _mm256_set1_ps(fErrorThreshold);
+    __m256 MaxError = _mm256_setzero_ps();
+    for(int iBatchRow = 0; iBatchRow < Batch.iNumRows; iBatchRow++)
+    {
+        const UINT16 *pRow = pData + Batch.piStartCols[iBatchRow] + Batch.piRows[iBatchRow]*DataPitch;
+        int iNumCols = Batch.piNumCols[iBatchRow];
+        float fCrossU, fCrossV, fCrossW;
+        GetTriangleCrossProducts(Params, Batch.piStartCols[iBatchRow], Batch.piRows[iBatchRow], fCrossU, fCrossV, fCrossW);
+        __m256 CrossU = _mm256_add_ps( _mm256_set1_ps(fCrossU), LaneDCrossU );
+        __m256 CrossV = _mm256_add_ps( _mm256_set1_ps(fCrossV), LaneDCrossV );
+        __m256 CrossW = _mm256_add_ps( _mm256_set1_ps(fCrossW), LaneDCrossW );
+        for(int iCol = 0; iCol < iNumCols; iCol += 8)
+        {
+            int iNumLanes = iNumCols - iCol;
+            __m128i Samples;
+            if( iNumLanes >= 8 )
+                Samples = _mm_loadu_si128( (const __m128i*)(pRow + iCol) );
+            else
+            {
+                UINT16 TailSamples[8] = {0};
+                for(int iLane = 0; iLane < iNumLanes; iLane++)
+                    TailSamples[iLane] = pRow[iCol + iLane];
+                Samples = _mm_loadu_si128( (const __m128i*)TailSamples );
+            }
+            __m256 BaricentricU = _mm256_div_ps( _mm256_and_ps(CrossU, AbsMask), DoubledArea );
+            __m256 BaricentricV = _mm256_div_ps( _mm256_and_ps(CrossV, AbsMask), DoubledArea );
+            __m256 BaricentricW = _mm256_div_ps( _mm256_and_ps(CrossW, AbsMask), DoubledArea );
+            // Multiplications and additions are not fused to keep the rounding of the scalar code
+            __m256 TriangleZ = _mm256_add_ps( _mm256_add_ps(_mm256_mul_ps(BaricentricU, Elev0), _mm256_mul_ps(BaricentricV, Elev1)), _mm256_mul_ps(BaricentricW, Elev2) );
+            __m256 Elev = _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32(Samples) );
+            __m256 Error = _mm256_and_ps( _mm256_sub_ps(Elev, TriangleZ), AbsMask );
+            if( iNumLanes < 8 )
+                Error = _mm256_and_ps( Error, _mm256_cmp_ps(LaneOffsets, _mm256_set1_ps((float)iNumLanes), _CMP_LT_OQ) );
+            int iExceededMask = _mm256_movemask_ps( _mm256_cmp_ps(Error, Threshold, _CMP_GE_OQ) );
+            if( iExceededMask )
+            {
+                float fErrors[8];
+                _mm256_storeu_ps(fErrors, Error);
+                _mm256_zeroupper();
+                unsigned long ulFirstLane;
+                _BitScanForward(&ulFirstLane, iExceededMask);
+                return fErrors[ulFirstLane];
+            }
+            MaxError = _mm256_max_ps(MaxError, Error);
+            CrossU = _mm256_add_ps(CrossU, DCrossU);
+            CrossV = _mm256_add_ps(CrossV, DCrossV);
+            CrossW = _mm256_add_ps(CrossW, DCrossW);
+        }
+    }
+    __m128 MaxError128 = _mm_max_ps(_mm256_castps256_ps128(MaxError), _mm256_extractf128_ps(MaxError, 1));
+    // Avoid AVX-SSE transition penalty
+    _mm256_zeroupper();
+    MaxError128 = _mm_max_ps(MaxError128, _mm_shuffle_ps(MaxError128, MaxError128, _MM_SHUFFLE(1,0,3,2)));
+    MaxError128 = _mm_max_ps(MaxError128, _mm_shuffle_ps(MaxError128, MaxError128, _MM_SHUFFLE(2,3,0,1)));
+    return _mm_cvtss_f32(MaxError128);
+}
+#endif
+
+// Floor of the fraction with the positive denominator
+static inline int FloorDiv(int iNumerator, int iDenominator)
+{
+    return iNumerator >= 0 ? iNumerator / iDenominator : -((-iNumerator + iDenominator - 1) / iDenominator);
+}
+
+// Steps along the triangle rib from row to row. The column, at which the rib crosses the row,
+// is kept as the exact fraction, so that the covered samples are found without divisions
+struct STriangleRibStepper
+{
+    int iFloorCol;
+    int iRemainder;
+    int iFloorStep;
+    int iRemainderStep;
+    int iHeight;
+
+    void Init(int iStartCol, int iStartRow, int iEndCol, int iEndRow)
+    {
+        iHeight = iEndRow - iStartRow;
+        iFloorCol = iStartCol;
+        iRemainder = 0;
+        int iWidth = iEndCol - iStartCol;
+        // Ribs of the small triangles are mostly steep, so the division is avoided for them
+        if( iWidth >= 0 && iWidth < iHeight )
+            iFloorStep = 0;
+        else if( iWidth < 0 && iWidth >= -iHeight )
+            iFloorStep = -1;
+        else
+            iFloorStep = FloorDiv(iWidth, iHeight);
+        iRemainderStep = iWidth - iFloorStep * iHeight;
+    }
+
+    void Step()
+    {
+        iFloorCol += iFloorStep;
+        iRemainder += iRemainderStep;
+        if( iRemainder >= iHeight )
+        {
+            iFloorCol++;
+            iRemainder -= iHeight;
+        }
+    }
+
+    int GetFloorCol()const{return iFloorCol;}
+    int GetCeilCol()const{return iFloorCol + (iRemainder > 0 ? 1 : 0);}
+};
+
+float CalculateTriangleMaxError(const UINT16 *pData,
+                                size_t DataPitch,
+                                const int piVertCols[3],
+                                const int piVertRows[3],
+                                float fErrorThreshold,
+                                SIMD_LEVEL SIMDLevel)
+{
+    assert( SIMDLevel <= g_SupportedSIMDLevel );
+    // Rows of narrow triangles do not fill the registers, and the scalar code is faster for them.
+    // All kernels return the same errors, so the choice does not affect the result
+    int iWidth = max(max(piVertCols[0], piVertCols[1]), piVertCols[2]) - min(min(piVertCols[0], piVertCols[1]), piVertCols[2]) + 1;
+    if( SIMDLevel == SIMD_LEVEL_AVX2 && iWidth < 8 )
+        SIMDLevel = SIMD_LEVEL_SSE41;
+    if( SIMDLevel == SIMD_LEVEL_SSE41 && iWidth < 4 )
+        SIMDLevel = SIMD_LEVEL_SCALAR;
+    float (*CalculateTriangleRowsError)(const UINT16*, size_t, const STriangleErrorParams&, const STriangleRowBatch&, float) = CalculateTriangleRowsErrorScalar;
+    switch(SIMDLevel)
+    {
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+        case SIMD_LEVEL_AVX2:
+            CalculateTriangleRowsError = CalculateTriangleRowsErrorAVX2;
+            break;
+#endif
+        case SIMD_LEVEL_SSE41:
+            CalculateTriangleRowsError = CalculateTriangleRowsErrorSSE41;
+            break;
+        default:
+            break;
+    }
+
+    int iDoubledArea = abs( (piVertCols[1] - piVertCols[0]) * (piVertRows[2] - piVertRows[0]) -
+                            (piVertRows[1] - piVertRows[0]) * (piVertCols[2] - piVertCols[0]) );
+    assert( iDoubledArea > 0 );
+
+    STriangleErrorParams Params;
+    for(int iVert = 0; iVert < 3; iVert++)
+    {
+        Params.iVertCols[iVert] = piVertCols[iVert];
+        Params.iVertRows[iVert] = piVertRows[iVert];
+    }
+    Params.fDoubledArea = (float)iDoubledArea;
+    Params.fElev0 = (float)pData[piVertCols[0] + piVertRows[0]*DataPitch];
+    Params.fElev1 = (float)pData[piVertCols[1] + piVertRows[1]*DataPitch];
+    Params.fElev2 = (float)pData[piVertCols[2] + piVertRows[2]*DataPitch];
+    // Cross product of the directions from vertices A and B changes by (RowA - RowB) along the row
+    Params.fDCrossU = (float)(piVertRows[1] - piVertRows[2]);
+    Params.fDCrossV = (float)(piVertRows[0] - piVertRows[2]);
+    Params.fDCrossW = (float)(piVertRows[0] - piVertRows[1]);
+
+    // Order vertices by rows: iRow0 <= iRow1 <= iRow2
+    int iOrder[3] = {0, 1, 2};
+    if( piVertRows[iOrder[0]] > piVertRows[iOrder[1]] )
+        std::swap(iOrder[0], iOrder[1]);
+    if( piVertRows[iOrder[1]] > piVertRows[iOrder[2]] )
+    {
+        std::swap(iOrder[1], iOrder[2]);
+        if( piVertRows[iOrder[0]] > piVertRows[iOrder[1]] )
+            std::swap(iOrder[0], iOrder[1]);
+    }
+    int iCol0 = piVertCols[iOrder[0]], iRow0 = piVertRows[iOrder[0]];
+    int iCol1 = piVertCols[iOrder[1]], iRow1 = piVertRows[iOrder[1]];
+    int iCol2 = piVertCols[iOrder[2]], iRow2 = piVertRows[iOrder[2]];
+    if( iRow0 >= iRow2 )
+        return 0;
+
+    // Start column always lies on the rib [V0,V2], end column lies on the rib [V0,V1]
+    // up to the intermediate row and on the rib [V1,V2] below it
+    STriangleRibStepper LongRib, LowerRib, UpperRib;
+    LongRib.Init(iCol0, iRow0, iCol2, iRow2);
+    if( iRow1 > iRow0 )
+        LowerRib.Init(iCol0, iRow0, iCol1, iRow1);
+    if( iRow2 > iRow1 )
+        UpperRib.Init(iCol1, iRow1, iCol2, iRow2);
+
+    STriangleRowBatch Batch;
+    Batch.iNumRows = 0;
+    float fMaxError = 0;
+    for(int iRow = iRow0; iRow <= iRow2; iRow++)
+    {
+        int iStartCol = LongRib.GetCeilCol();
+        int iEndCol = LongRib.GetFloorCol();
+        if( iRow > iRow1 )
+        {
+            iStartCol = min(iStartCol, UpperRib.GetCeilCol());
+            iEndCol = max(iEndCol, UpperRib.GetFloorCol());
+        }
+        else if( iRow1 > iRow0 )
+        {
+            iStartCol = min(iStartCol, LowerRib.GetCeilCol());
+            iEndCol = max(iEndCol, LowerRib.GetFloorCol());
+        }
+        else
+        {
+            iStartCol = min(iStartCol, iCol1);
+            iEndCol = max(iEndCol, iCol1);
+        }
+        LongRib.Step();
+        if( iRow >= iRow1 )
+        {
+            if( iRow2 > iRow1 )
+                UpperRib.Step();
+        }
+        else
+            LowerRib.Step();
+
+        if( iStartCol <= iEndCol )
+        {
+            Batch.piRows[Batch.iNumRows] = iRow;
+            Batch.piStartCols[Batch.iNumRows] = iStartCol;
+            Batch.piNumCols[Batch.iNumRows] = iEndCol - iStartCol + 1;
+            Batch.iNumRows++;
+        }
+
+        if( Batch.iNumRows == TRIANGLE_ROW_BATCH_SIZE || (iRow == iRow2 && Batch.iNumRows > 0) )
+        {
+            float fBatchError = CalculateTriangleRowsError(pData, DataPitch, Params, Batch, fErrorThreshold);
+            if( fBatchError >= fErrorThreshold )
+                return fBatchError;
+            fMaxError = max(fMaxError, fBatchError);
+            Batch.iNumRows = 0;
+        }
+    }
+    return fMaxError;
+}
+
+// Returns the number of bits required to store the value
+static int GetNumBits(UINT uiValue)
+{
+    int iNumBits = 0;
+    while( uiValue >> iNumBits )
+        iNumBits++;
+    return iNumBits;
+}
+
+void InitPackedBlockDesc(const UINT16 *pSrc, size_t SrcPitch, SPackedBlockDesc &Desc)
+{
+    int iFirstRowMin = pSrc[0], iFirstRowMax = pSrc[0];
+    for(int iCol = 1; iCol < PACKED_BLOCK_SIZE; iCol++)
+    {
+        iFirstRowMin = min(iFirstRowMin, (int)pSrc[iCol]);
+        iFirstRowMax = max(iFirstRowMax, (int)pSrc[iCol]);
+    }
+    int iMin = iFirstRowMin, iMax = iFirstRowMax;
+    int iMinDelta = 0xFFFF, iMaxDelta = -0xFFFF;
+    for(int iRow = 1; iRow < PACKED_BLOCK_SIZE; iRow++)
+    {
+        const UINT16 *pRow = pSrc + iRow*SrcPitch;
+        for(int iCol = 0; iCol < PACKED_BLOCK_SIZE; iCol++)
+        {
+            int iDelta = (int)pRow[iCol] - (int)pRow[iCol - SrcPitch];
+            iMin = min(iMin, (int)pRow[iCol]);
+            iMax = max(iMax, (int)pRow[iCol]);
+            iMinDelta = min(iMinDelta, iDelta);
+            iMaxDelta = max(iMaxDelta, iDelta);
+        }
+    }
+
+    memset(&Desc, 0, sizeof(Desc));
+    int iFirstRowBits = GetNumBits(iFirstRowMax - iFirstRowMin);
+    int iDeltaBits = GetNumBits(iMaxDelta - iMinDelta);
+    int iPlainBits = GetNumBits(iMax - iMin);
+    if( iDeltaBits <= 16 && iFirstRowBits + (PACKED_BLOCK_SIZE-1)*iDeltaBits < PACKED_BLOCK_SIZE*iPlainBits )
+    {
+        Desc.FirstRowOffset = (UINT16)iFirstRowMin;
+        Desc.RowOffset = (UINT16)iMinDelta;
+        Desc.uiFirstRowBits = (BYTE)iFirstRowBits;
+        Desc.uiRowBits = (BYTE)iDeltaBits;
+        Desc.bDeltaRows = TRUE;
+    }
+    else
+    {
+        Desc.FirstRowOffset = Desc.RowOffset = (UINT16)iMin;
+        Desc.uiFirstRowBits = Desc.uiRowBits = (BYTE)iPlainBits;
+        Desc.bDeltaRows = FALSE;
+    }
+}
+
+// Returns the bit position of the row in the lane
+static inline int GetPackedRowBitPos(const SPackedBlockDesc &Desc, int iRow)
+{
+    return iRow == 0 ? 0 : Desc.uiFirstRowBits + (iRow-1) * Desc.uiRowBits;
+}
+
+void PackHeightMapBlock(const UINT16 *pSrc,
+                        size_t SrcPitch,
+                        const SPackedBlockDesc &Desc,
+                        UINT16 *pPackedData)
+{
+    memset(pPackedData, 0, GetPackedBlockSize(Desc) * sizeof(UINT16));
+    for(int iRow = 0; iRow < PACKED_BLOCK_SIZE; iRow++)
+    {
+        int iNumBits = iRow == 0 ? Desc.uiFirstRowBits : Desc.uiRowBits;
+        if( iNumBits == 0 )
+            continue;
+        int iBitPos = GetPackedRowBitPos(Desc, iRow);
+        UINT16 *pWords = pPackedData + (iBitPos >> 4) * PACKED_BLOCK_SIZE;
+        int iShift = iBitPos & 15;
+        const UINT16 *pRow = pSrc + iRow*SrcPitch;
+        for(int iLane = 0; iLane < PACKED_BLOCK_SIZE; iLane++)
+        {
+            UINT16 Base = iRow == 0 ? Desc.FirstRowOffset :
+                                      (UINT16)((Desc.bDeltaRows ? pRow[iLane - SrcPitch] : 0) + Desc.RowOffset);
+            UINT32 uiValue = (UINT16)(pRow[iLane] - Base);
+            assert( (uiValue >> iNumBits) == 0 );
+            pWords[iLane] |= (UINT16)(uiValue << iShift);
+            if( iShift + iNumBits > 16 )
+                pWords[iLane + PACKED_BLOCK_SIZE] |= (UINT16)(uiValue >> (16 - iShift));
+        }
+    }
+}
+
+static void UnpackHeightMapBlockScalar(const UINT16 *pPackedData, const SPackedBlockDesc &Desc, UINT16 *pDst, size_t DstPitch)
+{
+    UINT16 PrevRowMask = Desc.bDeltaRows ? 0xFFFF : 0;
+    for(int iRow = 0; iRow < PACKED_BLOCK_SIZE; iRow++)
+    {
+        int iNumBits = iRow == 0 ? Desc.uiFirstRowBits : Desc.uiRowBits;
+        int iBitPos = GetPackedRowBitPos(Desc, iRow);
+        const UINT16 *pWords = pPackedData + (iBitPos >> 4) * PACKED_BLOCK_SIZE;
+        int iShift = iBitPos & 15;
+        UINT16 *pDstRow = pDst + iRow*DstPitch;
+        for(int iLane = 0; iLane < PACKED_BLOCK_SIZE; iLane++)
+        {
+            UINT32 uiValue = 0;
+            if( iNumBits > 0 )
+            {
+                uiValue = pWords[iLane] >> iShift;
+                if( iShift + iNumBits > 16 )
+                    uiValue |= (UINT32)pWords[iLane + PACKED_BLOCK_SIZE] << (16 - iShift);
+                uiValue &= (1 << iNumBits) - 1;
+            }
+            UINT16 Base = iRow == 0 ? Desc.FirstRowOffset : (UINT16)((pDstRow[iLane - DstPitch] & PrevRowMask) + Desc.RowOffset);
+            pDstRow[iLane] = (UINT16)(Base + uiValue);
+        }
+    }
+}
+
+// Each block row is extracted from one or two words of all lanes with the same shift
+static void UnpackHeightMapBlockSSE41(const UINT16 *pPackedData, const SPackedBlockDesc &Desc, UINT16 *pDst, size_t DstPitch)
+{
+    __m128i PrevRowMask = _mm_set1_epi16( Desc.bDeltaRows ? -1 : 0 );
+    __m128i Row0 = _mm_set1_epi16( (short)Desc.FirstRowOffset );
+    __m128i Row1 = Row0;
+    __m128i RowOffset = _mm_set1_epi16( (short)Desc.RowOffset );
+    for(int iRow = 0; iRow < PACKED_BLOCK_SIZE; iRow++)
+    {
+        int iNumBits = iRow == 0 ? Desc.uiFirstRowBits : Desc.uiRowBits;
+        if( iRow > 0 )
+        {
+            Row0 = _mm_add_epi16( _mm_and_si128(Row0, PrevRowMask), RowOffset );
+            Row1 = _mm_add_epi16( _mm_and_si128(Row1, PrevRowMask), RowOffset );
+        }
+        if( iNumBits > 0 )
+        {
+            int iBitPos = GetPackedRowBitPos(Desc, iRow);
+            const UINT16 *pWords = pPackedData + (iBitPos >> 4) * PACKED_BLOCK_SIZE;
+            int iShift = iBitPos & 15;
+            __m128i Shift = _mm_cvtsi32_si128(iShift);
+            __m128i Values0 = _mm_srl_epi16( _mm_loadu_si128((const __m128i*)pWords), Shift );
+            __m128i Values1 = _mm_srl_epi16( _mm_loadu_si128((const __m128i*)(pWords+8)), Shift );
+            if( iShift + iNumBits > 16 )
+            {
+                __m128i NextWordShift = _mm_cvtsi32_si128(16 - iShift);
+                Values0 = _mm_or_si128( Values0, _mm_sll_epi16(_mm_loadu_si128((const __m128i*)(pWords+16)), NextWordShift) );
+                Values1 = _mm_or_si128( Values1, _mm_sll_epi16(_mm_loadu_si128((const __m128i*)(pWords+24)), NextWordShift) );
+            }
+            __m128i Mask = _mm_set1_epi16( (short)((1 << iNumBits) - 1) );
+            Row0 = _mm_add_epi16( Row0, _mm_and_si128(Values0, Mask) );
+            Row1 = _mm_add_epi16( Row1, _mm_and_si128(Values1, Mask) );
+        }
+        _mm_storeu_si128( (__m128i*)(pDst + iRow*DstPitch), Row0 );
+        _mm_storeu_si128( (__m128i*)(pDst + iRow*DstPitch + 8), Row1 );
+    }
+}
+
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+// The whole block row fits into one register
+static void UnpackHeightMapBlockAVX2(const UINT16 *pPackedData, const SPackedBlockDesc &Desc, UINT16 *pDst, size_t DstPitch)
+{
+    __m256i PrevRowMask = _mm256_set1_epi16( Desc.bDeltaRows ? -1 : 0 );
+    __m256i Row = _mm256_set1_epi16( (short)Desc.FirstRowOffset );
+    __m256i RowOffset = _mm256_set1_epi16( (short)Desc.RowOffset );
+    for(int iRow = 0; iRow < PACKED_BLOCK_SIZE; iRow++)
+    {
+        int iNumBits = iRow == 0 ? Desc.uiFirstRowBits : Desc.uiRowBits;
+        if( iRow > 0 )
+            Row = _mm256_add_epi16( _mm256_and_si256(Row, PrevRowMask), RowOffset );
+        if( iNumBits > 0 )
+        {
+            int iBitPos = GetPackedRowBitPos(Desc, iRow);
+            const UINT16 *pWords = pPackedData + (iBitPos >> 4) * PACKED_BLOCK_SIZE;
+            int iShift = iBitPos & 15;
+            __m256i Values = _mm256_srl_epi16( _mm256_loadu_si256((const __m256i*)pWords), _mm_cvtsi32_si128(iShift) );
+            if( iShift + iNumBits > 16 )
+                Values = _mm256_or_si256( Values, _mm256_sll_epi16(_mm256_loadu_si256((const __m256i*)(pWords+16)), _mm_cvtsi32_si128(16 - iShift)) );
+            Row = _mm256_add_epi16( Row, _mm256_and_si256(Values, _mm256_set1_epi16( (short)((1 << iNumBits) - 1) )) );
+        }
+        _mm256_storeu_si256( (__m256i*)(pDst + iRow*DstPitch), Row );
+    }
+    // Avoid AVX-SSE transition penalty
+    _mm256_zeroupper();
+}
+#endif
+
+void UnpackHeightMapBlock(const UINT16 *pPackedData,
+                          const SPackedBlockDesc &Desc,
+                          UINT16 *pDst,
+                          size_t DstPitch,
+                          SIMD_LEVEL SIMDLevel)
+{
+    assert( SIMDLevel <= g_SupportedSIMDLevel );
+    switch(SIMDLevel)
+    {
+#ifdef HEIGHT_MAP_KERNELS_AVX2
+        case SIMD_LEVEL_AVX2:
+            UnpackHeightMapBlockAVX2(pPackedData, Desc, pDst, DstPitch);
+            break;
+#endif
+        case SIMD_LEVEL_SSE41:
+            UnpackHeightMapBlockSSE41(pPackedData, Desc, pDst, DstPitch);
+            break;
+
+        default:
+            UnpackHeightMapBlockScalar(pPackedData, Desc, pDst, DstPitch);
+    }
+}
@@ -0,0 +1,719 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "HeightMapStore.h"
+
+// Copies each quad with FillHeightMap()
+void CHeightMapStore::GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const
+{
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+        FillHeightMap(pQuads + 4*iQuad, 2, pCols[iQuad], pCols[iQuad]+2, pRows[iQuad], pRows[iQuad]+2, iStep);
+}
+
+// Returns source sample index clamped to the height map extent
+static inline int ClampSampleIndex(int iInd, unsigned int uiNumSamples)
+{
+    return min( max(iInd, 0), (int)uiNumSamples-1 );
+}
+
+CResidentHeightMap::CResidentHeightMap(unsigned int iNumCols, unsigned int iNumRows)
+{
+    m_iNumCols = iNumCols;
+    m_iNumRows = iNumRows;
+    m_TheHeightMap.resize( (size_t)m_iNumCols * m_iNumRows );
+}
+
+void CResidentHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                       size_t DataPitch,
+                                       int iStartCol, int iEndCol,
+                                       int iStartRow, int iEndRow,
+                                       int iStep)const
+{
+    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
+    {
+        int iSrcRow = max(0, iRow*iStep); iSrcRow = min(iSrcRow, (int)m_iNumRows-1);
+        const UINT16 *pSrcRow = &m_TheHeightMap[(size_t)iSrcRow * m_iNumCols];
+        UINT16 *pDstRow = pDataPtr + (iRow-iStartRow) * DataPitch;
+        for(int iCol = iStartCol; iCol < iEndCol; iCol++)
+        {
+            int iSrcCol = max(0, iCol*iStep); iSrcCol = min(iSrcCol, (int)m_iNumCols-1);
+            pDstRow[iCol-iStartCol] = pSrcRow[iSrcCol];
+        }
+    }
+}
+
+void CResidentHeightMap::GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const
+{
+    const UINT16 *pSamples = &m_TheHeightMap[0];
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+    {
+        int iCol0 = ClampSampleIndex(pCols[iQuad]*iStep, m_iNumCols), iCol1 = ClampSampleIndex((pCols[iQuad]+1)*iStep, m_iNumCols);
+        const UINT16 *pRow0 = pSamples + (size_t)ClampSampleIndex(pRows[iQuad]*iStep, m_iNumRows) * m_iNumCols;
+        const UINT16 *pRow1 = pSamples + (size_t)ClampSampleIndex((pRows[iQuad]+1)*iStep, m_iNumRows) * m_iNumCols;
+        UINT16 *pQuad = pQuads + 4*iQuad;
+        pQuad[0] = pRow0[iCol0]; pQuad[1] = pRow0[iCol1];
+        pQuad[2] = pRow1[iCol0]; pQuad[3] = pRow1[iCol1];
+    }
+}
+
+HRESULT CResidentHeightMap::UpdateRegion(const UINT16 *pSamples,
+                                         size_t SamplesPitch,
+                                         int iStartCol, int iEndCol,
+                                         int iStartRow, int iEndRow)
+{
+    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
+        memcpy( &m_TheHeightMap[(size_t)iRow * m_iNumCols + iStartCol], pSamples + (iRow-iStartRow) * SamplesPitch, (iEndCol-iStartCol) * sizeof(UINT16) );
+    return S_OK;
+}
+
+// Inserts zero bit before each bit of the value
+static size_t SpreadBits(size_t Value)
+{
+    size_t Result = 0;
+    for(int iBit = 0; Value >> iBit; iBit++)
+        Result |= ((Value >> iBit) & 1) << (2*iBit);
+    return Result;
+}
+
+CMortonHeightMap::CMortonHeightMap(const CHeightMapStore &SrcHeightMap)
+{
+    m_iNumCols = SrcHeightMap.GetNumCols();
+    m_iNumRows = SrcHeightMap.GetNumRows();
+
+    const int BlockSizeLog2 = TILE_SIZE_LOG2 + BLOCK_SIZE_LOG2; // Block size in samples
+    const size_t BlockSamples = (size_t)1 << (2*BlockSizeLog2);
+    const int iTileMask = (1 << TILE_SIZE_LOG2) - 1;
+    const int iBlockTileMask = (1 << BLOCK_SIZE_LOG2) - 1;
+    size_t NumBlocksX = (m_iNumCols + (1 << BlockSizeLog2) - 1) >> BlockSizeLog2;
+    size_t NumBlocksY = (m_iNumRows + (1 << BlockSizeLog2) - 1) >> BlockSizeLog2;
+    m_Samples.resize( NumBlocksX * NumBlocksY * BlockSamples );
+
+    // Column bits occupy even positions of the tile Morton code, row bits occupy odd positions
+    m_ColOffsets.resize(m_iNumCols);
+    for(unsigned int iCol = 0; iCol < m_iNumCols; iCol++)
+    {
+        m_ColOffsets[iCol] = (size_t)(iCol >> BlockSizeLog2) * BlockSamples + 
+                             (SpreadBits( (iCol >> TILE_SIZE_LOG2) & iBlockTileMask ) << (2*TILE_SIZE_LOG2)) + 
+                             (iCol & iTileMask);
+    }
+    m_RowOffsets.resize(m_iNumRows);
+    for(unsigned int iRow = 0; iRow < m_iNumRows; iRow++)
+    {
+        m_RowOffsets[iRow] = (size_t)(iRow >> BlockSizeLog2) * NumBlocksX * BlockSamples + 
+                             (SpreadBits( (iRow >> TILE_SIZE_LOG2) & iBlockTileMask ) << (2*TILE_SIZE_LOG2 + 1)) + 
+                             ((iRow & iTileMask) << TILE_SIZE_LOG2);
+    }
+
+    std::vector<UINT16> Row(m_iNumCols);
+    for(unsigned int iRow = 0; iRow < m_iNumRows; iRow++)
+    {
+        SrcHeightMap.FillHeightMap(&Row[0], m_iNumCols, 0, m_iNumCols, iRow, iRow+1, 1);
+        UINT16 *pDstRow = &m_Samples[m_RowOffsets[iRow]];
+        for(unsigned int iCol = 0; iCol < m_iNumCols; iCol++)
+            pDstRow[m_ColOffsets[iCol]] = Row[iCol];
+    }
+}
+
+void CMortonHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                     size_t DataPitch,
+                                     int iStartCol, int iEndCol,
+                                     int iStartRow, int iEndRow,
+                                     int iStep)const
+{
+    const int iTileSize = 1 << TILE_SIZE_LOG2;
+    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
+    {
+        int iSrcRow = max(0, iRow*iStep); iSrcRow = min(iSrcRow, (int)m_iNumRows-1);
+        const UINT16 *pSrcRow = &m_Samples[m_RowOffsets[iSrcRow]];
+        UINT16 *pDstRow = pDataPtr + (iRow-iStartRow) * DataPitch;
+        int iCol = iStartCol;
+        if( iStep == 1 && iCol >= 0 )
+        {
+            // Samples in one tile row are contiguous and are copied at once
+            int iEndInteriorCol = min(iEndCol, (int)m_iNumCols);
+            while( iCol < iEndInteriorCol )
+            {
+                int iRunLength = min( iTileSize - (iCol & (iTileSize-1)), iEndInteriorCol - iCol );
+                memcpy( pDstRow + (iCol-iStartCol), pSrcRow + m_ColOffsets[iCol], iRunLength * sizeof(UINT16) );
+                iCol += iRunLength;
+            }
+        }
+        for(; iCol < iEndCol; iCol++)
+        {
+            int iSrcCol = max(0, iCol*iStep); iSrcCol = min(iSrcCol, (int)m_iNumCols-1);
+            pDstRow[iCol-iStartCol] = pSrcRow[m_ColOffsets[iSrcCol]];
+        }
+    }
+}
+
+void CMortonHeightMap::GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const
+{
+    const UINT16 *pSamples = &m_Samples[0];
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+    {
+        size_t ColOffset0 = m_ColOffsets[ ClampSampleIndex(pCols[iQuad]*iStep, m_iNumCols) ];
+        size_t ColOffset1 = m_ColOffsets[ ClampSampleIndex((pCols[iQuad]+1)*iStep, m_iNumCols) ];
+        const UINT16 *pRow0 = pSamples + m_RowOffsets[ ClampSampleIndex(pRows[iQuad]*iStep, m_iNumRows) ];
+        const UINT16 *pRow1 = pSamples + m_RowOffsets[ ClampSampleIndex((pRows[iQuad]+1)*iStep, m_iNumRows) ];
+        UINT16 *pQuad = pQuads + 4*iQuad;
+        pQuad[0] = pRow0[ColOffset0]; pQuad[1] = pRow0[ColOffset1];
+        pQuad[2] = pRow1[ColOffset0]; pQuad[3] = pRow1[ColOffset1];
+    }
+}
+
+HRESULT CMortonHeightMap::UpdateRegion(const UINT16 *pSamples,
+                                       size_t SamplesPitch,
+                                       int iStartCol, int iEndCol,
+                                       int iStartRow, int iEndRow)
+{
+    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
+    {
+        const UINT16 *pSrcRow = pSamples + (iRow-iStartRow) * SamplesPitch;
+        UINT16 *pDstRow = &m_Samples[m_RowOffsets[iRow]];
+        for(int iCol = iStartCol; iCol < iEndCol; iCol++)
+            pDstRow[m_ColOffsets[iCol]] = pSrcRow[iCol-iStartCol];
+    }
+    return S_OK;
+}
+
+// Returns the range of the samples of the level decimated with the step, which are taken from the
+// source samples [iStart, iEnd). The last samples of the level are clamped to the last source sample
+static void GetDecimatedRange(int iStart, int iEnd, int iStep,
+                              unsigned int uiNumSrcSamples, unsigned int uiNumLevelSamples,
+                              int &iLevelStart, int &iLevelEnd)
+{
+    iLevelStart = min( (iStart + iStep-1) / iStep, (int)uiNumLevelSamples );
+    if( iEnd >= (int)uiNumSrcSamples )
+        iLevelEnd = (int)uiNumLevelSamples;
+    else
+        iLevelEnd = min( (iEnd + iStep-1) / iStep, (int)uiNumLevelSamples );
+}
+
+CDecimatedHeightMap::CDecimatedHeightMap(CHeightMapStore *pSrcHeightMap) :
+    m_pSrcHeightMap(pSrcHeightMap)
+{
+    m_iNumCols = m_pSrcHeightMap->GetNumCols();
+    m_iNumRows = m_pSrcHeightMap->GetNumRows();
+
+    unsigned int uiNumCols = m_iNumCols, uiNumRows = m_iNumRows;
+    while( uiNumCols > 2 || uiNumRows > 2 )
+    {
+        // Level k has ceil((N-1)/2^k)+1 samples along each side
+        uiNumCols = uiNumCols/2 + 1;
+        uiNumRows = uiNumRows/2 + 1;
+        m_Levels.push_back( SLevel() );
+        SLevel &Level = m_Levels.back();
+        Level.uiNumCols = uiNumCols;
+        Level.uiNumRows = uiNumRows;
+        Level.Samples.resize( (size_t)uiNumCols * uiNumRows );
+        if( m_Levels.size() == 1 )
+        {
+            m_pSrcHeightMap->FillHeightMap(&Level.Samples[0], uiNumCols, 0, uiNumCols, 0, uiNumRows, 2);
+        }
+        else
+        {
+            // Build the level from the previous one, which is already in memory
+            const SLevel &FinerLevel = m_Levels[m_Levels.size()-2];
+            for(unsigned int uiRow = 0; uiRow < uiNumRows; uiRow++)
+            {
+                const UINT16 *pSrcRow = &FinerLevel.Samples[ (size_t)min(uiRow*2, FinerLevel.uiNumRows-1) * FinerLevel.uiNumCols ];
+                UINT16 *pDstRow = &Level.Samples[ (size_t)uiRow * uiNumCols ];
+                for(unsigned int uiCol = 0; uiCol < uiNumCols; uiCol++)
+                    pDstRow[uiCol] = pSrcRow[ min(uiCol*2, FinerLevel.uiNumCols-1) ];
+            }
+        }
+    }
+}
+
+void CDecimatedHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                        size_t DataPitch,
+                                        int iStartCol, int iEndCol,
+                                        int iStartRow, int iEndRow,
+                                        int iStep)const
+{
+    int iLevel = 0;
+    while( (1 << iLevel) < iStep )
+        iLevel++;
+    if( iLevel == 0 || (1 << iLevel) != iStep || iLevel > (int)m_Levels.size() )
+    {
+        m_pSrcHeightMap->FillHeightMap(pDataPtr, DataPitch, iStartCol, iEndCol, iStartRow, iEndRow, iStep);
+        return;
+    }
+
+    const SLevel &Level = m_Levels[iLevel-1];
+    int iEndInteriorCol = min(iEndCol, (int)Level.uiNumCols);
+    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
+    {
+        int iSrcRow = max(0, iRow); iSrcRow = min(iSrcRow, (int)Level.uiNumRows-1);
+        const UINT16 *pSrcRow = &Level.Samples[(size_t)iSrcRow * Level.uiNumCols];
+        UINT16 *pDstRow = pDataPtr + (iRow-iStartRow) * DataPitch;
+        int iCol = iStartCol;
+        for(; iCol < iEndCol && iCol < 0; iCol++)
+            pDstRow[iCol-iStartCol] = pSrcRow[0];
+        if( iCol < iEndInteriorCol )
+        {
+            memcpy( pDstRow + (iCol-iStartCol), pSrcRow + iCol, (iEndInteriorCol - iCol) * sizeof(UINT16) );
+            iCol = iEndInteriorCol;
+        }
+        for(; iCol < iEndCol; iCol++)
+            pDstRow[iCol-iStartCol] = pSrcRow[Level.uiNumCols-1];
+    }
+}
+
+void CDecimatedHeightMap::GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const
+{
+    int iLevel = 0;
+    while( (1 << iLevel) < iStep )
+        iLevel++;
+    if( iLevel == 0 || (1 << iLevel) != iStep || iLevel > (int)m_Levels.size() )
+    {
+        m_pSrcHeightMap->GatherSampleQuads(pCols, pRows, iNumQuads, iStep, pQuads);
+        return;
+    }
+
+    const SLevel &Level = m_Levels[iLevel-1];
+    const UINT16 *pSamples = &Level.Samples[0];
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+    {
+        int iCol0 = ClampSampleIndex(pCols[iQuad], Level.uiNumCols), iCol1 = ClampSampleIndex(pCols[iQuad]+1, Level.uiNumCols);
+        const UINT16 *pRow0 = pSamples + (size_t)ClampSampleIndex(pRows[iQuad], Level.uiNumRows) * Level.uiNumCols;
+        const UINT16 *pRow1 = pSamples + (size_t)ClampSampleIndex(pRows[iQuad]+1, Level.uiNumRows) * Level.uiNumCols;
+        UINT16 *pQuad = pQuads + 4*iQuad;
+        pQuad[0] = pRow0[iCol0]; pQuad[1] = pRow0[iCol1];
+        pQuad[2] = pRow1[iCol0]; pQuad[3] = pRow1[iCol1];
+    }
+}
+
+HRESULT CDecimatedHeightMap::UpdateRegion(const UINT16 *pSamples,
+                                          size_t SamplesPitch,
+                                          int iStartCol, int iEndCol,
+                                          int iStartRow, int iEndRow)
+{
+    HRESULT hr = m_pSrcHeightMap->UpdateRegion(pSamples, SamplesPitch, iStartCol, iEndCol, iStartRow, iEndRow);
+    if( FAILED(hr) )
+        return hr;
+
+    // Sample of the level k is the source sample (min(iCol*2^k, N-1), min(iRow*2^k, N-1)),
+    // so the affected samples are copied from the updated source
+    for(size_t iLevel = 1; iLevel <= m_Levels.size(); iLevel++)
+    {
+        SLevel &Level = m_Levels[iLevel-1];
+        int iStep = 1 << iLevel;
+        int iLevelStartCol, iLevelEndCol, iLevelStartRow, iLevelEndRow;
+        GetDecimatedRange(iStartCol, iEndCol, iStep, m_iNumCols, Level.uiNumCols, iLevelStartCol, iLevelEndCol);
+        GetDecimatedRange(iStartRow, iEndRow, iStep, m_iNumRows, Level.uiNumRows, iLevelStartRow, iLevelEndRow);
+        if( iLevelStartCol >= iLevelEndCol || iLevelStartRow >= iLevelEndRow )
+            continue;
+        m_pSrcHeightMap->FillHeightMap(&Level.Samples[(size_t)iLevelStartRow * Level.uiNumCols + iLevelStartCol], Level.uiNumCols,
+                                       iLevelStartCol, iLevelEndCol, iLevelStartRow, iLevelEndRow, iStep);
+    }
+    return S_OK;
+}
+
+CBlockCompressedHeightMap::CBlockCompressedHeightMap(const CHeightMapStore &SrcHeightMap)
+{
+    m_iNumCols = SrcHeightMap.GetNumCols();
+    m_iNumRows = SrcHeightMap.GetNumRows();
+
+    // Level dimensions are the same as in CDecimatedHeightMap
+    unsigned int uiNumCols = m_iNumCols, uiNumRows = m_iNumRows;
+    for(int iLevel = 0; ; iLevel++)
+    {
+        m_Levels.push_back( SLevel() );
+        SLevel &Level = m_Levels.back();
+        Level.uiNumCols = uiNumCols;
+        Level.uiNumRows = uiNumRows;
+        CompressLevel(SrcHeightMap, 1 << iLevel, Level);
+        if( uiNumCols <= 2 && uiNumRows <= 2 )
+            break;
+        uiNumCols = uiNumCols/2 + 1;
+        uiNumRows = uiNumRows/2 + 1;
+    }
+}
+
+void CBlockCompressedHeightMap::CompressLevel(const CHeightMapStore &SrcHeightMap, int iStep, SLevel &Level)
+{
+    Level.uiNumBlocksX = (Level.uiNumCols + PACKED_BLOCK_SIZE-1) / PACKED_BLOCK_SIZE;
+    Level.uiNumBlocksY = (Level.uiNumRows + PACKED_BLOCK_SIZE-1) / PACKED_BLOCK_SIZE;
+    Level.Blocks.resize( (size_t)Level.uiNumBlocksX * Level.uiNumBlocksY );
+
+    // Blocks crossing the level boundary are filled by clamping, which matches the clamping of the
+    // requested coordinates. The first pass selects the block coding so that the packed data is
+    // allocated at once
+    size_t BlockRowPitch = (size_t)Level.uiNumBlocksX * PACKED_BLOCK_SIZE;
+    std::vector<UINT16> BlockRow( BlockRowPitch * PACKED_BLOCK_SIZE );
+    size_t PackedDataSize = 0;
+    for(int iPass = 0; iPass < 2; iPass++)
+    {
+        // Flat blocks do not have packed data, but still point into the array
+        if( iPass == 1 )
+            Level.PackedData.resize( PackedDataSize + PACKED_BLOCK_SIZE );
+        for(unsigned int uiBlockY = 0; uiBlockY < Level.uiNumBlocksY; uiBlockY++)
+        {
+            SrcHeightMap.FillHeightMap(&BlockRow[0], BlockRowPitch, 0, (int)BlockRowPitch,
+                                       uiBlockY * PACKED_BLOCK_SIZE, (uiBlockY+1) * PACKED_BLOCK_SIZE, iStep);
+            for(unsigned int uiBlockX = 0; uiBlockX < Level.uiNumBlocksX; uiBlockX++)
+            {
+                const UINT16 *pBlockSamples = &BlockRow[uiBlockX * PACKED_BLOCK_SIZE];
+                SBlockDesc &Block = Level.Blocks[uiBlockX + (size_t)uiBlockY * Level.uiNumBlocksX];
+                if( iPass == 0 )
+                {
+                    InitPackedBlockDesc(pBlockSamples, BlockRowPitch, Block.Packing);
+                    Block.uiDataOffset = (UINT32)(PackedDataSize / PACKED_BLOCK_SIZE);
+                    PackedDataSize += GetPackedBlockSize(Block.Packing);
+                }
+                else
+                {
+                    PackHeightMapBlock(pBlockSamples, BlockRowPitch, Block.Packing,
+                                       &Level.PackedData[(size_t)Block.uiDataOffset * PACKED_BLOCK_SIZE]);
+                }
+            }
+        }
+    }
+}
+
+HRESULT CBlockCompressedHeightMap::UpdateRegion(const UINT16 *pSamples,
+                                                size_t SamplesPitch,
+                                                int iStartCol, int iEndCol,
+                                                int iStartRow, int iEndRow)
+{
+    UINT16 DecodedBlock[PACKED_BLOCK_SIZE * PACKED_BLOCK_SIZE];
+    for(size_t iLevel = 0; iLevel < m_Levels.size(); iLevel++)
+    {
+        SLevel &Level = m_Levels[iLevel];
+        int iStep = 1 << iLevel;
+        int iLevelStartCol, iLevelEndCol, iLevelStartRow, iLevelEndRow;
+        GetDecimatedRange(iStartCol, iEndCol, iStep, m_iNumCols, Level.uiNumCols, iLevelStartCol, iLevelEndCol);
+        GetDecimatedRange(iStartRow, iEndRow, iStep, m_iNumRows, Level.uiNumRows, iLevelStartRow, iLevelEndRow);
+        if( iLevelStartCol >= iLevelEndCol || iLevelStartRow >= iLevelEndRow )
+            continue;
+
+        for(int iBlockY = iLevelStartRow / PACKED_BLOCK_SIZE; iBlockY <= (iLevelEndRow-1) / PACKED_BLOCK_SIZE; iBlockY++)
+            for(int iBlockX = iLevelStartCol / PACKED_BLOCK_SIZE; iBlockX <= (iLevelEndCol-1) / PACKED_BLOCK_SIZE; iBlockX++)
+            {
+                SBlockDesc &Block = Level.Blocks[iBlockX + (size_t)iBlockY * Level.uiNumBlocksX];
+                UnpackHeightMapBlock(&Level.PackedData[(size_t)Block.uiDataOffset * PACKED_BLOCK_SIZE], Block.Packing, DecodedBlock, PACKED_BLOCK_SIZE);
+
+                // Samples past the level boundary are clamped in the same way as during compression
+                for(int iY = 0; iY < PACKED_BLOCK_SIZE; iY++)
+                {
+                    int iSrcRow = min( (iBlockY * PACKED_BLOCK_SIZE + iY) * iStep, (int)m_iNumRows-1 );
+                    if( iSrcRow < iStartRow || iSrcRow >= iEndRow )
+                        continue;
+                    for(int iX = 0; iX < PACKED_BLOCK_SIZE; iX++)
+                    {
+                        int iSrcCol = min( (iBlockX * PACKED_BLOCK_SIZE + iX) * iStep, (int)m_iNumCols-1 );
+                        if( iSrcCol >= iStartCol && iSrcCol < iEndCol )
+                            DecodedBlock[iX + iY * PACKED_BLOCK_SIZE] = pSamples[(iSrcCol-iStartCol) + (iSrcRow-iStartRow) * SamplesPitch];
+                    }
+                }
+
+                size_t OldPackedSize = GetPackedBlockSize(Block.Packing);
+                InitPackedBlockDesc(DecodedBlock, PACKED_BLOCK_SIZE, Block.Packing);
+                size_t NewPackedSize = GetPackedBlockSize(Block.Packing);
+                if( NewPackedSize > OldPackedSize )
+                {
+                    // The block is placed over the padding at the end of the array, which
+                    // is then restored for flat blocks
+                    size_t DataEnd = Level.PackedData.size() - PACKED_BLOCK_SIZE;
+                    Block.uiDataOffset = (UINT32)(DataEnd / PACKED_BLOCK_SIZE);
+                    Level.PackedData.resize( DataEnd + NewPackedSize + PACKED_BLOCK_SIZE );
+                }
+                PackHeightMapBlock(DecodedBlock, PACKED_BLOCK_SIZE, Block.Packing, &Level.PackedData[(size_t)Block.uiDataOffset * PACKED_BLOCK_SIZE]);
+            }
+    }
+    return S_OK;
+}
+
+size_t CBlockCompressedHeightMap::GetCompressedSize()const
+{
+    size_t Size = 0;
+    for(size_t iLevel = 0; iLevel < m_Levels.size(); iLevel++)
+        Size += m_Levels[iLevel].Blocks.size() * sizeof(SBlockDesc) + m_Levels[iLevel].PackedData.size() * sizeof(UINT16);
+    return Size;
+}
+
+void CBlockCompressedHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                              size_t DataPitch,
+                                              int iStartCol, int iEndCol,
+                                              int iStartRow, int iEndRow,
+                                              int iStep)const
+{
+    // Power of two steps are served from the corresponding level with unit step
+    int iLevel = 0;
+    while( (1 << iLevel) < iStep )
+        iLevel++;
+    if( (1 << iLevel) == iStep && iLevel < (int)m_Levels.size() )
+        FillLevelHeightMap(m_Levels[iLevel], pDataPtr, DataPitch, iStartCol, iEndCol, iStartRow, iEndRow, 1);
+    else
+        FillLevelHeightMap(m_Levels[0], pDataPtr, DataPitch, iStartCol, iEndCol, iStartRow, iEndRow, iStep);
+}
+
+// Requested samples are gathered block by block so that every block is decoded once.
+// Blocks completely covered by the request with unit step are decoded in place
+void CBlockCompressedHeightMap::FillLevelHeightMap(const SLevel &Level,
+                                                   UINT16 *pDataPtr,
+                                                   size_t DataPitch,
+                                                   int iStartCol, int iEndCol,
+                                                   int iStartRow, int iEndRow,
+                                                   int iStep)const
+{
+    UINT16 DecodedBlock[PACKED_BLOCK_SIZE * PACKED_BLOCK_SIZE];
+    for(int iRow = iStartRow; iRow < iEndRow; )
+    {
+        int iSrcRow = max(0, iRow*iStep); iSrcRow = min(iSrcRow, (int)Level.uiNumRows-1);
+        int iBlockY = iSrcRow / PACKED_BLOCK_SIZE;
+        int iEndBlockRow = iRow + 1;
+        for(; iEndBlockRow < iEndRow; iEndBlockRow++)
+        {
+            int iNextSrcRow = max(0, iEndBlockRow*iStep); iNextSrcRow = min(iNextSrcRow, (int)Level.uiNumRows-1);
+            if( iNextSrcRow / PACKED_BLOCK_SIZE != iBlockY )
+                break;
+        }
+        // Rows past the last one are clamped in the block data in the same way as the coordinates
+        bool bWholeBlockRows = iStep == 1 && iRow >= 0 && iRow % PACKED_BLOCK_SIZE == 0 && iEndBlockRow - iRow == PACKED_BLOCK_SIZE;
+
+        for(int iCol = iStartCol; iCol < iEndCol; )
+        {
+            int iSrcCol = max(0, iCol*iStep); iSrcCol = min(iSrcCol, (int)Level.uiNumCols-1);
+            int iBlockX = iSrcCol / PACKED_BLOCK_SIZE;
+            int iEndBlockCol = iCol + 1;
+            for(; iEndBlockCol < iEndCol; iEndBlockCol++)
+            {
+                int iNextSrcCol = max(0, iEndBlockCol*iStep); iNextSrcCol = min(iNextSrcCol, (int)Level.uiNumCols-1);
+                if( iNextSrcCol / PACKED_BLOCK_SIZE != iBlockX )
+                    break;
+            }
+            bool bWholeBlockCols = iStep == 1 && iCol >= 0 && iCol % PACKED_BLOCK_SIZE == 0 && iEndBlockCol - iCol == PACKED_BLOCK_SIZE;
+
+            const SBlockDesc &Block = Level.Blocks[iBlockX + (size_t)iBlockY * Level.uiNumBlocksX];
+            const UINT16 *pPackedData = &Level.PackedData[(size_t)Block.uiDataOffset * PACKED_BLOCK_SIZE];
+            UINT16 *pDstBlock = pDataPtr + (iRow-iStartRow) * DataPitch + (iCol-iStartCol);
+            if( bWholeBlockRows && bWholeBlockCols )
+            {
+                UnpackHeightMapBlock(pPackedData, Block.Packing, pDstBlock, DataPitch);
+            }
+            else
+            {
+                UnpackHeightMapBlock(pPackedData, Block.Packing, DecodedBlock, PACKED_BLOCK_SIZE);
+                for(int iBlockRow = iRow; iBlockRow < iEndBlockRow; iBlockRow++)
+                {
+                    int iSrcRowInBlock = min(max(0, iBlockRow*iStep), (int)Level.uiNumRows-1) % PACKED_BLOCK_SIZE;
+                    const UINT16 *pSrcRow = DecodedBlock + iSrcRowInBlock * PACKED_BLOCK_SIZE;
+                    UINT16 *pDstRow = pDstBlock + (iBlockRow-iRow) * DataPitch;
+                    if( iStep == 1 && iCol >= 0 && iEndBlockCol <= (int)Level.uiNumCols )
+                    {
+                        memcpy(pDstRow, pSrcRow + iCol % PACKED_BLOCK_SIZE, (iEndBlockCol-iCol) * sizeof(UINT16));
+                        continue;
+                    }
+                    for(int iBlockCol = iCol; iBlockCol < iEndBlockCol; iBlockCol++)
+                    {
+                        int iSrcColInBlock = min(max(0, iBlockCol*iStep), (int)Level.uiNumCols-1) % PACKED_BLOCK_SIZE;
+                        pDstRow[iBlockCol-iCol] = pSrcRow[iSrcColInBlock];
+                    }
+                }
+            }
+            iCol = iEndBlockCol;
+        }
+        iRow = iEndBlockRow;
+    }
+}
+
+CMappedTiledHeightMap::CMappedTiledHeightMap() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hFileMapping(NULL),
+    m_pMappedData(NULL),
+    m_pTiles(NULL),
+    m_iTileSizeLog2(0),
+    m_iNumTilesX(0),
+    m_iNumTilesY(0)
+{
+}
+
+CMappedTiledHeightMap::~CMappedTiledHeightMap()
+{
+    Close();
+}
+
+void CMappedTiledHeightMap::Close()
+{
+    if( m_pMappedData )
+        UnmapViewOfFile(m_pMappedData);
+    if( m_hFileMapping )
+        CloseHandle(m_hFileMapping);
+    if( m_hFile != INVALID_HANDLE_VALUE )
+        CloseHandle(m_hFile);
+
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hFileMapping = NULL;
+    m_pMappedData = NULL;
+    m_pTiles = NULL;
+    m_iNumCols = m_iNumRows = 0;
+    m_iNumTilesX = m_iNumTilesY = 0;
+}
+
+// Opens the tiled height map file
+HRESULT CMappedTiledHeightMap::Open(LPCTSTR strFilePath)
+{
+    Close();
+
+    // Note that the file is opened for sharing so that several processes can map it
+    m_hFile = CreateFile(strFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if( m_hFile == INVALID_HANDLE_VALUE )
+        return E_FAIL;
+
+    LARGE_INTEGER FileSize;
+    if( !GetFileSizeEx(m_hFile, &FileSize) || FileSize.QuadPart < TILES_DATA_OFFSET )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    m_hFileMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if( m_hFileMapping == NULL )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    m_pMappedData = (const BYTE*)MapViewOfFile(m_hFileMapping, FILE_MAP_READ, 0, 0, 0);
+    if( m_pMappedData == NULL )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    const STiledFileHeader &Header = *(const STiledFileHeader*)m_pMappedData;
+    if( Header.uiSignature != TILED_FILE_SIGNATURE ||
+        Header.uiVersion != TILED_FILE_VERSION ||
+        Header.uiTileSizeLog2 == 0 || Header.uiTileSizeLog2 > 12 ||
+        Header.uiNumTilesX != (Header.uiNumCols + (1<<Header.uiTileSizeLog2)-1) >> Header.uiTileSizeLog2 ||
+        Header.uiNumTilesY != (Header.uiNumRows + (1<<Header.uiTileSizeLog2)-1) >> Header.uiTileSizeLog2 )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    LONGLONG TileDataSize = ((LONGLONG)Header.uiNumTilesX * Header.uiNumTilesY << (2*Header.uiTileSizeLog2)) * sizeof(UINT16);
+    if( FileSize.QuadPart < TILES_DATA_OFFSET + TileDataSize )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    m_iNumCols = Header.uiNumCols;
+    m_iNumRows = Header.uiNumRows;
+    m_iTileSizeLog2 = Header.uiTileSizeLog2;
+    m_iNumTilesX = Header.uiNumTilesX;
+    m_iNumTilesY = Header.uiNumTilesY;
+    m_pTiles = (const UINT16*)(m_pMappedData + TILES_DATA_OFFSET);
+
+    return S_OK;
+}
+
+void CMappedTiledHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                          size_t DataPitch,
+                                          int iStartCol, int iEndCol,
+                                          int iStartRow, int iEndRow,
+                                          int iStep)const
+{
+    int iTileSize = 1 << m_iTileSizeLog2;
+    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
+    {
+        int iSrcRow = max(0, iRow*iStep); iSrcRow = min(iSrcRow, (int)m_iNumRows-1);
+        UINT16 *pDstRow = pDataPtr + (iRow-iStartRow) * DataPitch;
+        int iCol = iStartCol;
+        // Samples left to the height map are clamped to the first column
+        for(; iCol < iEndCol && iCol*iStep < 0; iCol++)
+            pDstRow[iCol-iStartCol] = *GetSamplePtr(0, iSrcRow);
+        if( iStep == 1 )
+        {
+            // Copy contiguous runs within each tile
+            while( iCol < iEndCol && iCol < (int)m_iNumCols )
+            {
+                int iRunEnd = min( (iCol & ~(iTileSize-1)) + iTileSize, min(iEndCol, (int)m_iNumCols) );
+                memcpy(pDstRow + (iCol-iStartCol), GetSamplePtr(iCol, iSrcRow), (iRunEnd - iCol) * sizeof(UINT16) );
+                iCol = iRunEnd;
+            }
+        }
+        else
+        {
+            for(; iCol < iEndCol && iCol*iStep < (int)m_iNumCols; iCol++)
+                pDstRow[iCol-iStartCol] = *GetSamplePtr(iCol*iStep, iSrcRow);
+        }
+        // Samples right to the height map are clamped to the last column
+        for(; iCol < iEndCol; iCol++)
+            pDstRow[iCol-iStartCol] = *GetSamplePtr(m_iNumCols-1, iSrcRow);
+    }
+}
+
+void CMappedTiledHeightMap::GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const
+{
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+    {
+        int iCol0 = ClampSampleIndex(pCols[iQuad]*iStep, m_iNumCols), iCol1 = ClampSampleIndex((pCols[iQuad]+1)*iStep, m_iNumCols);
+        int iRow0 = ClampSampleIndex(pRows[iQuad]*iStep, m_iNumRows), iRow1 = ClampSampleIndex((pRows[iQuad]+1)*iStep, m_iNumRows);
+        UINT16 *pQuad = pQuads + 4*iQuad;
+        pQuad[0] = *GetSamplePtr(iCol0, iRow0); pQuad[1] = *GetSamplePtr(iCol1, iRow0);
+        pQuad[2] = *GetSamplePtr(iCol0, iRow1); pQuad[3] = *GetSamplePtr(iCol1, iRow1);
+    }
+}
+
+// Writes the height map to the tiled file
+HRESULT CMappedTiledHeightMap::CreateTiledFile(LPCTSTR strFilePath,
+                                               const CHeightMapStore &SrcHeightMap,
+                                               int iTileSize)
+{
+    if( iTileSize <= 0 || (iTileSize & (iTileSize-1)) )
+        return E_INVALIDARG;
+
+    STiledFileHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    Header.uiSignature = TILED_FILE_SIGNATURE;
+    Header.uiVersion = TILED_FILE_VERSION;
+    Header.uiNumCols = SrcHeightMap.GetNumCols();
+    Header.uiNumRows = SrcHeightMap.GetNumRows();
+    while( (1 << Header.uiTileSizeLog2) < iTileSize )
+        Header.uiTileSizeLog2++;
+    Header.uiNumTilesX = (Header.uiNumCols + iTileSize-1) / iTileSize;
+    Header.uiNumTilesY = (Header.uiNumRows + iTileSize-1) / iTileSize;
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("wb") ) != 0 )
+        return E_FAIL;
+
+    std::vector<BYTE> HeaderBlock(TILES_DATA_OFFSET, 0);
+    memcpy(&HeaderBlock[0], &Header, sizeof(Header));
+    HRESULT hr = S_OK;
+    if( fwrite(&HeaderBlock[0], HeaderBlock.size(), 1, pFile) != 1 )
+        hr = E_FAIL;
+
+    // Tiles crossing the height map boundary are filled by clamping to the last row/column
+    std::vector<UINT16> TileData( iTileSize*iTileSize );
+    for(UINT iTileY = 0; iTileY < Header.uiNumTilesY && SUCCEEDED(hr); iTileY++)
+        for(UINT iTileX = 0; iTileX < Header.uiNumTilesX && SUCCEEDED(hr); iTileX++)
+        {
+            SrcHeightMap.FillHeightMap(&TileData[0], iTileSize,
+                                       iTileX*iTileSize, (iTileX+1)*iTileSize,
+                                       iTileY*iTileSize, (iTileY+1)*iTileSize,
+                                       1);
+            if( fwrite(&TileData[0], TileData.size() * sizeof(UINT16), 1, pFile) != 1 )
+                hr = E_FAIL;
+        }
+
+    fclose(pFile);
+
+    return hr;
+}
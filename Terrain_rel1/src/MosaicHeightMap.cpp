@@ -0,0 +1,371 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "MosaicHeightMap.h"
+#include "DEMReader.h"
+
+static const TCHAR g_strMosaicSignature[] = _T("DEMMosaic");
+
+CMosaicHeightMap::CMosaicHeightMap() :
+    m_uiOverviewCols(0),
+    m_uiOverviewRows(0)
+{
+    InitializeCriticalSection(&m_csOverview);
+}
+
+CMosaicHeightMap::~CMosaicHeightMap()
+{
+    Close();
+    DeleteCriticalSection(&m_csOverview);
+}
+
+void CMosaicHeightMap::Close()
+{
+    m_pTileCache.reset();
+    m_Tiles.clear();
+    m_CellEdgesX.clear();
+    m_CellEdgesY.clear();
+    m_CellTiles.clear();
+    m_Overview.clear();
+    m_IsTileInOverview.clear();
+    m_IsTileErrorReported.clear();
+    m_uiOverviewCols = m_uiOverviewRows = 0;
+    m_iNumCols = m_iNumRows = 0;
+}
+
+// Returns true if the file starts with the mosaic index signature
+bool CMosaicHeightMap::IsMosaicIndexFile(LPCTSTR strFilePath)
+{
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("rt") ) != 0 || pFile == NULL )
+        return false;
+    TCHAR strLine[_countof(g_strMosaicSignature)] = {0};
+    bool bIsIndex = _fgetts(strLine, _countof(strLine), pFile) != NULL &&
+                    _tcscmp(strLine, g_strMosaicSignature) == 0;
+    fclose(pFile);
+    return bIsIndex;
+}
+
+// Parses the index file. Errors are reported to the user if bReportErrors is true
+HRESULT CMosaicHeightMap::ReadIndexFile(LPCTSTR strIndexFile, bool bReportErrors, std::vector<STileDesc> &Tiles, UINT64 &MosaicCols, UINT64 &MosaicRows)
+{
+    HRESULT hr = IsMosaicIndexFile(strIndexFile) ? S_OK : E_FAIL;
+    if( bReportErrors )
+        CHECK_HR(hr, _T("%s is not a DEM mosaic index file"), strIndexFile);
+    if( FAILED(hr) )
+        return hr;
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strIndexFile, _T("rt") ) != 0 || pFile == NULL )
+        return E_FAIL;
+
+    // Tile paths are relative to the folder of the index file
+    std::wstring strFolder(strIndexFile);
+    size_t SlashPos = strFolder.find_last_of(L"\\/");
+    strFolder.resize( SlashPos != std::wstring::npos ? SlashPos+1 : 0 );
+
+    TCHAR strLine[MAX_PATH + 128];
+    int iLine = 0;
+    MosaicCols = 0;
+    MosaicRows = 0;
+    while( SUCCEEDED(hr) && _fgetts(strLine, _countof(strLine), pFile) != NULL )
+    {
+        iLine++;
+        // Strip the trailing white spaces and the line break
+        size_t Len = _tcslen(strLine);
+        while( Len > 0 && _istspace(strLine[Len-1]) )
+            strLine[--Len] = 0;
+        const TCHAR *pStart = strLine;
+        while( _istspace(*pStart) )
+            pStart++;
+        // Skip the signature, empty lines and comments
+        if( iLine == 1 || *pStart == 0 || *pStart == _T('#') )
+            continue;
+
+        STileDesc Tile;
+        int iPathPos = 0;
+        if( _stscanf_s(pStart, _T("%u %u %u %u %n"), &Tile.uiStartCol, &Tile.uiStartRow, &Tile.uiNumCols, &Tile.uiNumRows, &iPathPos) != 4 ||
+            iPathPos == 0 || pStart[iPathPos] == 0 ||
+            Tile.uiNumCols == 0 || Tile.uiNumRows == 0 )
+        {
+            hr = E_FAIL;
+            if( bReportErrors )
+                CHECK_HR(hr, _T("Invalid tile description in line %d of the mosaic index file %s"), iLine, strIndexFile);
+            break;
+        }
+
+        const TCHAR *strTileFile = pStart + iPathPos;
+        bool bAbsolutePath = strTileFile[0] == _T('\\') || strTileFile[0] == _T('/') || (strTileFile[0] && strTileFile[1] == _T(':'));
+        Tile.strFilePath = bAbsolutePath ? std::wstring(strTileFile) : strFolder + strTileFile;
+        // Tiles are decoded lazily, so only check that the file exists
+        if( GetFileAttributes(Tile.strFilePath.c_str()) == INVALID_FILE_ATTRIBUTES )
+        {
+            hr = E_FAIL;
+            if( bReportErrors )
+                CHECK_HR(hr, _T("Mosaic tile file %s listed in line %d of %s is not found"), Tile.strFilePath.c_str(), iLine, strIndexFile);
+            break;
+        }
+
+        MosaicCols = max(MosaicCols, (UINT64)Tile.uiStartCol + Tile.uiNumCols);
+        MosaicRows = max(MosaicRows, (UINT64)Tile.uiStartRow + Tile.uiNumRows);
+        Tiles.push_back(Tile);
+    }
+    fclose(pFile);
+
+    return hr;
+}
+
+// Returns the paths of the tile files listed in the index file. Errors are not reported
+HRESULT CMosaicHeightMap::GetTileFiles(LPCTSTR strIndexFile, std::vector<std::wstring> &TileFiles)
+{
+    std::vector<STileDesc> Tiles;
+    UINT64 MosaicCols, MosaicRows;
+    HRESULT hr = ReadIndexFile(strIndexFile, false, Tiles, MosaicCols, MosaicRows);
+    if( FAILED(hr) )
+        return hr;
+    TileFiles.clear();
+    for(size_t iTile = 0; iTile < Tiles.size(); iTile++)
+        TileFiles.push_back(Tiles[iTile].strFilePath);
+    return S_OK;
+}
+
+// Reads the index file. Errors are reported to the user
+HRESULT CMosaicHeightMap::Open(LPCTSTR strIndexFile, size_t TileCacheBudget)
+{
+    Close();
+
+    UINT64 MosaicCols = 0, MosaicRows = 0;
+    HRESULT hr = ReadIndexFile(strIndexFile, true, m_Tiles, MosaicCols, MosaicRows);
+
+    if( SUCCEEDED(hr) && (m_Tiles.empty() || MosaicCols > INT_MAX/2 || MosaicRows > INT_MAX/2) )
+    {
+        hr = E_FAIL;
+        CHECK_HR(hr, _T("Mosaic index file %s contains no tiles or the mosaic is too large"), strIndexFile);
+    }
+    if( FAILED(hr) )
+    {
+        Close();
+        return hr;
+    }
+    m_iNumCols = (unsigned int)MosaicCols;
+    m_iNumRows = (unsigned int)MosaicRows;
+
+    // Split the mosaic into cells by the tile edges
+    m_CellEdgesX.push_back(0);
+    m_CellEdgesY.push_back(0);
+    for(size_t iTile = 0; iTile < m_Tiles.size(); iTile++)
+    {
+        const STileDesc &Tile = m_Tiles[iTile];
+        m_CellEdgesX.push_back(Tile.uiStartCol);
+        m_CellEdgesX.push_back(Tile.uiStartCol + Tile.uiNumCols);
+        m_CellEdgesY.push_back(Tile.uiStartRow);
+        m_CellEdgesY.push_back(Tile.uiStartRow + Tile.uiNumRows);
+    }
+    std::sort(m_CellEdgesX.begin(), m_CellEdgesX.end());
+    m_CellEdgesX.erase( std::unique(m_CellEdgesX.begin(), m_CellEdgesX.end()), m_CellEdgesX.end() );
+    std::sort(m_CellEdgesY.begin(), m_CellEdgesY.end());
+    m_CellEdgesY.erase( std::unique(m_CellEdgesY.begin(), m_CellEdgesY.end()), m_CellEdgesY.end() );
+
+    // Tiles listed later cover the earlier ones
+    size_t NumCellsX = m_CellEdgesX.size()-1;
+    m_CellTiles.assign(NumCellsX * (m_CellEdgesY.size()-1), -1);
+    for(size_t iTile = 0; iTile < m_Tiles.size(); iTile++)
+    {
+        const STileDesc &Tile = m_Tiles[iTile];
+        int iStartCellX = GetCellIndex(m_CellEdgesX, Tile.uiStartCol);
+        int iEndCellX = GetCellIndex(m_CellEdgesX, Tile.uiStartCol + Tile.uiNumCols);
+        int iStartCellY = GetCellIndex(m_CellEdgesY, Tile.uiStartRow);
+        int iEndCellY = GetCellIndex(m_CellEdgesY, Tile.uiStartRow + Tile.uiNumRows);
+        for(int iCellY = iStartCellY; iCellY < iEndCellY; iCellY++)
+            for(int iCellX = iStartCellX; iCellX < iEndCellX; iCellX++)
+                m_CellTiles[iCellX + iCellY * NumCellsX] = (int)iTile;
+    }
+
+    // Samples of the tiles, which have not been decoded yet, are filled when the tiles are
+    // decoded. Samples not covered by any tile remain zero
+    m_uiOverviewCols = ((m_iNumCols-1 + (1<<OVERVIEW_STEP_LOG2)-1) >> OVERVIEW_STEP_LOG2) + 1;
+    m_uiOverviewRows = ((m_iNumRows-1 + (1<<OVERVIEW_STEP_LOG2)-1) >> OVERVIEW_STEP_LOG2) + 1;
+    m_Overview.assign((size_t)m_uiOverviewCols * m_uiOverviewRows, 0);
+    m_IsTileInOverview.assign(m_Tiles.size(), false);
+    m_IsTileErrorReported.assign(m_Tiles.size(), false);
+
+    m_pTileCache.reset( new CTileCache(this, TileCacheBudget) );
+
+    return S_OK;
+}
+
+// Decodes the tile file. The method is called by the tile cache on the thread that requested
+// the data. The task manager threads are busy with the requests during the preprocessing, so
+// the file is decoded sequentially
+HRESULT CMosaicHeightMap::LoadTile(UINT64 TileKey, std::vector<UINT16> &TileData)
+{
+    int iTile = (int)TileKey;
+    const STileDesc &Tile = m_Tiles[iTile];
+    TileData.resize((size_t)Tile.uiNumCols * Tile.uiNumRows);
+
+    CDEMReader DEMReader;
+    if( !DEMReader.Open(Tile.strFilePath.c_str(), Tile.uiNumCols, Tile.uiNumRows) ||
+        DEMReader.GetWidth() != Tile.uiNumCols || DEMReader.GetHeight() != Tile.uiNumRows ||
+        !DEMReader.Read(&TileData[0], Tile.uiNumCols) )
+    {
+        // The tile is not cached, so decoding is retried on the next request
+        TileData.clear();
+        EnterCriticalSection(&m_csOverview);
+        bool bErrorReported = m_IsTileErrorReported[iTile];
+        m_IsTileErrorReported[iTile] = true;
+        LeaveCriticalSection(&m_csOverview);
+        if( !bErrorReported )
+            CHECK_HR(E_FAIL, _T("Failed to decode mosaic tile %s"), Tile.strFilePath.c_str() );
+        return E_FAIL;
+    }
+
+    UpdateOverview(iTile, &TileData[0]);
+
+    return S_OK;
+}
+
+// Copies the tile samples, which are not covered by other tiles, to the overview
+void CMosaicHeightMap::UpdateOverview(int iTile, const UINT16 *pTileData)
+{
+    const STileDesc &Tile = m_Tiles[iTile];
+    EnterCriticalSection(&m_csOverview);
+    if( !m_IsTileInOverview[iTile] )
+    {
+        // The last overview column and row are the last column and row of the mosaic
+        UINT uiStartCol = min( (Tile.uiStartCol + (1<<OVERVIEW_STEP_LOG2)-1) >> OVERVIEW_STEP_LOG2, m_uiOverviewCols-1 );
+        UINT uiStartRow = min( (Tile.uiStartRow + (1<<OVERVIEW_STEP_LOG2)-1) >> OVERVIEW_STEP_LOG2, m_uiOverviewRows-1 );
+        std::vector<UINT> SrcCols;
+        std::vector<int> CellCols;
+        for(UINT uiCol = uiStartCol; uiCol < m_uiOverviewCols; uiCol++)
+        {
+            UINT uiSrcCol = min(uiCol << OVERVIEW_STEP_LOG2, m_iNumCols-1);
+            if( uiSrcCol >= Tile.uiStartCol + Tile.uiNumCols )
+                break;
+            SrcCols.push_back(uiSrcCol);
+            CellCols.push_back( GetCellIndex(m_CellEdgesX, uiSrcCol) );
+        }
+        for(UINT uiRow = uiStartRow; uiRow < m_uiOverviewRows; uiRow++)
+        {
+            UINT uiSrcRow = min(uiRow << OVERVIEW_STEP_LOG2, m_iNumRows-1);
+            if( uiSrcRow >= Tile.uiStartRow + Tile.uiNumRows )
+                break;
+            int iCellRow = GetCellIndex(m_CellEdgesY, uiSrcRow);
+            const UINT16 *pSrcRow = pTileData + (size_t)(uiSrcRow - Tile.uiStartRow) * Tile.uiNumCols;
+            UINT16 *pDstRow = &m_Overview[(size_t)uiRow * m_uiOverviewCols + uiStartCol];
+            for(size_t iCol = 0; iCol < SrcCols.size(); iCol++)
+                if( GetCellTile(CellCols[iCol], iCellRow) == iTile )
+                    pDstRow[iCol] = pSrcRow[SrcCols[iCol] - Tile.uiStartCol];
+        }
+        m_IsTileInOverview[iTile] = true;
+    }
+    LeaveCriticalSection(&m_csOverview);
+}
+
+// Makes sure the overview contains the samples of the tile
+void CMosaicHeightMap::LoadTileOverview(int iTile)const
+{
+    EnterCriticalSection(&m_csOverview);
+    bool bIsTileInOverview = m_IsTileInOverview[iTile];
+    LeaveCriticalSection(&m_csOverview);
+    if( !bIsTileInOverview )
+    {
+        // Decoding the tile updates the overview
+        const UINT16 *pTileData = m_pTileCache->AcquireTile(iTile);
+        if( pTileData )
+            m_pTileCache->ReleaseTile(iTile);
+    }
+}
+
+void CMosaicHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                     size_t DataPitch,
+                                     int iStartCol, int iEndCol,
+                                     int iStartRow, int iEndRow,
+                                     int iStep)const
+{
+    int iNumCols = iEndCol - iStartCol;
+    int iNumRows = iEndRow - iStartRow;
+    std::vector<int> SrcCols(iNumCols), SrcRows(iNumRows);
+    for(int iCol = 0; iCol < iNumCols; iCol++)
+        SrcCols[iCol] = min( max(0, (iStartCol + iCol)*iStep), (int)m_iNumCols-1 );
+    for(int iRow = 0; iRow < iNumRows; iRow++)
+        SrcRows[iRow] = min( max(0, (iStartRow + iRow)*iStep), (int)m_iNumRows-1 );
+
+    // All samples requested with the power of 2 step not less than the overview
+    // step are present in the overview
+    assert( (iStep & (iStep-1)) == 0 );
+    bool bUseOverview = iStep >= (1 << OVERVIEW_STEP_LOG2);
+
+    // Source indices are monotonic, so the requested region is split into
+    // rectangular parts each inside a single cell
+    for(int iRowStart = 0; iRowStart < iNumRows; )
+    {
+        int iCellY = GetCellIndex(m_CellEdgesY, SrcRows[iRowStart]);
+        int iRowEnd = iRowStart + 1;
+        while( iRowEnd < iNumRows && SrcRows[iRowEnd] < (int)m_CellEdgesY[iCellY+1] )
+            iRowEnd++;
+
+        for(int iColStart = 0; iColStart < iNumCols; )
+        {
+            int iCellX = GetCellIndex(m_CellEdgesX, SrcCols[iColStart]);
+            int iColEnd = iColStart + 1;
+            while( iColEnd < iNumCols && SrcCols[iColEnd] < (int)m_CellEdgesX[iCellX+1] )
+                iColEnd++;
+
+            int iTile = GetCellTile(iCellX, iCellY);
+            const UINT16 *pTileData = NULL;
+            if( iTile >= 0 && bUseOverview )
+                LoadTileOverview(iTile);
+            else if( iTile >= 0 )
+                pTileData = m_pTileCache->AcquireTile(iTile);
+
+            for(int iRow = iRowStart; iRow < iRowEnd; iRow++)
+            {
+                UINT16 *pDstRow = pDataPtr + iRow * DataPitch;
+                if( pTileData )
+                {
+                    const STileDesc &Tile = m_Tiles[iTile];
+                    const UINT16 *pSrcRow = pTileData + (size_t)(SrcRows[iRow] - Tile.uiStartRow) * Tile.uiNumCols;
+                    for(int iCol = iColStart; iCol < iColEnd; iCol++)
+                        pDstRow[iCol] = pSrcRow[SrcCols[iCol] - Tile.uiStartCol];
+                }
+                else if( iTile >= 0 && bUseOverview )
+                {
+                    int iOverviewRow = (SrcRows[iRow] >= (int)m_iNumRows-1) ? m_uiOverviewRows-1 : (SrcRows[iRow] >> OVERVIEW_STEP_LOG2);
+                    const UINT16 *pSrcRow = &m_Overview[(size_t)iOverviewRow * m_uiOverviewCols];
+                    for(int iCol = iColStart; iCol < iColEnd; iCol++)
+                        pDstRow[iCol] = pSrcRow[ (SrcCols[iCol] >= (int)m_iNumCols-1) ? m_uiOverviewCols-1 : (SrcCols[iCol] >> OVERVIEW_STEP_LOG2) ];
+                }
+                else
+                {
+                    for(int iCol = iColStart; iCol < iColEnd; iCol++)
+                        pDstRow[iCol] = 0;
+                }
+            }
+            if( pTileData )
+                m_pTileCache->ReleaseTile(iTile);
+
+            iColStart = iColEnd;
+        }
+        iRowStart = iRowEnd;
+    }
+}
+
+bool CMosaicHeightMap::GetTileCacheStatistics(CTileCache::SStatistics &Stat)const
+{
+    if( !m_pTileCache.get() )
+        return false;
+    m_pTileCache->GetStatistics(Stat);
+    return true;
+}
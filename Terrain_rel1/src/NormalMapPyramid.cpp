@@ -0,0 +1,216 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "NormalMapPyramid.h"
+
+CNormalMapPyramid::CNormalMapPyramid() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hFileMapping(NULL),
+    m_pMappedData(NULL),
+    m_pNodeBlocks(NULL)
+{
+    memset(&m_Desc, 0, sizeof(m_Desc));
+}
+
+CNormalMapPyramid::~CNormalMapPyramid()
+{
+    Close();
+}
+
+void CNormalMapPyramid::Close()
+{
+    if( m_pMappedData )
+        UnmapViewOfFile(m_pMappedData);
+    if( m_hFileMapping )
+        CloseHandle(m_hFileMapping);
+    if( m_hFile != INVALID_HANDLE_VALUE )
+        CloseHandle(m_hFile);
+
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_hFileMapping = NULL;
+    m_pMappedData = NULL;
+    m_pNodeBlocks = NULL;
+    memset(&m_Desc, 0, sizeof(m_Desc));
+    m_DiscardedNodes.clear();
+}
+
+// Nodes are enumerated level by level, row by row
+UINT64 CNormalMapPyramid::GetNodeIndex(const SDesc &Desc, const SQuadTreeNodeLocation &Pos)
+{
+    UINT64 NodeIndex = 0;
+    for(int iLevel = 0; iLevel < Pos.level; iLevel++)
+        NodeIndex += ((UINT64)Desc.uiNumRootNodesHorz << iLevel) * ((UINT64)Desc.uiNumRootNodesVert << iLevel);
+    return NodeIndex + Pos.horzOrder + (UINT64)Pos.vertOrder * ((UINT64)Desc.uiNumRootNodesHorz << Pos.level);
+}
+
+// Opens the pyramid file. Fails if the file was baked with different parameters or for different DEM
+HRESULT CNormalMapPyramid::Open(LPCTSTR strFilePath, const SDesc &ExpectedDesc)
+{
+    Close();
+
+    m_hFile = CreateFile(strFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if( m_hFile == INVALID_HANDLE_VALUE )
+        return E_FAIL;
+
+    LARGE_INTEGER FileSize;
+    if( !GetFileSizeEx(m_hFile, &FileSize) || FileSize.QuadPart < PAGE_SIZE )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    m_hFileMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if( m_hFileMapping == NULL )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    m_pMappedData = (const BYTE*)MapViewOfFile(m_hFileMapping, FILE_MAP_READ, 0, 0, 0);
+    if( m_pMappedData == NULL )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    const SFileHeader &Header = *(const SFileHeader*)m_pMappedData;
+    UINT64 NumNodes = GetNumNodes(ExpectedDesc);
+    if( Header.uiSignature != PYRAMID_FILE_SIGNATURE ||
+        Header.uiVersion != PYRAMID_FILE_VERSION ||
+        memcmp(&Header.Desc, &ExpectedDesc, sizeof(SDesc)) != 0 ||
+        Header.NumNodes != NumNodes ||
+        (UINT64)FileSize.QuadPart < sizeof(SFileHeader) + NumNodes * sizeof(SNodeBlock) )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    // Check that all blocks are inside the file, so that the corrupted file does not cause access violations
+    m_pNodeBlocks = (const SNodeBlock*)(m_pMappedData + sizeof(SFileHeader));
+    for(UINT64 Node = 0; Node < NumNodes; Node++)
+    {
+        const SNodeBlock &Block = m_pNodeBlocks[Node];
+        if( Block.Size != 0 && (Block.Offset > (UINT64)FileSize.QuadPart || Block.Size > (UINT64)FileSize.QuadPart - Block.Offset) )
+        {
+            Close();
+            return E_FAIL;
+        }
+    }
+
+    m_Desc = ExpectedDesc;
+    m_DiscardedNodes.assign((size_t)NumNodes, false);
+
+    return S_OK;
+}
+
+// Returns the normal map data of the node or NULL if the node is not stored in the file
+const BYTE* CNormalMapPyramid::GetNormalMapData(const SQuadTreeNodeLocation &Pos, size_t &DataSize)const
+{
+    DataSize = 0;
+    if( m_pNodeBlocks == NULL ||
+        Pos.level >= (int)m_Desc.uiNumLevels ||
+        Pos.horzOrder >= (int)(m_Desc.uiNumRootNodesHorz << Pos.level) ||
+        Pos.vertOrder >= (int)(m_Desc.uiNumRootNodesVert << Pos.level) )
+        return NULL;
+    size_t NodeIndex = (size_t)GetNodeIndex(m_Desc, Pos);
+    const SNodeBlock &Block = m_pNodeBlocks[NodeIndex];
+    if( Block.Size == 0 || m_DiscardedNodes[NodeIndex] )
+        return NULL;
+    DataSize = (size_t)Block.Size;
+    return m_pMappedData + Block.Offset;
+}
+
+void CNormalMapPyramid::DiscardNode(const SQuadTreeNodeLocation &Pos)
+{
+    if( m_pNodeBlocks == NULL ||
+        Pos.level >= (int)m_Desc.uiNumLevels ||
+        Pos.horzOrder >= (int)(m_Desc.uiNumRootNodesHorz << Pos.level) ||
+        Pos.vertOrder >= (int)(m_Desc.uiNumRootNodesVert << Pos.level) )
+        return;
+    m_DiscardedNodes[(size_t)GetNodeIndex(m_Desc, Pos)] = true;
+}
+
+// Bakes the normal maps of the nodes into the file
+HRESULT CNormalMapPyramid::CreatePyramidFile(LPCTSTR strFilePath,
+                                             const SDesc &Desc,
+                                             INormalMapGenerator *pGenerator)
+{
+    SFileHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    Header.uiSignature = PYRAMID_FILE_SIGNATURE;
+    Header.uiVersion = PYRAMID_FILE_VERSION;
+    Header.Desc = Desc;
+    Header.NumNodes = GetNumNodes(Desc);
+
+    // The table is filled first, so that the blocks are written sequentially
+    UINT64 FirstBlockOffset = sizeof(SFileHeader) + Header.NumNodes * sizeof(SNodeBlock);
+    FirstBlockOffset = (FirstBlockOffset + PAGE_SIZE-1) & ~(UINT64)(PAGE_SIZE-1);
+    UINT64 DataOffset = FirstBlockOffset;
+    std::vector<SNodeBlock> NodeBlocks( (size_t)Header.NumNodes );
+    memset(&NodeBlocks[0], 0, NodeBlocks.size() * sizeof(SNodeBlock));
+    std::vector<SQuadTreeNodeLocation> StoredNodes;
+    size_t MaxBlockSize = 0;
+    for(int iLevel = 0; iLevel < (int)Desc.uiNumLevels; iLevel++)
+        for(int iVert = 0; iVert < (int)(Desc.uiNumRootNodesVert << iLevel); iVert++)
+            for(int iHorz = 0; iHorz < (int)(Desc.uiNumRootNodesHorz << iLevel); iHorz++)
+            {
+                SQuadTreeNodeLocation Pos(iHorz, iVert, iLevel);
+                size_t DataSize = pGenerator->GetNormalMapDataSize(Pos);
+                if( DataSize == 0 )
+                    continue;
+                SNodeBlock &Block = NodeBlocks[(size_t)GetNodeIndex(Desc, Pos)];
+                Block.Offset = DataOffset;
+                Block.Size = DataSize;
+                DataOffset += (DataSize + 15) & ~(size_t)15;
+                MaxBlockSize = max(MaxBlockSize, DataSize);
+                StoredNodes.push_back(Pos);
+            }
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("wb") ) != 0 )
+        return E_FAIL;
+
+    // The header is written after all blocks have been baked, so that the file interrupted
+    // by a failure or a crash is never accepted
+    HRESULT hr = S_OK;
+    std::vector<BYTE> HeaderBlock( (size_t)FirstBlockOffset, 0 );
+    if( fwrite(&HeaderBlock[0], HeaderBlock.size(), 1, pFile) != 1 )
+        hr = E_FAIL;
+
+    std::vector<BYTE> Block( (MaxBlockSize + 15) & ~(size_t)15, 0 );
+    for(size_t Node = 0; Node < StoredNodes.size() && SUCCEEDED(hr); Node++)
+    {
+        size_t DataSize = (size_t)NodeBlocks[(size_t)GetNodeIndex(Desc, StoredNodes[Node])].Size;
+        hr = pGenerator->GenerateNormalMap(StoredNodes[Node], &Block[0]);
+        if( SUCCEEDED(hr) && fwrite(&Block[0], (DataSize + 15) & ~(size_t)15, 1, pFile) != 1 )
+            hr = E_FAIL;
+    }
+
+    if( SUCCEEDED(hr) )
+    {
+        memcpy(&HeaderBlock[0], &Header, sizeof(Header));
+        memcpy(&HeaderBlock[sizeof(Header)], &NodeBlocks[0], NodeBlocks.size() * sizeof(SNodeBlock));
+        if( fseek(pFile, 0, SEEK_SET) != 0 || fwrite(&HeaderBlock[0], HeaderBlock.size(), 1, pFile) != 1 )
+            hr = E_FAIL;
+    }
+
+    fclose(pFile);
+
+    // Do not leave the incomplete file, which would be rejected anyway
+    if( FAILED(hr) )
+        DeleteFile(strFilePath);
+
+    return hr;
+}
@@ -0,0 +1,153 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "ProceduralHeightMap.h"
+
+static const TCHAR g_strProceduralSignature[] = _T("DEMProcedural");
+
+CProceduralHeightMap::CProceduralHeightMap()
+{
+}
+
+// Returns true if the file starts with the procedural height map signature
+bool CProceduralHeightMap::IsProceduralHeightMapFile(LPCTSTR strFilePath)
+{
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("rt") ) != 0 || pFile == NULL )
+        return false;
+    TCHAR strLine[_countof(g_strProceduralSignature)] = {0};
+    bool bIsProcedural = _fgetts(strLine, _countof(strLine), pFile) != NULL &&
+                         _tcscmp(strLine, g_strProceduralSignature) == 0;
+    fclose(pFile);
+    return bIsProcedural;
+}
+
+// Returns the pseudo-random value in [0,1] of the lattice node
+static float GetLatticeValue(UINT uiSeed, int iOctave, UINT uiNode)
+{
+    UINT uiHash = uiNode * 0x9E3779B1U + uiSeed * 0x85EBCA77U + (UINT)iOctave * 0xC2B2AE3DU;
+    uiHash ^= uiHash >> 16;
+    uiHash *= 0x7FEB352DU;
+    uiHash ^= uiHash >> 15;
+    return (float)(uiHash >> 8) / (float)((1 << 24) - 1);
+}
+
+// Tabulates the fractal value noise. The amplitude of the octave halves with its lattice spacing
+void CProceduralHeightMap::CreateProfile(UINT uiNumSamples, UINT uiSeed, std::vector<UINT16> &Profile)
+{
+    const int MAX_SPACING_LOG2 = 16, MIN_SPACING_LOG2 = 2;
+    std::vector<float> Noise(uiNumSamples, 0.f);
+    float fAmplitude = 1.f;
+    for(int iOctave = 0; iOctave <= MAX_SPACING_LOG2 - MIN_SPACING_LOG2; iOctave++, fAmplitude *= 0.5f)
+    {
+        int iSpacingLog2 = MAX_SPACING_LOG2 - iOctave;
+        float fInvSpacing = 1.f / (float)(1 << iSpacingLog2);
+        for(UINT uiSample = 0; uiSample < uiNumSamples; uiSample++)
+        {
+            UINT uiNode = uiSample >> iSpacingLog2;
+            float fFrac = (float)(uiSample & ((1 << iSpacingLog2)-1)) * fInvSpacing;
+            float fValue0 = GetLatticeValue(uiSeed, iOctave, uiNode);
+            float fValue1 = GetLatticeValue(uiSeed, iOctave, uiNode+1);
+            Noise[uiSample] += (fValue0 + (fValue1 - fValue0) * fFrac) * fAmplitude;
+        }
+    }
+
+    // Stretch the noise to the profile elevation range
+    float fMinNoise = *std::min_element(Noise.begin(), Noise.end());
+    float fMaxNoise = *std::max_element(Noise.begin(), Noise.end());
+    float fScale = fMaxNoise > fMinNoise ? (float)MAX_PROFILE_ELEVATION / (fMaxNoise - fMinNoise) : 0.f;
+    Profile.resize(uiNumSamples);
+    for(UINT uiSample = 0; uiSample < uiNumSamples; uiSample++)
+        Profile[uiSample] = (UINT16)min( (Noise[uiSample] - fMinNoise) * fScale + 0.5f, (float)MAX_PROFILE_ELEVATION );
+}
+
+// Reads the description file and tabulates the profiles. Errors are reported to the user
+HRESULT CProceduralHeightMap::Open(LPCTSTR strDescFile)
+{
+    m_ColProfile.clear();
+    m_RowProfile.clear();
+    m_iNumCols = m_iNumRows = 0;
+
+    HRESULT hr = IsProceduralHeightMapFile(strDescFile) ? S_OK : E_FAIL;
+    CHECK_HR_RET(hr, _T("%s is not a procedural height map description file"), strDescFile);
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strDescFile, _T("rt") ) != 0 || pFile == NULL )
+        return E_FAIL;
+
+    UINT uiNumCols = 0, uiNumRows = 0, uiSeed = 0;
+    bool bParamsRead = false;
+    TCHAR strLine[256];
+    int iLine = 0;
+    while( !bParamsRead && _fgetts(strLine, _countof(strLine), pFile) != NULL )
+    {
+        iLine++;
+        const TCHAR *pStart = strLine;
+        while( _istspace(*pStart) )
+            pStart++;
+        // Skip the signature, empty lines and comments
+        if( iLine == 1 || *pStart == 0 || *pStart == _T('#') )
+            continue;
+        bParamsRead = _stscanf_s(pStart, _T("%u %u %u"), &uiNumCols, &uiNumRows, &uiSeed) == 3;
+        if( !bParamsRead )
+            break;
+    }
+    fclose(pFile);
+
+    if( !bParamsRead || uiNumCols < 2 || uiNumRows < 2 || uiNumCols > (UINT)MAX_DIMENSION || uiNumRows > (UINT)MAX_DIMENSION )
+    {
+        hr = E_FAIL;
+        CHECK_HR(hr, _T("Invalid dimensions in line %d of the procedural height map file %s"), iLine, strDescFile);
+        return hr;
+    }
+
+    // Profiles use different seeds, so that the terrain is not symmetric
+    CreateProfile(uiNumCols, uiSeed * 2,     m_ColProfile);
+    CreateProfile(uiNumRows, uiSeed * 2 + 1, m_RowProfile);
+    m_iNumCols = uiNumCols;
+    m_iNumRows = uiNumRows;
+
+    return S_OK;
+}
+
+void CProceduralHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                         size_t DataPitch,
+                                         int iStartCol, int iEndCol,
+                                         int iStartRow, int iEndRow,
+                                         int iStep)const
+{
+    for(int iRow = iStartRow; iRow < iEndRow; iRow++)
+    {
+        int iSrcRow = max(0, iRow*iStep); iSrcRow = min(iSrcRow, (int)m_iNumRows-1);
+        UINT16 *pDstRow = pDataPtr + (iRow-iStartRow) * DataPitch;
+        for(int iCol = iStartCol; iCol < iEndCol; iCol++)
+        {
+            int iSrcCol = max(0, iCol*iStep); iSrcCol = min(iSrcCol, (int)m_iNumCols-1);
+            pDstRow[iCol-iStartCol] = GetSample(iSrcCol, iSrcRow);
+        }
+    }
+}
+
+void CProceduralHeightMap::GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const
+{
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+    {
+        int iCol0 = min( max(pCols[iQuad]*iStep, 0), (int)m_iNumCols-1 ), iCol1 = min( max((pCols[iQuad]+1)*iStep, 0), (int)m_iNumCols-1 );
+        int iRow0 = min( max(pRows[iQuad]*iStep, 0), (int)m_iNumRows-1 ), iRow1 = min( max((pRows[iQuad]+1)*iStep, 0), (int)m_iNumRows-1 );
+        UINT16 *pQuad = pQuads + 4*iQuad;
+        pQuad[0] = GetSample(iCol0, iRow0); pQuad[1] = GetSample(iCol1, iRow0);
+        pQuad[2] = GetSample(iCol0, iRow1); pQuad[3] = GetSample(iCol1, iRow1);
+    }
+}
@@ -13,6 +13,7 @@
 // responsibility to update it.
 #include "stdafx.h"
 #include "RQTTriangulation.h"
+#include <float.h>
 
 void CRQTVertsEnabledFlags::Init(int iPatchSize, char bInitialEnableValue/* = TRUE*/)
 {
@@ -77,6 +78,7 @@ CRQTTriangulation::CRQTTriangulation(const SQuadTreeNodeLocation &pos,
     m_iNumLevelsInHierarchy(iNumLevelsInHierarchy),
     m_iNumLevelsInLocalPatchQT(0),
     m_EnabledFlags(EnabledFlags),
+    m_fDisabledVertsErrorBound(+FLT_MAX),
     m_pEncodedRQTBitStream(pEncodedRQTBitStream),
     m_bIsEncodingMode(true)
 {
@@ -92,6 +94,7 @@ CRQTTriangulation::CRQTTriangulation(const SQuadTreeNodeLocation &pos,
     m_pos(pos),
     m_iNumLevelsInHierarchy(iNumLevelsInHierarchy),
     m_iNumLevelsInLocalPatchQT(0),
+    m_fDisabledVertsErrorBound(+FLT_MAX),
     
     // This is the first time the indices are generated. We will use
     // encoded bit stream to decode enabled flags and store them in
@@ -110,6 +113,7 @@ CRQTTriangulation::CRQTTriangulation(const CRQTTriangulation &Triang)
     m_pos = Triang.m_pos;
     m_iNumLevelsInHierarchy = Triang.m_iNumLevelsInHierarchy;
     m_EnabledFlags = Triang.m_EnabledFlags;
+    m_fDisabledVertsErrorBound = Triang.m_fDisabledVertsErrorBound;
     m_pEncodedRQTBitStream = Triang.m_pEncodedRQTBitStream;
 }
 
@@ -0,0 +1,309 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "SparseHeightMap.h"
+
+static const TCHAR g_strSparseSignature[] = _T("DEMSparse");
+
+CSparseHeightMap::CSparseHeightMap()
+{
+}
+
+// Returns true if the file starts with the sparse height map signature
+bool CSparseHeightMap::IsSparseHeightMapFile(LPCTSTR strFilePath)
+{
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("rt") ) != 0 || pFile == NULL )
+        return false;
+    TCHAR strLine[_countof(g_strSparseSignature)] = {0};
+    bool bIsSparse = _fgetts(strLine, _countof(strLine), pFile) != NULL &&
+                     _tcscmp(strLine, g_strSparseSignature) == 0;
+    fclose(pFile);
+    return bIsSparse;
+}
+
+// Coarser layers go first
+static bool IsCoarserLayer(const std::pair<int, size_t> &Layer1, const std::pair<int, size_t> &Layer2)
+{
+    return Layer1.first > Layer2.first;
+}
+
+// Parses the description file. Errors are reported to the user if bReportErrors is true
+HRESULT CSparseHeightMap::ReadDescFile(LPCTSTR strDescFile, bool bReportErrors, std::vector<SLayer> &Layers, std::vector<std::wstring> &LayerFiles)
+{
+    Layers.clear();
+    LayerFiles.clear();
+
+    HRESULT hr = IsSparseHeightMapFile(strDescFile) ? S_OK : E_FAIL;
+    if( bReportErrors )
+        CHECK_HR(hr, _T("%s is not a sparse height map description file"), strDescFile);
+    if( FAILED(hr) )
+        return hr;
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strDescFile, _T("rt") ) != 0 || pFile == NULL )
+        return E_FAIL;
+
+    // Layer paths are relative to the folder of the description file
+    std::wstring strFolder(strDescFile);
+    size_t SlashPos = strFolder.find_last_of(L"\\/");
+    strFolder.resize( SlashPos != std::wstring::npos ? SlashPos+1 : 0 );
+
+    TCHAR strLine[MAX_PATH + 128];
+    int iLine = 0;
+    while( SUCCEEDED(hr) && _fgetts(strLine, _countof(strLine), pFile) != NULL )
+    {
+        iLine++;
+        // Strip the trailing white spaces and the line break
+        size_t Len = _tcslen(strLine);
+        while( Len > 0 && _istspace(strLine[Len-1]) )
+            strLine[--Len] = 0;
+        const TCHAR *pStart = strLine;
+        while( _istspace(*pStart) )
+            pStart++;
+        // Skip the signature, empty lines and comments
+        if( iLine == 1 || *pStart == 0 || *pStart == _T('#') )
+            continue;
+
+        SLayer Layer;
+        UINT uiSpacing = 0;
+        int iPathPos = 0;
+        if( _stscanf_s(pStart, _T("%u %u %u %u %u %n"), &uiSpacing, &Layer.uiStartCol, &Layer.uiStartRow, &Layer.uiNumCols, &Layer.uiNumRows, &iPathPos) != 5 ||
+            iPathPos == 0 || pStart[iPathPos] == 0 ||
+            Layer.uiNumCols == 0 || Layer.uiNumRows == 0 ||
+            uiSpacing == 0 || (uiSpacing & (uiSpacing-1)) || uiSpacing > (1 << MAX_SPACING_LOG2) ||
+            (Layer.uiStartCol & (uiSpacing-1)) || (Layer.uiStartRow & (uiSpacing-1)) )
+        {
+            hr = E_FAIL;
+            if( bReportErrors )
+                CHECK_HR(hr, _T("Invalid layer description in line %d of the sparse height map file %s"), iLine, strDescFile);
+            break;
+        }
+        Layer.iSpacingLog2 = 0;
+        while( (1U << Layer.iSpacingLog2) < uiSpacing )
+            Layer.iSpacingLog2++;
+        if( (UINT64)Layer.uiStartCol + ((UINT64)(Layer.uiNumCols-1) << Layer.iSpacingLog2) >= INT_MAX/2 ||
+            (UINT64)Layer.uiStartRow + ((UINT64)(Layer.uiNumRows-1) << Layer.iSpacingLog2) >= INT_MAX/2 )
+        {
+            hr = E_FAIL;
+            if( bReportErrors )
+                CHECK_HR(hr, _T("Layer in line %d of the sparse height map file %s is too large"), iLine, strDescFile);
+            break;
+        }
+
+        const TCHAR *strLayerFile = pStart + iPathPos;
+        bool bAbsolutePath = strLayerFile[0] == _T('\\') || strLayerFile[0] == _T('/') || (strLayerFile[0] && strLayerFile[1] == _T(':'));
+        LayerFiles.push_back( bAbsolutePath ? std::wstring(strLayerFile) : strFolder + strLayerFile );
+        Layers.push_back(Layer);
+    }
+    fclose(pFile);
+
+    if( SUCCEEDED(hr) && Layers.empty() )
+    {
+        hr = E_FAIL;
+        if( bReportErrors )
+            CHECK_HR(hr, _T("Sparse height map file %s contains no layers"), strDescFile);
+    }
+    return hr;
+}
+
+// Returns the paths of the layer files listed in the description file. Errors are not reported
+HRESULT CSparseHeightMap::GetLayerFiles(LPCTSTR strDescFile, std::vector<std::wstring> &LayerFiles)
+{
+    std::vector<SLayer> Layers;
+    return ReadDescFile(strDescFile, false, Layers, LayerFiles);
+}
+
+// Reads the description file and decodes the layers. Errors are reported to the user
+HRESULT CSparseHeightMap::Open(LPCTSTR strDescFile, DEM_PARALLEL_FOR_FUNC pParallelFor, void *pUserData)
+{
+    m_Layers.clear();
+    m_iNumCols = m_iNumRows = 0;
+
+    std::vector<SLayer> Layers;
+    std::vector<std::wstring> LayerFiles;
+    HRESULT hr = ReadDescFile(strDescFile, true, Layers, LayerFiles);
+    if( FAILED(hr) )
+        return hr;
+
+    // Coarser layers go first. Layers of the same spacing keep the listed order
+    std::vector< std::pair<int, size_t> > LayerOrder;
+    for(size_t iLayer = 0; iLayer < Layers.size(); iLayer++)
+        LayerOrder.push_back( std::make_pair(Layers[iLayer].iSpacingLog2, iLayer) );
+    std::stable_sort(LayerOrder.begin(), LayerOrder.end(), IsCoarserLayer);
+
+    m_Layers.resize(Layers.size());
+    for(size_t iLayer = 0; iLayer < m_Layers.size(); iLayer++)
+    {
+        size_t iSrcLayer = LayerOrder[iLayer].second;
+        SLayer &Layer = m_Layers[iLayer];
+        Layer = Layers[iSrcLayer];
+        const std::wstring &strLayerFile = LayerFiles[iSrcLayer];
+
+        CDEMReader DEMReader;
+        DEMReader.SetParallelFor(pParallelFor, pUserData);
+        if( !DEMReader.Open(strLayerFile.c_str(), Layer.uiNumCols, Layer.uiNumRows) ||
+            DEMReader.GetWidth() != Layer.uiNumCols || DEMReader.GetHeight() != Layer.uiNumRows )
+        {
+            hr = E_FAIL;
+            CHECK_HR(hr, _T("Failed to open layer file %s or its dimensions do not match the description: %S"), strLayerFile.c_str(), DEMReader.GetErrorMessage());
+            break;
+        }
+        Layer.Samples.resize((size_t)Layer.uiNumCols * Layer.uiNumRows);
+        if( !DEMReader.Read(&Layer.Samples[0], Layer.uiNumCols) )
+        {
+            hr = E_FAIL;
+            CHECK_HR(hr, _T("Failed to decode layer file %s: %S"), strLayerFile.c_str(), DEMReader.GetErrorMessage());
+            break;
+        }
+
+        m_iNumCols = max(m_iNumCols, Layer.GetEndCol()+1);
+        m_iNumRows = max(m_iNumRows, Layer.GetEndRow()+1);
+    }
+    if( FAILED(hr) )
+    {
+        m_Layers.clear();
+        m_iNumCols = m_iNumRows = 0;
+    }
+
+    return hr;
+}
+
+void CSparseHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                     size_t DataPitch,
+                                     int iStartCol, int iEndCol,
+                                     int iStartRow, int iEndRow,
+                                     int iStep)const
+{
+    int iNumCols = iEndCol - iStartCol;
+    int iNumRows = iEndRow - iStartRow;
+    std::vector<int> SrcCols(iNumCols), SrcRows(iNumRows);
+    for(int iCol = 0; iCol < iNumCols; iCol++)
+        SrcCols[iCol] = min( max(0, (iStartCol + iCol)*iStep), (int)m_iNumCols-1 );
+    for(int iRow = 0; iRow < iNumRows; iRow++)
+    {
+        SrcRows[iRow] = min( max(0, (iStartRow + iRow)*iStep), (int)m_iNumRows-1 );
+        memset(pDataPtr + iRow * DataPitch, 0, iNumCols * sizeof(UINT16));
+    }
+
+    std::vector<UINT> LayerCols(iNumCols), ColWeights(iNumCols);
+    for(size_t iLayer = 0; iLayer < m_Layers.size(); iLayer++)
+    {
+        const SLayer &Layer = m_Layers[iLayer];
+        // Source indices are monotonic, so the layer covers contiguous ranges of the requested columns and rows
+        int iLayerStartCol = (int)(std::lower_bound(SrcCols.begin(), SrcCols.end(), (int)Layer.uiStartCol) - SrcCols.begin());
+        int iLayerEndCol = (int)(std::upper_bound(SrcCols.begin(), SrcCols.end(), (int)Layer.GetEndCol()) - SrcCols.begin());
+        int iLayerStartRow = (int)(std::lower_bound(SrcRows.begin(), SrcRows.end(), (int)Layer.uiStartRow) - SrcRows.begin());
+        int iLayerEndRow = (int)(std::upper_bound(SrcRows.begin(), SrcRows.end(), (int)Layer.GetEndRow()) - SrcRows.begin());
+        if( iLayerStartCol >= iLayerEndCol || iLayerStartRow >= iLayerEndRow )
+            continue;
+
+        int iSpacingLog2 = Layer.iSpacingLog2;
+        UINT uiSpacing = 1 << iSpacingLog2;
+        for(int iCol = iLayerStartCol; iCol < iLayerEndCol; iCol++)
+        {
+            UINT uiOffset = SrcCols[iCol] - Layer.uiStartCol;
+            LayerCols[iCol] = uiOffset >> iSpacingLog2;
+            ColWeights[iCol] = uiOffset & (uiSpacing-1);
+        }
+        for(int iRow = iLayerStartRow; iRow < iLayerEndRow; iRow++)
+        {
+            UINT uiOffset = SrcRows[iRow] - Layer.uiStartRow;
+            UINT uiRowWeight = uiOffset & (uiSpacing-1);
+            const UINT16 *pRow0 = &Layer.Samples[(size_t)(uiOffset >> iSpacingLog2) * Layer.uiNumCols];
+            // Samples between the last two rows and columns have non-zero weights only
+            // inside the layer, so the next row and column always exist when accessed
+            const UINT16 *pRow1 = uiRowWeight ? pRow0 + Layer.uiNumCols : pRow0;
+            UINT16 *pDstRow = pDataPtr + iRow * DataPitch;
+            for(int iCol = iLayerStartCol; iCol < iLayerEndCol; iCol++)
+            {
+                UINT uiLayerCol = LayerCols[iCol];
+                UINT uiColWeight = ColWeights[iCol];
+                if( (uiColWeight | uiRowWeight) == 0 )
+                {
+                    pDstRow[iCol] = pRow0[uiLayerCol];
+                    continue;
+                }
+                // Bilinear interpolation with rounding
+                UINT uiNextCol = uiColWeight ? uiLayerCol+1 : uiLayerCol;
+                UINT uiBottom = pRow0[uiLayerCol] * (uiSpacing-uiColWeight) + pRow0[uiNextCol] * uiColWeight;
+                UINT uiTop    = pRow1[uiLayerCol] * (uiSpacing-uiColWeight) + pRow1[uiNextCol] * uiColWeight;
+                UINT64 Elev = (UINT64)uiBottom * (uiSpacing-uiRowWeight) + (UINT64)uiTop * uiRowWeight;
+                pDstRow[iCol] = (UINT16)( (Elev + ((UINT64)1 << (2*iSpacingLog2-1))) >> (2*iSpacingLog2) );
+            }
+        }
+    }
+}
+
+// Returns the finest spacing of the layers intersecting the region
+int CSparseHeightMap::GetSampleSpacingLog2(int iStartCol, int iEndCol, int iStartRow, int iEndRow)const
+{
+    // The region is clamped in the same way as the requested samples
+    UINT uiFirstCol = min( (UINT)max(iStartCol, 0), m_iNumCols-1 );
+    UINT uiLastCol  = min( (UINT)max(iEndCol-1, 0), m_iNumCols-1 );
+    UINT uiFirstRow = min( (UINT)max(iStartRow, 0), m_iNumRows-1 );
+    UINT uiLastRow  = min( (UINT)max(iEndRow-1, 0), m_iNumRows-1 );
+    // Areas not covered by any layer are flat
+    int iSpacingLog2 = m_Layers.front().iSpacingLog2;
+    for(size_t iLayer = 0; iLayer < m_Layers.size(); iLayer++)
+    {
+        const SLayer &Layer = m_Layers[iLayer];
+        if( Layer.uiStartCol <= uiLastCol && Layer.GetEndCol() >= uiFirstCol &&
+            Layer.uiStartRow <= uiLastRow && Layer.GetEndRow() >= uiFirstRow )
+            iSpacingLog2 = min(iSpacingLog2, Layer.iSpacingLog2);
+    }
+    return iSpacingLog2;
+}
+
+// Returns bounds of the layer samples, from which the samples of the region are interpolated
+bool CSparseHeightMap::GetElevationBounds(int iStartCol, int iEndCol, int iStartRow, int iEndRow,
+                                          UINT16 &MinElevation, UINT16 &MaxElevation)const
+{
+    UINT uiFirstCol = min( (UINT)max(iStartCol, 0), m_iNumCols-1 );
+    UINT uiLastCol  = min( (UINT)max(iEndCol-1, 0), m_iNumCols-1 );
+    UINT uiFirstRow = min( (UINT)max(iStartRow, 0), m_iNumRows-1 );
+    UINT uiLastRow  = min( (UINT)max(iEndRow-1, 0), m_iNumRows-1 );
+    MinElevation = UINT16_MAX;
+    MaxElevation = 0;
+    // Parts of the region, which are not covered by any layer, would require
+    // checking the union of the layers, so such regions are not bounded
+    bool bIsCovered = false;
+    for(size_t iLayer = 0; iLayer < m_Layers.size(); iLayer++)
+    {
+        const SLayer &Layer = m_Layers[iLayer];
+        if( Layer.uiStartCol > uiLastCol || Layer.GetEndCol() < uiFirstCol ||
+            Layer.uiStartRow > uiLastRow || Layer.GetEndRow() < uiFirstRow )
+            continue;
+        bIsCovered |= Layer.uiStartCol <= uiFirstCol && Layer.GetEndCol() >= uiLastCol &&
+                      Layer.uiStartRow <= uiFirstRow && Layer.GetEndRow() >= uiLastRow;
+
+        // Layer samples surrounding the intersection of the region and the layer
+        UINT uiSpacing = 1 << Layer.iSpacingLog2;
+        UINT uiFirstLayerCol = (max(uiFirstCol, Layer.uiStartCol) - Layer.uiStartCol) >> Layer.iSpacingLog2;
+        UINT uiLastLayerCol  = (min(uiLastCol, Layer.GetEndCol()) - Layer.uiStartCol + uiSpacing-1) >> Layer.iSpacingLog2;
+        UINT uiFirstLayerRow = (max(uiFirstRow, Layer.uiStartRow) - Layer.uiStartRow) >> Layer.iSpacingLog2;
+        UINT uiLastLayerRow  = (min(uiLastRow, Layer.GetEndRow()) - Layer.uiStartRow + uiSpacing-1) >> Layer.iSpacingLog2;
+        for(UINT uiRow = uiFirstLayerRow; uiRow <= uiLastLayerRow; uiRow++)
+        {
+            const UINT16 *pRow = &Layer.Samples[(size_t)uiRow * Layer.uiNumCols];
+            for(UINT uiCol = uiFirstLayerCol; uiCol <= uiLastLayerCol; uiCol++)
+            {
+                MinElevation = min(MinElevation, pRow[uiCol]);
+                MaxElevation = max(MaxElevation, pRow[uiCol]);
+            }
+        }
+    }
+    return bIsCovered;
+}
@@ -17,6 +17,7 @@
 #include "ElevationDataSource.h"
 #include "RQTTriangulation.h"
 #include "PatchCache.h"
+#include "NormalMapPyramid.h"
 #include <gdiplus.h>
 #include "EffectUtil.h"
 #include "DXTCompressorDLL.h"
@@ -209,6 +210,121 @@ void CTerrainPatch::DefineNormalMapDesc(D3D11_TEXTURE2D_DESC &NormalMapDesc)
     NormalMapDesc.MipLevels = NORMAL_MAP_MIPS;
 }
 
+// Returns the size of the normal map data with all mip levels. Dimensions of each level are aligned
+// to 4 texels. Compressed normal map takes 1 byte per texel
+size_t CTerrainPatch::GetNormalMapDataSize(const CDX11PatchesCommon *pPatchCommon, int iPatchSize, int iHighResElevDataLODBias)
+{
+    int iNumChannels = pPatchCommon->m_bCompressNormalMap ? 4 : 2;
+    UINT CurrMipSize = (iPatchSize + ELEVATION_DATA_BOUNDARY_EXTENSION*2) << iHighResElevDataLODBias;
+    size_t NormMapDataSize = 0;
+    for(int iNormalMapMip = 0; iNormalMapMip < NORMAL_MAP_MIPS; iNormalMapMip++, CurrMipSize /= 2)
+        NormMapDataSize += ((CurrMipSize+3) & (-4)) * ((CurrMipSize+3) & (-4));
+    return pPatchCommon->m_bCompressNormalMap ? NormMapDataSize : NormMapDataSize * iNumChannels;
+}
+
+// Calculates all mip levels of the patch normal map. The levels are stored one after another at the
+// aligned pointer to NormalMapData or, if the normal map is compressed, NormalMapDataBC3. Returns
+// pointer to the finest level
+const BYTE* CTerrainPatch::GenerateNormalMap(const CDX11PatchesCommon *pPatchCommon,
+                                      const CPatchElevationData *pPatchElevData,
+                                      std::vector<BYTE> &NormalMapData,
+                                      std::vector<BYTE> &NormalMapDataBC3)
+{
+    int iPatchSize = pPatchElevData->GetPatchSize();
+    SQuadTreeNodeLocation pos;
+    pPatchElevData->GetPos(pos);
+
+    const UINT16 *pHighResElevData = NULL;
+    size_t HighResElevDataPitch = 0;
+    int iHighResElevDataLODBias = pPatchElevData->GetHighResDataLODBias();
+    pPatchElevData->GetHighResDataPtr( pHighResElevData, HighResElevDataPitch,
+                                       ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias, 
+                                       ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias,
+                                       ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias,
+                                       ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias );
+    assert( pHighResElevData );
+
+    UINT NormalMapSize = (iPatchSize + ELEVATION_DATA_BOUNDARY_EXTENSION*2) << iHighResElevDataLODBias;
+
+    // Uncompressed normals are stored in a two-channel texture
+    // Compressed normal map is stored in a BC3_UNORM format: r,g,b channels store x 
+    // component; a stores y component
+    int iNumChannels = pPatchCommon->m_bCompressNormalMap ? 4 : 2;
+    // Data alignement is necessary for the normal map compression
+    int iNormMapDataSize = 0;
+    UINT CurrMipHeight = NormalMapSize;
+    UINT CurrMipWidth  = NormalMapSize;
+    // Compute required space amount for all mip levels taking into account alignment and 
+    for(int iNormalMapMip = 0; iNormalMapMip < NORMAL_MAP_MIPS; iNormalMapMip++, CurrMipHeight /= 2, CurrMipWidth /= 2)
+        iNormMapDataSize += ((CurrMipHeight+3) & (-4)) * ((CurrMipWidth+3) & (-4));
+        
+    NormalMapData.resize( iNormMapDataSize * iNumChannels  + 15 ); // Reserve additional space for 16-byte alignement
+    if( pPatchCommon->m_bCompressNormalMap )
+        NormalMapDataBC3.resize( iNormMapDataSize + 15 ); // Reserve additional space for 16-byte alignement
+        
+    int iAlignedNormMapWidth = (NormalMapSize + 3) & (-4);
+
+    float fHighResDataSpacingInterval = pPatchCommon->m_fElevationSampleSpacing * (float)(1<<(pPatchCommon->m_iNumLevelsInPatchHierarchy-1 - pos.level - iHighResElevDataLODBias ));
+    assert( ((NormalMapSize & 0x03) == 0) );
+    // Generate normal map
+    CalculateNormalMap( pHighResElevData + (ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias) + (ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias)*HighResElevDataPitch,
+                        iPatchSize<<iHighResElevDataLODBias,
+                        ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias, 
+                        ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias,
+                        ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias,
+                        ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias,
+                        HighResElevDataPitch,
+                        AlignPointer( &NormalMapData[0] ) + ( (ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias) + (ELEVATION_DATA_BOUNDARY_EXTENSION<<iHighResElevDataLODBias)*iAlignedNormMapWidth) * iNumChannels,
+                        iAlignedNormMapWidth,
+                        fHighResDataSpacingInterval,
+                        pPatchCommon->m_fElevationScale,
+                        iNumChannels);
+
+    // Generate coarse normal map MIP levels
+    CurrMipWidth  = NormalMapSize;
+    CurrMipHeight = NormalMapSize;
+
+    BYTE *pFinerMipLevel = NULL;
+    int iFinerMipAlignedWidth = 0;
+    BYTE *pCurrMipLevel = AlignPointer( &NormalMapData[0] );
+    BYTE *pCurrCompressedMipLevel = pPatchCommon->m_bCompressNormalMap ? AlignPointer( &NormalMapDataBC3[0] ) : NULL;
+    for(int iNormalMapMip = 0; iNormalMapMip < NORMAL_MAP_MIPS; iNormalMapMip++)
+    {
+        int iAlignedMipHeight = (CurrMipHeight + 3) & (-4);
+        int iAlignedMipWidth  = (CurrMipWidth  + 3) & (-4);
+
+        if( iNormalMapMip >= 1)
+        {
+            CalculateCoarseNormalMapMIP(pFinerMipLevel, iFinerMipAlignedWidth,
+                                        pCurrMipLevel, iAlignedMipWidth,
+                                        CurrMipWidth,
+                                        CurrMipHeight,
+                                        iNumChannels);
+        }
+
+        if( pPatchCommon->m_bCompressNormalMap )
+        {
+            // Compress normal map if necessary
+            DXTC::CompressImageDXT5SSE2( pCurrMipLevel, pCurrCompressedMipLevel, iAlignedMipWidth, iAlignedMipHeight );
+            pCurrCompressedMipLevel += iAlignedMipWidth * iAlignedMipHeight;
+        }
+
+        pFinerMipLevel = pCurrMipLevel;
+        pCurrMipLevel += iAlignedMipWidth * iAlignedMipHeight * iNumChannels;
+
+        iFinerMipAlignedWidth = iAlignedMipWidth;
+        CurrMipWidth/=2;
+        CurrMipHeight/=2;
+    }
+        
+    if( pPatchCommon->m_bCompressNormalMap )
+    {
+        PurgeVector( NormalMapData );
+        return AlignPointer( &NormalMapDataBC3[0] );
+    }
+    return AlignPointer( &NormalMapData[0] );
+}
+
 CTerrainPatch::CTerrainPatch(const CDX11PatchesCommon *pPatchesCommon,
                              const CPatchElevationData *pPatchElevData,
                              CRQTTriangulation *pAdaptiveTriangulation) : 
@@ -218,6 +334,7 @@ CTerrainPatch::CTerrainPatch(const CDX11PatchesCommon *pPatchesCommon,
     m_fPatchApproxErrorBound(-1.f),
     m_uiNumIndicesInAdaptiveTriang(0),
     m_pPatchElevData(pPatchElevData),
+    m_pBakedNormalMapData(NULL),
     m_pParent(NULL)
 {
     memset(m_pChild,0,sizeof(m_pChild));
@@ -244,23 +361,12 @@ CTerrainPatch::CTerrainPatch(const CDX11PatchesCommon *pPatchesCommon,
 
     assert( pElevData != NULL );
 
-    const UINT16 *pHighResElevData = NULL;
-    size_t HighResElevDataPitch = 0;
     m_iHighResElevDataLODBias = m_pPatchElevData->GetHighResDataLODBias();
-    m_pPatchElevData->GetHighResDataPtr( pHighResElevData, HighResElevDataPitch,
-                                         ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias, 
-                                         ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias,
-                                         ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias,
-                                         ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias );
-    assert( pHighResElevData );
 
 	//
 	// elevation data
 	//
 
-    D3D11_TEXTURE2D_DESC ElevDataTexDesc;
-    DefineElevDataTexDesc(ElevDataTexDesc);
-
 	if( !m_pPatchCommon->m_bAsyncModeWorkaround )
 	{
         V( CreateElevDataTexture() );
@@ -278,82 +384,16 @@ CTerrainPatch::CTerrainPatch(const CDX11PatchesCommon *pPatchesCommon,
 		assert(m_ptex2DNormalMapSRV);
 	}
 
-    
-    // Uncompressed normals are stored in a two-channel texture
-    // Compressed normal map is stored in a BC3_UNORM format: r,g,b channels store x 
-    // component; a stores y component
-    int iNumChannels = m_pPatchCommon->m_bCompressNormalMap ? 4 : 2;
-    // Data alignement is necessary for the normal map compression
-    int iNormMapDataSize = 0;
-    UINT CurrMipHeight = NormalMapDesc.Height;
-    UINT CurrMipWidth  = NormalMapDesc.Width;
-    // Compute required space amount for all mip levels taking into account alignment and 
-    for(int iNormalMapMip = 0; iNormalMapMip < NORMAL_MAP_MIPS; iNormalMapMip++, CurrMipHeight /= 2, CurrMipWidth /= 2)
-        iNormMapDataSize += ((CurrMipHeight+3) & (-4)) * ((CurrMipWidth+3) & (-4));
-        
-    m_NormalMapData.resize( iNormMapDataSize * iNumChannels  + 15 ); // Reserve additional space for 16-byte alignement
-    if( m_pPatchCommon->m_bCompressNormalMap )
-        m_NormalMapDataBC3.resize( iNormMapDataSize + 15 ); // Reserve additional space for 16-byte alignement
-        
-    int iAlignedNormMapWidth = (NormalMapDesc.Width + 3) & (-4);
-
-    float fHighResDataSpacingInterval = m_pPatchCommon->m_fElevationSampleSpacing * (float)(1<<(m_pPatchCommon->m_iNumLevelsInPatchHierarchy-1 - m_pos.level - m_iHighResElevDataLODBias ));
-    assert( ((NormalMapDesc.Width & 0x03) == 0) && ((NormalMapDesc.Height & 0x03) == 0) );
-    // Generate normal map
-    CalculateNormalMap( pHighResElevData + (ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias) + (ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias)*HighResElevDataPitch,
-                        m_iPatchSize<<m_iHighResElevDataLODBias,
-                        ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias, 
-                        ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias,
-                        ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias,
-                        ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias,
-                        HighResElevDataPitch,
-                        AlignPointer( &m_NormalMapData[0] ) + ( (ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias) + (ELEVATION_DATA_BOUNDARY_EXTENSION<<m_iHighResElevDataLODBias)*iAlignedNormMapWidth) * iNumChannels,
-                        iAlignedNormMapWidth,
-                        fHighResDataSpacingInterval,
-                        m_pPatchCommon->m_fElevationScale,
-                        iNumChannels);
-
-    // Generate coarse normal map MIP levels
-    CurrMipWidth  = NormalMapDesc.Width;
-    CurrMipHeight = NormalMapDesc.Height;
-
-    BYTE *pFinerMipLevel = NULL;
-    int iFinerMipAlignedWidth = 0;
-    BYTE *pCurrMipLevel = AlignPointer( &m_NormalMapData[0] );
-    BYTE *pCurrCompressedMipLevel = m_pPatchCommon->m_bCompressNormalMap ? AlignPointer( &m_NormalMapDataBC3[0] ) : NULL;
-    for(int iNormalMapMip = 0; iNormalMapMip < NORMAL_MAP_MIPS; iNormalMapMip++)
-    {
-        int iAlignedMipHeight = (CurrMipHeight + 3) & (-4);
-        int iAlignedMipWidth  = (CurrMipWidth  + 3) & (-4);
-
-        if( iNormalMapMip >= 1)
-        {
-            CalculateCoarseNormalMapMIP(pFinerMipLevel, iFinerMipAlignedWidth,
-                                        pCurrMipLevel, iAlignedMipWidth,
-                                        CurrMipWidth,
-                                        CurrMipHeight,
-                                        m_pPatchCommon->m_bCompressNormalMap ? 4 : 2);
-        }
-
-        if( m_pPatchCommon->m_bCompressNormalMap )
-        {
-            // Compress normal map if necessary
-            DXTC::CompressImageDXT5SSE2( pCurrMipLevel, pCurrCompressedMipLevel, iAlignedMipWidth, iAlignedMipHeight );
-            pCurrCompressedMipLevel += iAlignedMipWidth * iAlignedMipHeight;
-        }
-
-        pFinerMipLevel = pCurrMipLevel;
-        pCurrMipLevel += iAlignedMipWidth * iAlignedMipHeight * iNumChannels;
-
-        iFinerMipAlignedWidth = iAlignedMipWidth;
-        CurrMipWidth/=2;
-        CurrMipHeight/=2;
-    }
-        
-    if( m_pPatchCommon->m_bCompressNormalMap )
+    // Normal map baked for the static terrain is uploaded directly from the pyramid file
+    if( m_pPatchCommon->m_pNormalMapPyramid )
     {
-        PurgeVector( m_NormalMapData );
+        size_t BakedDataSize = 0;
+        m_pBakedNormalMapData = m_pPatchCommon->m_pNormalMapPyramid->GetNormalMapData(m_pos, BakedDataSize);
+        if( BakedDataSize != GetNormalMapDataSize(m_pPatchCommon, m_iPatchSize, m_iHighResElevDataLODBias) )
+            m_pBakedNormalMapData = NULL;
     }
+    if( m_pBakedNormalMapData == NULL )
+        GenerateNormalMap(m_pPatchCommon, m_pPatchElevData, m_NormalMapData, m_NormalMapDataBC3);
 
 	if( pAdaptiveTriangulation )
 	{
@@ -488,11 +528,16 @@ HRESULT CTerrainPatch::UpdateDeviceResources()
 	    CurrMipHeight = NormMapDesc.Height;
         assert( NormMapDesc.MipLevels == NORMAL_MAP_MIPS );
 
-        if(!m_NormalMapData.empty() || !m_NormalMapDataBC3.empty())
+        if(!m_NormalMapData.empty() || !m_NormalMapDataBC3.empty() || m_pBakedNormalMapData)
         {
-            BYTE *pwCurrMipLevel = NULL;
-            BYTE *pCurrCompressedMipLevel = NULL;
-            if( m_pPatchCommon->m_bCompressNormalMap )
+            const BYTE *pwCurrMipLevel = NULL;
+            const BYTE *pCurrCompressedMipLevel = NULL;
+            // Baked normal map has the same layout as the generated one
+            if( m_pBakedNormalMapData && m_pPatchCommon->m_bCompressNormalMap )
+                pCurrCompressedMipLevel = m_pBakedNormalMapData;
+            else if( m_pBakedNormalMapData )
+                pwCurrMipLevel = m_pBakedNormalMapData;
+            else if( m_pPatchCommon->m_bCompressNormalMap )
                 pCurrCompressedMipLevel = AlignPointer( &m_NormalMapDataBC3[0] );
             else
                 pwCurrMipLevel = AlignPointer( &m_NormalMapData[0] );
@@ -521,6 +566,7 @@ HRESULT CTerrainPatch::UpdateDeviceResources()
             
 	        PurgeVector(m_NormalMapData);
             PurgeVector(m_NormalMapDataBC3);
+            m_pBakedNormalMapData = NULL;
         
 		    m_bNormalMapIsValid = true;
         }
@@ -566,7 +612,8 @@ CDX11PatchesCommon::CDX11PatchesCommon(float fElevationSampleSpacing,
     m_fElevationSampleSpacing(fElevationSampleSpacing),
     m_fElevationScale(fElevationScale),
     m_iNumLevelsInPatchHierarchy(iNumLevelsInPatchHierarchy),
-	m_bAsyncModeWorkaround(bAsyncModeWorkaround)
+	m_bAsyncModeWorkaround(bAsyncModeWorkaround),
+    m_pNormalMapPyramid(NULL)
 {
 }
 
@@ -153,13 +153,26 @@ void RenderText();
 #endif
 
 TCHAR g_strRawDEMDataFile[MAX_PATH_LENGTH];
+TCHAR g_strTiledHeightMapFile[MAX_PATH_LENGTH];
+TCHAR g_strTilePyramidFile[MAX_PATH_LENGTH];
+TCHAR g_strCompressedHeightMapFile[MAX_PATH_LENGTH];
+TCHAR g_strHierarchyCacheFile[MAX_PATH_LENGTH];
 TCHAR g_strEncodedRQTTriangFile[MAX_PATH_LENGTH];
+TCHAR g_strNormalMapPyramidFile[MAX_PATH_LENGTH];
 
 // These variables are initialized by ParseConfigurationFile()
 int g_iNumColumns = 1024;
 int g_iNumRows    = 1024;
 int g_iPatchSize = 64;
+int g_iTileCacheBudgetMB = 256;
+int g_iPatchDataCacheBudgetMB = 64;
+bool g_bBenchmarkElevDataKernels = false;
+bool g_bVerifyProceduralHeightMap = false;
+bool g_bMortonHeightMapLayout = false;
+bool g_bBlockCompressedHeightMap = false;
+bool g_bDecimatedLODPyramid = false;
 float g_fElevationSamplingInterval = 160.f;
+float g_fReconstrPrecision = 1.f;
 float g_fElevationScale = 0.1f;
 
 SRenderingParams g_TerrainRenderParams = 
@@ -180,7 +193,12 @@ CAdaptiveModelDX11Render::SRenderParams g_DX11PatchRenderParams;
 HRESULT LoadScene()
 {
     memset( g_strRawDEMDataFile, 0, sizeof(g_strRawDEMDataFile) );
+    memset( g_strTiledHeightMapFile, 0, sizeof(g_strTiledHeightMapFile) );
+    memset( g_strTilePyramidFile, 0, sizeof(g_strTilePyramidFile) );
+    memset( g_strCompressedHeightMapFile, 0, sizeof(g_strCompressedHeightMapFile) );
+    memset( g_strHierarchyCacheFile, 0, sizeof(g_strHierarchyCacheFile) );
     memset( g_strEncodedRQTTriangFile, 0, sizeof(g_strEncodedRQTTriangFile) );
+    memset( g_strNormalMapPyramidFile, 0, sizeof(g_strNormalMapPyramidFile) );
     // Get selected config file
     int iSelectedConfigFile = (int)g_SampleUI.GetComboBox( IDC_CONFIG_COMBO )->GetSelectedData();
     // Parse the config file
@@ -194,9 +212,22 @@ HRESULT LoadScene()
 
     g_SampleUI.GetSlider( IDC_SCR_SPACE_THRESHOLD_SLIDER )->SetValue( (int)g_TerrainRenderParams.m_fScrSpaceErrorBound );
     // Create data source
+    SElevDataSourceParams ElevDataSourceParams;
+    ElevDataSourceParams.strTiledHeightMapFile = g_strTiledHeightMapFile;
+    ElevDataSourceParams.strTilePyramidFile = g_strTilePyramidFile;
+    ElevDataSourceParams.TileCacheBudget = (size_t)g_iTileCacheBudgetMB << 20;
+    ElevDataSourceParams.uiRawDEMWidth = g_iNumColumns;
+    ElevDataSourceParams.uiRawDEMHeight = g_iNumRows;
+    ElevDataSourceParams.strHierarchyCacheFile = g_strHierarchyCacheFile;
+    ElevDataSourceParams.bMortonHeightMapLayout = g_bMortonHeightMapLayout;
+    ElevDataSourceParams.bBlockCompressedHeightMap = g_bBlockCompressedHeightMap;
+    ElevDataSourceParams.bDecimatedLODPyramid = g_bDecimatedLODPyramid;
+    ElevDataSourceParams.strCompressedHeightMapFile = g_strCompressedHeightMapFile;
+    ElevDataSourceParams.fReconstrPrecision = g_fReconstrPrecision;
+    ElevDataSourceParams.PatchDataCacheBudget = (size_t)g_iPatchDataCacheBudgetMB << 20;
     try
     {
-        g_pElevDataSource.reset( new CElevationDataSource(g_strRawDEMDataFile, g_iPatchSize) );
+        g_pElevDataSource.reset( new CElevationDataSource(g_strRawDEMDataFile, g_iPatchSize, ElevDataSourceParams) );
     }
     catch(const std::exception &)
     {
@@ -204,6 +235,16 @@ HRESULT LoadScene()
         return E_FAIL;
     }
 
+    if( g_bBenchmarkElevDataKernels )
+    {
+        g_pElevDataSource->BenchmarkMinMaxElevations(_T("ElevDataStat.txt"));
+        g_pElevDataSource->BenchmarkHeightMapLayouts(_T("ElevDataStat.txt"));
+    }
+
+    // Mismatches are reported by the data source
+    if( g_bVerifyProceduralHeightMap && FAILED(g_pElevDataSource->VerifyProceduralHeightMap()) )
+        return E_FAIL;
+
     g_TerrainRenderParams.m_iNumLevelsInPatchHierarchy = g_pElevDataSource->GetNumLevelsInHierarchy();
     g_TerrainRenderParams.m_fGlobalMinElevation = g_pElevDataSource->GetGlobalMinElevation() * g_fElevationScale;
     g_TerrainRenderParams.m_fGlobalMaxElevation = g_pElevDataSource->GetGlobalMaxElevation() * g_fElevationScale;
@@ -233,6 +274,8 @@ HRESULT InitTerrainRender()
             if( SUCCEEDED(hr) )
             {
                 if( g_pTriangDataSource->GetNumLevelsInHierarchy() != g_pElevDataSource->GetNumLevelsInHierarchy() ||
+                    g_pTriangDataSource->GetNumRootNodesHorz() != g_pElevDataSource->GetNumRootNodesHorz() ||
+                    g_pTriangDataSource->GetNumRootNodesVert() != g_pElevDataSource->GetNumRootNodesVert() ||
                     g_pTriangDataSource->GetPatchSize() != g_pElevDataSource->GetPatchSize() )
                     bCreateAdaptiveTriang =  true; // Incorrect parameters
             }
@@ -246,7 +289,8 @@ HRESULT InitTerrainRender()
     // Init empty adaptive triangulation data source if file was not found or other problem occured
     if( bCreateAdaptiveTriang )
     {
-        g_pTriangDataSource->Init( g_pElevDataSource->GetNumLevelsInHierarchy(), g_pElevDataSource->GetPatchSize(), fFinestLevelTriangError );
+        g_pTriangDataSource->Init( g_pElevDataSource->GetNumLevelsInHierarchy(), g_pElevDataSource->GetPatchSize(), fFinestLevelTriangError,
+                                   g_pElevDataSource->GetNumRootNodesHorz(), g_pElevDataSource->GetNumRootNodesVert() );
     }
 
     V( g_TerrainDX11Render.Init(g_TerrainRenderParams, g_DX11PatchRenderParams, g_pElevDataSource.get(), g_pTriangDataSource.get() ) );
@@ -257,6 +301,27 @@ HRESULT InitTerrainRender()
         g_TerrainDX11Render.ConstructPatchAdaptiveTriangulations();
         hr = g_pTriangDataSource->SaveToFile(str);
     }
+
+    // Data source boundary extensions required by triangle error kernels are set up by the renderer
+    if( g_bBenchmarkElevDataKernels )
+    {
+        g_pTriangDataSource->BenchmarkTriangleErrorKernels(g_pElevDataSource.get(), _T("ElevDataStat.txt"));
+        g_pTriangDataSource->BenchmarkTriangulationDecoding(_T("ElevDataStat.txt"));
+    }
+
+    // Normal maps are baked once for the terrain. If the file cannot be created, patches
+    // generate normal maps at run time
+    if( *g_strNormalMapPyramidFile )
+    {
+        hr = DXUTFindDXSDKMediaFileCch( str, MAX_PATH, g_strNormalMapPyramidFile );
+        if( SUCCEEDED(hr) )
+            hr = g_TerrainDX11Render.OpenNormalMapPyramid(str);
+        if( FAILED(hr) )
+        {
+            hr = g_TerrainDX11Render.ConstructNormalMapPyramid(str);
+            CHECK_HR(hr, _T("Failed to bake normal map pyramid. Normal maps will be generated at run time"));
+        }
+    }
         
     SPatchBoundingBox TerrainAABB;
     g_TerrainDX11Render.GetTerrainBoundingBox(TerrainAABB);
@@ -380,6 +445,9 @@ void InitApp()
 	
 	g_TerrainDX11Render.SetQuadTreePreviewPos(10, 290, 200, 200);
 
+    // Task manager is used to decode the elevation data
+    gTaskMgr.Init();
+
     V( LoadScene() );
     
     // Setup the camera's view parameters
@@ -402,8 +470,6 @@ void InitApp()
     g_llPrevTick = CurrTick.QuadPart;
     g_llTrianglesRendered = 0;
     g_dCurrMTrPS = 0;
-
-    gTaskMgr.Init();
 }
 
 
@@ -453,6 +519,33 @@ void RenderText()
                     g_dCurrMTrPS);
         g_pTxtHelper->DrawTextLine( Str );
 
+        CTileCache::SStatistics TileCacheStat;
+        if( g_pElevDataSource.get() && g_pElevDataSource->GetTileCacheStatistics(TileCacheStat) )
+        {
+            UINT64 uiNumRequests = TileCacheStat.uiNumHits + TileCacheStat.uiNumMisses;
+            _stprintf_s(Str, sizeof(Str)/sizeof(Str[0]),
+                        L"Tile cache: %.1lf MB (peak %.1lf MB, budget %.1lf MB)  Hit rate: %.1lf%%",
+                        (double)TileCacheStat.ResidentBytes / (1<<20),
+                        (double)TileCacheStat.PeakResidentBytes / (1<<20),
+                        (double)TileCacheStat.BudgetBytes / (1<<20),
+                        uiNumRequests ? (double)TileCacheStat.uiNumHits / (double)uiNumRequests * 100.0 : 0.0);
+            g_pTxtHelper->DrawTextLine( Str );
+        }
+
+        CTileCache::SStatistics PatchCacheStat;
+        if( g_pElevDataSource.get() )
+        {
+            g_pElevDataSource->GetPatchDataCacheStatistics(PatchCacheStat);
+            UINT64 uiNumRequests = PatchCacheStat.uiNumHits + PatchCacheStat.uiNumMisses;
+            _stprintf_s(Str, sizeof(Str)/sizeof(Str[0]),
+                        L"Patch data cache: %.1lf MB (peak %.1lf MB, budget %.1lf MB)  Hit rate: %.1lf%%",
+                        (double)PatchCacheStat.ResidentBytes / (1<<20),
+                        (double)PatchCacheStat.PeakResidentBytes / (1<<20),
+                        (double)PatchCacheStat.BudgetBytes / (1<<20),
+                        uiNumRequests ? (double)PatchCacheStat.uiNumHits / (double)uiNumRequests * 100.0 : 0.0);
+            g_pTxtHelper->DrawTextLine( Str );
+        }
+
         if( g_bShowHelp )
 	    {
 		    UINT BackBufferHeight = DXUTGetDXGIBackBufferSurfaceDesc()->Height;
@@ -768,6 +861,15 @@ void CALLBACK OnFrameMove( double fTime, float fElapsedTime, void* pUserContext
 
             if( g_pPerfDataFile )
             {
+                CTileCache::SStatistics TileCacheStat;
+                if( g_pElevDataSource->GetTileCacheStatistics(TileCacheStat) )
+                    _ftprintf(g_pPerfDataFile, _T("\nTile cache peak: %.1lf MB, budget: %.1lf MB"), 
+                              (double)TileCacheStat.PeakResidentBytes / (1<<20), (double)TileCacheStat.BudgetBytes / (1<<20));
+                CTileCache::SStatistics PatchCacheStat;
+                g_pElevDataSource->GetPatchDataCacheStatistics(PatchCacheStat);
+                _ftprintf(g_pPerfDataFile, _T("\nPatch data cache peak: %.1lf MB, budget: %.1lf MB, hits: %I64u, misses: %I64u"), 
+                          (double)PatchCacheStat.PeakResidentBytes / (1<<20), (double)PatchCacheStat.BudgetBytes / (1<<20),
+                          PatchCacheStat.uiNumHits, PatchCacheStat.uiNumMisses);
                 fclose(g_pPerfDataFile);
                 g_pPerfDataFile = NULL;
             }
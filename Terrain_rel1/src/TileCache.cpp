@@ -0,0 +1,238 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "TileCache.h"
+
+CTileCache::CTileCache(ITileLoader *pLoader, size_t BudgetBytes) :
+    m_pLoader(pLoader),
+    m_uiInvalidationCount(0)
+{
+    memset(&m_Stat, 0, sizeof(m_Stat));
+    m_Stat.BudgetBytes = BudgetBytes;
+    // Free buffers are swapped in and out, so the list itself is never reallocated
+    m_FreeBuffers.reserve(MAX_FREE_BUFFERS);
+    InitializeCriticalSection(&m_cs);
+}
+
+CTileCache::~CTileCache()
+{
+    DeleteCriticalSection(&m_cs);
+}
+
+const UINT16* CTileCache::AcquireTile(UINT64 TileKey)
+{
+    EnterCriticalSection(&m_cs);
+    TileMapType::iterator TileIt = m_Tiles.find(TileKey);
+    if( TileIt != m_Tiles.end() )
+    {
+        // Move the tile to the front of the LRU list
+        m_LRUList.splice(m_LRUList.begin(), m_LRUList, TileIt->second.LRUPos);
+        TileIt->second.iPinCount++;
+        m_Stat.uiNumHits++;
+        const UINT16 *pTileData = &TileIt->second.Data[0];
+        LeaveCriticalSection(&m_cs);
+        return pTileData;
+    }
+    m_Stat.uiNumMisses++;
+    std::vector<UINT16> TileData;
+    if( !m_FreeBuffers.empty() )
+    {
+        TileData.swap(m_FreeBuffers.back());
+        m_FreeBuffers.pop_back();
+    }
+    UINT uiInvalidationCount = m_uiInvalidationCount;
+    LeaveCriticalSection(&m_cs);
+
+    // Load the tile outside the critical section so that other threads
+    // are not blocked while the data is read from the disk
+    HRESULT hr = m_pLoader->LoadTile(TileKey, TileData);
+
+    EnterCriticalSection(&m_cs);
+    if( FAILED(hr) || TileData.empty() )
+    {
+        RecycleBuffer(TileData);
+        LeaveCriticalSection(&m_cs);
+        return NULL;
+    }
+
+    // The tile could have been loaded from the data, which were changed when the tile or the
+    // whole cache was invalidated. It is only given to the caller and is released as the invalidated tile
+    if( uiInvalidationCount != m_uiInvalidationCount )
+    {
+        const UINT16 *pTileData = &TileData[0];
+        STileEntry &DetachedEntry = m_DetachedTiles[pTileData];
+        DetachedEntry.Data.swap(TileData);
+        DetachedEntry.iPinCount = 1;
+        m_Stat.ResidentBytes += DetachedEntry.Data.size() * sizeof(UINT16);
+        m_Stat.PeakResidentBytes = max(m_Stat.PeakResidentBytes, m_Stat.ResidentBytes);
+        LeaveCriticalSection(&m_cs);
+        return pTileData;
+    }
+
+    // The same tile could have been loaded by another thread
+    std::pair<TileMapType::iterator, bool> InsertRes = m_Tiles.insert( std::make_pair(TileKey, STileEntry()) );
+    STileEntry &Entry = InsertRes.first->second;
+    if( InsertRes.second )
+    {
+        Entry.Data.swap(TileData);
+        Entry.iPinCount = 0;
+        m_LRUList.push_front(TileKey);
+        Entry.LRUPos = m_LRUList.begin();
+        m_Stat.ResidentBytes += Entry.Data.size() * sizeof(UINT16);
+    }
+    else
+    {
+        m_LRUList.splice(m_LRUList.begin(), m_LRUList, Entry.LRUPos);
+        RecycleBuffer(TileData);
+    }
+    Entry.iPinCount++;
+    const UINT16 *pTileData = &Entry.Data[0];
+    EvictTiles();
+    m_Stat.PeakResidentBytes = max(m_Stat.PeakResidentBytes, m_Stat.ResidentBytes);
+    LeaveCriticalSection(&m_cs);
+
+    return pTileData;
+}
+
+void CTileCache::ReleaseTile(UINT64 TileKey, const UINT16 *pTileData)
+{
+    EnterCriticalSection(&m_cs);
+    if( pTileData && !m_DetachedTiles.empty() )
+    {
+        DetachedTileMapType::iterator DetachedIt = m_DetachedTiles.find(pTileData);
+        if( DetachedIt != m_DetachedTiles.end() )
+        {
+            if( --DetachedIt->second.iPinCount == 0 )
+            {
+                m_Stat.ResidentBytes -= DetachedIt->second.Data.size() * sizeof(UINT16);
+                RecycleBuffer(DetachedIt->second.Data);
+                m_DetachedTiles.erase(DetachedIt);
+            }
+            LeaveCriticalSection(&m_cs);
+            return;
+        }
+    }
+    TileMapType::iterator TileIt = m_Tiles.find(TileKey);
+    assert( TileIt != m_Tiles.end() && TileIt->second.iPinCount > 0 );
+    if( TileIt != m_Tiles.end() )
+        TileIt->second.iPinCount--;
+    // Tiles pinned while the budget was exceeded are evicted now
+    EvictTiles();
+    LeaveCriticalSection(&m_cs);
+}
+
+bool CTileCache::IsTileResident(UINT64 TileKey)const
+{
+    EnterCriticalSection(&m_cs);
+    bool bResident = m_Tiles.find(TileKey) != m_Tiles.end();
+    LeaveCriticalSection(&m_cs);
+    return bResident;
+}
+
+void CTileCache::InsertTile(UINT64 TileKey, std::vector<UINT16> &TileData)
+{
+    if( TileData.empty() )
+        return;
+
+    EnterCriticalSection(&m_cs);
+    std::pair<TileMapType::iterator, bool> InsertRes = m_Tiles.insert( std::make_pair(TileKey, STileEntry()) );
+    if( InsertRes.second )
+    {
+        STileEntry &Entry = InsertRes.first->second;
+        Entry.Data.swap(TileData);
+        Entry.iPinCount = 0;
+        m_LRUList.push_front(TileKey);
+        Entry.LRUPos = m_LRUList.begin();
+        m_Stat.ResidentBytes += Entry.Data.size() * sizeof(UINT16);
+        // The new tile is at the front of the LRU list, so it is evicted last
+        EvictTiles();
+        m_Stat.PeakResidentBytes = max(m_Stat.PeakResidentBytes, m_Stat.ResidentBytes);
+    }
+    LeaveCriticalSection(&m_cs);
+}
+
+void CTileCache::InvalidateTile(UINT64 TileKey)
+{
+    EnterCriticalSection(&m_cs);
+    TileMapType::iterator TileIt = m_Tiles.find(TileKey);
+    if( TileIt != m_Tiles.end() )
+        RemoveTile(TileIt);
+    // The tile may be being loaded by another thread even if it is not resident
+    m_uiInvalidationCount++;
+    LeaveCriticalSection(&m_cs);
+}
+
+void CTileCache::RemoveTile(TileMapType::iterator TileIt)
+{
+    STileEntry &Entry = TileIt->second;
+    m_LRUList.erase(Entry.LRUPos);
+    if( Entry.iPinCount > 0 )
+    {
+        // The data stay in the same buffer, so the pointers held by the users remain valid
+        STileEntry &DetachedEntry = m_DetachedTiles[&Entry.Data[0]];
+        DetachedEntry.Data.swap(Entry.Data);
+        DetachedEntry.iPinCount = Entry.iPinCount;
+    }
+    else
+    {
+        m_Stat.ResidentBytes -= Entry.Data.size() * sizeof(UINT16);
+        RecycleBuffer(Entry.Data);
+    }
+    m_Tiles.erase(TileIt);
+}
+
+void CTileCache::EvictTiles()
+{
+    std::list<UINT64>::iterator LRUIt = m_LRUList.end();
+    while( m_Stat.ResidentBytes > m_Stat.BudgetBytes && LRUIt != m_LRUList.begin() )
+    {
+        --LRUIt;
+        TileMapType::iterator TileIt = m_Tiles.find(*LRUIt);
+        assert( TileIt != m_Tiles.end() );
+        if( TileIt->second.iPinCount > 0 )
+            continue;
+
+        m_Stat.ResidentBytes -= TileIt->second.Data.size() * sizeof(UINT16);
+        RecycleBuffer(TileIt->second.Data);
+        m_Tiles.erase(TileIt);
+        LRUIt = m_LRUList.erase(LRUIt);
+    }
+}
+
+void CTileCache::RecycleBuffer(std::vector<UINT16> &Buffer)
+{
+    if( m_FreeBuffers.size() < MAX_FREE_BUFFERS && Buffer.capacity() > 0 )
+    {
+        m_FreeBuffers.push_back( std::vector<UINT16>() );
+        m_FreeBuffers.back().swap(Buffer);
+    }
+}
+
+void CTileCache::Clear()
+{
+    EnterCriticalSection(&m_cs);
+    while( !m_Tiles.empty() )
+        RemoveTile(m_Tiles.begin());
+    m_FreeBuffers.clear();
+    m_uiInvalidationCount++;
+    LeaveCriticalSection(&m_cs);
+}
+
+void CTileCache::GetStatistics(SStatistics &Stat)const
+{
+    EnterCriticalSection(&m_cs);
+    Stat = m_Stat;
+    LeaveCriticalSection(&m_cs);
+}
@@ -0,0 +1,409 @@
+// Copyright 2011 Intel Corporation
+// All Rights Reserved
+//
+// Permission is granted to use, copy, distribute and prepare derivative works of this
+// software for any purpose and without fee, provided, that the above copyright notice
+// and this statement appear in all copies.  Intel makes no representations about the
+// suitability of this software for any purpose.  THIS SOFTWARE IS PROVIDED "AS IS."
+// INTEL SPECIFICALLY DISCLAIMS ALL WARRANTIES, EXPRESS OR IMPLIED, AND ALL LIABILITY,
+// INCLUDING CONSEQUENTIAL AND OTHER INDIRECT DAMAGES, FOR THE USE OF THIS SOFTWARE,
+// INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PROPRIETARY RIGHTS, AND INCLUDING THE
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.  Intel does not
+// assume any responsibility for any errors which may appear in this software nor any
+// responsibility to update it.
+#include "stdafx.h"
+
+#include "TilePyramidHeightMap.h"
+
+CTilePyramidHeightMap::CTilePyramidHeightMap() :
+    m_iTileSizeLog2(0),
+    m_hFile(INVALID_HANDLE_VALUE)
+{
+    InitializeCriticalSection(&m_csPendingReads);
+    InitializeCriticalSection(&m_csFailedTiles);
+}
+
+CTilePyramidHeightMap::~CTilePyramidHeightMap()
+{
+    Close();
+    DeleteCriticalSection(&m_csPendingReads);
+    DeleteCriticalSection(&m_csFailedTiles);
+}
+
+void CTilePyramidHeightMap::Close()
+{
+    // Pending reads are cancelled before their buffers are released
+    m_pAsyncReader.reset();
+    m_PendingReads.clear();
+    m_pTileCache.reset();
+    if( m_hFile != INVALID_HANDLE_VALUE )
+        CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    m_Levels.clear();
+    m_FailedTiles.clear();
+    m_iNumCols = m_iNumRows = 0;
+}
+
+// Calculates the dimensions of the pyramid levels
+// Sample i of level k is the sample min(i * 2^k, NumCols-1) of the full resolution height map
+void CTilePyramidHeightMap::InitLevelDescs(UINT32 uiNumCols, UINT32 uiNumRows, int iTileSizeLog2, std::vector<SLevelDesc> &Levels)
+{
+    Levels.clear();
+    UINT32 uiTileSize = 1 << iTileSizeLog2;
+    UINT64 DataOffset = sizeof(SPyramidFileHeader);
+    for(int iLevel = 0; ; iLevel++)
+    {
+        SLevelDesc Level;
+        Level.uiNumCols = ((uiNumCols-1 + (1<<iLevel)-1) >> iLevel) + 1;
+        Level.uiNumRows = ((uiNumRows-1 + (1<<iLevel)-1) >> iLevel) + 1;
+        Level.uiNumTilesX = (Level.uiNumCols + uiTileSize-1) >> iTileSizeLog2;
+        Level.uiNumTilesY = (Level.uiNumRows + uiTileSize-1) >> iTileSizeLog2;
+        Levels.push_back(Level);
+        if( Level.uiNumCols <= uiTileSize && Level.uiNumRows <= uiTileSize )
+            break;
+    }
+
+    DataOffset += Levels.size() * sizeof(SLevelDesc);
+    for(size_t iLevel = 0; iLevel < Levels.size(); iLevel++)
+    {
+        Levels[iLevel].DataOffset = DataOffset;
+        DataOffset += ((UINT64)Levels[iLevel].uiNumTilesX * Levels[iLevel].uiNumTilesY << (2*iTileSizeLog2)) * sizeof(UINT16);
+    }
+}
+
+// Opens the pyramid file
+HRESULT CTilePyramidHeightMap::Open(LPCTSTR strFilePath, size_t TileCacheBudget)
+{
+    Close();
+
+    m_hFile = CreateFile(strFilePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if( m_hFile == INVALID_HANDLE_VALUE )
+        return E_FAIL;
+
+    SPyramidFileHeader Header;
+    DWORD dwBytesRead = 0;
+    if( !ReadFile(m_hFile, &Header, sizeof(Header), &dwBytesRead, NULL) || dwBytesRead != sizeof(Header) ||
+        Header.uiSignature != PYRAMID_FILE_SIGNATURE ||
+        Header.uiVersion != PYRAMID_FILE_VERSION ||
+        Header.uiTileSizeLog2 == 0 || Header.uiTileSizeLog2 > 12 ||
+        Header.uiNumCols == 0 || Header.uiNumRows == 0 )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    std::vector<SLevelDesc> ExpectedLevels;
+    InitLevelDescs(Header.uiNumCols, Header.uiNumRows, Header.uiTileSizeLog2, ExpectedLevels);
+    m_Levels.resize(Header.uiNumLevels);
+    if( Header.uiNumLevels != ExpectedLevels.size() ||
+        !ReadFile(m_hFile, &m_Levels[0], (DWORD)(m_Levels.size()*sizeof(SLevelDesc)), &dwBytesRead, NULL) ||
+        dwBytesRead != m_Levels.size()*sizeof(SLevelDesc) ||
+        memcmp(&m_Levels[0], &ExpectedLevels[0], m_Levels.size()*sizeof(SLevelDesc)) != 0 )
+    {
+        Close();
+        return E_FAIL;
+    }
+
+    m_iNumCols = Header.uiNumCols;
+    m_iNumRows = Header.uiNumRows;
+    m_iTileSizeLog2 = Header.uiTileSizeLog2;
+    m_pTileCache.reset( new CTileCache(this, TileCacheBudget) );
+
+    // If the file can not be opened for the asynchronous reads, tiles
+    // are only loaded on cache misses
+    m_pAsyncReader.reset( new CAsyncFileReader );
+    if( FAILED(m_pAsyncReader->Open(strFilePath)) )
+        m_pAsyncReader.reset();
+
+    return S_OK;
+}
+
+// Returns offset of the tile in the pyramid file
+UINT64 CTilePyramidHeightMap::GetTileOffset(UINT64 TileKey)const
+{
+    int iLevel = (int)(TileKey >> 56);
+    int iTileY = (int)((TileKey >> 28) & 0x0FFFFFFF);
+    int iTileX = (int)(TileKey & 0x0FFFFFFF);
+    const SLevelDesc &Level = m_Levels[iLevel];
+    assert( iTileX < (int)Level.uiNumTilesX && iTileY < (int)Level.uiNumTilesY );
+    return Level.DataOffset + (((UINT64)iTileX + (UINT64)iTileY * Level.uiNumTilesX) << (2*m_iTileSizeLog2)) * sizeof(UINT16);
+}
+
+// Loads the tile from the file. The method is called by the tile cache
+// on the thread that requested the data
+HRESULT CTilePyramidHeightMap::LoadTile(UINT64 TileKey, std::vector<UINT16> &TileData)
+{
+    size_t TileSamples = (size_t)1 << (2*m_iTileSizeLog2);
+    TileData.resize(TileSamples);
+
+    // Positional read does not use the shared file pointer, so several
+    // threads can read tiles simultaneously
+    UINT64 Offset = GetTileOffset(TileKey);
+    OVERLAPPED Overlapped;
+    memset(&Overlapped, 0, sizeof(Overlapped));
+    Overlapped.Offset = (DWORD)(Offset & 0xFFFFFFFF);
+    Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    DWORD dwBytesRead = 0;
+    if( !ReadFile(m_hFile, &TileData[0], (DWORD)(TileSamples * sizeof(UINT16)), &dwBytesRead, &Overlapped) ||
+        dwBytesRead != TileSamples * sizeof(UINT16) )
+    {
+        DWORD dwError = GetLastError();
+        TileData.clear();
+        // The tile is requested again on every cache miss, so the error is only reported once
+        EnterCriticalSection(&m_csFailedTiles);
+        bool bFirstFailure = m_FailedTiles.insert(TileKey).second;
+        LeaveCriticalSection(&m_csFailedTiles);
+        if( bFirstFailure )
+            LOG_ERROR(_T("Failed to read tile (%d,%d) of level %d of the tile pyramid: %d of %d bytes read, error %u"),
+                      (int)(TileKey & 0x0FFFFFFF), (int)((TileKey >> 28) & 0x0FFFFFFF), (int)(TileKey >> 56),
+                      (int)dwBytesRead, (int)(TileSamples * sizeof(UINT16)), dwError);
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+// Returns the pyramid level containing the samples requested with the step
+int CTilePyramidHeightMap::GetLevelForStep(int iStep)const
+{
+    // The data source always requests power of 2 steps, so all requested samples
+    // are present in the pyramid level 2^iLevel == iStep
+    assert( (iStep & (iStep-1)) == 0 );
+    int iLevel = 0;
+    while( (2 << iLevel) <= iStep && iLevel+1 < (int)m_Levels.size() )
+        iLevel++;
+    return iLevel;
+}
+
+// Starts asynchronous reads of the tiles covering the region, which are neither resident
+// nor being read. Returns true if all the tiles are resident
+bool CTilePyramidHeightMap::PrefetchRegion(int iStartCol, int iEndCol,
+                                           int iStartRow, int iEndRow,
+                                           int iStep)const
+{
+    // Without the asynchronous reader tiles are loaded on demand
+    if( !m_pAsyncReader.get() || iStartCol >= iEndCol || iStartRow >= iEndRow )
+        return true;
+
+    int iLevel = GetLevelForStep(iStep);
+    const SLevelDesc &Level = m_Levels[iLevel];
+    // Level sample indices are monotonic, so the tiles are bounded by the first and the last ones
+    int iStartTileX = GetLevelSampleIndex(iStartCol,  iStep, iLevel, m_iNumCols, Level.uiNumCols) >> m_iTileSizeLog2;
+    int iEndTileX   = GetLevelSampleIndex(iEndCol-1,  iStep, iLevel, m_iNumCols, Level.uiNumCols) >> m_iTileSizeLog2;
+    int iStartTileY = GetLevelSampleIndex(iStartRow,  iStep, iLevel, m_iNumRows, Level.uiNumRows) >> m_iTileSizeLog2;
+    int iEndTileY   = GetLevelSampleIndex(iEndRow-1,  iStep, iLevel, m_iNumRows, Level.uiNumRows) >> m_iTileSizeLog2;
+
+    bool bResident = true;
+    size_t TileSamples = (size_t)1 << (2*m_iTileSizeLog2);
+    EnterCriticalSection(&m_csPendingReads);
+    for(int iTileY = iStartTileY; iTileY <= iEndTileY; iTileY++)
+        for(int iTileX = iStartTileX; iTileX <= iEndTileX; iTileX++)
+        {
+            UINT64 TileKey = GetTileKey(iLevel, iTileX, iTileY);
+            if( m_pTileCache->IsTileResident(TileKey) )
+                continue;
+            if( m_PendingReads.find(TileKey) != m_PendingReads.end() )
+            {
+                bResident = false;
+                continue;
+            }
+
+            std::vector<UINT16> &TileData = m_PendingReads[TileKey];
+            TileData.resize(TileSamples);
+            HRESULT hr = m_pAsyncReader->BeginRead(GetTileOffset(TileKey), &TileData[0], (DWORD)(TileSamples * sizeof(UINT16)), TileKey);
+            if( FAILED(hr) )
+                m_PendingReads.erase(TileKey);
+            // If too many reads are in flight, the tile is requested again later. If the
+            // read failed to start, the tile is loaded synchronously on the cache miss
+            if( SUCCEEDED(hr) || hr == E_PENDING )
+                bResident = false;
+        }
+    LeaveCriticalSection(&m_csPendingReads);
+
+    return bResident;
+}
+
+// Inserts tiles of the completed asynchronous reads into the cache
+void CTilePyramidHeightMap::ProcessAsyncReads()
+{
+    if( m_pAsyncReader.get() )
+        m_pAsyncReader->ProcessCompletedReads(this);
+}
+
+void CTilePyramidHeightMap::OnReadCompleted(UINT64 TileKey, HRESULT hr)
+{
+    EnterCriticalSection(&m_csPendingReads);
+    PendingReadsMapType::iterator ReadIt = m_PendingReads.find(TileKey);
+    assert( ReadIt != m_PendingReads.end() );
+    if( ReadIt != m_PendingReads.end() )
+    {
+        // Failed tiles are not inserted, so they are loaded synchronously on the cache miss
+        if( SUCCEEDED(hr) )
+            m_pTileCache->InsertTile(TileKey, ReadIt->second);
+        m_PendingReads.erase(ReadIt);
+    }
+    LeaveCriticalSection(&m_csPendingReads);
+}
+
+void CTilePyramidHeightMap::FillHeightMap(UINT16 *pDataPtr,
+                                          size_t DataPitch,
+                                          int iStartCol, int iEndCol,
+                                          int iStartRow, int iEndRow,
+                                          int iStep)const
+{
+    int iLevel = GetLevelForStep(iStep);
+    const SLevelDesc &Level = m_Levels[iLevel];
+
+    // Calculate level sample indices for all columns and rows
+    int iNumCols = iEndCol - iStartCol;
+    int iNumRows = iEndRow - iStartRow;
+    std::vector<int> SrcCols(iNumCols), SrcRows(iNumRows);
+    for(int iCol = 0; iCol < iNumCols; iCol++)
+        SrcCols[iCol] = GetLevelSampleIndex(iStartCol + iCol, iStep, iLevel, m_iNumCols, Level.uiNumCols);
+    for(int iRow = 0; iRow < iNumRows; iRow++)
+        SrcRows[iRow] = GetLevelSampleIndex(iStartRow + iRow, iStep, iLevel, m_iNumRows, Level.uiNumRows);
+
+    // Source indices are monotonic, so the requested region is split into
+    // rectangular parts each covered by a single tile
+    int iTileMask = (1 << m_iTileSizeLog2) - 1;
+    for(int iRowStart = 0; iRowStart < iNumRows; )
+    {
+        int iTileY = SrcRows[iRowStart] >> m_iTileSizeLog2;
+        int iRowEnd = iRowStart + 1;
+        while( iRowEnd < iNumRows && (SrcRows[iRowEnd] >> m_iTileSizeLog2) == iTileY )
+            iRowEnd++;
+
+        for(int iColStart = 0; iColStart < iNumCols; )
+        {
+            int iTileX = SrcCols[iColStart] >> m_iTileSizeLog2;
+            int iColEnd = iColStart + 1;
+            while( iColEnd < iNumCols && (SrcCols[iColEnd] >> m_iTileSizeLog2) == iTileX )
+                iColEnd++;
+
+            UINT64 TileKey = GetTileKey(iLevel, iTileX, iTileY);
+            const UINT16 *pTileData = m_pTileCache->AcquireTile(TileKey);
+            for(int iRow = iRowStart; iRow < iRowEnd; iRow++)
+            {
+                UINT16 *pDstRow = pDataPtr + iRow * DataPitch;
+                if( pTileData )
+                {
+                    const UINT16 *pSrcRow = pTileData + ((SrcRows[iRow] & iTileMask) << m_iTileSizeLog2);
+                    for(int iCol = iColStart; iCol < iColEnd; iCol++)
+                        pDstRow[iCol] = pSrcRow[SrcCols[iCol] & iTileMask];
+                }
+                else
+                {
+                    // The tile failed to load. The error is reported by LoadTile()
+                    for(int iCol = iColStart; iCol < iColEnd; iCol++)
+                        pDstRow[iCol] = 0;
+                }
+            }
+            if( pTileData )
+                m_pTileCache->ReleaseTile(TileKey);
+
+            iColStart = iColEnd;
+        }
+        iRowStart = iRowEnd;
+    }
+}
+
+void CTilePyramidHeightMap::GatherSampleQuads(const int *pCols, const int *pRows, int iNumQuads, int iStep, UINT16 *pQuads)const
+{
+    int iLevel = GetLevelForStep(iStep);
+    const SLevelDesc &Level = m_Levels[iLevel];
+    int iTileMask = (1 << m_iTileSizeLog2) - 1;
+    // Nearby queries usually hit the same tile, so the last acquired tile is kept pinned
+    UINT64 CurrTileKey = 0;
+    const UINT16 *pCurrTileData = NULL;
+    for(int iQuad = 0; iQuad < iNumQuads; iQuad++)
+    {
+        int iSrcCols[2], iSrcRows[2];
+        for(int i = 0; i < 2; i++)
+        {
+            iSrcCols[i] = GetLevelSampleIndex(pCols[iQuad]+i, iStep, iLevel, m_iNumCols, Level.uiNumCols);
+            iSrcRows[i] = GetLevelSampleIndex(pRows[iQuad]+i, iStep, iLevel, m_iNumRows, Level.uiNumRows);
+        }
+        for(int iCorner = 0; iCorner < 4; iCorner++)
+        {
+            int iSrcCol = iSrcCols[iCorner & 1], iSrcRow = iSrcRows[iCorner >> 1];
+            UINT64 TileKey = GetTileKey(iLevel, iSrcCol >> m_iTileSizeLog2, iSrcRow >> m_iTileSizeLog2);
+            if( !pCurrTileData || TileKey != CurrTileKey )
+            {
+                if( pCurrTileData )
+                    m_pTileCache->ReleaseTile(CurrTileKey);
+                CurrTileKey = TileKey;
+                pCurrTileData = m_pTileCache->AcquireTile(TileKey);
+            }
+            pQuads[4*iQuad + iCorner] = pCurrTileData ? pCurrTileData[((iSrcRow & iTileMask) << m_iTileSizeLog2) + (iSrcCol & iTileMask)] : 0;
+        }
+    }
+    if( pCurrTileData )
+        m_pTileCache->ReleaseTile(CurrTileKey);
+}
+
+bool CTilePyramidHeightMap::HasReadErrors()const
+{
+    EnterCriticalSection(&m_csFailedTiles);
+    bool bHasReadErrors = !m_FailedTiles.empty();
+    LeaveCriticalSection(&m_csFailedTiles);
+    return bHasReadErrors;
+}
+
+bool CTilePyramidHeightMap::GetTileCacheStatistics(CTileCache::SStatistics &Stat)const
+{
+    if( !m_pTileCache.get() )
+        return false;
+    m_pTileCache->GetStatistics(Stat);
+    return true;
+}
+
+// Builds the pyramid file from the height map
+HRESULT CTilePyramidHeightMap::CreatePyramidFile(LPCTSTR strFilePath,
+                                                 const CHeightMapStore &SrcHeightMap,
+                                                 int iTileSize)
+{
+    if( iTileSize <= 0 || (iTileSize & (iTileSize-1)) )
+        return E_INVALIDARG;
+
+    SPyramidFileHeader Header;
+    memset(&Header, 0, sizeof(Header));
+    Header.uiSignature = PYRAMID_FILE_SIGNATURE;
+    Header.uiVersion = PYRAMID_FILE_VERSION;
+    Header.uiNumCols = SrcHeightMap.GetNumCols();
+    Header.uiNumRows = SrcHeightMap.GetNumRows();
+    while( (1 << Header.uiTileSizeLog2) < iTileSize )
+        Header.uiTileSizeLog2++;
+    std::vector<SLevelDesc> Levels;
+    InitLevelDescs(Header.uiNumCols, Header.uiNumRows, Header.uiTileSizeLog2, Levels);
+    Header.uiNumLevels = (UINT32)Levels.size();
+
+    FILE *pFile = NULL;
+    if( _tfopen_s( &pFile, strFilePath, _T("wb") ) != 0 )
+        return E_FAIL;
+
+    HRESULT hr = S_OK;
+    if( fwrite(&Header, sizeof(Header), 1, pFile) != 1 ||
+        fwrite(&Levels[0], sizeof(SLevelDesc) * Levels.size(), 1, pFile) != 1 )
+        hr = E_FAIL;
+
+    // Tiles crossing the level boundary are filled by clamping to the last row/column
+    std::vector<UINT16> TileData( iTileSize*iTileSize );
+    for(UINT iLevel = 0; iLevel < Levels.size() && SUCCEEDED(hr); iLevel++)
+    {
+        const SLevelDesc &Level = Levels[iLevel];
+        for(UINT iTileY = 0; iTileY < Level.uiNumTilesY && SUCCEEDED(hr); iTileY++)
+            for(UINT iTileX = 0; iTileX < Level.uiNumTilesX && SUCCEEDED(hr); iTileX++)
+            {
+                SrcHeightMap.FillHeightMap(&TileData[0], iTileSize,
+                                           iTileX*iTileSize, (iTileX+1)*iTileSize,
+                                           iTileY*iTileSize, (iTileY+1)*iTileSize,
+                                           1 << iLevel);
+                if( fwrite(&TileData[0], TileData.size() * sizeof(UINT16), 1, pFile) != 1 )
+                    hr = E_FAIL;
+            }
+    }
+
+    fclose(pFile);
+
+    return hr;
+}
@@ -15,10 +15,14 @@
 #include "TriangDataSource.h"
 #include "RQTTriangulation.h"
 #include "ElevationDataSource.h"
+#include "HeightMapKernels.h"
+#include "ElevMinMaxPyramid.h"
 
 CTriangDataSource::CTriangDataSource(void) :
     m_iNumLevelsInHierarchy(0), 
-    m_iNumLevelsInPatchQuadTree(0)
+    m_iNumLevelsInPatchQuadTree(0),
+    m_iNumRootNodesHorz(1),
+    m_iNumRootNodesVert(1)
 {
 }
 
@@ -27,7 +31,8 @@ CTriangDataSource::~CTriangDataSource(void)
 }
 
 // Init empty triangulation data source object
-void CTriangDataSource::Init(int iNumLevelsInHierarchy, int iPatchSize, float fFinestLevelTriangErrorThreshold)
+void CTriangDataSource::Init(int iNumLevelsInHierarchy, int iPatchSize, float fFinestLevelTriangErrorThreshold,
+                             int iNumRootNodesHorz/* = 1*/, int iNumRootNodesVert/* = 1*/)
 {
     if( iPatchSize & (iPatchSize-1) )
     {
@@ -36,16 +41,18 @@ void CTriangDataSource::Init(int iNumLevelsInHierarchy, int iPatchSize, float fF
     }
 
     m_iNumLevelsInHierarchy = iNumLevelsInHierarchy;
+    m_iNumRootNodesHorz = iNumRootNodesHorz;
+    m_iNumRootNodesVert = iNumRootNodesVert;
     m_fFinestLevelTriangErrorThreshold = fFinestLevelTriangErrorThreshold;
 
     m_iNumLevelsInPatchQuadTree = 0;
     while( (1 << (m_iNumLevelsInPatchQuadTree-1)) < iPatchSize)
         m_iNumLevelsInPatchQuadTree++;
 
-    m_AdaptiveTriangInfo.Resize( m_iNumLevelsInHierarchy );
+    m_AdaptiveTriangInfo.Resize( m_iNumLevelsInHierarchy, m_iNumRootNodesHorz, m_iNumRootNodesVert );
 
 	// todo: check if this loop is redundant
-    for( HierarchyIterator it(m_iNumLevelsInHierarchy); it.IsValid(); it.Next() )
+    for( HierarchyIterator it(m_iNumLevelsInHierarchy, m_iNumRootNodesHorz, m_iNumRootNodesVert); it.IsValid(); it.Next() )
     {
         m_AdaptiveTriangInfo[it].fTriangulationErrorBound = 0;
     }
@@ -113,8 +120,10 @@ HRESULT CTriangDataSource::SaveToFile(LPCTSTR FilePath)
     fwrite(&m_iNumLevelsInHierarchy, sizeof(m_iNumLevelsInHierarchy), 1, pFile);
     fwrite(&m_iNumLevelsInPatchQuadTree, sizeof(m_iNumLevelsInPatchQuadTree), 1, pFile);
     fwrite(&m_fFinestLevelTriangErrorThreshold, sizeof(m_fFinestLevelTriangErrorThreshold), 1, pFile);
+    fwrite(&m_iNumRootNodesHorz, sizeof(m_iNumRootNodesHorz), 1, pFile);
+    fwrite(&m_iNumRootNodesVert, sizeof(m_iNumRootNodesVert), 1, pFile);
 
-    for( HierarchyIterator it(m_iNumLevelsInHierarchy); it.IsValid(); it.Next() )
+    for( HierarchyIterator it(m_iNumLevelsInHierarchy, m_iNumRootNodesHorz, m_iNumRootNodesVert); it.IsValid(); it.Next() )
     {
         fwrite(&m_AdaptiveTriangInfo[it].fTriangulationErrorBound, sizeof(float), 1, pFile);
         if( it.Level() > 0 )
@@ -160,9 +169,20 @@ HRESULT CTriangDataSource::LoadFromFile(LPCTSTR FilePath)
         CHECK_HR_RET(E_FAIL, _T("Failed to read num Finest Level Triang Error Threshold") );
     }
 
-    Init(iNumLevelsInHierarchy, 1 << (iNumLevelsInPatchQuadTree-1), fFinestLevelTriangErrorThreshold);
+    // Files written before the forest layout was introduced store the root error bound
+    // here, which never passes the check
+    int iNumRootNodes[2];
+    ItemsRead = fread(iNumRootNodes, sizeof(int), 2, pFile);
+    if( ItemsRead != 2 || iNumRootNodes[0] < 1 || iNumRootNodes[1] < 1 || 
+        iNumRootNodes[0] > MAX_ROOT_NODES || iNumRootNodes[1] > MAX_ROOT_NODES )
+    {
+        fclose(pFile);
+        CHECK_HR_RET(E_FAIL, _T("Failed to read number of root nodes") );
+    }
+
+    Init(iNumLevelsInHierarchy, 1 << (iNumLevelsInPatchQuadTree-1), fFinestLevelTriangErrorThreshold, iNumRootNodes[0], iNumRootNodes[1]);
 
-    for( HierarchyIterator it(m_iNumLevelsInHierarchy); it.IsValid(); it.Next() )
+    for( HierarchyIterator it(m_iNumLevelsInHierarchy, m_iNumRootNodesHorz, m_iNumRootNodesVert); it.IsValid(); it.Next() )
     {
         ItemsRead = fread(&m_AdaptiveTriangInfo[it].fTriangulationErrorBound, sizeof(float), 1, pFile);
         if( ItemsRead != 1 )
@@ -195,9 +215,10 @@ size_t CTriangDataSource::GetEncodedTriangulationsSize(const struct SQuadTreeNod
 // This function calculates maximum world space error of the triangle specified by
 // puiTriangleVertPackedIndices[]
 // It goes through all height map samples covered by the triangle and
-// calculates maximum vertical distance from the sample to the triangle surface
+// calculates maximum vertical distance from the sample to the triangle surface.
+// This is the reference implementation, which CalculateTriangleMaxError() kernel is verified against
 static
-float GetTriangleWorldSpaceError(UINT puiTriangleVertPackedIndices[3],
+float GetTriangleWorldSpaceErrorReference(UINT puiTriangleVertPackedIndices[3],
                                  const UINT16 *pElevData,  size_t ElevDataPitch,
                                  int iPackedIndicesBoundaryExtension,
                                  float fErrorThreshold = +FLT_MAX)
@@ -395,6 +416,76 @@ float GetTriangleWorldSpaceError(UINT puiTriangleVertPackedIndices[3],
     return fMaxError;
 }
 
+// This function calculates maximum world space error of the triangle specified by
+// puiTriangleVertPackedIndices[] with the height map kernel
+static
+float GetTriangleWorldSpaceError(UINT puiTriangleVertPackedIndices[3],
+                                 const UINT16 *pElevData,  size_t ElevDataPitch,
+                                 int iPackedIndicesBoundaryExtension,
+                                 float fErrorThreshold = +FLT_MAX)
+{
+    int piVertCols[3], piVertRows[3];
+    for(int iVert=0; iVert < 3; iVert++)
+        UnpackIndices(puiTriangleVertPackedIndices[iVert], piVertCols[iVert], piVertRows[iVert], iPackedIndicesBoundaryExtension);
+
+    // Degenerate and zero-area triangles can't cover any vertices, so return 0
+    int iDoubledArea = (piVertCols[1] - piVertCols[0]) * (piVertRows[2] - piVertRows[0]) -
+                       (piVertRows[1] - piVertRows[0]) * (piVertCols[2] - piVertCols[0]);
+    if( iDoubledArea == 0 )
+        return 0.f;
+
+    float fMaxError = CalculateTriangleMaxError(pElevData, ElevDataPitch, piVertCols, piVertRows, fErrorThreshold);
+#ifdef _DEBUG
+    // The kernel must visit the same samples and return exactly the same error as the reference implementation,
+    // otherwise the triangulations would change
+    assert( fMaxError == GetTriangleWorldSpaceErrorReference(puiTriangleVertPackedIndices, pElevData, ElevDataPitch, iPackedIndicesBoundaryExtension, fErrorThreshold) );
+#endif
+    return fMaxError;
+}
+
+// Returns true if the world space error of the triangle is not less than the threshold.
+// The error is bounded with the min/max pyramid first, and the samples covered by the
+// triangle are only tested if the bound does not allow to make the decision
+static
+bool IsTriangleErrorThresholdExceeded(UINT puiTriangleVertPackedIndices[3],
+                                      const UINT16 *pElevData,  size_t ElevDataPitch,
+                                      int iPackedIndicesBoundaryExtension,
+                                      const CElevMinMaxPyramid &MinMaxPyramid,
+                                      float fErrorThreshold)
+{
+    int piVertCols[3], piVertRows[3];
+    for(int iVert=0; iVert < 3; iVert++)
+        UnpackIndices(puiTriangleVertPackedIndices[iVert], piVertCols[iVert], piVertRows[iVert], iPackedIndicesBoundaryExtension);
+
+    bool bThresholdExceeded;
+    if( MinMaxPyramid.CompareTriangleErrorWithThreshold(piVertCols, piVertRows, fErrorThreshold, bThresholdExceeded) )
+    {
+#ifdef _DEBUG
+        // The bound must never change the decision
+        assert( bThresholdExceeded == (GetTriangleWorldSpaceErrorReference(puiTriangleVertPackedIndices, pElevData, ElevDataPitch, iPackedIndicesBoundaryExtension) >= fErrorThreshold) );
+#endif
+        return bThresholdExceeded;
+    }
+
+    return GetTriangleWorldSpaceError(puiTriangleVertPackedIndices, pElevData, ElevDataPitch,
+                                      iPackedIndicesBoundaryExtension, fErrorThreshold) >= fErrorThreshold;
+}
+
+// Returns true if the vertex of the child patch, which is located at the vertex (iX, iY) of the patch,
+// is disabled. Child patch samples are the samples of the patch and the ones between them, so the child
+// tested the vertex with the triangles covering the same area as the triangles of the patch vertex. The
+// errors of the patch triangles can not be greater than the errors of the child triangles, which are
+// below the child bound if the vertex is disabled
+static inline
+bool IsChildVertexDisabled(const CRQTVertsEnabledFlags *pChildEnabledFlags[4],
+                           int iPatchSize,
+                           int iX, int iY,
+                           int iChildCol, int iChildRow)
+{
+    const CRQTVertsEnabledFlags *pEnabledFlags = pChildEnabledFlags[iChildCol + iChildRow*2];
+    return pEnabledFlags && !pEnabledFlags->IsVertexEnabled(iX*2 - iChildCol*iPatchSize, iY*2 - iChildRow*iPatchSize);
+}
+
 // This function calculates maximum world space error of the triangulation specified by
 // puiIndices[]. It goes through all triangles and determines maximum world space error
 static
@@ -436,10 +527,10 @@ float CalculateTriangulationError(UINT *puiIndices,
 
 // Builds adaptive triangulation for the specified patch
 CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatchElevationData *pElevData,
-                                                      class CRQTTriangulation* /* pLBChildTriangulation */,
-                                                      class CRQTTriangulation* /* pRBChildTriangulation */,
-                                                      class CRQTTriangulation* /* pLTChildTriangulation */,
-                                                      class CRQTTriangulation* /* pRTChildTriangulation */,
+                                                      class CRQTTriangulation* pLBChildTriangulation,
+                                                      class CRQTTriangulation* pRBChildTriangulation,
+                                                      class CRQTTriangulation* pLTChildTriangulation,
+                                                      class CRQTTriangulation* pRTChildTriangulation,
                                                       float fTriangulationErrorThreshold,
                                                       float &fTriangulationError,
                                                       UINT &uiNumTriangles)
@@ -457,11 +548,35 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
     const UINT16 *ElevData;
     size_t ElevDataPitch;
     pElevData->GetDataPtr( ElevData, ElevDataPitch, 0, 0, 1, 1);
+
+    // Most triangles are classified by the error bound without visiting their samples
+    CElevMinMaxPyramid MinMaxPyramid(ElevData, ElevDataPitch, iPatchSize);
+
+    // Samples of the lossy height maps differ from the source ones, so the errors of the same triangle
+    // calculated from the patch and the child samples may differ by twice the reconstruction errors.
+    // The margin covers the rounding of the errors calculated from the different samples
+    float fMaxReconstructionError = pElevData->GetMaxReconstructionError();
+    if( fMaxReconstructionError > 0 )
+        fMaxReconstructionError += 0.25f;
+    // Children are triangulated with lower thresholds. Triangles of the vertices disabled in the child
+    // need not be tested if the child bound is not greater than the threshold
+    CRQTTriangulation *pChildTriangulations[4] = {pLBChildTriangulation, pRBChildTriangulation, pLTChildTriangulation, pRTChildTriangulation};
+    const CRQTVertsEnabledFlags *pChildEnabledFlags[4];
+    int iHalfPatchSize = iPatchSize/2;
+    for(int iChild = 0; iChild < 4; iChild++)
+    {
+        const CRQTTriangulation *pChildTriang = pChildTriangulations[iChild];
+        bool bUseChild = pChildTriang && pChildTriang->m_EnabledFlags.GetPatchSize() == iPatchSize &&
+                         pChildTriang->m_fDisabledVertsErrorBound + 2.f*fMaxReconstructionError <= fTriangulationErrorThreshold;
+        pChildEnabledFlags[iChild] = bUseChild ? &pChildTriang->m_EnabledFlags : NULL;
+    }
     
     for(int iLevel = iNumLevelsInLocalPatchQT-1; iLevel > 0; iLevel--)
     {
         int iLevelStep = 1 << ((iNumLevelsInLocalPatchQT-1) - iLevel);
         int iNextFinerLevelStep = iLevelStep/2;
+        // Triangles of the coarsest level cross the boundaries between the children
+        bool bUseChildren = iLevelStep*4 <= iPatchSize;
 
         //process non-center vertices on even rows
         for(int iY = 0; iY <= iPatchSize; iY += iLevelStep*2 )
@@ -488,13 +603,13 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
                         CalculatePackedIndex(iX+iLevelStep, iY, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                         CalculatePackedIndex(iX, iY+iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension)
                     };
-                    float fCurrTriangleWorldSpaceError =
-                        GetTriangleWorldSpaceError(puiTriangleVertPackedIndices,
-                                                   &ElevData[0], ElevDataPitch,
-                                                   iPackedIndicesBoundaryExtension,
-                                                   fTriangulationErrorThreshold);
                     // If the threshold is exceeded, enable vertex
-                    if( fCurrTriangleWorldSpaceError >= fTriangulationErrorThreshold )
+                    if( !(bUseChildren && IsChildVertexDisabled(pChildEnabledFlags, iPatchSize, iX, iY, iX > iHalfPatchSize, iY >= iHalfPatchSize)) &&
+                        IsTriangleErrorThresholdExceeded(puiTriangleVertPackedIndices,
+                                                         &ElevData[0], ElevDataPitch,
+                                                         iPackedIndicesBoundaryExtension,
+                                                         MinMaxPyramid,
+                                                         fTriangulationErrorThreshold) )
                         bEnableVertex = true;
                 }   
                 
@@ -506,13 +621,13 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
                         CalculatePackedIndex(iX, iY-iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                         CalculatePackedIndex(iX+iLevelStep, iY, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension)
                     };
-                    float fCurrTriangleWorldSpaceError =
-                        GetTriangleWorldSpaceError(puiTriangleVertPackedIndices,
-                                                   &ElevData[0], ElevDataPitch,
-                                                   iPackedIndicesBoundaryExtension,
-                                                   fTriangulationErrorThreshold);
                     // If the threshold is exceeded, enable vertex
-                    if( fCurrTriangleWorldSpaceError >= fTriangulationErrorThreshold )
+                    if( !(bUseChildren && IsChildVertexDisabled(pChildEnabledFlags, iPatchSize, iX, iY, iX > iHalfPatchSize, iY > iHalfPatchSize)) &&
+                        IsTriangleErrorThresholdExceeded(puiTriangleVertPackedIndices,
+                                                         &ElevData[0], ElevDataPitch,
+                                                         iPackedIndicesBoundaryExtension,
+                                                         MinMaxPyramid,
+                                                         fTriangulationErrorThreshold) )
                         bEnableVertex = true;
                 }   
 
@@ -544,13 +659,13 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
                         CalculatePackedIndex(iX, iY+iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                         CalculatePackedIndex(iX+iLevelStep, iY, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension)
                     };
-                    float fCurrTriangleWorldSpaceError =
-                        GetTriangleWorldSpaceError(puiTriangleVertPackedIndices,
-                                                   &ElevData[0], ElevDataPitch,
-                                                   iPackedIndicesBoundaryExtension,
-                                                   fTriangulationErrorThreshold);
                     // If the threshold is exceeded, enable vertex
-                    if( fCurrTriangleWorldSpaceError >= fTriangulationErrorThreshold )
+                    if( !(bUseChildren && IsChildVertexDisabled(pChildEnabledFlags, iPatchSize, iX, iY, iX >= iHalfPatchSize, iY > iHalfPatchSize)) &&
+                        IsTriangleErrorThresholdExceeded(puiTriangleVertPackedIndices,
+                                                         &ElevData[0], ElevDataPitch,
+                                                         iPackedIndicesBoundaryExtension,
+                                                         MinMaxPyramid,
+                                                         fTriangulationErrorThreshold) )
                         bEnableVertex = true;
                 }   
                 
@@ -562,13 +677,13 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
                         CalculatePackedIndex(iX, iY+iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                         CalculatePackedIndex(iX-iLevelStep, iY, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension)
                     };
-                    float fCurrTriangleWorldSpaceError =
-                        GetTriangleWorldSpaceError(puiTriangleVertPackedIndices,
-                                                   &ElevData[0], ElevDataPitch,
-                                                   iPackedIndicesBoundaryExtension,
-                                                   fTriangulationErrorThreshold);
                     // If the threshold is exceeded, enable vertex
-                    if( fCurrTriangleWorldSpaceError >= fTriangulationErrorThreshold )
+                    if( !(bUseChildren && IsChildVertexDisabled(pChildEnabledFlags, iPatchSize, iX, iY, iX > iHalfPatchSize, iY > iHalfPatchSize)) &&
+                        IsTriangleErrorThresholdExceeded(puiTriangleVertPackedIndices,
+                                                         &ElevData[0], ElevDataPitch,
+                                                         iPackedIndicesBoundaryExtension,
+                                                         MinMaxPyramid,
+                                                         fTriangulationErrorThreshold) )
                         bEnableVertex = true;
                 }   
 
@@ -590,6 +705,13 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
                 bool bLTtoRBOrientation = ( (((iX-iLevelStep) / (2*iLevelStep)) & 0x01) +
                                             (((iY-iLevelStep) / (2*iLevelStep)) & 0x01) ) & 0x01 ? true : false;
 
+                // The diagonal is chosen by the vertex position, so at the level with the step of the quarter
+                // of the patch, the vertices of the RB and LT children are tested with the other triangles
+                int iChildCol = iX > iHalfPatchSize ? 1 : 0, iChildRow = iY > iHalfPatchSize ? 1 : 0;
+                bool bChildTrianglesKnown = bUseChildren &&
+                                            !(iLevelStep*4 == iPatchSize && iChildCol != iChildRow) &&
+                                            IsChildVertexDisabled(pChildEnabledFlags, iPatchSize, iX, iY, iChildCol, iChildRow);
+
                 if( !bEnableVertex )
                 {
                     UINT puiTriangleVertPackedIndices[6] = 
@@ -602,13 +724,13 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
                         CalculatePackedIndex(iX+iLevelStep, iY-iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                         CalculatePackedIndex(iX-iLevelStep, iY-iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                     };
-                    float fCurrTriangleWorldSpaceError =
-                        GetTriangleWorldSpaceError(puiTriangleVertPackedIndices + (bLTtoRBOrientation ? 3 : 0),
-                                                   &ElevData[0], ElevDataPitch,
-                                                   iPackedIndicesBoundaryExtension,
-                                                   fTriangulationErrorThreshold);
                     // If the threshold is exceeded, enable vertex
-                    if( fCurrTriangleWorldSpaceError >= fTriangulationErrorThreshold )
+                    if( !bChildTrianglesKnown &&
+                        IsTriangleErrorThresholdExceeded(puiTriangleVertPackedIndices + (bLTtoRBOrientation ? 3 : 0),
+                                                         &ElevData[0], ElevDataPitch,
+                                                         iPackedIndicesBoundaryExtension,
+                                                         MinMaxPyramid,
+                                                         fTriangulationErrorThreshold) )
                         bEnableVertex = true;
                 }   
                 
@@ -624,13 +746,13 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
                         CalculatePackedIndex(iX+iLevelStep, iY-iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                         CalculatePackedIndex(iX+iLevelStep, iY+iLevelStep, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension),
                     };
-                    float fCurrTriangleWorldSpaceError =
-                        GetTriangleWorldSpaceError(puiTriangleVertPackedIndices + (bLTtoRBOrientation ? 3 : 0),
-                                                   &ElevData[0], ElevDataPitch,
-                                                   iPackedIndicesBoundaryExtension,
-                                                   fTriangulationErrorThreshold);
                     // If the threshold is exceeded, enable vertex
-                    if( fCurrTriangleWorldSpaceError >= fTriangulationErrorThreshold )
+                    if( !bChildTrianglesKnown &&
+                        IsTriangleErrorThresholdExceeded(puiTriangleVertPackedIndices + (bLTtoRBOrientation ? 3 : 0),
+                                                         &ElevData[0], ElevDataPitch,
+                                                         iPackedIndicesBoundaryExtension,
+                                                         MinMaxPyramid,
+                                                         fTriangulationErrorThreshold) )
                         bEnableVertex = true;
                 }   
 
@@ -643,6 +765,8 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
     pElevData->GetPos(pos);
 
     CRQTTriangulation *pRQTAdaptiveTriang = new CRQTTriangulation(pos, EnabledFlags, m_iNumLevelsInHierarchy );
+    // Errors of the triangles of the disabled vertices are below the threshold
+    pRQTAdaptiveTriang->m_fDisabledVertsErrorBound = fTriangulationErrorThreshold + 2.f*fMaxReconstructionError;
 
     // Calculate the whole triangulation error
     std::vector<UINT> WorkIndexBuffer;
@@ -660,3 +784,226 @@ CRQTTriangulation* CTriangDataSource :: CreateAdaptiveTriangulation(class CPatch
 
     return pRQTAdaptiveTriang;
 }
+
+// Returns time of calculating the errors of the triangles in all patches. If SIMDLevel is
+// SIMD_LEVEL_NUM_LEVELS, the reference implementation is used
+static double MeasureTriangleErrorTime(const std::vector<CPatchElevationData*> &Patches,
+                                       std::vector<UINT> &TriangleIndices,
+                                       int iPackedIndicesBoundaryExtension,
+                                       SIMD_LEVEL SIMDLevel,
+                                       std::vector<float> &Errors)
+{
+    UINT uiNumTriangles = (UINT)TriangleIndices.size() / 3;
+    Errors.resize( Patches.size() * uiNumTriangles );
+    LARGE_INTEGER PerfFreq, StartTick, EndTick;
+    QueryPerformanceFrequency( &PerfFreq );
+    QueryPerformanceCounter( &StartTick );
+    for(size_t iPatch = 0; iPatch < Patches.size(); iPatch++)
+    {
+        const UINT16 *ElevData;
+        size_t ElevDataPitch;
+        Patches[iPatch]->GetDataPtr( ElevData, ElevDataPitch, 0, 0, 1, 1);
+        for(UINT uiTriangle = 0; uiTriangle < uiNumTriangles; uiTriangle++)
+        {
+            UINT *puiTriangleVertPackedIndices = &TriangleIndices[uiTriangle*3];
+            float &fError = Errors[iPatch * uiNumTriangles + uiTriangle];
+            if( SIMDLevel == SIMD_LEVEL_NUM_LEVELS )
+                fError = GetTriangleWorldSpaceErrorReference(puiTriangleVertPackedIndices, ElevData, ElevDataPitch, iPackedIndicesBoundaryExtension);
+            else
+            {
+                int piVertCols[3], piVertRows[3];
+                for(int iVert=0; iVert < 3; iVert++)
+                    UnpackIndices(puiTriangleVertPackedIndices[iVert], piVertCols[iVert], piVertRows[iVert], iPackedIndicesBoundaryExtension);
+                fError = CalculateTriangleMaxError(ElevData, ElevDataPitch, piVertCols, piVertRows, +FLT_MAX, SIMDLevel);
+            }
+        }
+    }
+    QueryPerformanceCounter( &EndTick );
+    return (double)(EndTick.QuadPart - StartTick.QuadPart) / (double)PerfFreq.QuadPart;
+}
+
+void CTriangDataSource::BenchmarkTriangleErrorKernels(CElevationDataSource *pDataSource, LPCTSTR strStatFile)
+{
+    FILE *pStatFile;
+    if( _tfopen_s(&pStatFile, strStatFile, _T("at")) != 0 )
+        return;
+
+    int iPatchSize = pDataSource->GetPatchSize();
+    int iNumLevelsInLocalPatchQT = 0;
+    while( (1 << iNumLevelsInLocalPatchQT) <= iPatchSize )iNumLevelsInLocalPatchQT++;
+    const int iPackedIndicesBoundaryExtension = 1;
+
+    // Triangles tested by CreateAdaptiveTriangulation() for the vertices on the even rows of all levels
+    std::vector<UINT> TriangleIndices;
+    for(int iLevel = iNumLevelsInLocalPatchQT-1; iLevel > 0; iLevel--)
+    {
+        int iLevelStep = 1 << ((iNumLevelsInLocalPatchQT-1) - iLevel);
+        for(int iY = 0; iY <= iPatchSize; iY += iLevelStep*2 )
+            for(int iX = iLevelStep; iX <= iPatchSize; iX += iLevelStep*2 )
+            {
+                int iThirdVertY[2] = {iY + iLevelStep, iY - iLevelStep};
+                for(int iTriangle = 0; iTriangle < 2; iTriangle++)
+                {
+                    if( iThirdVertY[iTriangle] < 0 || iThirdVertY[iTriangle] > iPatchSize )
+                        continue;
+                    TriangleIndices.push_back( CalculatePackedIndex(iX-iLevelStep, iY, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension) );
+                    TriangleIndices.push_back( CalculatePackedIndex(iX+iLevelStep, iY, iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension) );
+                    TriangleIndices.push_back( CalculatePackedIndex(iX, iThirdVertY[iTriangle], iNumLevelsInLocalPatchQT-1, iNumLevelsInLocalPatchQT, iPackedIndicesBoundaryExtension) );
+                }
+            }
+    }
+
+    // Patches of the finest level are visited in pseudo-random order
+    const int NUM_PATCHES = 16;
+    int iFinestLevel = pDataSource->GetNumLevelsInHierarchy()-1;
+    int iLevelPatchesHorz = pDataSource->GetNumRootNodesHorz() << iFinestLevel;
+    int iNumPatchesInLevel = iLevelPatchesHorz * (pDataSource->GetNumRootNodesVert() << iFinestLevel);
+    std::vector<CPatchElevationData*> Patches;
+    unsigned int uiRandom = 1;
+    for(int iAttempt = 0; iAttempt < NUM_PATCHES*4 && Patches.size() < NUM_PATCHES; iAttempt++)
+    {
+        uiRandom = uiRandom * 1664525 + 1013904223;
+        int iPatchInd = (uiRandom >> 8) % iNumPatchesInLevel;
+        SQuadTreeNodeLocation Pos(iPatchInd % iLevelPatchesHorz, iPatchInd / iLevelPatchesHorz, iFinestLevel);
+        if( pDataSource->IsPatchInPaddedArea(Pos) )
+            continue;
+        CPatchElevationData *pElevData = pDataSource->GetElevData(Pos);
+        if( pElevData )
+            Patches.push_back(pElevData);
+    }
+
+    double dNumTriangles = (double)Patches.size() * (double)(TriangleIndices.size() / 3);
+    _ftprintf_s(pStatFile, _T("Triangle error kernels (%d patches, %d triangles per patch):\n"), (int)Patches.size(), (int)(TriangleIndices.size() / 3));
+    std::vector<float> ReferenceErrors, Errors;
+    double dReferenceTime = 0;
+    for(int iSIMDLevel = SIMD_LEVEL_NUM_LEVELS; iSIMDLevel >= SIMD_LEVEL_SCALAR; iSIMDLevel--)
+    {
+        if( iSIMDLevel < SIMD_LEVEL_NUM_LEVELS && iSIMDLevel > GetSupportedSIMDLevel() )
+            continue;
+        // The best of several runs is reported
+        const int NUM_RUNS = 3;
+        double dBestTime = 0;
+        for(int iRun = 0; iRun < NUM_RUNS; iRun++)
+        {
+            double dTime = MeasureTriangleErrorTime(Patches, TriangleIndices, iPackedIndicesBoundaryExtension, (SIMD_LEVEL)iSIMDLevel, Errors);
+            if( iRun == 0 || dTime < dBestTime )
+                dBestTime = dTime;
+        }
+        if( iSIMDLevel == SIMD_LEVEL_NUM_LEVELS )
+        {
+            dReferenceTime = dBestTime;
+            ReferenceErrors.swap(Errors);
+            _ftprintf_s(pStatFile, _T("Reference: %.2lf MTriangles/s\n"), dNumTriangles / max(dBestTime, 1e-9) / 1e6);
+        }
+        else
+        {
+            // Errors must be exactly the same, otherwise triangulations would change
+            int iNumMismatches = 0;
+            for(size_t i = 0; i < Errors.size(); i++)
+                if( Errors[i] != ReferenceErrors[i] )
+                    iNumMismatches++;
+            _ftprintf_s(pStatFile, _T("%s: %.2lf MTriangles/s (speedup %.2lf), mismatches: %d\n"),
+                        GetSIMDLevelName((SIMD_LEVEL)iSIMDLevel),
+                        dNumTriangles / max(dBestTime, 1e-9) / 1e6,
+                        dReferenceTime / max(dBestTime, 1e-9),
+                        iNumMismatches );
+        }
+    }
+
+    for(size_t iPatch = 0; iPatch < Patches.size(); iPatch++)
+        delete Patches[iPatch];
+    fclose(pStatFile);
+}
+
+// Returns time of decoding the triangulations of all nodes and generating their index lists. If
+// bDecodedFlags is true, only the indices are generated from the flags decoded beforehand
+static double MeasureTriangulationDecodingTime(CTriangDataSource *pTriangDataSource,
+                                               const std::vector<SQuadTreeNodeLocation> &Nodes,
+                                               bool bDecodedFlags,
+                                               UINT &uiTotalNumIndices)
+{
+    int iPatchSize = pTriangDataSource->GetPatchSize();
+    const int iElevDataBoundaryExtension = 2; // As used by the terrain patches
+    std::vector<UINT> WorkIndexBuffer( (iPatchSize+4 - 1) * (iPatchSize+4 - 1) * 2 * 3 );
+    std::vector<CRQTTriangulation*> Triangulations;
+    if( bDecodedFlags )
+    {
+        for(size_t iNode = 0; iNode < Nodes.size(); iNode++)
+        {
+            UINT uiNumIndices;
+            Triangulations.push_back( pTriangDataSource->DecodeTriangulation(Nodes[iNode]) );
+            Triangulations.back()->GenerateIndices(iElevDataBoundaryExtension, &WorkIndexBuffer[0], uiNumIndices);
+        }
+    }
+
+    uiTotalNumIndices = 0;
+    LARGE_INTEGER PerfFreq, StartTick, EndTick;
+    QueryPerformanceFrequency( &PerfFreq );
+    QueryPerformanceCounter( &StartTick );
+    for(size_t iNode = 0; iNode < Nodes.size(); iNode++)
+    {
+        UINT uiNumIndices;
+        if( bDecodedFlags )
+        {
+            // The bit stream is not read again once the flags are decoded
+            Triangulations[iNode]->GenerateIndices(iElevDataBoundaryExtension, &WorkIndexBuffer[0], uiNumIndices);
+        }
+        else
+        {
+            CRQTTriangulation *pTriangulation = pTriangDataSource->DecodeTriangulation(Nodes[iNode]);
+            pTriangulation->GenerateIndices(iElevDataBoundaryExtension, &WorkIndexBuffer[0], uiNumIndices);
+            delete pTriangulation;
+        }
+        uiTotalNumIndices += uiNumIndices;
+    }
+    QueryPerformanceCounter( &EndTick );
+
+    for(size_t iNode = 0; iNode < Triangulations.size(); iNode++)
+        delete Triangulations[iNode];
+    return (double)(EndTick.QuadPart - StartTick.QuadPart) / (double)PerfFreq.QuadPart;
+}
+
+void CTriangDataSource::BenchmarkTriangulationDecoding(LPCTSTR strStatFile)
+{
+    FILE *pStatFile;
+    if( _tfopen_s(&pStatFile, strStatFile, _T("at")) != 0 )
+        return;
+
+    std::vector<SQuadTreeNodeLocation> Nodes;
+    double dTotalNumBits = 0;
+    for( HierarchyIterator it(m_iNumLevelsInHierarchy, m_iNumRootNodesHorz, m_iNumRootNodesVert); it.IsValid(); it.Next() )
+    {
+        int iNumBits = m_AdaptiveTriangInfo[it].m_EncodedRQTEnabledFlags.GetBitStreamSizeInBits();
+        if( iNumBits > 0 )
+        {
+            Nodes.push_back(it);
+            dTotalNumBits += iNumBits;
+        }
+    }
+
+    _ftprintf_s(pStatFile, _T("Triangulation decoding (%d patches, %.1lf bits per patch):\n"),
+                (int)Nodes.size(), dTotalNumBits / max((double)Nodes.size(), 1.0));
+    for(int iDecodedFlags = 0; iDecodedFlags < 2; iDecodedFlags++)
+    {
+        // The best of several runs is reported
+        const int NUM_RUNS = 3;
+        double dBestTime = 0;
+        UINT uiTotalNumIndices = 0;
+        for(int iRun = 0; iRun < NUM_RUNS; iRun++)
+        {
+            double dTime = MeasureTriangulationDecodingTime(this, Nodes, iDecodedFlags != 0, uiTotalNumIndices);
+            if( iRun == 0 || dTime < dBestTime )
+                dBestTime = dTime;
+        }
+        dBestTime = max(dBestTime, 1e-9);
+        if( iDecodedFlags )
+            _ftprintf_s(pStatFile, _T("GenerateIndices: %.2lf MTriangles/s\n"),
+                        (double)(uiTotalNumIndices/3) / dBestTime / 1e6);
+        else
+            _ftprintf_s(pStatFile, _T("DecodeTriangulation + GenerateIndices: %.2lf MTriangles/s, %.2lf Mbits/s\n"),
+                        (double)(uiTotalNumIndices/3) / dBestTime / 1e6,
+                        dTotalNumBits / dBestTime / 1e6);
+    }
+
+    fclose(pStatFile);
+}